@@ -180,10 +180,23 @@ static Value lxArrayJoin(int argCount, Value *args) {
 
 // returns a newly sorted array. Each element must be comparable (number or
 // string)
+// ex: [3,1,2].sort(); => [1,2,3]
+//     [3,1,2].sort(reverse: true); => [3,2,1]
 static Value lxArraySort(int argCount, Value *args) {
     CHECK_ARITY("Array#sort", 1, 1, argCount);
     Value self = *args;
-    return arraySort(self);
+    Value kwargs = args[argCount];
+    checkNativeKwargs("Array#sort", kwargs, "reverse", NULL);
+    Value ret = arraySort(self);
+    if (isTruthy(nativeKwarg(kwargs, "reverse", BOOL_VAL(false)))) {
+        ValueArray *ary = &AS_ARRAY(ret)->valAry;
+        for (int i = 0, j = ary->count-1; i < j; i++, j--) {
+            Value tmp = ary->values[i];
+            ary->values[i] = ary->values[j];
+            ary->values[j] = tmp;
+        }
+    }
+    return ret;
 }
 
 static Value lxArraySortBy(int argCount, Value *args) {
@@ -326,68 +339,38 @@ static Value lxArrayFillStatic(int argCount, Value *args) {
 
 static Value lxArrayEach(int argCount, Value *args) {
     CHECK_ARITY("Array#each", 1, 1, argCount); // 2nd could be block arg (&arg)
-    ObjArray *self = AS_ARRAY(*args);
-    volatile ValueArray *ary = &self->valAry;
-    volatile Value el; volatile int valIdx = 0;
-    volatile int status = 0;
-    volatile int iterStart = 0;
-    volatile LxThread *th = vm.curThread;
-    volatile BlockIterFunc fn = getFrame()->callInfo->blockIterFunc;
-    volatile Obj *block = NULL;
-    volatile ObjInstance *blockInstance = NULL;
-    blockInstance = getBlockArg(getFrame());
-    if (blockInstance) {
-        block = blockCallableBlock(OBJ_VAL(blockInstance));
-    }
-    if (!block && getFrame()->callInfo) {
-        block = (Obj*)(getFrame()->callInfo->blockFunction);
-    }
-    if (!block) {
-        throwErrorFmt(lxErrClass, "no block given");
-    }
-    volatile BlockStackEntry *bentry = NULL;
-    while (true) {
-        if (iterStart == ary->count) {
-            return *args;
-        }
-        SETUP_BLOCK(block, bentry, status, th->errInfo)
-        if (status == TAG_NONE) {
+    Value self = *args;
+    ObjArray *selfObj = AS_ARRAY(self);
+    CallInfo *cinfo = getFrame()->callInfo;
+    BlockIterFunc fn = cinfo->blockIterFunc;
+    ObjInstance *blockInstance = getBlockArg(getFrame());
+    Value block = blockCallableFromC(blockInstance);
+    push(block); // keep it reachable between yields
+    CallInfo yinfo;
+    initYieldInfo(&yinfo, blockInstance);
+    Value ret = self;
+    for (int i = 0; i < selfObj->valAry.count; i++) {
+        Value el = selfObj->valAry.values[i];
+        BlockStatus status;
+        Value blockRet = yieldFromC(block, 1, &el, &yinfo, &status);
+        if (status == BLOCK_ST_BREAK) {
+            ret = NIL_VAL;
             break;
-        } else if (status == TAG_RAISE) {
+        }
+        if (fn) {
             int iterFlags = 0;
-            ObjInstance *errInst = AS_INSTANCE(th->lastErrorThrown);
-            ASSERT(errInst);
-            if (errInst->klass == lxBreakBlockErrClass) {
-                return NIL_VAL;
-            } else if (errInst->klass == lxContinueBlockErrClass) {
-                if (fn) {
-                    Value retVal = getProp(th->lastErrorThrown, INTERN("ret"));
-                    fn(1, (Value*)&el, retVal, getFrame()->callInfo, &iterFlags);
-                    if (iterFlags & ITER_FLAG_STOP) {
-                        return NIL_VAL;
-                    }
-                }
-            } else if (errInst->klass == lxReturnBlockErrClass) {
-                Value retVal = getProp(th->lastErrorThrown, INTERN("ret"));
-                if (fn) {
-                    fn(1, (Value*)&el, retVal, getFrame()->callInfo, &iterFlags);
-                    if (iterFlags & ITER_FLAG_STOP) {
-                        return NIL_VAL;
-                    }
-                } else {
-                    return retVal;
-                }
-            } else {
-                throwError(th->lastErrorThrown);
+            fn(1, &el, blockRet, cinfo, &iterFlags);
+            if (iterFlags & ITER_FLAG_STOP) {
+                ret = NIL_VAL;
+                break;
             }
+        } else if (status == BLOCK_ST_RETURN) {
+            ret = blockRet;
+            break;
         }
     }
-
-    VALARRAY_FOREACH_START(ary, el, iterStart, valIdx) {
-        iterStart++;
-        yieldFromC(1, (Value*)&el, TO_INSTANCE(blockInstance));
-    }
-    return *args;
+    pop();
+    return ret;
 }
 
 static void mapIter(int argCount, Value *args, Value ret, CallInfo *cinfo, int *iterFlags) {
@@ -578,34 +561,34 @@ void Init_ArrayClass() {
     // methods
     addNativeMethod(arrayClass, "dup", lxArrayDup);
     addNativeMethod(arrayClass, "inspect", lxArrayInspect);
-    addNativeMethod(arrayClass, "first", lxArrayFirst);
-    addNativeMethod(arrayClass, "last", lxArrayLast);
-    addNativeMethod(arrayClass, "push", lxArrayPush);
-    addNativeMethod(arrayClass, "opShovelLeft", lxArrayPush);
-    addNativeMethod(arrayClass, "pop", lxArrayPop);
-    addNativeMethod(arrayClass, "pushFront", lxArrayPushFront);
-    addNativeMethod(arrayClass, "popFront", lxArrayPopFront);
+    addLeafNativeMethod(arrayClass, "first", lxArrayFirst);
+    addLeafNativeMethod(arrayClass, "last", lxArrayLast);
+    addLeafNativeMethod(arrayClass, "push", lxArrayPush);
+    addLeafNativeMethod(arrayClass, "opShovelLeft", lxArrayPush);
+    addLeafNativeMethod(arrayClass, "pop", lxArrayPop);
+    addLeafNativeMethod(arrayClass, "pushFront", lxArrayPushFront);
+    addLeafNativeMethod(arrayClass, "popFront", lxArrayPopFront);
     addNativeMethod(arrayClass, "delete", lxArrayDelete);
-    addNativeMethod(arrayClass, "deleteAt", lxArrayDeleteAt);
-    addNativeMethod(arrayClass, "opIndexGet", lxArrayOpIndexGet);
-    addNativeMethod(arrayClass, "opIndexSet", lxArrayOpIndexSet);
+    addLeafNativeMethod(arrayClass, "deleteAt", lxArrayDeleteAt);
+    addLeafNativeMethod(arrayClass, "opIndexGet", lxArrayOpIndexGet);
+    addLeafNativeMethod(arrayClass, "opIndexSet", lxArrayOpIndexSet);
     addNativeMethod(arrayClass, "opEquals", lxArrayOpEquals);
     addNativeMethod(arrayClass, "toString", lxArrayToString);
-    addNativeMethod(arrayClass, "sort", lxArraySort);
+    addKwargsNativeMethod(arrayClass, "sort", lxArraySort);
     addNativeMethod(arrayClass, "sortBy", lxArraySortBy);
     addNativeMethod(arrayClass, "iter", lxArrayIter);
-    addNativeMethod(arrayClass, "clear", lxArrayClear);
+    addLeafNativeMethod(arrayClass, "clear", lxArrayClear);
     addNativeMethod(arrayClass, "join", lxArrayJoin);
     addNativeMethod(arrayClass, "hashKey", lxArrayHashKey);
-    addNativeMethod(arrayClass, "each", lxArrayEach);
-    addNativeMethod(arrayClass, "map", lxArrayMap);
-    addNativeMethod(arrayClass, "select", lxArraySelect);
-    addNativeMethod(arrayClass, "reject", lxArrayReject);
-    addNativeMethod(arrayClass, "find", lxArrayFind);
-    addNativeMethod(arrayClass, "reduce", lxArrayReduce);
-    addNativeMethod(arrayClass, "sum", lxArraySum);
-    addNativeMethod(arrayClass, "reverse", lxArrayReverse);
+    addLoopIterNativeMethod(arrayClass, "each", lxArrayEach, LOOP_ITER_EACH);
+    addLoopIterNativeMethod(arrayClass, "map", lxArrayMap, LOOP_ITER_MAP);
+    addLoopIterNativeMethod(arrayClass, "select", lxArraySelect, LOOP_ITER_SELECT);
+    addLoopIterNativeMethod(arrayClass, "reject", lxArrayReject, LOOP_ITER_REJECT);
+    addLoopIterNativeMethod(arrayClass, "find", lxArrayFind, LOOP_ITER_FIND);
+    addLoopIterNativeMethod(arrayClass, "reduce", lxArrayReduce, LOOP_ITER_REDUCE);
+    addLeafNativeMethod(arrayClass, "sum", lxArraySum);
+    addLeafNativeMethod(arrayClass, "reverse", lxArrayReverse);
 
     // getters
-    addNativeGetter(arrayClass, "size", lxArrayGetSize);
+    addLeafNativeGetter(arrayClass, "size", lxArrayGetSize);
 }
@@ -59,6 +59,7 @@ typedef struct NodeLvl {
 #define INSN_FL_NUMBER 1
 #define INSN_FL_BREAK 2
 #define INSN_FL_CONTINUE 4
+#define INSN_FL_KWARG_DEFAULT 8 // jump over a keyword param's default
 // single instruction
 typedef struct Insn {
     bytecode_t code;
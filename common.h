@@ -18,6 +18,7 @@ extern "C" {
 #define QUOTE(x) xstr(x)
 
 #define MAYBE_UNUSED __attribute__((unused))
+#define NOINLINE __attribute__((noinline))
 
 // generational GC, on by default
 #ifndef GEN_GC
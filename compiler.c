@@ -14,6 +14,7 @@
 #include "value.h"
 #include "debug.h"
 #include "options.h"
+#include "optimizer.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -78,7 +79,8 @@ typedef enum {
     CONST_T_ARYLIT,
     CONST_T_MAPLIT,
     CONST_T_CODE,
-    CONST_T_CALLINFO
+    CONST_T_CALLINFO,
+    CONST_T_CONSTCACHE
 } ConstType;
 
 static void compiler_trace_debug(const char *fmt, ...) {
@@ -304,25 +306,29 @@ static inline void emitLeave() {
 
 // Adds an upvalue to [compiler]'s function with the given properties. Does not
 // add one if an upvalue for that variable is already in the list. Returns the
-// index of the upvalue.
-static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
+// index of the upvalue. With [isCaptured], it's added to the values copied
+// into the closure instead (see Local.isAssigned).
+static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal, bool isCaptured) {
     // Look for an existing one.
-    COMP_TRACE("Adding upvalue to COMP=%p, index: %d, isLocal: %s",
-            compiler, index, isLocal ? "true" : "false");
-    for (int i = 0; i < compiler->function->upvalueCount; i++) {
-        Upvalue *upvalue = &compiler->upvalues[i];
+    COMP_TRACE("Adding upvalue to COMP=%p, index: %d, isLocal: %s, isCaptured: %s",
+            compiler, index, isLocal ? "true" : "false", isCaptured ? "true" : "false");
+    Upvalue *upvalues = isCaptured ? compiler->captured : compiler->upvalues;
+    unsigned short *count = isCaptured ? &compiler->function->capturedCount :
+                                         &compiler->function->upvalueCount;
+    for (int i = 0; i < *count; i++) {
+        Upvalue *upvalue = &upvalues[i];
         if (upvalue->index == index && upvalue->isLocal == isLocal) return i;
     }
 
-    if (compiler->function->upvalueCount == LX_MAX_UPVALUES) {
+    if (*count == LX_MAX_UPVALUES) {
         error("Too many closure variables in function.");
         return 0;
     }
 
     // If we got here, it's a new upvalue.
-    compiler->upvalues[compiler->function->upvalueCount].isLocal = isLocal;
-    compiler->upvalues[compiler->function->upvalueCount].index = index;
-    return compiler->function->upvalueCount++;
+    upvalues[*count].isLocal = isLocal;
+    upvalues[*count].index = index;
+    return (*count)++;
 }
 
 static bool identifiersEqual(Token *a, Token *b) {
@@ -348,12 +354,14 @@ static int resolveLocal(Compiler *compiler, Token* name) {
 // Attempts to look up [name] in the functions enclosing the one being compiled
 // by [compiler]. If found, it adds an upvalue for it to this compiler's list
 // of upvalues (unless it's already in there) and returns its index. If not
-// found, returns -1.
+// found, returns -1. [isCaptured] is set if the variable is never assigned
+// after it's declared, then the upvalue is a copy of its value in the
+// closure's captured values.
 //
 // If the name is found outside of the immediately enclosing function, this
 // will flatten the closure and add upvalues to all of the intermediate
 // functions so that it gets walked down to this one.
-static int resolveUpvalue(Compiler *compiler, Token *name) {
+static int resolveUpvalue(Compiler *compiler, Token *name, bool *isCaptured) {
     COMP_TRACE("Resolving upvalue for variable '%s'", tokStr(name));
     // If we are at the top level, we didn't find it.
     if (compiler->enclosing == NULL) return -1;
@@ -362,10 +370,15 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         COMP_TRACE("Upvalue variable '%s' found as local", tokStr(name));
-        // Mark the local as an upvalue so we know to close it when it goes out of
-        // scope.
-        compiler->enclosing->locals[local].isUpvalue = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        Local *var = &compiler->enclosing->locals[local];
+        *isCaptured = !var->isAssigned;
+        if (!*isCaptured) {
+            // Mark the local as an upvalue so we know to close it when it goes out of
+            // scope.
+            var->isUpvalue = true;
+            compiler->enclosing->sharedSlots[local] = true;
+        }
+        return addUpvalue(compiler, (uint8_t)local, true, *isCaptured);
     }
 
     // See if it's an upvalue in the immediately enclosing function. In other
@@ -374,10 +387,10 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
     // intermediate functions to get from the function where a local is declared
     // all the way into the possibly deeply nested function that is closing over
     // it.
-    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    int upvalue = resolveUpvalue(compiler->enclosing, name, isCaptured);
     if (upvalue != -1) {
         COMP_TRACE("Upvalue variable '%s' found as non-local", tokStr(name));
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, (uint8_t)upvalue, false, *isCaptured);
     }
 
     // If we got here, we walked all the way up the parent chain and couldn't
@@ -386,6 +399,88 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
     return -1;
 }
 
+static bool isFunctionNode(Node *n) {
+    switch (nodeKind(n)) {
+        case FUNCTION_STMT:
+        case METHOD_STMT:
+        case CLASS_METHOD_STMT:
+        case GETTER_STMT:
+        case SETTER_STMT:
+        case ANON_FN_EXPR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Names that give code compiled at runtime access to the function's
+// variables (see optSkipReason() in optimizer.c)
+static bool isEvalName(Token *tok) {
+    if (tok->type != TOKEN_IDENTIFIER) return false;
+    const char *names[] = { "eval", "instanceEval", "Binding", "debugger" };
+    for (unsigned i = 0; i < sizeof(names)/sizeof(names[0]); i++) {
+        if (tok->length == (int)strlen(names[i]) &&
+                memcmp(tokStr(tok), names[i], tok->length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Adds the names of the variables assigned to in `n` to the compiler's
+// assignedNames. Nested functions are walked too, they can assign to the
+// variables they close over. Foreach variables count as assigned, they're
+// set by OP_ITER_NEXT on every iteration, and so does every variable of a
+// function that uses eval (see Compiler.usesEval).
+static void collectAssignedNames(Compiler *compiler, Node *n) {
+    if (isEvalName(&n->tok)) {
+        compiler->usesEval = true;
+    }
+    if (n->type.type != NODE_OTHER) {
+        switch (nodeKind(n)) {
+            case ASSIGN_EXPR:
+            case BINARY_ASSIGN_EXPR: {
+                Node *varNode = vec_first(n->children);
+                if (nodeKind(varNode) == VARIABLE_EXPR) {
+                    vec_push(&compiler->assignedNames, &varNode->tok);
+                }
+                break;
+            }
+            case FOREACH_STMT: {
+                int numVars = n->children->length - 2;
+                for (int i = 0; i < numVars; i++) {
+                    vec_push(&compiler->assignedNames, &n->children->data[i]->tok);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        if (isFunctionNode(n)) {
+            vec_nodep_t *params = (vec_nodep_t*)nodeGetData(n);
+            Node *param = NULL; int i = 0;
+            vec_foreach(params, param, i) {
+                collectAssignedNames(compiler, param);
+            }
+        }
+    }
+    if (n->children) {
+        Node *child = NULL; int i = 0;
+        vec_foreach(n->children, child, i) {
+            collectAssignedNames(compiler, child);
+        }
+    }
+}
+
+static bool isAssignedName(Compiler *compiler, Token *name) {
+    if (compiler->usesEval) return true;
+    Token *tok = NULL; int i = 0;
+    vec_foreach(&compiler->assignedNames, tok, i) {
+        if (identifiersEqual(tok, name)) return true;
+    }
+    return false;
+}
+
 static bool isBinOp(Insn *in) {
     bytecode_t code = in->code;
     switch (code) {
@@ -491,6 +586,25 @@ static void patchJumpInsnWithOffset(Insn *jump, int offset) {
     jump->operands[0] += offset;
 }
 
+// The catch table holds word offsets into the iseq, so they need adjusting
+// when the optimizer changes the size of an instruction (by `delta` words).
+static void patchCatchTblOffsets(Iseq *seq, Insn *insn, int delta) {
+    int off = 0;
+    Insn *in = seq->insns;
+    while (in && in != insn) {
+        off += in->numOperands+1;
+        in = in->next;
+    }
+    ASSERT(in);
+    CatchTable *row = seq->catchTbl;
+    while (row) {
+        if (row->ifrom > off) row->ifrom += delta;
+        if (row->ito > off) row->ito += delta;
+        if (row->itarget > off) row->itarget += delta;
+        row = row->next;
+    }
+}
+
 /* Remove the given instruction. If there's a forward jump to this instruction or
  * to an instruction after it, the jump needs to be patched. If there's a backwards jump
  * to this instruction or to an instruction before it, the jump needs to be patched.
@@ -548,6 +662,7 @@ static void rmInsnAndPatchJumps(Iseq *seq, Insn *insn) {
         in = in->next;
         idx++;
     }
+    patchCatchTblOffsets(seq, insn, -(insn->numOperands+1));
     iseqRmInsn(seq, insn);
 }
 
@@ -632,6 +747,7 @@ static void addInsnOperand(Iseq *seq, Insn *insn, bytecode_t operand) {
     if (insn->numOperands == MAX_INSN_OPERANDS) {
         UNREACHABLE("too many operands"); // TODO: error out
     }
+    patchCatchTblOffsets(seq, insn, 1);
     insn->operands[insn->numOperands] = operand;
     insn->numOperands+=1;
     seq->wordCount += 1;
@@ -785,11 +901,12 @@ static void optimizeIseq(Iseq *iseq) {
     COMP_TRACE("/OptimizeIseq");
 }
 
-static void copyIseqToChunk(Iseq *iseq, Chunk *chunk) {
-    ASSERT(iseq);
+static void copyIseqToChunk(Compiler *compiler, Chunk *chunk) {
+    Iseq *iseq = &compiler->iseq;
     ASSERT(chunk);
     if (!compilerOpts.noOptimize) {
         optimizeIseq(iseq);
+        optimizeIseqSSA(compiler);
     }
     COMP_TRACE("copyIseqToChunk (%d insns, wordcount: %d)", iseq->count, iseq->wordCount);
     chunk->catchTbl = iseq->catchTbl;
@@ -809,6 +926,23 @@ static void copyIseqToChunk(Iseq *iseq, Chunk *chunk) {
     COMP_TRACE("/copyIseqToChunk");
 }
 
+// Offset of the code after the keyword parameters' defaults, which are
+// the last parameter code in a function. It's where the last keyword
+// param's OP_JUMP_IF_TRUE jumps to, after optimization.
+static int kwargsEndOffset(Iseq *iseq) {
+    int end = 0;
+    int off = 0;
+    Insn *in = iseq->insns;
+    while (in) {
+        if (in->flags & INSN_FL_KWARG_DEFAULT) {
+            end = off + 1 + in->operands[0];
+        }
+        off += in->numOperands+1;
+        in = in->next;
+    }
+    return end;
+}
+
 static ObjFunction *endCompiler() {
     COMP_TRACE("endCompiler");
     ASSERT(current);
@@ -816,9 +950,13 @@ static ObjFunction *endCompiler() {
         emitLeave();
     }
     ObjFunction *func = current->function;
-    copyIseqToChunk(currentIseq(), currentChunk());
+    copyIseqToChunk(current, currentChunk());
+    if (func->numKwargs > 0) {
+        func->kwargsEnd = kwargsEndOffset(currentIseq());
+    }
     freeTable(&current->constTbl);
     freeIseq(&current->iseq);
+    vec_deinit(&current->assignedNames);
     func->localCount = current->localCountMax;
 
     current = current->enclosing;
@@ -857,6 +995,14 @@ static bytecode_t identifierConstant(Token *name) {
     return makeConstant(OBJ_VAL(ident), CONST_T_STRLIT);
 }
 
+// Global variables are resolved to their slot at compile time. Names that
+// aren't defined yet get a slot too, and are looked up again at runtime
+// while it's undefined.
+static bytecode_t globalVarSlot(Token *name) {
+    DBG_ASSERT(vm.inited);
+    return (bytecode_t)globalSlot(INTERNED(tokStr(name), name->length));
+}
+
 static bytecode_t identifierLocal(Local *local) {
     return identifierConstant(&local->name);
 }
@@ -973,7 +1119,7 @@ static void patchContinuesBetween(Insn *a, Insn *b) {
 }
 
 // Emit a jump backwards (loop) instruction from the current code count to offset `loopStart`
-static void emitLoop(int loopStart) {
+static Insn *emitLoop(int loopStart) {
 
   int offset = (currentIseq()->wordCount - loopStart)+2;
   if ((bytecode_t)offset > BYTECODE_MAX) error("Loop body too large.");
@@ -983,6 +1129,7 @@ static void emitLoop(int loopStart) {
   loopInsn->jumpTo = insnAtOffset(currentIseq(), loopStart-2);
   ASSERT(loopInsn->jumpTo);
   loopInsn->jumpTo->isLabel = true;
+  return loopInsn;
 }
 
 static inline bool isBreak(Insn *in) {
@@ -1035,13 +1182,14 @@ static int addLocal(Token name) {
     Local local = {
         .name = name,
         .depth = current->scopeDepth,
-        .popOnScopeEnd = true
+        .popOnScopeEnd = true,
+        .isAssigned = isAssignedName(current, &name),
     };
     int slot = current->localCount;
     current->locals[slot] = local;
     incrLocalCount(current);
     LocalVariable *var = ALLOCATE(LocalVariable, 1);
-    var->name = copyString(tokStr(&name), strlen(tokStr(&name)), NEWOBJ_FLAG_OLD);
+    var->name = INTERN(tokStr(&name));
     var->scope = curScope;
     var->slot = slot;
     var->bytecode_declare_start = currentIseq()->wordCount;
@@ -1097,23 +1245,26 @@ static int declareVariable(Token *name) {
 static void namedVariable(Token name, VarOp getSet) {
     bytecode_t getOp, setOp;
     int arg = resolveLocal(current, &name);
-    bool varNameUsed = false;
+    bool isGlobal = false;
+    bool isCaptured = false;
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
-    } else if ((arg = resolveUpvalue(current, &name)) != -1) {
-        getOp = OP_GET_UPVALUE;
+    } else if ((arg = resolveUpvalue(current, &name, &isCaptured)) != -1) {
+        getOp = isCaptured ? OP_GET_CAPTURED : OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
+        // assigned variables aren't captured by value
+        DBG_ASSERT(!isCaptured || getSet == VAR_GET);
     } else {
         arg = identifierConstant(&name);
-        varNameUsed = true;
+        isGlobal = true;
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
     bytecode_t op = getOp;
     if (getSet == VAR_SET) { op = setOp; }
-    if (varNameUsed) {
-        emitOp1(op, (bytecode_t)arg);
+    if (isGlobal) {
+        emitOp2(op, (bytecode_t)arg, globalVarSlot(&name));
     } else {
         bytecode_t varNameSlot = identifierConstant(&name);
         emitOp2(op, (bytecode_t)arg, varNameSlot);
@@ -1202,10 +1353,7 @@ static void initCompiler(
 
     switch (ftype) {
     case FUN_TYPE_NAMED:
-        current->function->name = copyString(
-            tokStr(fTok), strlen(tokStr(fTok)),
-            NEWOBJ_FLAG_OLD
-        );
+        current->function->name = INTERN(tokStr(fTok));
         OBJ_WRITE(OBJ_VAL(current->function), OBJ_VAL(current->function->name));
         break;
     case FUN_TYPE_INIT:
@@ -1229,7 +1377,7 @@ static void initCompiler(
         }
         strncat(methodNameBuf, sep, 1);
         strcat(methodNameBuf, funcName);
-        ObjString *methodName = copyString(methodNameBuf, strlen(methodNameBuf), NEWOBJ_FLAG_OLD);
+        ObjString *methodName = INTERN(methodNameBuf);
         current->function->name = methodName;
         OBJ_WRITE(OBJ_VAL(current->function), OBJ_VAL(methodName));
         xfree(methodNameBuf);
@@ -1335,6 +1483,7 @@ static void initEvalCompiler(
             local->depth = current->scopeDepth;
             local->popOnScopeEnd = true;
             local->isUpvalue = false;
+            local->isAssigned = true; // the function can still set it
         } else {
         }
     }
@@ -1398,6 +1547,7 @@ static void initBindingEvalCompiler(
         local->depth = current->scopeDepth;
         local->isUpvalue = false;
         local->popOnScopeEnd = true;
+        local->isAssigned = true; // the function can still set it
     });
 
     COMP_TRACE("/initCompiler");
@@ -1406,9 +1556,8 @@ static void initBindingEvalCompiler(
 // Define a declared variable in local or global scope (locals MUST be
 // declared before being defined)
 static void defineVariable(Token *name, bytecode_t arg, bool checkDecl) {
-  (void)name;
   if (current->scopeDepth == 0) {
-    emitOp1(OP_DEFINE_GLOBAL, arg);
+    emitOp2(OP_DEFINE_GLOBAL, arg, globalVarSlot(name));
   } else {
     // Mark the given local as defined now (-1 is undefined, but declared)
     /*if (current->locals[arg].depth != -1 && checkDecl) {*/
@@ -1485,7 +1634,48 @@ static void emitIn(Node *n) {
     inINBlock = oldIn;
 }
 
-static CallInfo *emitCall(Node *n) {
+static void markConstCache(Obj *obj) {
+    ConstCache *cache = internalGetData((ObjInternal*)obj);
+    if (cache->serial != vm.constantSerial) return; // stale, not used anymore
+    if (cache->cref) grayObject(cache->cref);
+    grayValue(cache->value);
+}
+
+// Add an empty constant cache to the constant pool, return index to it
+static bytecode_t constCacheConstant(void) {
+    ConstCache *cache = ALLOCATE(ConstCache, 1);
+    ASSERT_MEM(cache);
+    memset(cache, 0, sizeof(ConstCache));
+    ObjInternal *cacheObj = newInternalObject(true, cache, sizeof(ConstCache), markConstCache, NULL, NEWOBJ_FLAG_OLD);
+    hideFromGC(TO_OBJ(cacheObj));
+    return makeConstant(OBJ_VAL(cacheObj), CONST_T_CONSTCACHE);
+}
+
+// Can `return <call>` in the current function reuse the function's frame
+// for the call? The VM still falls back to a regular call when the frame
+// has open upvalues or a catch table (see OP_TAIL_CALL).
+static bool canEmitTailCall(void) {
+    switch (current->type) {
+        case FUN_TYPE_NAMED:
+        case FUN_TYPE_ANON:
+        case FUN_TYPE_METHOD:
+        case FUN_TYPE_CLASS_METHOD:
+            return !inINBlock && !breakBlock;
+        default:
+            return false;
+    }
+}
+
+static void markCallInfo(Obj *obj) {
+    CallInfo *cinfo = internalGetData((ObjInternal*)obj);
+    if (cinfo->kwFunc) grayObject(TO_OBJ(cinfo->kwFunc));
+}
+
+// Sites that give only positional arguments get OP_CALL_SIMPLE or
+// OP_INVOKE_SIMPLE, which push the callee's frame without the VM's argument
+// processing if the callee takes only required parameters (see
+// ObjFunction.isSimple).
+static CallInfo *emitCall(Node *n, bool isTail, bool withBlock) {
     int nArgs = n->children->length-1;
     // arbitrary, but we don't want the VM op stack to blow by pushing a whole
     // bunch of arguments
@@ -1499,6 +1689,7 @@ static CallInfo *emitCall(Node *n) {
     int argc = n->children->length; // num regular arguments
     int numKwargs = 0;
     bool usesSplat = false;
+    bool usesToBlock = false;
     CallInfo *callInfoData;
     if (nodeKind(lhs) == PROP_ACCESS_EXPR) {
         emitChildren(lhs); // the instance
@@ -1511,6 +1702,8 @@ static CallInfo *emitCall(Node *n) {
             } else if (arg->type.kind == SPLAT_EXPR) {
                 usesSplat = true;
                 argc--;
+            } else if (arg->type.kind == TO_BLOCK_EXPR) {
+                usesToBlock = true;
             }
             emitNode(arg);
         }
@@ -1523,14 +1716,23 @@ static CallInfo *emitCall(Node *n) {
         i = 0; int idx = 0;
         vec_foreach(n->children, arg, i) {
             if (arg->type.kind == KWARG_IN_CALL_STMT) {
+                // matched by name at runtime, when the source may be gone
+                tokStr(&arg->tok);
                 callInfoData->kwargNames[idx] = arg->tok;
                 idx++;
             }
         }
-        ObjInternal *callInfoObj = newInternalObject(true, callInfoData, sizeof(CallInfo), NULL, NULL, NEWOBJ_FLAG_OLD);
+        ObjInternal *callInfoObj = newInternalObject(true, callInfoData, sizeof(CallInfo), markCallInfo, NULL, NEWOBJ_FLAG_OLD);
         hideFromGC(TO_OBJ(callInfoObj));
         bytecode_t callInfoConstSlot = makeConstant(OBJ_VAL(callInfoObj), CONST_T_CALLINFO);
-        emitOp3(OP_INVOKE, methodNameArg, nArgs, callInfoConstSlot);
+        bool isSimple = numKwargs == 0 && !usesSplat && !usesToBlock && !withBlock;
+        if (isTail) {
+            emitOp3(OP_TAIL_INVOKE, methodNameArg, nArgs, callInfoConstSlot);
+        } else if (isSimple) {
+            emitOp3(OP_INVOKE_SIMPLE, methodNameArg, nArgs, callInfoConstSlot);
+        } else {
+            emitOp3(OP_INVOKE, methodNameArg, nArgs, callInfoConstSlot);
+        }
     } else {
         emitNode(lhs); // the function itself
         i = 0;
@@ -1542,6 +1744,8 @@ static CallInfo *emitCall(Node *n) {
             } else if (arg->type.kind == SPLAT_EXPR) {
                 usesSplat = true;
                 argc--;
+            } else if (arg->type.kind == TO_BLOCK_EXPR) {
+                usesToBlock = true;
             }
             emitNode(arg);
         }
@@ -1555,23 +1759,42 @@ static CallInfo *emitCall(Node *n) {
         i = 0; int idx = 0;
         vec_foreach(n->children, arg, i) {
             if (arg->type.kind == KWARG_IN_CALL_STMT) {
+                tokStr(&arg->tok);
                 callInfoData->kwargNames[idx] = arg->tok;
                 idx++;
             }
         }
-        ObjInternal *callInfoObj = newInternalObject(true, callInfoData, sizeof(CallInfo), NULL, NULL, NEWOBJ_FLAG_OLD);
+        ObjInternal *callInfoObj = newInternalObject(true, callInfoData, sizeof(CallInfo), markCallInfo, NULL, NEWOBJ_FLAG_OLD);
         hideFromGC(TO_OBJ(callInfoObj));
         bytecode_t callInfoConstSlot = makeConstant(OBJ_VAL(callInfoObj), CONST_T_CALLINFO);
-        emitOp2(OP_CALL, (bytecode_t)nArgs, callInfoConstSlot);
+        bool isSimple = numKwargs == 0 && !usesSplat && !usesToBlock && !withBlock;
+        if (isTail) {
+            emitOp2(OP_TAIL_CALL, (bytecode_t)nArgs, callInfoConstSlot);
+        } else if (isSimple) {
+            emitOp2(OP_CALL_SIMPLE, (bytecode_t)nArgs, callInfoConstSlot);
+        } else {
+            emitOp2(OP_CALL, (bytecode_t)nArgs, callInfoConstSlot);
+        }
     }
     return callInfoData;
 }
 
+// The param is set after its default value is evaluated, so closures made
+// in it can't capture the param by value.
+static void emitParamDefault(Node *param, int localSlot) {
+    Local *local = &current->locals[localSlot];
+    bool isAssigned = local->isAssigned;
+    local->isAssigned = true;
+    emitNode(vec_first(param->children));
+    local->isAssigned = isAssigned;
+}
+
 // emit function or method
 static ObjFunction *emitFunction(Node *n, FunctionType ftype) {
     Compiler fCompiler;
     int scopeDepth = current->scopeDepth;
     initCompiler(&fCompiler, scopeDepth, ftype, &n->tok, NULL);
+    collectAssignedNames(&fCompiler, n);
     CompileScopeType stype = COMPILE_SCOPE_FUNCTION;
 
     if (ftype == FUN_TYPE_TOP_LEVEL) {
@@ -1603,7 +1826,7 @@ static ObjFunction *emitFunction(Node *n, FunctionType ftype) {
             defineVariable(&param->tok, localSlot, true);
             func->numDefaultArgs++;
             Insn *insnBefore = currentIseq()->tail; // NOTE: can be NULL
-            emitNode(vec_first(param->children)); // default arg
+            emitParamDefault(param, localSlot);
             // the VM skips these instructions if the argument is supplied
             emitOp2(OP_SET_LOCAL, (bytecode_t)localSlot, identifierConstant(&param->tok));
             emitOp0(OP_POP);
@@ -1621,6 +1844,7 @@ static ObjFunction *emitFunction(Node *n, FunctionType ftype) {
             func->hasRestArg = true;
         } else if (param->type.kind == PARAM_NODE_KWARG) {
             hasKwarg = true;
+            tokStr(&param->tok); // see kwargParamIndexes() in vm.c
             uint8_t localSlot = declareVariable(&param->tok);
             defineVariable(&param->tok, localSlot, true);
             emitOp2(OP_CHECK_KEYWORD,
@@ -1631,10 +1855,11 @@ static ObjFunction *emitFunction(Node *n, FunctionType ftype) {
             );
             func->numKwargs++;
             Insn *ifJumpStart = emitJump(OP_JUMP_IF_TRUE);
-            emitChildren(param);
+            emitParamDefault(param, localSlot);
             emitOp2(OP_SET_LOCAL, localSlot, identifierConstant(&param->tok));
             emitOp0(OP_POP);
             patchJump(ifJumpStart, -1, NULL);
+            ifJumpStart->flags |= INSN_FL_KWARG_DEFAULT;
         } else if (param->type.kind == PARAM_NODE_BLOCK) { // &arg
             uint8_t localSlot = declareVariable(&param->tok);
             defineVariable(&param->tok, localSlot, true);
@@ -1649,6 +1874,8 @@ static ObjFunction *emitFunction(Node *n, FunctionType ftype) {
     if (hasKwarg) {
         addFakeLocal(true);
     }
+    func->isSimple = ftype != FUN_TYPE_BLOCK && func->numDefaultArgs == 0 &&
+        !hasKwarg && !func->hasRestArg && !func->hasBlockArg;
 
     bool oldBreakBlock = breakBlock;
     if (ftype == FUN_TYPE_BLOCK) {
@@ -1683,6 +1910,17 @@ static ObjFunction *emitFunction(Node *n, FunctionType ftype) {
         }
         func->upvaluesInfo[i] = fCompiler.upvalues[i]; // copy upvalue info
     }
+    // then the same for the captured values
+    if (func->capturedCount > 0) {
+        func->capturedInfo = ALLOCATE(Upvalue, func->capturedCount);
+    }
+    for (int i = 0; i < func->capturedCount; i++) {
+        if (ftype != FUN_TYPE_BLOCK) {
+            emitOp0(fCompiler.captured[i].isLocal ? 1 : 0);
+            emitOp0(fCompiler.captured[i].index);
+        }
+        func->capturedInfo[i] = fCompiler.captured[i];
+    }
 
     if (ftype == FUN_TYPE_TOP_LEVEL || ftype == FUN_TYPE_BLOCK ||
             ftype == FUN_TYPE_ANON) {
@@ -1714,8 +1952,8 @@ static ObjFunction *emitFunction(Node *n, FunctionType ftype) {
     return func;
 }
 
-static void pushVarSlots() {
-    addFakeLocal(true);
+static int pushVarSlots() {
+    return addFakeLocal(true);
 }
 
 static void emitBinaryOp(Token tok) {
@@ -1930,6 +2168,27 @@ static void emitNode(Node *n) {
         }
         break;
     }
+    case STRING_INTERP_EXPR: {
+        if (n->children->length >= UINT8_MAX) {
+            error("Too many parts in string interpolation");
+            return;
+        }
+        Node *part = NULL; int partIdx = 0;
+        vec_foreach(n->children, part, partIdx) {
+            // OP_STRING_INTERP only reads the literal parts, they don't need
+            // to be copied like with OP_STRING
+            if (nodeKind(part) == LITERAL_EXPR && part->type.litKind == STRING_TYPE) {
+                Token *tok = &part->tok;
+                ObjString *str = INTERNED(tokStr(tok), tok->length);
+                STRING_SET_STATIC(str);
+                emitConstant(OBJ_VAL(str), CONST_T_STRLIT);
+            } else {
+                emitNode(part);
+            }
+        }
+        emitOp1(OP_STRING_INTERP, (bytecode_t)n->children->length);
+        break;
+    }
     case ARRAY_EXPR: {
         if (n->children->length >= UINT8_MAX) {
             // TODO: fix
@@ -2095,67 +2354,54 @@ static void emitNode(Node *n) {
     }
     case FOREACH_STMT: {
         pushScope(COMPILE_SCOPE_FOREACH);
-        vec_byte_t v_slots;
-        vec_init(&v_slots);
         int numVars = n->children->length - 2;
-        pushVarSlots(); // don't overwrite the iterator with the variables
-        if (numVars > 1) {
-            pushVarSlots(); // the iterator value
-        }
-        int i = 0;
-        for (i = 0; i < numVars; i++) {
+        // The iterable (or its iterator) and the cursor live in hidden slots
+        // below the loop variables for the duration of the loop.
+        int iterSlot = pushVarSlots(); // iterable
+        pushVarSlots(); // cursor
+        // iterator expression
+        emitNode(n->children->data[numVars]);
+        emitNil(); // cursor, set by OP_ITER
+        emitOp1(OP_ITER, iterSlot);
+        uint8_t firstSlot = 0;
+        for (int i = 0; i < numVars; i++) {
             Token varName = n->children->data[i]->tok;
             uint8_t varSlot = declareVariable(&varName);
-            vec_push(&v_slots, varSlot);
+            if (i == 0) firstSlot = varSlot;
+            emitNil(); // set by OP_ITER_NEXT
         }
-        // iterator expression
-        emitNode(n->children->data[i]);
-        i++;
 
-        emitOp0(OP_ITER); // push iterator to stack
         int beforeIterNext = currentIseq()->wordCount+2;
-        emitOp0(OP_ITER_NEXT);
-        // TODO: op_jump_if_undef? Otherwise, nil or false marks end of iteration
-        Insn *iterDone = emitJump(OP_JUMP_IF_FALSE_PEEK);
-        bytecode_t slotNum = 0; int slotIdx = 0;
-        int setOp = numVars > 1 ? OP_UNPACK_SET_LOCAL : OP_SET_LOCAL;
-        vec_foreach(&v_slots, slotNum, slotIdx) {
-            Token name = n->children->data[slotIdx]->tok;
-            bytecode_t nameIdx = identifierConstant(&name);
-            if (setOp == OP_SET_LOCAL) {
-                emitOp2(setOp, slotNum, nameIdx);
-            } else { // SET_UNPACK
-                emitOp3(setOp, slotNum, (bytecode_t)slotIdx, nameIdx);
-            }
-        }
+        emitOp2(OP_ITER_NEXT, firstSlot, numVars);
+        Insn *iterDone = emitJump(OP_JUMP_IF_FALSE);
         Insn *beforeForeach = currentIseq()->tail;
         eLoopType lastLoopType = curLoopType;
         curLoopType = LOOP_T_FOREACH;
 
         int oldLoopLocalCount = loopLocalCount;
         loopLocalCount = current->localCount;
-        emitNode(n->children->data[i]); // foreach block
+        emitNode(n->children->data[numVars+1]); // foreach block
         loopLocalCount = oldLoopLocalCount;
 
         curLoopType = lastLoopType;
         Insn *afterForeach = currentIseq()->tail;
         patchContinuesBetween(beforeForeach, afterForeach);
-        if (numVars == 1) {
-            emitOp0(OP_POP); // pop the iterator value
-        }
-        if (numVars > 1) {
-            for (int j = 0; j < numVars; j++) {
-                emitOp0(OP_POP); // pop the iterator values
-            }
-            emitOp0(OP_POP); // pop the iterator value array, for unpack
+        Insn *loop = emitLoop(beforeIterNext);
+        // the scope's pops (loop variables, cursor and iterable) are the
+        // loop's exit, for breaks and for when iteration is done
+        int numLoopSlots = 0;
+        for (int i = iterSlot; i < current->localCount; i++) {
+            if (!current->locals[i].isUpvalue) numLoopSlots++;
         }
-        emitLoop(beforeIterNext);
         popScope(COMPILE_SCOPE_FOREACH);
-        patchJump(iterDone, -1, NULL);
-        emitOp0(OP_POP); // pop the iterator value
-        patchBreaks(beforeForeach, currentIseq()->tail, 0);
-        emitOp0(OP_POP); // pop the iterator
-        vec_deinit(&v_slots);
+        if (current->type == FUN_TYPE_BLOCK) {
+            // blocks don't pop their locals, pop the ones pushed above
+            emitOp1(OP_POP_N, numLoopSlots);
+        }
+        patchJump(iterDone, -1, loop);
+        Insn *exit = loop->next;
+        ASSERT(exit);
+        patchBreaks(beforeForeach, exit, 0);
         break;
     }
     case BREAK_STMT: {
@@ -2232,9 +2478,9 @@ static void emitNode(Node *n) {
             if (arg == -1) return; // error already printed
             if (current->scopeDepth == 0) {
                 if (numVarsSet == 1 || uninitialized) {
-                    emitOp1(OP_DEFINE_GLOBAL, (bytecode_t)arg);
+                    emitOp2(OP_DEFINE_GLOBAL, (bytecode_t)arg, globalVarSlot(&varNode->tok));
                 } else {
-                    emitOp2(OP_UNPACK_DEFINE_GLOBAL, (bytecode_t)arg, slotIdx);
+                    emitOp3(OP_UNPACK_DEFINE_GLOBAL, (bytecode_t)arg, globalVarSlot(&varNode->tok), slotIdx);
                     slotIdx++;
                 }
             } else {
@@ -2255,7 +2501,7 @@ static void emitNode(Node *n) {
     }
     case CONSTANT_EXPR: {
         bytecode_t arg = identifierConstant(&n->tok);
-        emitOp1(OP_GET_CONST, arg);
+        emitOp2(OP_GET_CONST, arg, constCacheConstant());
         break;
     }
     case CONSTANT_LOOKUP_EXPR: {
@@ -2368,6 +2614,8 @@ static void emitNode(Node *n) {
             // always return instance in init function
             if (current->type == FUN_TYPE_INIT) {
                 emitOp0(OP_GET_THIS);
+            } else if (nodeKind(n->children->data[0]) == CALL_EXPR && canEmitTailCall()) {
+                emitCall(n->children->data[0], true, false);
             } else {
                 emitChildren(n);
             }
@@ -2404,11 +2652,11 @@ static void emitNode(Node *n) {
         break;
     }
     case CALL_EXPR: {
-        emitCall(n);
+        emitCall(n, false, false);
         break;
     }
     case CALL_BLOCK_EXPR: {
-        CallInfo *cinfo = emitCall(n->children->data[0]);
+        CallInfo *cinfo = emitCall(n->children->data[0], false, true);
         ObjFunction *block = emitFunction(n->children->data[1], FUN_TYPE_BLOCK);
         cinfo->blockFunction = block;
         break;
@@ -2605,6 +2853,7 @@ ObjFunction *compile_src(char *src, CompileErr *err) {
     Compiler mainCompiler;
     top = &mainCompiler;
     initCompiler(&mainCompiler, 0, FUN_TYPE_TOP_LEVEL, NULL, NULL);
+    collectAssignedNames(&mainCompiler, program);
     emitNode(program);
     ObjFunction *prog = endCompiler();
     prog->programNode = program;
@@ -2629,6 +2878,7 @@ ObjFunction *compile_node(Node *program, CompileErr *err) {
     Compiler mainCompiler;
     top = &mainCompiler;
     initCompiler(&mainCompiler, 0, FUN_TYPE_TOP_LEVEL, NULL, NULL);
+    collectAssignedNames(&mainCompiler, program);
     emitNode(program);
     ObjFunction *prog = endCompiler();
     prog->programNode = program;
@@ -2681,6 +2931,7 @@ ObjFunction *compile_eval_src(char *src, CompileErr *err, ObjInstance *instance,
     top = &mainCompiler;
     ClassCompiler classCompiler;
     initEvalCompiler(&mainCompiler, func_in, ip_at);
+    collectAssignedNames(&mainCompiler, program);
     if (compilingClassBody) {
         currentClassOrModule = &classCompiler;
         classCompiler.name = syntheticToken(instance->klass->classInfo->name->chars);
@@ -2738,6 +2989,7 @@ ObjFunction *compile_binding_eval_src(char *src, CompileErr *err, ObjScope *scop
     Compiler mainCompiler;
     top = &mainCompiler;
     initBindingEvalCompiler(&mainCompiler, scope);
+    collectAssignedNames(&mainCompiler, program);
     CompileScopeType stype = COMPILE_SCOPE_FUNCTION;
     if (scope->function->ftype == FUN_TYPE_TOP_LEVEL) {
       stype = COMPILE_SCOPE_MAIN;
@@ -66,11 +66,16 @@ typedef struct Local {
   int depth;
   bool isUpvalue;
   bool popOnScopeEnd;
+  // Whether the variable can be set after it's declared (see
+  // Compiler.assignedNames). Closures copy variables that can't be into
+  // their captured values instead of sharing them through an ObjUpvalue.
+  bool isAssigned;
 } Local;
 
 typedef struct Upvalue {
   // The index of the local variable or upvalue being captured from the
-  // enclosing function.
+  // enclosing function. For captured values that aren't locals, it's the
+  // index into the enclosing closure's captured values.
   uint8_t index;
 
   // Whether the captured variable is a local or upvalue in the enclosing
@@ -87,6 +92,8 @@ typedef struct Compiler {
   FunctionType type;
   Local locals[LX_MAX_LOCALS];
   Upvalue upvalues[LX_MAX_UPVALUES];
+  // Variables copied by value when the closure is made (ObjClosure.captured)
+  Upvalue captured[LX_MAX_UPVALUES];
 
   // The number of local variables declared/defined in this scope (including
   // function parameters).
@@ -99,6 +106,15 @@ typedef struct Compiler {
 
   Iseq iseq; // Generated instructions for the function
   Table constTbl;
+  // Names that are the target of an assignment or a foreach variable
+  // anywhere in the function, including in nested functions (Token*)
+  vec_void_t assignedNames;
+  // eval, instanceEval, Binding or debugger is referenced in the function,
+  // so any of its variables can be assigned to
+  bool usesEval;
+  // Local slots closed over by a nested function through an ObjUpvalue.
+  // The optimizer leaves them alone, they can change under it.
+  bool sharedSlots[LX_MAX_LOCALS];
 
   vec_void_t v_errMessages;
   bool hadError;
@@ -117,6 +133,13 @@ struct CallInfo; // fwd decl
 #define ITER_FLAG_STOP 1
 typedef void (*BlockIterFunc)(int blkArgCount, Value *blkArgs, Value blkRet, struct CallInfo *cinfo, int *iterFlags);
 
+// How a block yielded to from C exited (see yieldFromC)
+typedef enum BlockStatus {
+    BLOCK_ST_CONTINUE = 0, // end of block or 'continue'
+    BLOCK_ST_BREAK,
+    BLOCK_ST_RETURN,
+} BlockStatus;
+
 #ifdef NAN_TAGGING
 typedef Value uint64_t;
 #else
@@ -129,6 +152,11 @@ typedef struct CallInfo {
     int numKwargs;
     bool usesSplat;
     Token kwargNames[LX_MAX_KWARGS];
+    // keyword parameter index (or -1) for each keyword argument, matched
+    // for the last Lox function called from this site
+    ObjFunction *kwFunc;
+    signed char kwParamIdx[LX_MAX_KWARGS];
+    bool kwAllGiven; // every keyword parameter of kwFunc is given
     // for blocks
     ObjFunction *blockFunction; // lox block given as argument to fn
     ObjInstance *blockInstance; // from &blk, turned closure to block instance
@@ -137,8 +165,21 @@ typedef struct CallInfo {
     volatile Value *blockArgsExtra;
     int blockArgsNumExtra;
     bool isYield;
+    // set by yieldFromC: the block frame returns normally with a status
+    // instead of throwing a block control flow error
+    bool yieldStatus;
+    BlockStatus blockStatus;
 } CallInfo;
 
+// Per-instruction cache of OP_GET_CONST. It's valid as long as no constant
+// has been defined since it was filled (see vm.constantSerial) and the
+// lookup happens under the same class or module.
+typedef struct ConstCache {
+    unsigned long serial; // 0 if empty
+    Obj *cref; // class or module the constant was looked up under, or NULL
+    Value value;
+} ConstCache;
+
 
 typedef struct CompilerOpts {
     bool noOptimize; // default: false (optimize)
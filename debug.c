@@ -72,6 +72,22 @@ const char *opName(OpCode code) {
         return "OP_SHOVEL_R";
     case OP_NEGATE:
         return "OP_NEGATE";
+    case OP_ADD_NUM:
+        return "OP_ADD_NUM";
+    case OP_SUBTRACT_NUM:
+        return "OP_SUBTRACT_NUM";
+    case OP_MULTIPLY_NUM:
+        return "OP_MULTIPLY_NUM";
+    case OP_DIVIDE_NUM:
+        return "OP_DIVIDE_NUM";
+    case OP_LESS_NUM:
+        return "OP_LESS_NUM";
+    case OP_GREATER_NUM:
+        return "OP_GREATER_NUM";
+    case OP_GREATER_EQUAL_NUM:
+        return "OP_GREATER_EQUAL_NUM";
+    case OP_LESS_EQUAL_NUM:
+        return "OP_LESS_EQUAL_NUM";
     case OP_NOT:
         return "OP_NOT";
     case OP_LESS:
@@ -118,6 +134,8 @@ const char *opName(OpCode code) {
         return "OP_CLOSURE";
     case OP_GET_UPVALUE:
         return "OP_GET_UPVALUE";
+    case OP_GET_CAPTURED:
+        return "OP_GET_CAPTURED";
     case OP_SET_UPVALUE:
         return "OP_SET_UPVALUE";
     case OP_CLOSE_UPVALUE:
@@ -126,8 +144,18 @@ const char *opName(OpCode code) {
         return "OP_CALL";
     case OP_INVOKE:
         return "OP_INVOKE";
+    case OP_TAIL_CALL:
+        return "OP_TAIL_CALL";
+    case OP_TAIL_INVOKE:
+        return "OP_TAIL_INVOKE";
+    case OP_CALL_SIMPLE:
+        return "OP_CALL_SIMPLE";
+    case OP_INVOKE_SIMPLE:
+        return "OP_INVOKE_SIMPLE";
     case OP_STRING:
         return "OP_STRING";
+    case OP_STRING_INTERP:
+        return "OP_STRING_INTERP";
     case OP_ARRAY:
         return "OP_ARRAY";
     case OP_DUPARRAY:
@@ -348,6 +376,32 @@ static int constantInstruction(ObjString *buf, const char *op, Chunk *chunk, int
     return i+2;
 }
 
+// instruction has 2 operands, a constant slot index for the variable name
+// and the global variable slot
+static int printGlobalVarInstruction(FILE *f, const char *op, Chunk *chunk, int i) {
+    bytecode_t constantIdx = chunk->code[i + 1];
+    bytecode_t globalIdx = chunk->code[i + 2];
+    fprintf(f, "%-16s %4" PRId8 " '", op, constantIdx);
+    printValue(f, getConstant(chunk, constantIdx), false, -1);
+    fprintf(f, "' (slot=%d)\n", globalIdx);
+    return i+3;
+}
+static int globalVarInstruction(ObjString *buf, const char *op, Chunk *chunk, int i) {
+    constantInstruction(buf, op, chunk, i);
+    return i+3;
+}
+
+// instruction has 2 operands, a constant slot index for the constant name
+// and one for its cache
+static int printConstLookupInstruction(FILE *f, const char *op, Chunk *chunk, int i) {
+    printConstantInstruction(f, op, chunk, i);
+    return i+3;
+}
+static int constLookupInstruction(ObjString *buf, const char *op, Chunk *chunk, int i) {
+    constantInstruction(buf, op, chunk, i);
+    return i+3;
+}
+
 static int printStringInstruction(FILE *f, const char *op, Chunk *chunk, int i) {
     bytecode_t constantIdx = chunk->code[i + 1];
     bytecode_t isStatic = chunk->code[i + 2];
@@ -442,14 +496,15 @@ static int unpackSetVarInstruction(ObjString *buf, const char *op, Chunk *chunk,
 static int printUnpackDefGlobalInstruction(FILE *f, const char *op, Chunk *chunk, int i) {
     bytecode_t constantIdx = chunk->code[i + 1];
     Value constant = getConstant(chunk, constantIdx);
-    bytecode_t unpackIdx = chunk->code[i + 2];
-    fprintf(f, "%-16s    '%s' %d\n", op, AS_STRING(constant)->chars, unpackIdx);
-    return i+3;
+    bytecode_t globalIdx = chunk->code[i + 2];
+    bytecode_t unpackIdx = chunk->code[i + 3];
+    fprintf(f, "%-16s    '%s' %d (slot=%d)\n", op, AS_STRING(constant)->chars, unpackIdx, globalIdx);
+    return i+4;
 }
 
 static int unpackDefGlobalInstruction(ObjString *buf, const char *op, Chunk *chunk, int i) {
     // TODO
-    return i+3;
+    return i+4;
 }
 
 static int printClosureInstruction(FILE *f, const char *op, Chunk *chunk, int i, vec_funcp_t *funcs) {
@@ -457,13 +512,14 @@ static int printClosureInstruction(FILE *f, const char *op, Chunk *chunk, int i,
     Value constant = getConstant(chunk, funcConstIdx);
     ASSERT(IS_FUNCTION(constant));
     int numUpvalues = AS_FUNCTION(constant)->upvalueCount;
+    int numCaptured = AS_FUNCTION(constant)->capturedCount;
 
     addFunc(funcs, AS_FUNCTION(constant));
 
     fprintf(f, "%-16s %4" PRId8 " '", op, funcConstIdx);
     printValue(f, constant, false, -1);
-    fprintf(f, "' (upvals: %d)\n", numUpvalues);
-    return i+2+(numUpvalues*2);
+    fprintf(f, "' (upvals: %d, captured: %d)\n", numUpvalues, numCaptured);
+    return i+2+((numUpvalues+numCaptured)*2);
 }
 
 static int closureInstruction(ObjString *buf, const char *op, Chunk *chunk, int i, vec_funcp_t *funcs) {
@@ -471,6 +527,7 @@ static int closureInstruction(ObjString *buf, const char *op, Chunk *chunk, int
     Value constant = getConstant(chunk, funcConstIdx);
     ASSERT(IS_FUNCTION(constant));
     int numUpvalues = AS_FUNCTION(constant)->upvalueCount;
+    int numCaptured = AS_FUNCTION(constant)->capturedCount;
 
     addFunc(funcs, AS_FUNCTION(constant));
 
@@ -483,7 +540,7 @@ static int closureInstruction(ObjString *buf, const char *op, Chunk *chunk, int
 
     pushCString(buf, cbuf, strlen(cbuf));
     xfree(cbuf);
-    return i+2+(numUpvalues*2);
+    return i+2+((numUpvalues+numCaptured)*2);
 }
 
 static int printJumpInstruction(FILE *f, const char *op, Chunk *chunk, int i) {
@@ -676,6 +733,24 @@ static int byteInstruction(ObjString *buf, const char *op, Chunk *chunk, int i)
     return i+2;
 }
 
+static int printIterNextInstruction(FILE *f, const char *op, Chunk *chunk, int i) {
+    bytecode_t slot = chunk->code[i + 1];
+    bytecode_t numVars = chunk->code[i + 2];
+    fprintf(f, "%-16s (slot=%d, vars=%d)\n", op, slot, numVars);
+    return i+3;
+}
+
+static int iterNextInstruction(ObjString *buf, const char *op, Chunk *chunk, int i) {
+    char *cbuf = (char*)calloc(1, strlen(op)+1+28);
+    ASSERT_MEM(cbuf);
+    bytecode_t slot = chunk->code[i + 1];
+    bytecode_t numVars = chunk->code[i + 2];
+    sprintf(cbuf, "%s\t(slot=%d, vars=%d)\n", op, slot, numVars);
+    pushCString(buf, cbuf, strlen(cbuf));
+    xfree(cbuf);
+    return i+3;
+}
+
 int printDisassembledInstruction(FILE *f, Chunk *chunk, int i, vec_funcp_t *funcs) {
     fprintf(f, "%04d ", i*BYTES_IN_INSTRUCTION);
     // same line as prev instruction
@@ -686,11 +761,13 @@ int printDisassembledInstruction(FILE *f, Chunk *chunk, int i, vec_funcp_t *func
     }
     bytecode_t byte = chunk->code[i];
     switch (byte) {
-        case OP_CONSTANT:
         case OP_DEFINE_GLOBAL:
         case OP_GET_GLOBAL:
         case OP_SET_GLOBAL:
+            return printGlobalVarInstruction(f, opName(byte), chunk, i);
         case OP_GET_CONST:
+            return printConstLookupInstruction(f, opName(byte), chunk, i);
+        case OP_CONSTANT:
         case OP_SET_CONST:
         case OP_GET_CONST_UNDER:
         case OP_CLASS:
@@ -721,6 +798,7 @@ int printDisassembledInstruction(FILE *f, Chunk *chunk, int i, vec_funcp_t *func
         case OP_SET_LOCAL:
         case OP_SET_UPVALUE:
         case OP_GET_UPVALUE:
+        case OP_GET_CAPTURED:
             return printLocalVarInstruction(f, opName(byte), chunk, i);
         case OP_UNPACK_SET_LOCAL:
             return printUnpackSetVarInstruction(f, opName(byte), chunk, i);
@@ -739,8 +817,12 @@ int printDisassembledInstruction(FILE *f, Chunk *chunk, int i, vec_funcp_t *func
         case OP_BREAK:
             return printBreakInstruction(f, opName(byte), chunk, i);
         case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_SIMPLE:
             return printCallInstruction(f, opName(byte), chunk, i, funcs);
         case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_INVOKE_SIMPLE:
             return printInvokeInstruction(f, opName(byte), chunk, i, funcs);
         case OP_CHECK_KEYWORD:
             return printCheckKeywordInstruction(f, opName(byte), chunk, i);
@@ -760,6 +842,14 @@ int printDisassembledInstruction(FILE *f, Chunk *chunk, int i, vec_funcp_t *func
         case OP_GREATER:
         case OP_GREATER_EQUAL:
         case OP_LESS_EQUAL:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_LESS_NUM:
+        case OP_GREATER_NUM:
+        case OP_GREATER_EQUAL_NUM:
+        case OP_LESS_EQUAL_NUM:
         case OP_EQUAL:
         case OP_NOT_EQUAL:
         case OP_NOT:
@@ -779,15 +869,17 @@ int printDisassembledInstruction(FILE *f, Chunk *chunk, int i, vec_funcp_t *func
         case OP_IN:
         case OP_GET_THIS:
         case OP_SPLAT_ARRAY:
-        case OP_ITER:
-        case OP_ITER_NEXT:
         case OP_BLOCK_BREAK:
         case OP_BLOCK_CONTINUE:
         case OP_BLOCK_RETURN:
         case OP_TO_BLOCK:
             return printSimpleInstruction(f, opName(byte), i);
         case OP_POP_N:
+        case OP_ITER:
+        case OP_STRING_INTERP:
             return printByteInstruction(f, opName(byte), chunk, i);
+        case OP_ITER_NEXT:
+            return printIterNextInstruction(f, opName(byte), chunk, i);
         case OP_POP_DEBUG:
             return printOpPopDebugInstruction(f, opName(byte), chunk, i);
         default:
@@ -802,11 +894,13 @@ static int disassembledInstruction(ObjString *buf, Chunk *chunk, int i, vec_func
     pushCString(buf, numBuf, strlen(numBuf));
     bytecode_t byte = chunk->code[i];
     switch (byte) {
-        case OP_CONSTANT:
         case OP_DEFINE_GLOBAL:
         case OP_GET_GLOBAL:
         case OP_SET_GLOBAL:
+            return globalVarInstruction(buf, opName(byte), chunk, i);
         case OP_GET_CONST:
+            return constLookupInstruction(buf, opName(byte), chunk, i);
+        case OP_CONSTANT:
         case OP_SET_CONST:
         case OP_GET_CONST_UNDER:
         case OP_CLASS:
@@ -837,6 +931,7 @@ static int disassembledInstruction(ObjString *buf, Chunk *chunk, int i, vec_func
         case OP_SET_LOCAL:
         case OP_SET_UPVALUE:
         case OP_GET_UPVALUE:
+        case OP_GET_CAPTURED:
             return localVarInstruction(buf, opName(byte), chunk, i);
         case OP_UNPACK_SET_LOCAL:
             return unpackSetVarInstruction(buf, opName(byte), chunk, i);
@@ -853,8 +948,12 @@ static int disassembledInstruction(ObjString *buf, Chunk *chunk, int i, vec_func
         case OP_LOOP:
             return loopInstruction(buf, opName(byte), chunk, i);
         case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_SIMPLE:
             return callInstruction(buf, opName(byte), chunk, i, funcs);
         case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_INVOKE_SIMPLE:
             return invokeInstruction(buf, opName(byte), chunk, i, funcs);
         case OP_CHECK_KEYWORD:
             return checkKeywordInstruction(buf, opName(byte), chunk, i);
@@ -874,6 +973,14 @@ static int disassembledInstruction(ObjString *buf, Chunk *chunk, int i, vec_func
         case OP_GREATER:
         case OP_GREATER_EQUAL:
         case OP_LESS_EQUAL:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_LESS_NUM:
+        case OP_GREATER_NUM:
+        case OP_GREATER_EQUAL_NUM:
+        case OP_LESS_EQUAL_NUM:
         case OP_EQUAL:
         case OP_NOT_EQUAL:
         case OP_NOT:
@@ -893,15 +1000,17 @@ static int disassembledInstruction(ObjString *buf, Chunk *chunk, int i, vec_func
         case OP_IN:
         case OP_GET_THIS:
         case OP_SPLAT_ARRAY:
-        case OP_ITER:
-        case OP_ITER_NEXT:
         case OP_BLOCK_BREAK:
         case OP_BLOCK_CONTINUE:
         case OP_BLOCK_RETURN:
         case OP_TO_BLOCK:
             return simpleInstruction(buf, opName(byte), i);
         case OP_POP_N:
+        case OP_ITER:
+        case OP_STRING_INTERP:
             return byteInstruction(buf, opName(byte), chunk, i);
+        case OP_ITER_NEXT:
+            return iterNextInstruction(buf, opName(byte), chunk, i);
         default: {
             ASSERT(0);
             char *cBuf = calloc(1, 19+1);
@@ -217,8 +217,10 @@ void enterDebugger(Debugger *dbg, char *filename, int lineno, int ndepth, int nw
         } else if (strcmp(buf, "globals") == 0) {
             Entry e; int gidx = 0;
             TABLE_FOREACH(&vm.globals, e, gidx, {
+                Value val = vm.globalValues.values[(int)AS_NUMBER(e.value)];
+                if (IS_UNDEF(val)) continue;
                 fprintf(stdout, "%s: ", AS_CSTRING(e.key));
-                printValue(stdout, e.value, true, -1);
+                printValue(stdout, val, true, -1);
                 fprintf(stdout, "\n");
             });
         } else {
@@ -29,6 +29,12 @@ typedef struct Debugger {
 void initDebugger(Debugger *dbg);
 void freeDebugger(Debugger *dbg); // free internal structures
 
+// Is there anything that could make shouldEnterDebugger() true? Checked by
+// the VM before each instruction, so it's inline.
+static inline bool debuggerArmed(Debugger *dbg) {
+    return dbg->awaitingPause || dbg->v_breakpoints.length > 0 ||
+        dbg->v_breaklvls.length > 0;
+}
 bool shouldEnterDebugger(Debugger *dbg, char *fname, int curLine, int lastLine,
     int ndepth, int nwidth);
 void enterDebugger(Debugger *dbg, char *fname, int lineno, int ndepth, int nwidth);
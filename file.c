@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <pwd.h>
 #include <grp.h>
 #include "object.h"
@@ -104,6 +105,61 @@ static Value lxFileReadStatic(int argCount, Value *args) {
     return OBJ_VAL(buf);
 }
 
+// Returns a frozen String whose contents are a read-only shared mapping of the
+// given file. The pages come from the page cache, so they aren't copied onto
+// the lox heap and are shared with other processes (ex: forked workers) that
+// map the same file.
+static Value lxFileMmapStatic(int argCount, Value *args) {
+    CHECK_ARITY("File.mmap", 2, 2, argCount);
+    Value fname = args[1];
+    CHECK_ARG_IS_A(fname, lxStringClass, 1);
+    ObjString *fnameStr = VAL_TO_STRING(fname);
+    checkFileExists(fnameStr->chars);
+    int fd = checkOpen(fnameStr->chars, O_RDONLY|O_CLOEXEC, 0);
+    struct stat st;
+    int last = errno;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        errno = last;
+        throwErrorFmt(sysErrClass(err), "Error during stat for file %s: %s", fnameStr->chars, strerror(err));
+    }
+    size_t len = (size_t)st.st_size;
+    if (len == 0) {
+        close(fd);
+        ObjString *empty = emptyString();
+        objFreeze((Obj*)empty);
+        return OBJ_VAL(empty);
+    }
+    // Reserve an extra zeroed page-aligned area after the file contents so the
+    // string is always NUL-terminated, even if the file size is a multiple of
+    // the page size. The file is then mapped over the start of the reservation.
+    size_t pageSz = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapSize = ((len + 1) + pageSz - 1) & ~(pageSz - 1);
+    releaseGVL(THREAD_STOPPED);
+    char *base = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    char *chars = MAP_FAILED;
+    if (base != MAP_FAILED) {
+        chars = mmap(base, len, PROT_READ, MAP_SHARED|MAP_FIXED, fd, 0);
+        if (chars == MAP_FAILED) {
+            int err = errno;
+            munmap(base, mapSize);
+            errno = err;
+        }
+    }
+    acquireGVL();
+    if (chars == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        errno = last;
+        throwErrorFmt(sysErrClass(err), "Error during mmap for file %s: %s", fnameStr->chars, strerror(err));
+    }
+    // the mapping stays valid after the fd is closed
+    close(fd);
+    ObjString *str = mappedString(chars, len, mapSize, NEWOBJ_FLAG_NONE);
+    return OBJ_VAL(str);
+}
+
 static Value lxFileStatStatic(int argCount, Value *args) {
     CHECK_ARITY("File.stat", 2, 2, argCount);
     Value path = args[1];
@@ -203,21 +259,7 @@ static Value lxFileStaticCopy(int argCount, Value *args) {
     CHECK_ARG_IS_A(dst, lxFileClass, 2);
     LxFile *srcf = FILE_GETHIDDEN(src);
     LxFile *dstf = FILE_GETHIDDEN(dst);
-    size_t chunkSz = 1024 * 16;
-    ssize_t res = 0;
-    ssize_t bytesCopied = 0;
-    char *buf = ALLOCATE(char, chunkSz);
-    releaseGVL(THREAD_STOPPED);
-    while ((res = read(srcf->fd, buf, chunkSz)) > 0) {
-      int wres = write(dstf->fd, buf, res);
-      if (wres != res) {
-        FREE_SIZE(chunkSz, buf);
-        throwErrorFmt(sysErrClass(errno), "Error during write: %s", strerror(errno));
-      }
-      bytesCopied += res;
-    }
-    acquireGVL();
-    FREE_SIZE(chunkSz, buf);
+    size_t bytesCopied = IOCopyFd(srcf->fd, dstf->fd, -1);
     return NUMBER_VAL(bytesCopied);
 }
 
@@ -763,6 +805,7 @@ void Init_FileClass(void) {
     addNativeMethod(fileStatic, "exists", lxFileExistsStatic);
     addNativeMethod(fileStatic, "read", lxFileReadStatic);
     addNativeMethod(fileStatic, "readLines", lxFileReadLinesStatic);
+    addNativeMethod(fileStatic, "mmap", lxFileMmapStatic);
     addNativeMethod(fileStatic, "user", lxFileUserStatic);
     addNativeMethod(fileStatic, "group", lxFileGroupStatic);
     addNativeMethod(fileStatic, "stat", lxFileStatStatic);
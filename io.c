@@ -4,6 +4,12 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "object.h"
 #include "vm.h"
 #include "runtime.h"
@@ -14,6 +20,7 @@ ObjClass *lxIOClass;
 ObjClass *lxEWouldBlockClass;
 #define READBUF_SZ 4092
 #define WRITEBUF_SZ 4092
+#define COPYBUF_SZ (1024 * 64)
 
 static void markInternalFile(Obj *obj) {
     ASSERT(obj->type == OBJ_T_INTERNAL);
@@ -175,16 +182,19 @@ size_t IOWrite(Value io, const void *buf, size_t count) {
         throwErrorFmt(lxErrClass, "Cannot write to stdin");
     }
     int fd = f->fd;
-    size_t chunkSz = count > WRITEBUF_SZ ? WRITEBUF_SZ : count;
     char ioWritebuf[WRITEBUF_SZ];
-    memcpy(ioWritebuf, buf, chunkSz);
     size_t written = 0;
     ssize_t res = 0;
     int last = errno;
     releaseGVL(THREAD_STOPPED);
-    while ((res = write(fd, ioWritebuf, chunkSz)) > 0 && (written += res) && written < count) {
-        chunkSz -= written;
-        memcpy(ioWritebuf, buf+written, chunkSz > WRITEBUF_SZ ? WRITEBUF_SZ : chunkSz);
+    while (written < count) {
+        size_t chunkSz = count-written > WRITEBUF_SZ ? WRITEBUF_SZ : count-written;
+        memcpy(ioWritebuf, (const char*)buf+written, chunkSz);
+        if ((res = write(fd, ioWritebuf, chunkSz)) <= 0) {
+            if (res == -1 && errno == EINTR) continue;
+            break;
+        }
+        written += res;
     }
     acquireGVL();
     if (res == -1) {
@@ -195,6 +205,212 @@ size_t IOWrite(Value io, const void *buf, size_t count) {
     return written;
 }
 
+// Lets the kernel read the strings' buffers directly while the GVL is
+// released. Each buffer is handed over to a frozen owner like the ones String
+// slices share (see sliceOwner()), so another thread modifying one of the
+// strings in the meantime copies it first instead of reallocating the buffer
+// under the syscall. The owners are kept alive as C-call stack objects until
+// the calling native returns, even if the strings are dropped from their
+// array by then. Must be called with the GVL held, from a native.
+void IOPinStrings(Value *strs, int count) {
+    LxThread *th = vm.curThread;
+    ASSERT(th->inCCall > 0);
+    for (int i = 0; i < count; i++) {
+        ObjString *owner = sliceOwner(AS_STRING(strs[i]));
+        if (owner) { // NULL for interned buffers, which are never freed
+            vec_push(&th->stackObjects, TO_OBJ(owner));
+        }
+    }
+}
+
+// Write all the given strings with writev(2), using iovecs that point
+// directly at the strings' buffers (no concatenation copy). Handles partial
+// writes, and batches by IOV_MAX. Returns number of bytes written.
+size_t IOWritev(Value io, Value *strs, int count) {
+    LxFile *f = FILE_GETHIDDEN(io);
+    if (f->fd == STDIN_FILENO) {
+        throwErrorFmt(lxErrClass, "Cannot write to stdin");
+    }
+    if (count == 0) return 0;
+    int fd = f->fd;
+    IOPinStrings(strs, count);
+    struct iovec *iov = ALLOCATE(struct iovec, count);
+    for (int i = 0; i < count; i++) {
+        ObjString *str = AS_STRING(strs[i]);
+        iov[i].iov_base = str->chars;
+        iov[i].iov_len = str->length;
+    }
+    size_t written = 0;
+    int idx = 0;
+    int err = 0;
+    int last = errno;
+    releaseGVL(THREAD_STOPPED);
+    while (idx < count) {
+        int iovcnt = count - idx > IOV_MAX ? IOV_MAX : count - idx;
+        ssize_t res = writev(fd, iov+idx, iovcnt);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            err = errno;
+            break;
+        }
+        written += res;
+        // skip fully written buffers, adjust partially written one
+        while (idx < count && (size_t)res >= iov[idx].iov_len) {
+            res -= iov[idx].iov_len;
+            idx++;
+        }
+        if (idx < count) {
+            iov[idx].iov_base = (char*)iov[idx].iov_base + res;
+            iov[idx].iov_len -= res;
+        }
+    }
+    acquireGVL();
+    FREE_ARRAY(struct iovec, iov, count);
+    if (err != 0) {
+        throwIOSyserr(err, last, "writev");
+    }
+    return written;
+}
+
+// Is the error from a zero-copy syscall one that means "not supported for
+// these fds", so we should try the next (slower) way of copying?
+static inline bool copyErrUnsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV ||
+        err == EOPNOTSUPP || err == EBADF;
+}
+
+// Copies at most `chunk` bytes. Returns bytes copied, 0 on EOF or -1 with
+// errno set.
+typedef ssize_t (*copyFn)(int srcFd, int dstFd, size_t chunk);
+
+#ifdef __linux__
+static ssize_t copyFileRange(int srcFd, int dstFd, size_t chunk) {
+    return copy_file_range(srcFd, NULL, dstFd, NULL, chunk, 0);
+}
+
+static ssize_t copySendfile(int srcFd, int dstFd, size_t chunk) {
+    return sendfile(dstFd, srcFd, NULL, chunk);
+}
+
+static ssize_t copySplice(int srcFd, int dstFd, size_t chunk) {
+    return splice(srcFd, NULL, dstFd, NULL, chunk, SPLICE_F_MOVE|SPLICE_F_MORE);
+}
+#endif
+
+static inline bool isErrWouldBlock(int err) {
+    return err == EAGAIN || err == EWOULDBLOCK;
+}
+
+// Waits until the non-blocking `fd` is ready for `events`. Called without
+// the GVL. Returns false with errno set on error.
+static bool waitFdReady(int fd, short events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) return false;
+    }
+    return true;
+}
+
+// Copy using `fn` until EOF, `len` bytes are copied or an error occurs.
+// Returns false if `fn` isn't supported for these fds and nothing was copied
+// (caller should fall back to another method).
+static bool copyFdLoop(copyFn fn, int srcFd, int dstFd, ssize_t len, size_t *copied, int *err) {
+    ssize_t res = 0;
+    while (len < 0 || (ssize_t)*copied < len) {
+        size_t chunk = COPYBUF_SZ * 16;
+        if (len >= 0 && (size_t)(len - *copied) < chunk) {
+            chunk = len - *copied;
+        }
+        res = fn(srcFd, dstFd, chunk);
+        if (res == 0) break; // EOF
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            // either side can be non-blocking (ex: a socket used with
+            // IO.readNonBlock), wait until both are ready
+            if (isErrWouldBlock(errno) && waitFdReady(srcFd, POLLIN) &&
+                    waitFdReady(dstFd, POLLOUT)) {
+                continue;
+            }
+            if (*copied == 0 && copyErrUnsupported(errno)) {
+                return false;
+            }
+            *err = errno;
+            break;
+        }
+        *copied += res;
+    }
+    return true;
+}
+
+// Buffered read(2)/write(2) fallback, handles partial writes
+static void copyFdBuffered(int srcFd, int dstFd, ssize_t len, size_t *copied, int *err) {
+    char buf[COPYBUF_SZ];
+    while (len < 0 || (ssize_t)*copied < len) {
+        size_t chunk = sizeof(buf);
+        if (len >= 0 && (size_t)(len - *copied) < chunk) {
+            chunk = len - *copied;
+        }
+        ssize_t nread = read(srcFd, buf, chunk);
+        if (nread == 0) break;
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            if (isErrWouldBlock(errno) && waitFdReady(srcFd, POLLIN)) continue;
+            *err = errno;
+            return;
+        }
+        ssize_t nwritten = 0;
+        while (nwritten < nread) {
+            ssize_t wres = write(dstFd, buf+nwritten, nread-nwritten);
+            if (wres < 0) {
+                if (errno == EINTR) continue;
+                if (isErrWouldBlock(errno) && waitFdReady(dstFd, POLLOUT)) continue;
+                *err = errno;
+                return;
+            }
+            nwritten += wres;
+        }
+        *copied += nread;
+    }
+}
+
+// Copy `len` bytes (or until EOF if `len` is negative) from `srcFd` to
+// `dstFd`. The data never touches the lox heap: copy_file_range(2),
+// sendfile(2) or splice(2) are used when the kernel supports them for
+// the given fds, otherwise we fall back to a buffered read/write loop. The
+// GVL is released during the whole transfer, and non-blocking fds are
+// waited on with poll(2). Returns number of bytes copied.
+size_t IOCopyFd(int srcFd, int dstFd, ssize_t len) {
+    size_t copied = 0;
+    int err = 0;
+    int last = errno;
+    struct stat srcSt, dstSt;
+    if (fstat(srcFd, &srcSt) != 0 || fstat(dstFd, &dstSt) != 0) {
+        throwIOSyserr(errno, last, "copy (fstat)");
+    }
+    releaseGVL(THREAD_STOPPED);
+    bool done = false;
+#ifdef __linux__
+    if (S_ISREG(srcSt.st_mode) && S_ISREG(dstSt.st_mode)) {
+        done = copyFdLoop(copyFileRange, srcFd, dstFd, len, &copied, &err);
+    }
+    if (!done && S_ISREG(srcSt.st_mode)) {
+        done = copyFdLoop(copySendfile, srcFd, dstFd, len, &copied, &err);
+    }
+    if (!done && (S_ISFIFO(srcSt.st_mode) || S_ISFIFO(dstSt.st_mode))) {
+        done = copyFdLoop(copySplice, srcFd, dstFd, len, &copied, &err);
+    }
+#endif
+    if (!done) {
+        copyFdBuffered(srcFd, dstFd, len, &copied, &err);
+    }
+    acquireGVL();
+    if (err != 0) {
+        throwIOSyserr(err, last, "copy");
+    }
+    errno = last;
+    return copied;
+}
+
 static int IOFcntl(Value io, int cmd, int arg) {
     int fd = FILE_GETHIDDEN(io)->fd;
     int last = errno;
@@ -374,6 +590,53 @@ static Value lxIOWriteStatic(int argCount, Value *args) {
 
 
 
+// IO.writev(io, [strs...])
+// Writes all the strings with a single writev(2) call (when possible),
+// avoiding both multiple syscalls and concatenating into one big string.
+// Returns the number of bytes written.
+static Value lxIOWritevStatic(int argCount, Value *args) {
+    CHECK_ARITY("IO.writev", 3, 3, argCount);
+    Value ioVal = args[1];
+    CHECK_ARG_IS_A(ioVal, lxIOClass, 1);
+    CHECK_ARG_IS_A(args[2], lxAryClass, 2);
+    ValueArray *strs = &AS_ARRAY(args[2])->valAry;
+    Value el; int idx = 0;
+    VALARRAY_FOREACH(strs, el, idx) {
+        if (!IS_A_STRING(el)) {
+            throwErrorFmt(lxArgErrClass, "IO.writev: expected array of Strings, element %d is a %s",
+                    idx, typeOfVal(el));
+        }
+    }
+    return NUMBER_VAL(IOWritev(ioVal, strs->values, strs->count));
+}
+
+// IO.copyStream(src, dst, [len])
+// Copies `len` bytes (or everything until EOF if not given, nil or negative)
+// from IO `src` to IO `dst`, without reading the data into lox strings.
+// Returns the number of bytes copied.
+static Value lxIOCopyStreamStatic(int argCount, Value *args) {
+    CHECK_ARITY("IO.copyStream", 3, 4, argCount);
+    Value srcVal = args[1];
+    Value dstVal = args[2];
+    CHECK_ARG_IS_A(srcVal, lxIOClass, 1);
+    CHECK_ARG_IS_A(dstVal, lxIOClass, 2);
+    ssize_t len = -1;
+    if (argCount == 4 && !IS_NIL(args[3])) {
+        CHECK_ARG_BUILTIN_TYPE(args[3], IS_NUMBER_FUNC, "number", 3);
+        double lend = AS_NUMBER(args[3]);
+        if (lend >= 0) {
+            len = (ssize_t)lend;
+        }
+    }
+    LxFile *src = FILE_GETHIDDEN(srcVal);
+    LxFile *dst = FILE_GETHIDDEN(dstVal);
+    if (!src->isOpen || !dst->isOpen) {
+        throwErrorFmt(lxErrClass, "IO error: cannot copy %s closed fd: %d",
+                !src->isOpen ? "from" : "to", !src->isOpen ? src->fd : dst->fd);
+    }
+    return NUMBER_VAL(IOCopyFd(src->fd, dst->fd, len));
+}
+
 static Value lxIOReadStatic(int argCount, Value *args) {
     CHECK_ARITY("IO.read", 2, 3, argCount);
     Value ioVal = args[1];
@@ -496,9 +759,11 @@ void Init_IOClass(void) {
     addNativeMethod(ioStatic, "read", lxIOReadStatic);
     addNativeMethod(ioStatic, "readNonBlock", lxIOReadNonBlockStatic);
     addNativeMethod(ioStatic, "write", lxIOWriteStatic);
+    addNativeMethod(ioStatic, "writev", lxIOWritevStatic);
     addNativeMethod(ioStatic, "close", lxIOCloseStatic);
     addNativeMethod(ioStatic, "pipe", lxIOPipeStatic);
     addNativeMethod(ioStatic, "select", lxIOSelectStatic);
+    addNativeMethod(ioStatic, "copyStream", lxIOCopyStreamStatic);
 
     addNativeMethod(ioClass, "read", lxIORead);
     addNativeMethod(ioClass, "getline", lxIOGetline);
@@ -523,9 +788,9 @@ void Init_IOClass(void) {
     Value stderrVal = OBJ_VAL(istderr);
     initIOAfterOpen(stderrVal, INTERN("stderr"), fileno(stderr), 0, O_WRONLY);
 
-    tableSet(&vm.globals, OBJ_VAL(INTERN("stdin")), stdinVal);
-    tableSet(&vm.globals, OBJ_VAL(INTERN("stdout")), stdoutVal);
-    tableSet(&vm.globals, OBJ_VAL(INTERN("stderr")), stderrVal);
+    setGlobal(INTERN("stdin"), stdinVal);
+    setGlobal(INTERN("stdout"), stdoutVal);
+    setGlobal(INTERN("stderr"), stderrVal);
 
     Value ioClassVal = OBJ_VAL(ioClass);
     addConstantUnder("F_GETFD", NUMBER_VAL(F_GETFD), ioClassVal);
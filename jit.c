@@ -0,0 +1,918 @@
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "jit.h"
+#include "options.h"
+#include "memory.h"
+#include "debug.h"
+#include "vendor/vec.h"
+
+// Baseline (template) JIT for x86-64.
+//
+// Each supported instruction is translated on its own, in bytecode order,
+// and reads and writes the VM stack in memory the same way the interpreter
+// does, so the interpreter and the native code can hand off to each other
+// at any instruction boundary. Native code is entered from vm_run() at an
+// instruction that has an entry point, and leaves through a "deopt" stub
+// that stores the ip of the next instruction to run in the frame. It leaves
+// when:
+//
+// * the next instruction isn't supported (calls, property access, ...)
+// * a guard fails, ex: an operand of OP_ADD isn't a number, OP_GET_GLOBAL
+//   finds an undefined global, the thread has an interrupt pending before a
+//   jump. The ip is then the guarded instruction, and the interpreter runs it
+//   in full (and throws, calls opAdd, etc.)
+//
+// Nothing the native code does can throw or allocate, so no GC can run and
+// no C frames are left behind on an error.
+//
+// Registers while in native code:
+//   rbx: EC->stackTop          r12: VMExecContext*     r13: CallFrame*
+//   r14: frame's locals table  r15: LxThread*          rbp: lastValue, or 0
+//   r9: NIL_VAL  r10: QNAN  r11: QNAN|SIGN_BIT (tag of an object)
+// rax, rcx, rdx, xmm0 and xmm1 are scratch.
+
+int jitThreshold = 0;
+
+#if JIT_ENABLED
+
+// an entry point is only made where at least this many instructions can be
+// run before leaving native code, as entering and leaving has a cost too
+#define JIT_MIN_RUN 3
+
+typedef void (*JitEntryFn)(VMExecContext *ctx, CallFrame *frame, void *entry, LxThread *th);
+
+enum {
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// condition codes, for jcc and setcc
+enum {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+    CC_LE = 0xE,
+};
+
+// group-1 ALU opcode extensions
+enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+
+typedef struct JitFixup {
+    size_t pos; // offset of the rel32 to patch
+    int target; // instruction it jumps to
+    bool toStub; // always jump to the target's deopt stub
+} JitFixup;
+
+typedef vec_t(JitFixup) vec_jitfixup_t;
+
+typedef struct JitState {
+    ObjFunction *func;
+    Chunk *chunk;
+    uint8_t *buf;
+    size_t len;
+    size_t capa;
+    int *words; // length of each instruction, 0 if not an instruction start
+    int *insnPos; // native code offset of each instruction, -1 if none
+    int *stubPos; // offset of each instruction's deopt stub, -1 if none
+    vec_jitfixup_t fixups;
+    size_t exitPos;
+    int cur; // instruction being compiled
+} JitState;
+
+static void emit8(JitState *js, uint8_t byte) {
+    if (js->len == js->capa) {
+        js->capa = js->capa ? js->capa * 2 : 1024;
+        js->buf = realloc(js->buf, js->capa);
+        ASSERT_MEM(js->buf);
+    }
+    js->buf[js->len++] = byte;
+}
+
+static void emit32(JitState *js, uint32_t word) {
+    for (int i = 0; i < 4; i++) {
+        emit8(js, (word >> (i*8)) & 0xff);
+    }
+}
+
+static void emit64(JitState *js, uint64_t word) {
+    emit32(js, (uint32_t)word);
+    emit32(js, (uint32_t)(word >> 32));
+}
+
+static void patch32(JitState *js, size_t pos, uint32_t word) {
+    for (int i = 0; i < 4; i++) {
+        js->buf[pos+i] = (word >> (i*8)) & 0xff;
+    }
+}
+
+// ModRM (and SIB) for [base + disp], with `reg` in the reg field
+static void emitModRMMem(JitState *js, int reg, int base, int32_t disp) {
+    int mod;
+    if (disp == 0 && (base & 7) != RBP) {
+        mod = 0;
+    } else if (disp >= -128 && disp <= 127) {
+        mod = 1;
+    } else {
+        mod = 2;
+    }
+    emit8(js, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit8(js, 0x24); // SIB: base only
+    }
+    if (mod == 1) {
+        emit8(js, (uint8_t)disp);
+    } else if (mod == 2) {
+        emit32(js, (uint32_t)disp);
+    }
+}
+
+static void emitRexW(JitState *js, int reg, int rm) {
+    emit8(js, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// 64-bit `op reg, [base+disp]` or `op [base+disp], reg`, the direction is
+// given by the opcode (ex: 0x8B load, 0x89 store, 0x8D lea, 0x3B cmp)
+static void emitMem(JitState *js, uint8_t op, int reg, int base, int32_t disp) {
+    emitRexW(js, reg, base);
+    emit8(js, op);
+    emitModRMMem(js, reg, base, disp);
+}
+
+static void emitLoad(JitState *js, int dst, int base, int32_t disp) {
+    emitMem(js, 0x8B, dst, base, disp);
+}
+
+static void emitStore(JitState *js, int base, int32_t disp, int src) {
+    emitMem(js, 0x89, src, base, disp);
+}
+
+// 64-bit `op rm, reg` (ex: 0x89 mov, 0x01 add, 0x29 sub, 0x39 cmp, 0x85 test)
+static void emitRR(JitState *js, uint8_t op, int rm, int reg) {
+    emitRexW(js, reg, rm);
+    emit8(js, op);
+    emit8(js, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emitMovRR(JitState *js, int dst, int src) {
+    emitRR(js, 0x89, dst, src);
+}
+
+static void emitAluImm(JitState *js, int ext, int reg, int32_t imm) {
+    emitRexW(js, 0, reg);
+    if (imm >= -128 && imm <= 127) {
+        emit8(js, 0x83);
+        emit8(js, 0xC0 | (ext << 3) | (reg & 7));
+        emit8(js, (uint8_t)imm);
+    } else {
+        emit8(js, 0x81);
+        emit8(js, 0xC0 | (ext << 3) | (reg & 7));
+        emit32(js, (uint32_t)imm);
+    }
+}
+
+// ALU op on the int at [base+disp] with an 8-bit immediate
+static void emitAluMem32(JitState *js, int ext, int base, int32_t disp, int8_t imm) {
+    if (base >= 8) emit8(js, 0x41);
+    emit8(js, 0x83);
+    emitModRMMem(js, ext, base, disp);
+    emit8(js, (uint8_t)imm);
+}
+
+static void emitMovImm64(JitState *js, int reg, uint64_t imm) {
+    emit8(js, 0x48 | (reg >> 3));
+    emit8(js, 0xB8 | (reg & 7));
+    emit64(js, imm);
+}
+
+static void emitPushReg(JitState *js, int reg) {
+    if (reg >= 8) emit8(js, 0x41);
+    emit8(js, 0x50 | (reg & 7));
+}
+
+static void emitPopReg(JitState *js, int reg) {
+    if (reg >= 8) emit8(js, 0x41);
+    emit8(js, 0x58 | (reg & 7));
+}
+
+// setcc dl; movzx edx, dl
+static void emitSetccRdx(JitState *js, int cc) {
+    emit8(js, 0x0F); emit8(js, 0x90 | cc); emit8(js, 0xC2);
+    emit8(js, 0x0F); emit8(js, 0xB6); emit8(js, 0xD2);
+}
+
+// movq xmm, reg
+static void emitMovqToXmm(JitState *js, int xmm, int reg) {
+    emit8(js, 0x66); emitRexW(js, xmm, reg);
+    emit8(js, 0x0F); emit8(js, 0x6E);
+    emit8(js, 0xC0 | (xmm << 3) | (reg & 7));
+}
+
+// movq reg, xmm
+static void emitMovqFromXmm(JitState *js, int reg, int xmm) {
+    emit8(js, 0x66); emitRexW(js, xmm, reg);
+    emit8(js, 0x0F); emit8(js, 0x7E);
+    emit8(js, 0xC0 | (xmm << 3) | (reg & 7));
+}
+
+// short forward jump, returns the position to give to patchShortJump()
+static size_t emitShortJcc(JitState *js, int cc) {
+    emit8(js, 0x70 | cc);
+    emit8(js, 0);
+    return js->len - 1;
+}
+
+static void patchShortJump(JitState *js, size_t pos) {
+    ASSERT(js->len - (pos+1) < 128);
+    js->buf[pos] = (uint8_t)(js->len - (pos+1));
+}
+
+static void addFixup(JitState *js, int target, bool toStub) {
+    JitFixup fixup = { .pos = js->len, .target = target, .toStub = toStub };
+    vec_push(&js->fixups, fixup);
+    emit32(js, 0);
+}
+
+static void emitJmpTo(JitState *js, int target) {
+    emit8(js, 0xE9);
+    addFixup(js, target, false);
+}
+
+static void emitJccTo(JitState *js, int cc, int target) {
+    emit8(js, 0x0F); emit8(js, 0x80 | cc);
+    addFixup(js, target, false);
+}
+
+// leave native code before the current instruction if `cc` holds
+static void emitDeoptIf(JitState *js, int cc) {
+    emit8(js, 0x0F); emit8(js, 0x80 | cc);
+    addFixup(js, js->cur, true);
+}
+
+// Leaves native code if `reg` isn't a number. Clobbers rdx.
+static void emitCheckNumber(JitState *js, int reg) {
+    emitMovRR(js, RDX, reg);
+    emitRR(js, 0x21, RDX, R10); // and rdx, r10
+    emitRR(js, 0x39, RDX, R10); // cmp rdx, r10
+    emitDeoptIf(js, CC_E);
+}
+
+// Sets OBJ_FLAG_PUSHED_VM_STACK on the object in rax, if it is one, like
+// vm_push() does for the generational GC. Clobbers rcx.
+static void emitMarkPushed(JitState *js) {
+    emitMovRR(js, RCX, RAX);
+    emitRR(js, 0x31, RCX, R11); // xor rcx, r11: clears the tag of objects
+    emitRR(js, 0x85, RCX, R11); // test rcx, r11
+    size_t notObj = emitShortJcc(js, CC_NE);
+    // or word [rcx+flags], OBJ_FLAG_PUSHED_VM_STACK
+    emit8(js, 0x66); emit8(js, 0x83);
+    emitModRMMem(js, ALU_OR, RCX, offsetof(Obj, flags));
+    emit8(js, OBJ_FLAG_PUSHED_VM_STACK);
+    patchShortJump(js, notObj);
+}
+
+static void emitPushRax(JitState *js) {
+    emitStore(js, RBX, 0, RAX);
+    emitAluImm(js, ALU_ADD, RBX, 8);
+}
+
+static void emitPopN(JitState *js, int n) {
+    emitAluImm(js, ALU_SUB, RBX, 8*n);
+    emitMovRR(js, RBP, RBX); // lastValue, see vm_pop()
+}
+
+// Replaces the 2 operands of a binary operator with the value in rax
+static void emitBinopResult(JitState *js) {
+    emitPopN(js, 1);
+    emitStore(js, RBX, -8, RAX);
+}
+
+// rax = rdx ? TRUE_VAL : FALSE_VAL
+static void emitBoolFromRdx(JitState *js) {
+    emitMem(js, 0x8D, RAX, R9, (int32_t)(FALSE_VAL - NIL_VAL)); // lea rax, [r9+1]
+    emitRR(js, 0x01, RAX, RDX); // add rax, rdx
+}
+
+// Compares rax with 1 after subtracting NIL_VAL, so that "below or equal"
+// means nil or false (see isTruthy()). Clobbers rcx.
+static void emitFalsyTest(JitState *js) {
+    emitMovRR(js, RCX, RAX);
+    emitRR(js, 0x29, RCX, R9); // sub rcx, r9
+    emitAluImm(js, ALU_CMP, RCX, 1);
+}
+
+static void emitCheckInts(JitState *js) {
+    emitAluMem32(js, ALU_CMP, R15, offsetof(LxThread, interruptFlags), 0);
+    emitDeoptIf(js, CC_NE);
+}
+
+// loads the address of the closure's upvalue's value into rax
+static void emitUpvalueAddr(JitState *js, int slot) {
+    emitLoad(js, RAX, R13, offsetof(CallFrame, closure));
+    emitLoad(js, RAX, RAX, offsetof(ObjClosure, upvalues));
+    emitLoad(js, RAX, RAX, 8*slot);
+    emitLoad(js, RAX, RAX, offsetof(ObjUpvalue, value));
+}
+
+static void emitPrologue(JitState *js) {
+    emitPushReg(js, RBX);
+    emitPushReg(js, RBP);
+    emitPushReg(js, R12);
+    emitPushReg(js, R13);
+    emitPushReg(js, R14);
+    emitPushReg(js, R15);
+    emitAluImm(js, ALU_SUB, RSP, 8); // keep the stack 16-byte aligned
+    emitMovRR(js, R12, RDI);
+    emitMovRR(js, R13, RSI);
+    emitMovRR(js, R15, RCX);
+    emitLoad(js, RBX, R12, offsetof(VMExecContext, stackTop));
+    emitRR(js, 0x31, RBP, RBP); // xor rbp, rbp
+    if (js->func->localCount > 0) {
+        emitLoad(js, RAX, R13, offsetof(CallFrame, scope));
+        emitLoad(js, R14, RAX, offsetof(ObjScope, localsTable.tbl));
+    }
+    emitMovImm64(js, R9, NIL_VAL);
+    emitMovImm64(js, R10, QNAN);
+    emitMovImm64(js, R11, QNAN|SIGN_BIT);
+    emit8(js, 0xFF); emit8(js, 0xE2); // jmp rdx
+}
+
+// rax is the ip to continue at in the interpreter
+static void emitExit(JitState *js) {
+    js->exitPos = js->len;
+    emitStore(js, R13, offsetof(CallFrame, ip), RAX);
+    emitStore(js, R12, offsetof(VMExecContext, stackTop), RBX);
+    emitRR(js, 0x85, RBP, RBP); // test rbp, rbp
+    size_t noPop = emitShortJcc(js, CC_E);
+    emitStore(js, R12, offsetof(VMExecContext, lastValue), RBP);
+    emitStore(js, R15, offsetof(LxThread, lastValue), RBP);
+    patchShortJump(js, noPop);
+    emitAluImm(js, ALU_ADD, RSP, 8);
+    emitPopReg(js, R15);
+    emitPopReg(js, R14);
+    emitPopReg(js, R13);
+    emitPopReg(js, R12);
+    emitPopReg(js, RBP);
+    emitPopReg(js, RBX);
+    emit8(js, 0xC3); // ret
+}
+
+// Number of words of the instruction at `i`, 0 if unknown
+static int insnWords(Chunk *chunk, int i) {
+    switch (chunk->code[i]) {
+        case OP_CONSTANT:
+        case OP_POP_DEBUG:
+        case OP_POP_N:
+        case OP_GET_CONST_UNDER:
+        case OP_SET_CONST:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE_PEEK:
+        case OP_JUMP_IF_TRUE_PEEK:
+        case OP_LOOP:
+        case OP_GET_SUPER:
+        case OP_ITER:
+        case OP_CLASS:
+        case OP_MODULE:
+        case OP_SUBCLASS:
+        case OP_METHOD:
+        case OP_CLASS_METHOD:
+        case OP_GETTER:
+        case OP_SETTER:
+        case OP_PROP_GET:
+        case OP_PROP_SET:
+        case OP_GET_THROWN:
+        case OP_RETHROW_IF_ERR:
+        case OP_STRING_INTERP:
+        case OP_ARRAY:
+        case OP_DUPARRAY:
+        case OP_MAP:
+        case OP_DUPMAP:
+        case OP_REGEX:
+            return 2;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_CAPTURED:
+        case OP_GET_CONST:
+        case OP_BREAK:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_SIMPLE:
+        case OP_CHECK_KEYWORD:
+        case OP_ITER_NEXT:
+        case OP_STRING:
+            return 3;
+        case OP_UNPACK_DEFINE_GLOBAL:
+        case OP_UNPACK_SET_LOCAL:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_INVOKE_SIMPLE:
+            return 4;
+        case OP_CLOSURE: {
+            if (i+1 >= chunk->count) return 0;
+            Value funcVal = chunk->constants->values[chunk->code[i+1]];
+            if (!IS_FUNCTION(funcVal)) return 0;
+            ObjFunction *func = AS_FUNCTION(funcVal);
+            return 2 + 2*(func->upvalueCount + func->capturedCount);
+        }
+        default:
+            if (chunk->code[i] > OP_LEAVE) return 0;
+            return 1;
+    }
+}
+
+static bool isJump(bytecode_t code) {
+    switch (code) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE_PEEK:
+        case OP_JUMP_IF_TRUE_PEEK:
+        case OP_LOOP:
+        case OP_BREAK:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// doesn't continue at the next instruction
+static bool isUncondJump(bytecode_t code) {
+    return code == OP_JUMP || code == OP_LOOP || code == OP_BREAK;
+}
+
+// where the jump at `i` goes, the same as in vm_run()
+static int jumpTarget(Chunk *chunk, int i) {
+    bytecode_t *code = chunk->code;
+    switch (code[i]) {
+        case OP_LOOP:
+            return i - (int)code[i+1];
+        case OP_BREAK:
+            return i + (int)code[i+1];
+        default:
+            return i + 1 + (int)code[i+1];
+    }
+}
+
+static bool canCompile(JitState *js, int i) {
+    bytecode_t *code = js->chunk->code;
+    switch (code[i]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_CAPTURED:
+        case OP_GET_GLOBAL:
+        case OP_GET_THIS:
+        case OP_POP:
+        case OP_POP_N:
+        case OP_POP_DEBUG:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_LESS_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_NUM:
+        case OP_GREATER_NUM:
+        case OP_LESS_EQUAL_NUM:
+        case OP_GREATER_EQUAL_NUM:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE_PEEK:
+        case OP_JUMP_IF_TRUE_PEEK:
+        case OP_LOOP:
+        case OP_BREAK:
+            return true;
+        // the scope's locals table is sized for localCount, a bigger slot
+        // has to grow it
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+            return (int)code[i+1] < js->func->localCount;
+        case OP_SET_GLOBAL:
+            return (int)code[i+2] >= vm.numReservedGlobals;
+        default:
+            return false;
+    }
+}
+
+static void compileBinaryOp(JitState *js, bytecode_t op) {
+    emitLoad(js, RAX, RBX, -16);
+    emitLoad(js, RCX, RBX, -8);
+    emitCheckNumber(js, RAX);
+    emitCheckNumber(js, RCX);
+    if (op == OP_DIVIDE || op == OP_DIVIDE_NUM) {
+        // throws "Can't divide by 0" from the interpreter, for 0 and -0
+        emitMovRR(js, RDX, RCX);
+        emitRR(js, 0x01, RDX, RDX); // add rdx, rdx: shifts out the sign
+        emitDeoptIf(js, CC_E);
+    }
+    emitMovqToXmm(js, 0, RAX);
+    emitMovqToXmm(js, 1, RCX);
+    uint8_t sseOp = 0;
+    switch (op) {
+        case OP_ADD: case OP_ADD_NUM: sseOp = 0x58; break;
+        case OP_SUBTRACT: case OP_SUBTRACT_NUM: sseOp = 0x5C; break;
+        case OP_MULTIPLY: case OP_MULTIPLY_NUM: sseOp = 0x59; break;
+        case OP_DIVIDE: case OP_DIVIDE_NUM: sseOp = 0x5E; break;
+        default: UNREACHABLE("bad binary op: %d", op);
+    }
+    emit8(js, 0xF2); emit8(js, 0x0F); emit8(js, sseOp); emit8(js, 0xC1); // op xmm0, xmm1
+    emitMovqFromXmm(js, RAX, 0);
+    emitBinopResult(js);
+}
+
+// NaN compares greater than everything, like cmpValues()
+static void compileCompare(JitState *js, bytecode_t op) {
+    emitLoad(js, RAX, RBX, -16);
+    emitLoad(js, RCX, RBX, -8);
+    emitCheckNumber(js, RAX);
+    emitCheckNumber(js, RCX);
+    emitMovqToXmm(js, 0, RAX);
+    emitMovqToXmm(js, 1, RCX);
+    emit8(js, 0x66); emit8(js, 0x0F); emit8(js, 0x2E); emit8(js, 0xC8); // ucomisd xmm1, xmm0
+    int cc = 0;
+    switch (op) {
+        case OP_LESS: case OP_LESS_NUM: cc = CC_A; break;
+        case OP_LESS_EQUAL: case OP_LESS_EQUAL_NUM: cc = CC_AE; break;
+        case OP_GREATER: case OP_GREATER_NUM: cc = CC_B; break;
+        case OP_GREATER_EQUAL: case OP_GREATER_EQUAL_NUM: cc = CC_BE; break;
+        default: UNREACHABLE("bad compare op: %d", op);
+    }
+    emitSetccRdx(js, cc);
+    emitBoolFromRdx(js);
+    emitBinopResult(js);
+}
+
+static void compileInsn(JitState *js, int i) {
+    Chunk *chunk = js->chunk;
+    bytecode_t *code = chunk->code;
+    bytecode_t op = code[i];
+    switch (op) {
+        case OP_CONSTANT: {
+            Value constant = chunk->constants->values[code[i+1]];
+            if (IS_OBJ(constant)) {
+                emitMovImm64(js, RCX, (uint64_t)(uintptr_t)AS_OBJ(constant));
+                emit8(js, 0x66); emit8(js, 0x83);
+                emitModRMMem(js, ALU_OR, RCX, offsetof(Obj, flags));
+                emit8(js, OBJ_FLAG_PUSHED_VM_STACK);
+            }
+            emitMovImm64(js, RAX, constant);
+            emitPushRax(js);
+            break;
+        }
+        case OP_NIL:
+            emitStore(js, RBX, 0, R9);
+            emitAluImm(js, ALU_ADD, RBX, 8);
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            emitMem(js, 0x8D, RAX, R9, (int32_t)((op == OP_TRUE ? TRUE_VAL : FALSE_VAL) - NIL_VAL));
+            emitPushRax(js);
+            break;
+        case OP_GET_LOCAL:
+            emitLoad(js, RAX, R14, 8*code[i+1]);
+            emitMarkPushed(js);
+            emitPushRax(js);
+            break;
+        case OP_SET_LOCAL:
+            emitLoad(js, RAX, RBX, -8);
+            emitStore(js, R14, 8*code[i+1], RAX);
+            emitLoad(js, RCX, R13, offsetof(CallFrame, slots));
+            emitStore(js, RCX, 8*code[i+1], RAX);
+            break;
+        case OP_GET_UPVALUE:
+            emitUpvalueAddr(js, code[i+1]);
+            emitLoad(js, RAX, RAX, 0);
+            emitMarkPushed(js);
+            emitPushRax(js);
+            break;
+        case OP_SET_UPVALUE:
+            emitUpvalueAddr(js, code[i+1]);
+            emitLoad(js, RCX, RBX, -8);
+            emitStore(js, RAX, 0, RCX);
+            break;
+        case OP_GET_CAPTURED:
+            emitLoad(js, RAX, R13, offsetof(CallFrame, closure));
+            emitLoad(js, RAX, RAX, offsetof(ObjClosure, captured));
+            emitLoad(js, RAX, RAX, 8*code[i+1]);
+            emitMarkPushed(js);
+            emitPushRax(js);
+            break;
+        case OP_GET_GLOBAL:
+            // the array can be reallocated, load it each time
+            emitMovImm64(js, RCX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+            emitLoad(js, RCX, RCX, 0);
+            emitLoad(js, RAX, RCX, 8*code[i+2]);
+            emitMem(js, 0x8D, RDX, R9, (int32_t)(UNDEF_VAL - NIL_VAL));
+            emitRR(js, 0x39, RAX, RDX); // cmp rax, rdx
+            emitDeoptIf(js, CC_E); // getUndefinedGlobal() throws or autoloads
+            emitMarkPushed(js);
+            emitPushRax(js);
+            break;
+        case OP_SET_GLOBAL:
+            emitMovImm64(js, RCX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+            emitLoad(js, RCX, RCX, 0);
+            emitLoad(js, RAX, RBX, -8);
+            emitStore(js, RCX, 8*code[i+2], RAX);
+            break;
+        case OP_GET_THIS: {
+            emitLoad(js, RAX, R15, offsetof(LxThread, thisObj));
+            emitRR(js, 0x85, RAX, RAX); // test rax, rax
+            size_t isNil = emitShortJcc(js, CC_E);
+            emit8(js, 0x66); emit8(js, 0x83);
+            emitModRMMem(js, ALU_OR, RAX, offsetof(Obj, flags));
+            emit8(js, OBJ_FLAG_PUSHED_VM_STACK);
+            emitRR(js, 0x09, RAX, R11); // or rax, r11: OBJ_VAL()
+            emit8(js, 0xEB); emit8(js, 0); // jmp short push
+            size_t done = js->len - 1;
+            patchShortJump(js, isNil);
+            emitMovRR(js, RAX, R9);
+            patchShortJump(js, done);
+            emitPushRax(js);
+            break;
+        }
+        case OP_POP:
+        case OP_POP_DEBUG:
+            emitPopN(js, 1);
+            break;
+        case OP_POP_N:
+            emitPopN(js, code[i+1]);
+            break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+            compileBinaryOp(js, op);
+            break;
+        case OP_NEGATE:
+            emitLoad(js, RAX, RBX, -8);
+            emitCheckNumber(js, RAX);
+            // btc rax, 63
+            emit8(js, 0x48); emit8(js, 0x0F); emit8(js, 0xBA); emit8(js, 0xF8); emit8(js, 63);
+            emitStore(js, RBX, -8, RAX);
+            break;
+        case OP_NOT:
+            emitLoad(js, RAX, RBX, -8);
+            emitFalsyTest(js);
+            emitSetccRdx(js, CC_BE);
+            emitBoolFromRdx(js);
+            emitStore(js, RBX, -8, RAX);
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            // objects can have opEquals, everything else is equal if the
+            // Values are (see isValueOpEqual())
+            emitLoad(js, RAX, RBX, -16);
+            emitMovRR(js, RCX, RAX);
+            emitRR(js, 0x31, RCX, R11); // xor rcx, r11
+            emitRR(js, 0x85, RCX, R11); // test rcx, r11
+            emitDeoptIf(js, CC_E);
+            emitMem(js, 0x3B, RAX, RBX, -8); // cmp rax, [rbx-8]
+            emitSetccRdx(js, op == OP_EQUAL ? CC_E : CC_NE);
+            emitBoolFromRdx(js);
+            emitBinopResult(js);
+            break;
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_LESS_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_NUM:
+        case OP_GREATER_NUM:
+        case OP_LESS_EQUAL_NUM:
+        case OP_GREATER_EQUAL_NUM:
+            compileCompare(js, op);
+            break;
+        // The interpreter checks for interrupts after each jump. Leave native
+        // code instead, it then runs the jump and handles them.
+        case OP_JUMP:
+            emitCheckInts(js);
+            emitJmpTo(js, jumpTarget(chunk, i));
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE_PEEK:
+        case OP_JUMP_IF_TRUE_PEEK:
+            emitCheckInts(js);
+            emitLoad(js, RAX, RBX, -8);
+            if (op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE) {
+                emitPopN(js, 1);
+            }
+            emitFalsyTest(js);
+            emitJccTo(js, (op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_FALSE_PEEK) ? CC_BE : CC_A,
+                    jumpTarget(chunk, i));
+            break;
+        case OP_LOOP: {
+            emitCheckInts(js);
+            emitMovImm64(js, RAX, (uint64_t)(uintptr_t)&vm.exited);
+            emit8(js, 0x80); emit8(js, 0x38); emit8(js, 0); // cmp byte [rax], 0
+            emitDeoptIf(js, CC_NE);
+            // let other threads run, see the top of vm_run()'s loop. The
+            // interpreter counts each instruction of the loop's body.
+            int bodyInsns = 0;
+            for (int j = jumpTarget(chunk, i); j <= i && bodyInsns < 127; j += js->words[j]) {
+                bodyInsns++;
+            }
+            emitAluMem32(js, ALU_SUB, R15, offsetof(LxThread, opsRemaining), bodyInsns);
+            emitDeoptIf(js, CC_LE);
+            emitJmpTo(js, jumpTarget(chunk, i));
+            break;
+        }
+        case OP_BREAK:
+            emitCheckInts(js);
+            if (code[i+2] > 0) {
+                emitPopN(js, code[i+2]);
+            }
+            emitJmpTo(js, jumpTarget(chunk, i));
+            break;
+        default:
+            UNREACHABLE("can't compile op %d", op);
+    }
+}
+
+static void freeJitState(JitState *js) {
+    xfree(js->buf);
+    xfree(js->insnPos);
+    xfree(js->stubPos);
+    vec_deinit(&js->fixups);
+}
+
+void jitCompile(ObjFunction *func) {
+    Chunk *chunk = func->chunk;
+    // eval code shares its scope with the caller
+    if (func->jitCode || func->ftype == FUN_TYPE_EVAL || chunk == NULL || chunk->count == 0) {
+        return;
+    }
+    int count = chunk->count;
+    JitState js;
+    memset(&js, 0, sizeof(js));
+    js.func = func;
+    js.chunk = chunk;
+    vec_init(&js.fixups);
+    int *words = xcalloc(count, sizeof(int));
+    bool *supported = xcalloc(count+1, sizeof(bool));
+    int *run = xcalloc(count+1, sizeof(int));
+    ASSERT_MEM(words && supported && run);
+    js.words = words;
+    js.insnPos = xmalloc(sizeof(int)*count);
+    js.stubPos = xmalloc(sizeof(int)*count);
+    ASSERT_MEM(js.insnPos && js.stubPos);
+    JitCode *jc = NULL;
+
+    int i = 0;
+    while (i < count) {
+        int n = insnWords(chunk, i);
+        if (n == 0 || i+n > count) goto done;
+        words[i] = n;
+        i += n;
+    }
+    for (i = 0; i < count; i += words[i]) {
+        js.insnPos[i] = -1;
+        js.stubPos[i] = -1;
+        supported[i] = canCompile(&js, i);
+        if (supported[i] && isJump(chunk->code[i])) {
+            int target = jumpTarget(chunk, i);
+            if (target < 0 || target >= count || words[target] == 0) {
+                supported[i] = false;
+            }
+        }
+        // native code can't run off the end of the chunk
+        if (supported[i] && i+words[i] == count && !isUncondJump(chunk->code[i])) {
+            supported[i] = false;
+        }
+    }
+    // number of instructions that run in native code when entering at each
+    // one, counting a jump as enough (it usually goes to more)
+    bool anyEntry = false;
+    for (i = count-1; i >= 0; i--) {
+        if (words[i] == 0 || !supported[i]) continue;
+        if (isJump(chunk->code[i])) {
+            run[i] = JIT_MIN_RUN;
+        } else {
+            run[i] = 1 + run[i+words[i]];
+        }
+        if (run[i] >= JIT_MIN_RUN) anyEntry = true;
+    }
+    if (!anyEntry) goto done;
+
+    emitPrologue(&js);
+    emitExit(&js);
+    for (i = 0; i < count; i += words[i]) {
+        if (!supported[i]) continue;
+        js.cur = i;
+        js.insnPos[i] = (int)js.len;
+        compileInsn(&js, i);
+        int next = i + words[i];
+        if (!isUncondJump(chunk->code[i]) && !supported[next]) {
+            emit8(&js, 0xE9);
+            addFixup(&js, next, true);
+        }
+    }
+    // deopt stubs, and jumps to them or to compiled instructions
+    JitFixup *fixup = NULL; int fidx = 0;
+    vec_foreach_ptr(&js.fixups, fixup, fidx) {
+        int target = fixup->target;
+        if (fixup->toStub || js.insnPos[target] < 0) {
+            if (js.stubPos[target] < 0) {
+                js.stubPos[target] = (int)js.len;
+                emitMovImm64(&js, RAX, (uint64_t)(uintptr_t)(chunk->code + target));
+                emit8(&js, 0xE9);
+                emit32(&js, (uint32_t)((int64_t)js.exitPos - (int64_t)(js.len+4)));
+            }
+            target = js.stubPos[target];
+        } else {
+            target = js.insnPos[target];
+        }
+        patch32(&js, fixup->pos, (uint32_t)((int64_t)target - (int64_t)(fixup->pos+4)));
+    }
+
+    void *mem = mmap(NULL, js.len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) goto done;
+    memcpy(mem, js.buf, js.len);
+    if (mprotect(mem, js.len, PROT_READ|PROT_EXEC) != 0) {
+        munmap(mem, js.len);
+        goto done;
+    }
+    jc = xcalloc(1, sizeof(JitCode));
+    ASSERT_MEM(jc);
+    jc->mem = mem;
+    jc->size = js.len;
+    jc->entries = xcalloc(count, sizeof(void*));
+    ASSERT_MEM(jc->entries);
+    for (i = 0; i < count; i += words[i]) {
+        if (supported[i] && run[i] >= JIT_MIN_RUN) {
+            jc->entries[i] = (uint8_t*)mem + js.insnPos[i];
+            jc->numEntries++;
+        }
+    }
+    func->jitCode = jc;
+    VM_DEBUG(2, "JIT compiled function %s: %d entries, %lu bytes",
+            func->name ? func->name->chars : "<main>", jc->numEntries, (unsigned long)jc->size);
+
+done:
+    xfree(words);
+    xfree(supported);
+    xfree(run);
+    freeJitState(&js);
+}
+
+void freeJitCode(JitCode *code) {
+    munmap(code->mem, code->size);
+    xfree(code->entries);
+    xfree(code);
+}
+
+void jitEnter(JitCode *code, VMExecContext *ctx, CallFrame *frame, void *entry, LxThread *th) {
+    JitEntryFn fn = (JitEntryFn)(uintptr_t)code->mem;
+    fn(ctx, frame, entry, th);
+}
+
+void initJit(void) {
+    jitThreshold = GET_OPTION(jitThreshold);
+    // these look at every instruction in the interpreter
+    if (CLOX_OPTION_T(traceVMExecution) || CLOX_OPTION_T(stepVMExecution)) {
+        jitThreshold = 0;
+    }
+}
+
+#else
+
+void initJit(void) {
+    jitThreshold = 0;
+}
+
+void jitCompile(ObjFunction *func) {
+    (void)func;
+}
+
+void freeJitCode(JitCode *code) {
+    (void)code;
+}
+
+void jitEnter(JitCode *code, VMExecContext *ctx, CallFrame *frame, void *entry, LxThread *th) {
+    UNREACHABLE("JIT not supported on this platform");
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "object.h"
+#include "vm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Baseline JIT. Functions that are called (or loop) often enough get their
+// bytecode translated to x86-64, one template per instruction. The native
+// code works on the same VM stack and Values as the interpreter, and exits
+// back to it at an instruction boundary for anything it doesn't handle. Only
+// built for x86-64 with NAN_TAGGING, it's a no-op otherwise.
+
+#if defined(__x86_64__) && defined(NAN_TAGGING)
+#define JIT_ENABLED 1
+#else
+#define JIT_ENABLED 0
+#endif
+
+#define JIT_DEFAULT_THRESHOLD 1000
+
+typedef struct JitCode {
+    void *mem; // executable mapping, starts with the shared prologue
+    size_t size;
+    // native entry point for each instruction, by word offset into the
+    // chunk. NULL if the instruction is run by the interpreter.
+    void **entries;
+    int numEntries;
+} JitCode;
+
+// Calls and loop iterations left until a function gets compiled, 0 if
+// the JIT is off (see --jit-threshold)
+extern int jitThreshold;
+
+void initJit(void);
+void jitCompile(ObjFunction *func);
+void freeJitCode(JitCode *code);
+// Runs native code from `entry` until it exits, and leaves the frame's ip
+// and the stack ready for the interpreter to run the next instruction.
+void jitEnter(JitCode *code, VMExecContext *ctx, CallFrame *frame, void *entry, LxThread *th);
+
+static inline void jitCountUse(ObjFunction *func) {
+    if (func->jitCounter < jitThreshold && ++func->jitCounter == jitThreshold) {
+        jitCompile(func);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
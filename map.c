@@ -326,71 +326,44 @@ static Value lxMapGetSize(int argCount, Value *args) {
 
 static Value lxMapEach(int argCount, Value *args) {
     CHECK_ARITY("Map#each", 1, 1, argCount);
-    volatile LxThread *th = vm.curThread;
     Value self = *args;
-    volatile Table *map = AS_MAP(self)->table;
-    volatile int status = 0;
-    volatile int startIdx = 0;
-    volatile BlockIterFunc fn = getFrame()->callInfo->blockIterFunc;
-    volatile Value yieldArgs[2];
-    volatile Obj *block = NULL;
-    volatile ObjInstance *blockInstance = NULL;
-    blockInstance = getBlockArg(getFrame());
-    if (blockInstance) {
-        block = blockCallableBlock(OBJ_VAL(blockInstance));
-    }
-    if (!block && getFrame()->callInfo) {
-        block = (Obj*)(getFrame()->callInfo->blockFunction);
-    }
-    if (!block) {
-        throwErrorFmt(lxErrClass, "no block given");
-    }
-    volatile BlockStackEntry *bentry = NULL;
-    while (true) {
-        if (startIdx == map->count) {
-            return *args;
-        }
-        SETUP_BLOCK(block, bentry, status, th->errInfo)
-        if (status == TAG_NONE) {
+    Table *map = AS_MAP(self)->table;
+    CallInfo *cinfo = getFrame()->callInfo;
+    BlockIterFunc fn = cinfo->blockIterFunc;
+    ObjInstance *blockInstance = getBlockArg(getFrame());
+    Value block = blockCallableFromC(blockInstance);
+    push(block); // keep it reachable between yields
+    CallInfo yinfo;
+    initYieldInfo(&yinfo, blockInstance);
+    Value ret = self;
+    Value yieldArgs[2];
+    Entry e;
+    int cursor = 0;
+    while (tableNext(map, &cursor, &e)) {
+        yieldArgs[0] = e.key;
+        yieldArgs[1] = e.value;
+        BlockStatus status;
+        Value blockRet = yieldFromC(block, 2, yieldArgs, &yinfo, &status);
+        if (status == BLOCK_ST_BREAK) {
+            ret = NIL_VAL;
             break;
-        } else if (status == TAG_RAISE) {
+        }
+        if (fn) {
             int iterFlags = 0;
-            ObjInstance *errInst = AS_INSTANCE(th->lastErrorThrown);
-            ASSERT(errInst);
-            if (errInst->klass == lxBreakBlockErrClass) {
-                return NIL_VAL;
-            } else if (errInst->klass == lxContinueBlockErrClass) {
-                Value retVal = getProp(th->lastErrorThrown, INTERN("ret"));
-                if (fn) {
-                    fn(2, (Value*)yieldArgs, retVal, getFrame()->callInfo, &iterFlags);
-                    if (iterFlags & ITER_FLAG_STOP) {
-                        return NIL_VAL;
-                    }
-                }
-            } else if (errInst->klass == lxReturnBlockErrClass) {
-                Value retVal = getProp(th->lastErrorThrown, INTERN("ret"));
-                if (fn) {
-                    fn(2, (Value*)yieldArgs, retVal, getFrame()->callInfo, &iterFlags);
-                    if (iterFlags & ITER_FLAG_STOP) {
-                        return NIL_VAL;
-                    }
-                } else {
-                    return retVal;
-                }
-            } else {
-                throwError(th->lastErrorThrown);
+            fn(2, yieldArgs, blockRet, cinfo, &iterFlags);
+            if (iterFlags & ITER_FLAG_STOP) {
+                ret = NIL_VAL;
+                break;
             }
+        } else if (status == BLOCK_ST_RETURN) {
+            ret = blockRet;
+            break;
         }
+        // the block can add entries, which could reallocate the table
+        map = AS_MAP(self)->table;
     }
-
-    Entry e;
-    TABLE_FOREACH_IDX(map, e, startIdx, {
-        startIdx++;
-        yieldArgs[0] = e.key;
-        yieldArgs[1] = e.value;
-        yieldFromC(2, (Value*)yieldArgs, TO_INSTANCE(blockInstance));
-    })
-    return self;
+    pop();
+    return ret;
 }
 
 static void mapIter(int argCount, Value *args, Value ret, CallInfo *cinfo, int *iterFlags) {
@@ -511,22 +484,22 @@ void Init_MapClass() {
     addNativeMethod(mapClass, "opIndexSet", lxMapSet);
     addNativeMethod(mapClass, "opEquals", lxMapEquals);
     addNativeMethod(mapClass, "hashKey", lxMapHashKey);
-    addNativeMethod(mapClass, "keys", lxMapKeys);
-    addNativeMethod(mapClass, "values", lxMapValues);
+    addLeafNativeMethod(mapClass, "keys", lxMapKeys);
+    addLeafNativeMethod(mapClass, "values", lxMapValues);
     addNativeMethod(mapClass, "toString", lxMapToString);
     addNativeMethod(mapClass, "iter", lxMapIter);
-    addNativeMethod(mapClass, "clear", lxMapClear);
+    addLeafNativeMethod(mapClass, "clear", lxMapClear);
     addNativeMethod(mapClass, "hasKey", lxMapHasKey);
     addNativeMethod(mapClass, "slice", lxMapSlice);
     addNativeMethod(mapClass, "merge", lxMapMerge);
     addNativeMethod(mapClass, "mergeWith", lxMapMergeWith);
     addNativeMethod(mapClass, "delete", lxMapDelete);
     addNativeMethod(mapClass, "rehash", lxMapRehash);
-    addNativeMethod(mapClass, "each", lxMapEach);
-    addNativeMethod(mapClass, "map", lxMapMap);
+    addLoopIterNativeMethod(mapClass, "each", lxMapEach, LOOP_ITER_EACH);
+    addLoopIterNativeMethod(mapClass, "map", lxMapMap, LOOP_ITER_MAP);
 
     // getters
-    addNativeGetter(mapClass, "size", lxMapGetSize);
+    addLeafNativeGetter(mapClass, "size", lxMapGetSize);
 
     lxEnvClass = newClass(INTERNED("ENV", 3), lxObjClass, NEWOBJ_FLAG_OLD);
     lxEnv = newInstance(lxEnvClass, NEWOBJ_FLAG_OLD);
@@ -537,5 +510,5 @@ void Init_MapClass() {
     addNativeMethod(lxEnvClass, "delete", lxEnvDelete);
     addNativeMethod(lxEnvClass, "iter", lxEnvIter);
 
-    tableSet(&vm.constants, OBJ_VAL(INTERNED("ENV", 3)), OBJ_VAL(lxEnv));
+    addGlobalConstant(INTERNED("ENV", 3), OBJ_VAL(lxEnv));
 }
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 
 #include "common.h"
 #include "memory.h"
@@ -9,6 +10,7 @@
 #include "compiler.h"
 #include "value.h"
 #include "options.h"
+#include "jit.h"
 
 #ifdef NDEBUG
 #define GC_TRACE_MARK(lvl, obj) (void)0
@@ -32,6 +34,16 @@ static int heapListSize = 0;
 static ObjAny *freeList;
 static int heapsUsed = 0;
 
+// Mark bits live either in each object's header (OBJ_FLAG_DARK), or, when
+// `markBitmapOn`, in a side bitmap per heap. A forked child that shares its
+// heap pages copy-on-write with the parent doesn't have to copy every page
+// holding a live object when it collects if the marks go to the bitmaps.
+#define MARK_WORD_BITS 64
+#define MARK_WORDS ((HEAP_SLOTS+MARK_WORD_BITS-1)/MARK_WORD_BITS)
+static uint64_t **heapMarkBits; // parallel to heapList
+static int *heapsByAddr; // heap indices, sorted by heap address
+static bool markBitmapOn = false;
+
 static bool inGC = false;
 static bool GCOn = true;
 static bool dontGC = false;
@@ -249,14 +261,28 @@ void addHeap() {
             _exit(1);
         }
         GCStats.totalAllocated += (HEAPLIST_INCREMENT*sizeof(ObjAny*));
+        heapMarkBits = realloc(heapMarkBits, heapListSize*sizeof(uint64_t*));
+        heapsByAddr = realloc(heapsByAddr, heapListSize*sizeof(int));
+        if (heapMarkBits == NULL || heapsByAddr == NULL) {
+            fprintf(stderr, "can't alloc new heap list\n");
+            _exit(1);
+        }
     }
 
     size_t heapSz = sizeof(ObjAny)*HEAP_SLOTS;
-    p = heapList[heapsUsed++] = (ObjAny*)malloc(heapSz);
-    if (p == 0) {
+    p = heapList[heapsUsed] = (ObjAny*)malloc(heapSz);
+    heapMarkBits[heapsUsed] = calloc(MARK_WORDS, sizeof(uint64_t));
+    if (p == 0 || heapMarkBits[heapsUsed] == NULL) {
         fprintf(stderr, "addHeap: can't alloc new heap\n");
         _exit(1);
     }
+    int pos = heapsUsed;
+    while (pos > 0 && heapList[heapsByAddr[pos-1]] > p) {
+        heapsByAddr[pos] = heapsByAddr[pos-1];
+        pos--;
+    }
+    heapsByAddr[pos] = heapsUsed;
+    heapsUsed++;
     GCStats.totalAllocated += heapSz;
     GCStats.heapSize += heapSz;
     pend = p + HEAP_SLOTS;
@@ -270,6 +296,92 @@ void addHeap() {
     } // freeList points to last free entry in list, linked backwards
 }
 
+// Returns the index of the heap `obj` is allocated in, or -1 if it's not in
+// any (ex: off-heap internal objects).
+static int heapIndexOf(Obj *obj) {
+    ObjAny *p = (ObjAny*)obj;
+    int lo = 0;
+    int hi = heapsUsed-1;
+    while (lo <= hi) {
+        int mid = lo + (hi-lo)/2;
+        ObjAny *start = heapList[heapsByAddr[mid]];
+        if (p < start) {
+            hi = mid-1;
+        } else if (p >= start + HEAP_SLOTS) {
+            lo = mid+1;
+        } else {
+            return heapsByAddr[mid];
+        }
+    }
+    return -1;
+}
+
+static inline bool heapSlotMarked(int heapIdx, ObjAny *p) {
+    size_t slot = p - heapList[heapIdx];
+    return (heapMarkBits[heapIdx][slot/MARK_WORD_BITS] >> (slot%MARK_WORD_BITS)) & 1;
+}
+
+bool GCIsMarked(Obj *obj) {
+    if (markBitmapOn) {
+        int heapIdx = heapIndexOf(obj);
+        if (heapIdx >= 0) return heapSlotMarked(heapIdx, (ObjAny*)obj);
+    }
+    return OBJ_IS_DARK(obj);
+}
+
+static void GCSetMarked(Obj *obj) {
+    if (markBitmapOn) {
+        int heapIdx = heapIndexOf(obj);
+        if (heapIdx >= 0) {
+            size_t slot = (ObjAny*)obj - heapList[heapIdx];
+            heapMarkBits[heapIdx][slot/MARK_WORD_BITS] |= ((uint64_t)1 << (slot%MARK_WORD_BITS));
+            return;
+        }
+    }
+    OBJ_SET_DARK(obj);
+}
+
+static void GCUnsetMarked(Obj *obj) {
+    if (markBitmapOn) {
+        int heapIdx = heapIndexOf(obj);
+        if (heapIdx >= 0) {
+            size_t slot = (ObjAny*)obj - heapList[heapIdx];
+            heapMarkBits[heapIdx][slot/MARK_WORD_BITS] &= ~((uint64_t)1 << (slot%MARK_WORD_BITS));
+            return;
+        }
+    }
+    OBJ_UNSET_DARK(obj);
+}
+
+// Can only be switched between collections, when no object is marked.
+void GCSetMarkBitmap(bool on) {
+    ASSERT(!inGC);
+    markBitmapOn = on;
+}
+
+bool GCMarkBitmapOn(void) {
+    return markBitmapOn;
+}
+
+// Collect, then promote every survivor to the oldest generation so that
+// later collections don't write to their headers either (young collections
+// skip old objects, and full collections only bump the generation of objects
+// that aren't the oldest yet). Call before forking workers.
+void GCPrepareFork(void) {
+    GCSetMarkBitmap(true);
+    collectGarbage();
+    for (int i = 0; i < heapsUsed; i++) {
+        ObjAny *p = heapList[i];
+        ObjAny *pend = p + HEAP_SLOTS;
+        for (; p < pend; p++) {
+            Obj *obj = (Obj*)p;
+            if (obj->type != OBJ_T_NONE && obj->GCGen != GC_GEN_MAX) {
+                GC_OLD(obj);
+            }
+        }
+    }
+}
+
 // TODO: we shouldn't free all heaps right away, we should leave one
 // empty heap and mark it as empty, then we don't need to iterate over
 // it during GC, and we return it on next call to addHeap().
@@ -384,6 +496,7 @@ void collectYoungGarbage() {
     GC_TRACE_DEBUG(2, "# C-call stack objects found: %d", numStackObjects);
 
     grayTable(&vm.globals);
+    grayValueArray(&vm.globalValues);
     grayTable(&vm.constants);
     /*grayTable(&vm.strings);*/
     /*grayTable(&vm.regexLiterals);*/
@@ -412,6 +525,8 @@ void collectYoungGarbage() {
                 // XXX: is this necessary, they must be on the stack??
                 if (frame->closure)
                     grayObject(TO_OBJ(frame->closure));
+                if (frame->blockClosure)
+                    grayObject(TO_OBJ(frame->blockClosure));
                 if (frame->instance)
                     grayObject(TO_OBJ(frame->instance));
                 if (frame->scope) {
@@ -432,24 +547,28 @@ void collectYoungGarbage() {
         GC_TRACE_DEBUG(3, "Marking VM print buf");
         grayObject((Obj*)vm.printBuf);
     }
+    // young objects written to old ones are roots, and so are their young
+    // references (ex: the owner of a String slice)
+    GC_TRACE_DEBUG(2, "Marking remember set");
+    Obj *remembered = NULL; int remIdx = 0;
+    vec_foreach(&rememberSet, remembered, remIdx) {
+        grayObject(remembered);
+    }
     int numPromotedDark = 0;
     int numPromotedOther = 0;
     int numPromotedRemembered = 0;
     int numCollected = 0;
     ObjAny *newFreeList = freeList;
 
-    int grayCount = vm.grayCount;
-    while (grayCount > 0) {
-        // Pop an item from the gray stack.
-        grayCount--;
-        Obj *marked = vm.grayStack[grayCount];
+    // The gray stack isn't popped, its objects are whitened again below.
+    // Objects grayed while blackening are pushed after the current one, so
+    // walking it from the bottom blackens every one of them.
+    for (int grayIdx = 0; grayIdx < vm.grayCount; grayIdx++) {
+        Obj *marked = vm.grayStack[grayIdx];
         DBG_ASSERT(marked);
-        int oldCount = vm.grayCount;
         if (IS_YOUNG_OBJ(marked)) {
             blackenObject(marked); // NOTE: only grays young references
         }
-        int newCount = vm.grayCount;
-        grayCount += (newCount-oldCount);
     }
 
     int numNotYoung = 0;
@@ -469,7 +588,7 @@ void collectYoungGarbage() {
                 /*}*/
                 numNotYoung++;
             }
-            OBJ_UNSET_DARK(youngObj);
+            GCUnsetMarked(youngObj);
             continue;
         }
         // Let full GC deal with finalizer object destruction
@@ -477,17 +596,17 @@ void collectYoungGarbage() {
                 ((ObjInstance*)youngObj)->finalizerFunc != NULL) {
             numPromotedOther++;
             GC_PROMOTE_ONCE(youngObj);
-            OBJ_UNSET_DARK(youngObj);
+            GCUnsetMarked(youngObj);
             continue;
         }
-        if (OBJ_IS_DARK(youngObj)) {
+        if (GCIsMarked(youngObj)) {
             numPromotedDark++;
             GC_PROMOTE_ONCE(youngObj);
-            OBJ_UNSET_DARK(youngObj);
+            GCUnsetMarked(youngObj);
         } else if (inRememberSet(youngObj)) {
             numPromotedRemembered++;
             GC_PROMOTE_ONCE(youngObj);
-            OBJ_UNSET_DARK(youngObj);
+            GCUnsetMarked(youngObj);
         } else {
             ASSERT(IS_YOUNG_OBJ(youngObj));
             ASSERT(!OBJ_IS_HIDDEN(youngObj));
@@ -506,7 +625,7 @@ void collectYoungGarbage() {
         // Pop an item from the gray stack.
         Obj *marked = vm.grayStack[--vm.grayCount];
         DBG_ASSERT(marked);
-        OBJ_UNSET_DARK(marked);
+        GCUnsetMarked(marked);
     }
 
     GC_TRACE_DEBUG(2, "done FREE (young) process (%d young)", youngStackSz);
@@ -649,7 +768,7 @@ void grayObject(Obj *obj) {
         TRACE_GC_FUNC_END(4, "grayObject (null obj found)");
         return;
     }
-    if (OBJ_IS_DARK(obj)) {
+    if (GCIsMarked(obj)) {
         TRACE_GC_FUNC_END(4, "grayObject (already dark)");
         return;
     }
@@ -658,7 +777,7 @@ void grayObject(Obj *obj) {
         return;
     }
     GC_TRACE_MARK(4, obj);
-    OBJ_SET_DARK(obj);
+    GCSetMarked(obj);
     if (!inYoungGC) {
         INC_GEN(obj);
     }
@@ -682,13 +801,13 @@ void grayValue(Value val) {
     TRACE_GC_FUNC_END(4, "grayValue");
 }
 
-/*static void grayArray(ValueArray *ary) {*/
-    /*TRACE_GC_FUNC_START(5, "grayArray");*/
-    /*for (int i = 0; i < ary->count; i++) {*/
-        /*grayValue(ary->values[i]);*/
-    /*}*/
-    /*TRACE_GC_FUNC_END(5, "grayArray");*/
-/*}*/
+void grayValueArray(ValueArray *ary) {
+    TRACE_GC_FUNC_START(5, "grayValueArray");
+    for (int i = 0; i < ary->count; i++) {
+        grayValue(ary->values[i]);
+    }
+    TRACE_GC_FUNC_END(5, "grayValueArray");
+}
 
 // recursively gray an object's references
 void blackenObject(Obj *obj) {
@@ -782,6 +901,9 @@ void blackenObject(Obj *obj) {
             for (int i = 0; i < closure->upvalueCount; i++) {
                 grayObject((Obj*)closure->upvalues[i]); // closed upvalues
             }
+            for (int i = 0; i < closure->capturedCount; i++) {
+                grayValue(closure->captured[i]);
+            }
             break;
         }
         case OBJ_T_SCOPE: {
@@ -882,8 +1004,11 @@ void blackenObject(Obj *obj) {
             grayValue(((ObjUpvalue*)obj)->closed);
             break;
         }
-        case OBJ_T_STRING: { // no references
+        case OBJ_T_STRING: {
             ObjString *str = (ObjString*)obj;
+            if (str->parent) {
+                grayObject((Obj*)str->parent);
+            }
             if (str->klass) {
                 grayObject((Obj*)str->klass);
             }
@@ -984,9 +1109,14 @@ void freeObject(Obj *obj) {
             vec_deinit(&func->scopes);
             vec_deinit(&func->variables);
             FREE_SIZE(sizeof(Upvalue)*LX_MAX_UPVALUES, func->upvaluesInfo);
+            FREE_ARRAY(Upvalue, func->capturedInfo, func->capturedCount);
             if (func->programNode) {
                 freeNode(func->programNode, true);
             }
+            if (func->jitCode) {
+                freeJitCode(func->jitCode);
+                func->jitCode = NULL;
+            }
             GC_TRACE_DEBUG(5, "Freeing ObjFunction: p=%p", obj);
             obj->type = OBJ_T_NONE;
             break;
@@ -995,6 +1125,7 @@ void freeObject(Obj *obj) {
             ObjClosure *closure = (ObjClosure*)obj;
             GC_TRACE_DEBUG(5, "Freeing ObjClosure: p=%p", closure);
             FREE_ARRAY(Value, closure->upvalues, closure->upvalueCount);
+            FREE_ARRAY(Value, closure->captured, closure->capturedCount);
             obj->type = OBJ_T_NONE;
             break;
         }
@@ -1089,16 +1220,23 @@ void freeObject(Obj *obj) {
         case OBJ_T_STRING: {
             ObjString *string = (ObjString*)obj;
             ASSERT(string->chars);
-            GC_TRACE_DEBUG(5, "Freeing string chars: p=%p, interned=%s,static=%s,shared=%s",
+            GC_TRACE_DEBUG(5, "Freeing string chars: p=%p, interned=%s,static=%s,shared=%s,mmapped=%s",
                     string->chars,
                     STRING_IS_INTERNED(string) ? "t" : "f",
                     STRING_IS_STATIC(string) ? "t" : "f",
-                    STRING_IS_SHARED(string) ? "t" : "f"
+                    STRING_IS_SHARED(string) ? "t" : "f",
+                    STRING_IS_MMAPPED(string) ? "t" : "f"
             );
-            if (!STRING_IS_SHARED(string)) {
+            if (STRING_IS_MMAPPED(string)) {
+                GC_TRACE_DEBUG(5, "Unmapping string chars: (len=%d, mapsize=%d)", string->length, string->capacity+1);
+                munmap(string->chars, string->capacity + 1);
+            } else if (!STRING_IS_SHARED(string)) {
                 GC_TRACE_DEBUG(5, "Freeing string chars: s='%s' (len=%d, capa=%d)", string->chars, string->length, string->capacity);
                 FREE_ARRAY(char, string->chars, string->capacity + 1);
             }
+            if (string->charIndex) {
+                freeStringCharIndex(string);
+            }
             freeTable(string->fields);
             FREE_ARRAY(Table, string->fields, 1);
             string->chars = NULL;
@@ -1305,6 +1443,8 @@ void collectGarbage(void) {
                 CallFrame *frame = &ctx->frames[i];
                 if (frame->closure)
                     grayObject(TO_OBJ(frame->closure));
+                if (frame->blockClosure)
+                    grayObject(TO_OBJ(frame->blockClosure));
                 if (frame->instance)
                     grayObject(TO_OBJ(frame->instance));
                 if (frame->klass)
@@ -1337,9 +1477,10 @@ void collectGarbage(void) {
 
     GC_TRACE_DEBUG(2, "Marking globals (%d found)", vm.globals.count);
     grayTable(&vm.globals);
+    grayValueArray(&vm.globalValues);
     grayTable(&vm.constants);
     GC_TRACE_DEBUG(2, "Marking interned strings (%d found)", vm.strings.count);
-    grayTable(&vm.strings);
+    grayInternTable(&vm.strings);
     grayTable(&vm.regexLiterals);
     grayTable(&vm.autoloadTbl);
     GC_TRACE_DEBUG(2, "Marking compiler roots");
@@ -1444,7 +1585,8 @@ freeLoop:
 
             int rootedCStack = -1;
             vec_find(&v_stackObjs, obj, rootedCStack);
-            if (!OBJ_IS_DARK(obj) && !OBJ_IS_HIDDEN(obj)) {
+            bool marked = markBitmapOn ? heapSlotMarked(i, p) : OBJ_IS_DARK(obj);
+            if (!marked && !OBJ_IS_HIDDEN(obj)) {
                 if (phase == 2) { // phase 2, reclaim unmarked objects
                     if (rootedCStack == -1) {
                         numObjectsFreed++;
@@ -1468,14 +1610,14 @@ freeLoop:
                         }
                     }
                 }
-            } else if (OBJ_IS_HIDDEN(obj) && !OBJ_IS_DARK(obj)) { // keep
+            } else if (OBJ_IS_HIDDEN(obj) && !marked) { // keep
                 if (phase == 2) {
                     numObjectsHiddenNotMarked++;
                 }
             } else { // unmark for next run
                 if (phase == 2) {
                     GCPromoteOnce(obj);
-                    OBJ_UNSET_DARK(obj);
+                    if (!markBitmapOn) OBJ_UNSET_DARK(obj);
                     numObjectsKept++;
                 }
             }
@@ -1484,6 +1626,9 @@ freeLoop:
 
         if (phase == 2) {
             freeList = newFreeList;
+            if (markBitmapOn) {
+                memset(heapMarkBits[i], 0, MARK_WORDS*sizeof(uint64_t));
+            }
             if (objectsFree == HEAP_SLOTS) {
                 vec_push(&vFreeHeaps, heapList[i]);
             } else if (objectsFree >= (HEAP_SLOTS/2)) {
@@ -1594,27 +1739,30 @@ freeLoop:
         goto freeLoop;
     }
 
-    Entry e;
-    Obj *sym; int eidx = 0;
-    TABLE_FOREACH(&vm.strings, e, eidx, {
-        sym = AS_OBJ(e.key);
-        if (OBJ_IS_HIDDEN(sym))
+    ObjString *sym = NULL;
+    INTERN_TABLE_FOREACH(&vm.strings, sym, {
+        if (OBJ_IS_HIDDEN((Obj*)sym))
             continue;
-        freeObject(sym);
+        freeObject((Obj*)sym);
     })
 
     for (int i = 0; i < heapsUsed; i++) {
         p = heapList[i];
         xfree(p); // free the heap
+        xfree(heapMarkBits[i]);
         GCStats.totalAllocated -= (sizeof(ObjAny)*HEAP_SLOTS);
         GCStats.heapSize -= (sizeof(ObjAny)*HEAP_SLOTS);
     }
 
     if (heapList) {
         xfree(heapList);
+        xfree(heapMarkBits);
+        xfree(heapsByAddr);
         GCStats.totalAllocated -= (sizeof(void*)*heapListSize);
     }
     heapList = NULL;
+    heapMarkBits = NULL;
+    heapsByAddr = NULL;
     heapsUsed = 0;
     heapListSize = 0;
     freeList = NULL;
@@ -71,6 +71,7 @@ void nil_mem(Value *mem, size_t num);
 
 void grayObject(Obj *obj); // non-recursively mark object as live
 void grayValue(Value val); // non-recursively mark object in value as live
+void grayValueArray(ValueArray *ary);
 void collectGarbage(void); // do 1 mark+sweep
 void collectYoungGarbage(void); // collect young objects
 void freeObject(Obj *obj);
@@ -84,6 +85,11 @@ void GCPromote(Obj *obj, unsigned short gen);
 void GCPromoteOnce(Obj *obj);
 void pushRememberSet(Obj *obj);
 
+bool GCIsMarked(Obj *obj);
+void GCSetMarkBitmap(bool on);
+bool GCMarkBitmapOn(void);
+void GCPrepareFork(void);
+
 #define IS_OLD_VAL(value) (AS_OBJ(value)->GCGen > GC_GEN_MIN)
 #define IS_YOUNG_VAL(value) (AS_OBJ(value)->GCGen == GC_GEN_MIN)
 #define IS_OLD_OBJ(obj) ((obj)->GCGen > GC_GEN_MIN)
@@ -156,6 +156,18 @@ static char *outputArrayExpr(Node *n, int indentLevel) {
     return buf;
 }
 
+static char *outputStringInterpExpr(Node *n, int indentLevel) {
+    char *buf = (char*)"(interp";
+    Node *part = NULL;
+    int i = 0;
+    vec_foreach(n->children, part, i) {
+        buf = strAdd(buf, " ");
+        buf = strAdd(buf, outputASTString(part, indentLevel));
+    }
+    buf = strAdd(buf, ")");
+    return buf;
+}
+
 static char *outputIndexGetExpr(Node *n, int indentLevel) {
     char *buf = (char*)"(idxGet ";
     Node *left = vec_first(n->children);
@@ -707,6 +719,8 @@ char *outputASTString(Node *node, int indentLevel) {
                     return outputLiteralExpr(node, indentLevel);
                 case ARRAY_EXPR:
                     return outputArrayExpr(node, indentLevel);
+                case STRING_INTERP_EXPR:
+                    return outputStringInterpExpr(node, indentLevel);
                 case INDEX_GET_EXPR:
                     return outputIndexGetExpr(node, indentLevel);
                 case INDEX_SET_EXPR:
@@ -39,6 +39,7 @@ typedef enum eExprType {
     SUPER_EXPR,
     SPLAT_EXPR,
     BINARY_ASSIGN_EXPR, // 24
+    STRING_INTERP_EXPR, // "a ${b} c"
 } ExprType;
 
 static const char *exprTypeNames[] = {
@@ -66,10 +67,11 @@ static const char *exprTypeNames[] = {
     "SUPER_EXPR",
     "SPLAT_EXPR",
     "BINARY_ASSIGN_EXPR",
+    "STRING_INTERP_EXPR",
     NULL
 };
 
-#define STMT_TYPE_ENUM_FIRST 25
+#define STMT_TYPE_ENUM_FIRST 26
 typedef enum eStmtType {
     EXPR_STMT = STMT_TYPE_ENUM_FIRST,
     PRINT_STMT,
@@ -8,6 +8,7 @@
 #include "debug.h"
 #include "runtime.h"
 #include "vec.h"
+#include "string_simd.h"
 
 // allocate object and link it to the VM object heap
 #define ALLOCATE_OBJ(type, objectType, flags) \
@@ -57,6 +58,9 @@ static ObjString *allocateString(char *chars, int length, ObjClass *klass, int f
     string->capacity = length;
     string->chars = chars;
     string->hash = 0; // lazily computed
+    string->encoding = STRING_ENC_UNKNOWN;
+    string->charIndex = NULL;
+    string->parent = NULL;
     OBJ_SET_INSTANCE_LIKE(TO_OBJ(string));
     return string;
 }
@@ -85,11 +89,17 @@ void objUnfreeze(Obj *obj) {
         if (UNLIKELY(STRING_IS_STATIC(buf))) {
             throwErrorFmt(lxErrClass, "Tried to unfreeze static String");
         }
+        if (UNLIKELY(STRING_IS_MMAPPED(buf))) {
+            throwErrorFmt(lxErrClass, "Tried to unfreeze mmapped String");
+        }
     }
     OBJ_UNSET_FROZEN(obj);
 }
 
 uint32_t hashString(char *key, size_t length) {
+    if (length >= 16) {
+        return strHashLong(key, length);
+    }
     // FNV-1a hash. See: http://www.isthe.com/chongo/tech/comp/fnv/
     uint32_t hash = 2166136261u;
 
@@ -102,6 +112,8 @@ uint32_t hashString(char *key, size_t length) {
     return hash;
 }
 
+static void computeStringEncoding(ObjString *str);
+
 // use `*chars` as the underlying storage for the new string object
 // NOTE: length here is strlen(chars)
 // XXX: Do not pass a static string here, it'll break when GC tries to free it.
@@ -113,9 +125,11 @@ ObjString *takeString(char *chars, size_t length, int flags) {
 // use copy of `*chars` as the underlying storage for the new string object
 // NOTE: length here is strlen(chars), without NUL byte
 ObjString *copyString(char *chars, size_t length, int flags) {
+#ifndef NDEBUG
     if (strlen(chars) < length) {
         fprintf(stderr, "chars: '%s', length: %d", chars, (int)length);
     }
+#endif
     DBG_ASSERT(strlen(chars) >= length);
 
     char *heapChars = ALLOCATE(char, length + 1);
@@ -125,6 +139,116 @@ ObjString *copyString(char *chars, size_t length, int flags) {
     return allocateString(heapChars, length, lxStringClass, flags);
 }
 
+// New string for the interned string literal `lit`, like String(lit). It
+// shares the literal's characters until it's modified (see dedupString()).
+ObjString *stringLiteralCopy(ObjString *lit) {
+    DBG_ASSERT(STRING_IS_INTERNED(lit));
+    ObjString *str = allocateString(lit->chars, lit->length, lxStringClass, NEWOBJ_FLAG_NONE);
+    str->capacity = lit->capacity;
+    str->hash = lit->hash;
+    if (lit->encoding == STRING_ENC_UNKNOWN) {
+        computeStringEncoding(lit); // once, literals don't change
+    }
+    if (lit->encoding == STRING_ENC_ASCII) {
+        str->encoding = STRING_ENC_ASCII;
+    }
+    STRING_SET_SHARED(str);
+    return str;
+}
+
+ObjString *sharedSlice(ObjString *owner, char *chars, size_t length) {
+    DBG_ASSERT(chars[length] == '\0');
+    ObjString *str = allocateString(chars, length, lxStringClass, NEWOBJ_FLAG_NONE);
+    STRING_SET_SHARED(str);
+    str->parent = owner; // no write barrier needed, `str` is young
+    return str;
+}
+
+// The string that owns the buffer `str` points to, for slices of `str` to
+// keep alive. Static and mmapped strings are never modified, so they can own
+// slices of themselves. Otherwise the buffer is handed over to a new frozen
+// owner that Lox code never sees, and `str` becomes one of its shared users
+// like the slices, copying the buffer before it's next modified (see
+// dedupString()). Returns NULL if the buffer belongs to an interned string,
+// as those are never freed.
+ObjString *sliceOwner(ObjString *str) {
+    if (STRING_IS_STATIC(str) || STRING_IS_MMAPPED(str)) {
+        return str;
+    }
+    if (STRING_IS_SHARED(str)) {
+        return str->parent;
+    }
+    ObjString *owner = allocateString(str->chars, str->length, lxStringClass, NEWOBJ_FLAG_FROZEN);
+    owner->capacity = str->capacity;
+    owner->hash = str->hash;
+    STRING_SET_SHARED(str);
+    str->parent = owner;
+    OBJ_WRITE(OBJ_VAL(str), OBJ_VAL(owner));
+    return owner;
+}
+
+// New string with the characters of `str` from byte `start` on, sharing
+// `str`'s buffer instead of copying it.
+ObjString *stringSuffix(ObjString *str, size_t start) {
+    DBG_ASSERT(start <= str->length);
+    char *chars = str->chars + start;
+    size_t length = str->length - start;
+    return sharedSlice(sliceOwner(str), chars, length);
+}
+
+// New string with the contents of `a` followed by `b`, allocated once
+ObjString *concatStrings(ObjString *a, ObjString *b) {
+    size_t len = a->length + b->length;
+    char *chars = ALLOCATE(char, len + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[len] = '\0';
+    return allocateString(chars, len, lxStringClass, NEWOBJ_FLAG_NONE);
+}
+
+// Formats nil, a boolean or a number like String(val) into `buf`, returns
+// the length.
+static size_t primitiveToCString(Value val, char *buf, size_t bufSize) {
+    if (IS_NUMBER(val)) {
+        return snprintf(buf, bufSize, "%g", AS_NUMBER(val));
+    } else if (IS_BOOL(val)) {
+        return snprintf(buf, bufSize, "%s", AS_BOOL(val) ? "true" : "false");
+    } else {
+        DBG_ASSERT(IS_NIL(val));
+        return snprintf(buf, bufSize, "nil");
+    }
+}
+
+// Concatenates `parts` into one new string, allocated once (used for string
+// interpolation). The parts must be strings, nil, booleans or numbers, the
+// last 3 are formatted like String(val).
+ObjString *concatValues(Value *parts, int numParts) {
+    char numBuf[50];
+    size_t len = 0;
+    for (int i = 0; i < numParts; i++) {
+        if (IS_STRING(parts[i])) {
+            len += AS_STRING(parts[i])->length;
+        } else {
+            len += primitiveToCString(parts[i], numBuf, sizeof(numBuf));
+        }
+    }
+    char *chars = ALLOCATE(char, len + 1);
+    char *dst = chars;
+    for (int i = 0; i < numParts; i++) {
+        if (IS_STRING(parts[i])) {
+            ObjString *part = AS_STRING(parts[i]);
+            memcpy(dst, part->chars, part->length);
+            dst += part->length;
+        } else {
+            size_t partLen = primitiveToCString(parts[i], numBuf, sizeof(numBuf));
+            memcpy(dst, numBuf, partLen);
+            dst += partLen;
+        }
+    }
+    *dst = '\0';
+    return allocateString(chars, len, lxStringClass, NEWOBJ_FLAG_NONE);
+}
+
 ObjString *hiddenString(char *chars, size_t len, int flags) {
     DBG_ASSERT(strlen(chars) >= len);
     ObjString *string = copyString(chars, len, flags|NEWOBJ_FLAG_HIDDEN);
@@ -132,13 +256,24 @@ ObjString *hiddenString(char *chars, size_t len, int flags) {
     return string;
 }
 
+ObjString *mappedString(char *chars, size_t length, size_t mapSize, int flags) {
+    DBG_ASSERT(mapSize > length);
+    ObjString *string = allocateString(chars, length, lxStringClass, flags|NEWOBJ_FLAG_FROZEN);
+    // capacity+1 is the size of the allocation for all other strings, keep
+    // that invariant so that munmap() gets the right size.
+    string->capacity = mapSize-1;
+    STRING_SET_MMAPPED(string);
+    return string;
+}
+
 ObjString *internedString(char *chars, size_t length, int flags) {
     DBG_ASSERT(strlen(chars) >= length);
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString *interned = internTableFind(&vm.strings, chars, length, hash);
     if (!interned) {
         interned = copyString(chars, length, flags|NEWOBJ_FLAG_OLD|NEWOBJ_FLAG_FROZEN);
-        ASSERT(tableSet(&vm.strings, OBJ_VAL(interned), NIL_VAL));
+        interned->hash = hash;
+        internTableAdd(&vm.strings, interned, hash);
         STRING_SET_INTERNED(interned);
         objFreeze((Obj*)interned);
     }
@@ -154,13 +289,6 @@ void pushString(Value self, Value pushed) {
     pushObjString(lhsBuf, rhsBuf);
 }
 
-bool objStringEquals(ObjString *a, ObjString *b) {
-    DBG_ASSERT(a && b);
-    if (a->length != b->length) return false;
-    if (a->hash > 0 && b->hash > 0) return a->hash == b->hash;
-    return strcmp(a->chars, b->chars) == 0;
-}
-
 // Copies `chars`, adds them to end of string.
 // NOTE: don't use this function on a ObjString that is already a key
 // for a table, it won't retrieve the value in the table anymore unless
@@ -173,20 +301,26 @@ void pushCString(ObjString *string, const char *chars, size_t lenToAdd) {
 
     size_t newLen = string->length + lenToAdd;
     if (newLen > string->capacity) {
+        // `chars` can point into the string itself (ex: s.push(s))
+        bool isSelf = chars >= string->chars && chars <= string->chars + string->length;
+        size_t selfOffset = isSelf ? (size_t)(chars - string->chars) : 0;
         size_t newCapa = GROW_CAPACITY(string->capacity);
         size_t newSz = newLen > newCapa ? newLen : newCapa;
         string->chars = GROW_ARRAY(string->chars, char, string->capacity+1, newSz+1);
         string->capacity = newSz;
+        if (isSelf) {
+            chars = string->chars + selfOffset;
+        }
     }
-    size_t i = 0;
-    for (i = 0; i < lenToAdd; i++) {
-        char *c = (char*)chars+i;
-        if (c == NULL) break;
-        string->chars[string->length + i] = *c;
+    memcpy(string->chars + string->length, chars, lenToAdd);
+    string->chars[newLen] = '\0';
+    string->length = newLen;
+    // keep knowing that a string that's built up from ASCII is ASCII
+    if (string->encoding == STRING_ENC_ASCII && strAsciiSpan(chars, lenToAdd) == lenToAdd) {
+        string->hash = 0;
+    } else {
+        stringContentsChanged(string);
     }
-    string->chars[string->length + i] = '\0';
-    string->length += lenToAdd;
-    string->hash = 0;
 }
 
 void insertCString(ObjString *string, const char *chars, size_t lenToAdd, size_t at, bool replaceAt) {
@@ -201,28 +335,26 @@ void insertCString(ObjString *string, const char *chars, size_t lenToAdd, size_t
 
     if (lenToAdd == 0) return;
 
-    size_t newLen = string->length + lenToAdd;
-    if (replaceAt) {
-      newLen--;
-    }
+    spliceCString(string, at, replaceAt ? 1 : 0, chars, lenToAdd);
+}
+
+void spliceCString(ObjString *string, size_t at, size_t delLen, const char *chars, size_t lenToAdd) {
+    ASSERT(!isFrozen((Obj*)string));
+    ASSERT(at + delLen <= string->length);
+
+    size_t newLen = string->length - delLen + lenToAdd;
     if (newLen > string->capacity) {
         size_t newCapa = GROW_CAPACITY(string->capacity);
         size_t newSz = newLen > newCapa ? newLen : newCapa;
         string->chars = GROW_ARRAY(string->chars, char, string->capacity+1, newSz+1);
         string->capacity = newSz;
     }
-    char *dest = string->chars + at + lenToAdd;
-    char *src = string->chars+at;
-    if (replaceAt) src++;
-    int charsToMove = string->length-at;
-    if (replaceAt) charsToMove--;
-    memmove(dest, src, sizeof(char)*charsToMove);
-    for (size_t i = 0; i < lenToAdd; i++) {
-        string->chars[at+i] = chars[i];
-    }
+    memmove(string->chars + at + lenToAdd, string->chars + at + delLen,
+            string->length - at - delLen);
+    memcpy(string->chars + at, chars, lenToAdd);
     string->length = newLen;
     string->chars[string->length] = '\0';
-    string->hash = 0;
+    stringContentsChanged(string);
 }
 
 void pushCStringFmt(ObjString *string, const char *format, ...) {
@@ -257,7 +389,7 @@ void pushCStringVFmt(ObjString *string, const char *format, va_list ap) {
     }
     string->chars[string->length + i] = '\0';
     string->length += buflen;
-    string->hash = 0;
+    stringContentsChanged(string);
 }
 
 static inline void clearObjString(ObjString *string) {
@@ -266,7 +398,7 @@ static inline void clearObjString(ObjString *string) {
     string->chars[0] = '\0';
     string->length = 0;
     string->capacity = 0;
-    string->hash = 0;
+    stringContentsChanged(string);
 }
 
 ObjFunction *newFunction(Chunk *chunk, struct sNode *funcNode, FunctionType ftype, int flags) {
@@ -278,7 +410,9 @@ ObjFunction *newFunction(Chunk *chunk, struct sNode *funcNode, FunctionType ftyp
     function->numDefaultArgs = 0;
     function->numKwargs = 0;
     function->upvalueCount = 0;
+    function->capturedCount = 0;
     function->localCount = 0;
+    function->kwargsEnd = 0;
     function->name = NULL;
     function->klass = NULL;
     function->funcNode = funcNode;
@@ -286,7 +420,11 @@ ObjFunction *newFunction(Chunk *chunk, struct sNode *funcNode, FunctionType ftyp
     function->isSingletonMethod = false;
     function->hasRestArg = false;
     function->hasBlockArg = false;
+    function->isSimple = false;
+    function->jitCounter = 0;
+    function->jitCode = NULL;
     function->upvaluesInfo = NULL;
+    function->capturedInfo = NULL;
     function->hasReceiver = false;
     if (chunk == NULL) {
         chunk = ALLOCATE(Chunk, 1);
@@ -312,6 +450,11 @@ ObjClosure *newClosure(ObjFunction *func, int flags) {
             upvalues[i] = NULL;
         }
     }
+    Value *captured = NULL;
+    if (func->capturedCount > 0) {
+        captured = ALLOCATE(Value, func->capturedCount);
+        nil_mem(captured, func->capturedCount);
+    }
 
     ObjClosure *closure = ALLOCATE_OBJ(
         ObjClosure, OBJ_T_CLOSURE, flags
@@ -320,6 +463,8 @@ ObjClosure *newClosure(ObjFunction *func, int flags) {
     OBJ_WRITE(OBJ_VAL(closure), OBJ_VAL(func));
     closure->upvalues = upvalues;
     closure->upvalueCount = func->upvalueCount;
+    closure->captured = captured;
+    closure->capturedCount = func->capturedCount;
     closure->isBlock = false;
     GC_PROMOTE(closure, GC_GEN_YOUNG_MAX);
     return closure;
@@ -449,6 +594,7 @@ void setupIClass(ObjIClass *iclass) {
         iclass->superklass = origSuper;
         OBJ_WRITE(OBJ_VAL(iclass), OBJ_VAL(iclass->superklass));
         iclass->isSetup = true;
+        vm.methodSerial++;
     }
 }
 
@@ -532,6 +678,8 @@ ObjNative *newNative(ObjString *name, NativeFn function, int flags) {
     }
     native->klass = NULL;
     native->isStatic = false;
+    native->flags = 0;
+    native->loopIter = LOOP_ITER_NONE;
     GC_OLD(native);
     return native;
 }
@@ -730,6 +878,20 @@ Value newArray(void) {
     return pop();
 }
 
+// New array of 2 elements, built without calling Array#init like newArray()
+// does, since the native one wouldn't do anything else. Used for the [key,
+// value] pairs of map iteration.
+Value newArrayPair(Value a, Value b) {
+    ObjArray *ary = allocateArray(lxAryClass, NEWOBJ_FLAG_NONE);
+    Value aryVal = OBJ_VAL(ary);
+    initValueArrayWithCapa(&ary->valAry, 2);
+    writeValueArrayEnd(&ary->valAry, a);
+    OBJ_WRITE(aryVal, a);
+    writeValueArrayEnd(&ary->valAry, b);
+    OBJ_WRITE(aryVal, b);
+    return aryVal;
+}
+
 // NOTE: used in compiler, can't use VM stack
 Value newArrayConstant(void) {
     ObjArray *ary = allocateArray(lxAryClass, NEWOBJ_FLAG_OLD);
@@ -836,33 +998,44 @@ void clearString(Value string) {
     clearObjString(buf);
 }
 
+// `at` counts characters, see stringCharOffset()
 void stringInsertAt(Value self, Value insert, size_t at, bool replaceAt) {
     if (isFrozen(AS_OBJ(self))) {
         throwErrorFmt(lxErrClass, "%s", "String is frozen, cannot modify");
     }
     ObjString *selfBuf = AS_STRING(self);
     ObjString *insertBuf = AS_STRING(insert);
-    insertObjString(selfBuf, insertBuf, at, replaceAt);
+    size_t byteAt = stringCharOffset(selfBuf, at);
+    if (replaceAt && byteAt < selfBuf->length) {
+        spliceCString(selfBuf, byteAt, stringCharWidth(selfBuf, byteAt),
+                insertBuf->chars, insertBuf->length);
+    } else {
+        insertObjString(selfBuf, insertBuf, byteAt, false);
+    }
 }
 
+// `startIdx` and `len` count characters, see stringCharOffset()
 Value stringSubstr(Value self, size_t startIdx, int len) {
     ObjString *buf = AS_STRING(self);
     ObjString *substr = NULL;
-    if (startIdx >= buf->length) {
+    size_t charLength = stringCharLength(buf);
+    if (startIdx >= charLength) {
         substr = copyString("", 0, NEWOBJ_FLAG_NONE);
     } else {
-        char *start = buf->chars + startIdx;
-        size_t maxlen = buf->length - startIdx;
+        size_t start = stringCharOffset(buf, startIdx);
+        size_t maxlen = charLength - startIdx;
         if (len < 0) {
             len = maxlen + len + 1;
             if (len < 0) {
                 len = 0;
             }
         }
-        if ((size_t)len > maxlen) {
-            len = maxlen;
+        if ((size_t)len >= maxlen) {
+            substr = stringSuffix(buf, start);
+        } else {
+            size_t end = stringCharOffset(buf, startIdx + len);
+            substr = copyString(buf->chars + start, end - start, NEWOBJ_FLAG_NONE);
         }
-        substr = copyString(start, len, NEWOBJ_FLAG_NONE);
     }
 
     return OBJ_VAL(substr);
@@ -870,12 +1043,13 @@ Value stringSubstr(Value self, size_t startIdx, int len) {
 
 Value stringIndexGet(Value self, size_t index) {
     ObjString *buf = AS_STRING(self);
-    if (index >= buf->length) {
+    size_t start = stringCharOffset(buf, index);
+    if (start >= buf->length) {
         return OBJ_VAL(copyString("", 0, NEWOBJ_FLAG_NONE));
     /*} else if (index < 0) { // TODO: make it works from end of str?*/
         /*throwArgErrorFmt("%s", "index cannot be negative");*/
     } else {
-        return OBJ_VAL(copyString(buf->chars+index, 1, NEWOBJ_FLAG_NONE));
+        return OBJ_VAL(stringCharAt(buf, start, stringCharWidth(buf, start)));
     }
 }
 
@@ -892,12 +1066,120 @@ Value stringIndexSet(Value self, size_t index, char c) {
         char oldC = buf->chars[index];
         buf->chars[index] = c;
         if (oldC != c) {
-            buf->hash = 0;
+            stringContentsChanged(buf);
         }
     }
     return self;
 }
 
+#define IS_UTF8_CONT(c) (((unsigned char)(c) & 0xC0) == 0x80)
+
+static size_t charIndexSize(size_t numOffsets) {
+    return sizeof(StringCharIndex) + numOffsets * sizeof(size_t);
+}
+
+void freeStringCharIndex(ObjString *str) {
+    FREE_ARRAY(char, (char*)str->charIndex, charIndexSize(str->charIndex->numOffsets));
+    str->charIndex = NULL;
+}
+
+// Finds out if `str` is ASCII, UTF-8 or neither. For UTF-8 strings with
+// multibyte characters it also builds the character index.
+static void computeStringEncoding(ObjString *str) {
+    size_t ascii = strAsciiSpan(str->chars, str->length);
+    if (ascii == str->length) {
+        str->encoding = STRING_ENC_ASCII;
+        return;
+    }
+    if (!strValidUtf8(str->chars + ascii, str->length - ascii)) {
+        str->encoding = STRING_ENC_BINARY;
+        return;
+    }
+    // there are no more characters than bytes
+    size_t numOffsets = str->length / STRING_CHAR_INDEX_STRIDE + 1;
+    StringCharIndex *index = (StringCharIndex*)ALLOCATE(char, charIndexSize(numOffsets));
+    index->numOffsets = numOffsets;
+    size_t charIdx = 0;
+    for (; charIdx < ascii; charIdx += STRING_CHAR_INDEX_STRIDE) {
+        index->byteOffsets[charIdx / STRING_CHAR_INDEX_STRIDE] = charIdx;
+    }
+    charIdx = ascii;
+    for (size_t i = ascii; i < str->length; i++) {
+        if (IS_UTF8_CONT(str->chars[i])) continue;
+        if (charIdx % STRING_CHAR_INDEX_STRIDE == 0) {
+            index->byteOffsets[charIdx / STRING_CHAR_INDEX_STRIDE] = i;
+        }
+        charIdx++;
+    }
+    index->charLength = charIdx;
+    str->charIndex = index;
+    str->encoding = STRING_ENC_UTF8;
+}
+
+static inline bool stringHasMultibyteChars(ObjString *str) {
+    if (UNLIKELY(str->encoding == STRING_ENC_UNKNOWN)) {
+        computeStringEncoding(str);
+    }
+    return str->encoding == STRING_ENC_UTF8;
+}
+
+size_t stringCharLength(ObjString *str) {
+    if (!stringHasMultibyteChars(str)) return str->length;
+    return str->charIndex->charLength;
+}
+
+size_t stringCharOffset(ObjString *str, size_t charIdx) {
+    if (!stringHasMultibyteChars(str)) {
+        return charIdx < str->length ? charIdx : str->length;
+    }
+    StringCharIndex *index = str->charIndex;
+    if (charIdx >= index->charLength) return str->length;
+    size_t i = index->byteOffsets[charIdx / STRING_CHAR_INDEX_STRIDE];
+    for (size_t n = charIdx % STRING_CHAR_INDEX_STRIDE; n > 0; n--) {
+        i++;
+        while (IS_UTF8_CONT(str->chars[i])) i++;
+    }
+    return i;
+}
+
+size_t stringCharIndexAt(ObjString *str, size_t byteOffset) {
+    if (!stringHasMultibyteChars(str)) return byteOffset;
+    StringCharIndex *index = str->charIndex;
+    size_t numUsed = (index->charLength + STRING_CHAR_INDEX_STRIDE - 1) / STRING_CHAR_INDEX_STRIDE;
+    // last indexed character at or before `byteOffset`
+    size_t lo = 0, hi = numUsed;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (index->byteOffsets[mid] <= byteOffset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t charIdx = lo * STRING_CHAR_INDEX_STRIDE;
+    for (size_t i = index->byteOffsets[lo]; i < byteOffset && i < str->length; i++) {
+        if (!IS_UTF8_CONT(str->chars[i])) charIdx++;
+    }
+    return charIdx;
+}
+
+size_t stringCharWidth(ObjString *str, size_t byteOffset) {
+    if (byteOffset >= str->length) return 0;
+    if (!stringHasMultibyteChars(str)) return 1;
+    size_t i = byteOffset + 1;
+    while (i < str->length && IS_UTF8_CONT(str->chars[i])) i++;
+    return i - byteOffset;
+}
+
+// ASCII characters share the chars of an interned string
+ObjString *stringCharAt(ObjString *str, size_t byteOffset, size_t width) {
+    char *chars = str->chars + byteOffset;
+    if (width == 1 && (unsigned char)chars[0] < 0x80 && chars[0] != '\0') {
+        return stringLiteralCopy(INTERNED(chars, 1));
+    }
+    return copyString(chars, width, NEWOBJ_FLAG_NONE);
+}
+
 bool stringEquals(Value a, Value b) {
     ASSERT(IS_STRING(a));
     if (!IS_STRING(b)) return false;
@@ -1026,9 +1308,9 @@ Value newMap(void) {
 Value mapDup(Value other) {
     Value ret = newMap();
     Table *otherMap = AS_MAP(other)->table;
+    tableCopy(otherMap, AS_MAP(ret)->table);
     Entry e; int eidx = 0;
     TABLE_FOREACH(otherMap, e, eidx, {
-        mapSet(ret, e.key, e.value);
         OBJ_WRITE(ret, e.key);
         OBJ_WRITE(ret, e.value);
     })
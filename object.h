@@ -67,6 +67,7 @@ struct Upvalue;
 #define OBJ_FLAG_USER1 (1 << 10)
 #define OBJ_FLAG_USER2 (1 << 11)
 #define OBJ_FLAG_USER3 (1 << 12)
+#define OBJ_FLAG_USER4 (1 << 13)
 
 #define OBJ_HAS_FLAG(obj, name) ((((Obj*)obj)->flags & OBJ_FLAG_##name) != 0)
 #define OBJ_SET_FLAG(obj, name) (((Obj*)obj)->flags |= OBJ_FLAG_##name)
@@ -101,6 +102,9 @@ struct Upvalue;
 #define OBJ_HAS_USER3_FLAG(obj) OBJ_HAS_FLAG(obj, USER3)
 #define OBJ_SET_USER3_FLAG(obj) OBJ_SET_FLAG(obj, USER3)
 #define OBJ_UNSET_USER3_FLAG(obj) OBJ_UNSET_FLAG(obj, USER3)
+#define OBJ_HAS_USER4_FLAG(obj) OBJ_HAS_FLAG(obj, USER4)
+#define OBJ_SET_USER4_FLAG(obj) OBJ_SET_FLAG(obj, USER4)
+#define OBJ_UNSET_USER4_FLAG(obj) OBJ_UNSET_FLAG(obj, USER4)
 
 // basic object structure that all objects (values of VAL_T_OBJ type)
 typedef struct Obj {
@@ -139,16 +143,22 @@ typedef struct ObjFunction {
   struct sNode *funcNode;
   struct sNode *programNode;
   struct Upvalue *upvaluesInfo;
+  struct Upvalue *capturedInfo; // NULL if capturedCount is 0
   unsigned short arity; // number of required args
   unsigned short numDefaultArgs; // number of optional default args
   unsigned short numKwargs;
   unsigned short upvalueCount;
+  unsigned short capturedCount; // variables copied into the closure by value
   int localCount;
+  int kwargsEnd; // ip offset after the default code of all params
   bool isSingletonMethod;
   bool hasRestArg;
   bool hasBlockArg;
   bool isBlock;
   bool hasReceiver;
+  bool isSimple; // only required params, can be called by OP_CALL_SIMPLE
+  int jitCounter; // calls and loop iterations, see jitCountUse()
+  struct JitCode *jitCode; // NULL if not compiled to native code
 } ObjFunction;
 
 typedef struct LocalsTable {
@@ -183,17 +193,45 @@ typedef struct ObjClosure {
   ObjFunction *function;
   ObjUpvalue **upvalues;
   int upvalueCount; // always same as function->upvalueCount
+  // Values of the captured variables that are never assigned, copied when
+  // the closure is made. They need no ObjUpvalue.
+  Value *captured;
+  int capturedCount; // always same as function->capturedCount
   bool isBlock;
 } ObjClosure;
 
 typedef Value (*NativeFn)(int argCount, Value *args);
 
+// Natives that don't call back into Lox code, release the GVL or look at
+// their call frame (callInfo, blocks, this). OP_CALL_SIMPLE and
+// OP_INVOKE_SIMPLE call them without pushing a frame, so errors they throw
+// are raised from the calling frame.
+#define NATIVE_FL_LEAF 1
+// Natives that take keyword arguments. They get a Map of the ones given (or
+// nil) at args[argCount], after the positional arguments.
+#define NATIVE_FL_KWARGS 2
+
+// Block-taking iterators that the VM's dispatch loop runs itself when given a
+// block literal, so calling the block is a frame push (see startLoopIter()).
+// The native runs when it can't, ex: for a &block argument.
+typedef enum LoopIterOp {
+  LOOP_ITER_NONE = 0,
+  LOOP_ITER_EACH,
+  LOOP_ITER_MAP,
+  LOOP_ITER_SELECT,
+  LOOP_ITER_REJECT,
+  LOOP_ITER_FIND,
+  LOOP_ITER_REDUCE,
+} LoopIterOp;
+
 typedef struct ObjNative {
   Obj object;
   NativeFn function;
   struct ObjString *name;
   Obj *klass; // class or module, if a method
   bool isStatic; // if static method
+  unsigned flags; // NATIVE_FL_*
+  LoopIterOp loopIter;
 } ObjNative;
 
 #define CLASSINFO(klass) (((ObjClass*) (klass))->classInfo)
@@ -268,6 +306,8 @@ typedef struct ObjInstance {
 #define STRING_FLAG_STATIC OBJ_FLAG_USER1
 #define STRING_FLAG_INTERNED OBJ_FLAG_USER2
 #define STRING_FLAG_SHARED OBJ_FLAG_USER3
+// chars point into a read-only file mapping (see File.mmap), GC unmaps them
+#define STRING_FLAG_MMAPPED OBJ_FLAG_USER4
 
 #define STRING_IS_STATIC OBJ_HAS_USER1_FLAG
 #define STRING_SET_STATIC OBJ_SET_USER1_FLAG
@@ -280,6 +320,25 @@ typedef struct ObjInstance {
 #define STRING_IS_SHARED OBJ_HAS_USER3_FLAG
 #define STRING_SET_SHARED OBJ_SET_USER3_FLAG
 #define STRING_UNSET_SHARED OBJ_UNSET_USER3_FLAG
+
+#define STRING_IS_MMAPPED OBJ_HAS_USER4_FLAG
+#define STRING_SET_MMAPPED OBJ_SET_USER4_FLAG
+// What the bytes of a string hold, decides how it's indexed. Unless it's
+// UTF-8 with multibyte characters, characters are bytes.
+#define STRING_ENC_UNKNOWN 0
+#define STRING_ENC_ASCII 1
+#define STRING_ENC_UTF8 2
+#define STRING_ENC_BINARY 3 // not valid UTF-8
+
+// Byte offset of every STRING_CHAR_INDEX_STRIDE'th character of a UTF-8
+// string, so finding a character scans at most one stride of bytes.
+#define STRING_CHAR_INDEX_STRIDE 64
+typedef struct StringCharIndex {
+    size_t charLength;
+    size_t numOffsets;
+    size_t byteOffsets[];
+} StringCharIndex;
+
 typedef struct ObjString {
     Obj object;
     ObjClass *klass;
@@ -289,7 +348,12 @@ typedef struct ObjString {
     size_t length; // doesn't include NULL byte
     char *chars;
     uint32_t hash;
+    uint8_t encoding; // STRING_ENC_*, computed lazily like `hash`
     size_t capacity;
+    struct StringCharIndex *charIndex; // for UTF-8 strings, or NULL
+    // when SHARED, the string whose buffer `chars` points into, kept alive
+    // by this one. NULL if the buffer belongs to an interned string.
+    struct ObjString *parent;
 } ObjString;
 
 #define ARRAY_FLAG_SHARED OBJ_FLAG_USER1
@@ -482,10 +546,29 @@ typedef struct LxBinding {
 ObjString *takeString(char *chars, size_t length, int flags); // uses provided memory as internal buffer, must be heap memory or will error when GC'ing the object
 ObjString *copyString(char *chars, size_t length, int flags); // copies provided memory. Object lives on lox heap.
 ObjString *hiddenString(char *chars, size_t length, int flags); // hidden from GC, used in tests mainly.
+ObjString *stringLiteralCopy(ObjString *lit); // new string sharing the interned literal's chars
+ObjString *concatStrings(ObjString *a, ObjString *b); // new string, a followed by b
+ObjString *stringSuffix(ObjString *str, size_t start); // new string sharing str's chars from `start` on
+// new string for the NUL-terminated `length` chars at `chars`, which point
+// into the buffer of `owner`. `owner` must never be modified.
+ObjString *sharedSlice(ObjString *owner, char *chars, size_t length);
+// the frozen string owning `str`'s buffer, handing it over to one if needed
+// (`str` then copies it before it's next modified). NULL if interned.
+ObjString *sliceOwner(ObjString *str);
+ObjString *concatValues(Value *parts, int numParts); // new string from strings and primitives
+// uses provided read-only mapping as internal buffer. `mapSize` is the full size
+// of the mapping, which must be > length and zero-filled past `length`.
+// String is frozen, and the GC unmaps the memory when the string is freed.
+ObjString *mappedString(char *chars, size_t length, size_t mapSize, int flags);
 #define INTERN(chars) (internedString((char*)chars, strlen(chars), NEWOBJ_FLAG_NONE))
 #define INTERNED(chars, len) (internedString((char*)chars, len, NEWOBJ_FLAG_NONE))
 ObjString *internedString(char *chars, size_t length, int flags);
-bool objStringEquals(ObjString *a, ObjString *b);
+static inline bool objStringEquals(ObjString *a, ObjString *b) {
+    if (a == b) return true; // interned names
+    if (a->length != b->length) return false;
+    if (a->hash > 0 && b->hash > 0 && a->hash != b->hash) return false;
+    return memcmp(a->chars, b->chars, a->length) == 0;
+}
 static inline ObjString *dupString(ObjString *string) {
     return copyString(string->chars, string->length, NEWOBJ_FLAG_NONE);
 }
@@ -498,6 +581,21 @@ void clearString(Value self);
 void pushString(Value self, Value pushed);
 void stringInsertAt(Value self, Value insert, size_t at, bool replaceAt);
 Value stringSubstr(Value self, size_t startIdx, int len);
+// Characters of UTF-8 strings are codepoints, otherwise bytes
+size_t stringCharLength(ObjString *str);
+size_t stringCharOffset(ObjString *str, size_t charIdx); // byte offset of character, or length
+size_t stringCharIndexAt(ObjString *str, size_t byteOffset); // number of characters before byte offset
+size_t stringCharWidth(ObjString *str, size_t byteOffset); // size in bytes of character at byte offset
+ObjString *stringCharAt(ObjString *str, size_t byteOffset, size_t width); // new string for one character
+void freeStringCharIndex(ObjString *str);
+// Forgets what's cached about the contents of `str` after they change
+static inline void stringContentsChanged(ObjString *str) {
+    str->hash = 0;
+    if (UNLIKELY(str->charIndex != NULL)) {
+        freeStringCharIndex(str);
+    }
+    str->encoding = STRING_ENC_UNKNOWN;
+}
 Value stringIndexGet(Value self, size_t index);
 Value stringIndexSet(Value self, size_t index, char c);
 bool stringEquals(Value a, Value b);
@@ -507,6 +605,8 @@ bool stringEquals(Value a, Value b);
 // Map#rehash())
 void pushCString(ObjString *string, const char *chars, size_t lenToAdd);
 void insertCString(ObjString *a, const char *chars, size_t lenToAdd, size_t at, bool replaceAt);
+// replaces `delLen` bytes at `at` with `chars`
+void spliceCString(ObjString *string, size_t at, size_t delLen, const char *chars, size_t lenToAdd);
 void pushCStringFmt(ObjString *string, const char *format, ...);
 void pushCStringVFmt(ObjString *string, const char *format, va_list ap);
 uint32_t hashString(char *key, size_t length);
@@ -533,6 +633,7 @@ void setObjectFinalizer(ObjInstance *obj, Obj *callable);
 
 // arrays
 Value  newArray(void);
+Value  newArrayPair(Value a, Value b);
 Value  arrayFirst(Value aryVal);
 Value  arrayLast(Value aryVal);
 void   arrayPush(Value aryVal, Value el);
@@ -709,6 +810,7 @@ extern ObjClass *lxMutexClass;
 extern ObjModule *lxGCModule;
 extern ObjModule *lxProcessMod;
 extern ObjModule *lxSignalMod;
+extern ObjModule *lxWorkerPoolMod;
 extern ObjClass *lxIOClass;
 extern ObjClass *lxBindingClass;
 
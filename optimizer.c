@@ -0,0 +1,1670 @@
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include "optimizer.h"
+#include "chunk.h"
+#include "object.h"
+#include "memory.h"
+#include "options.h"
+#include "debug.h"
+
+// SSA-based optimizer. It runs on a function's instruction sequence after
+// the peephole passes in optimizeIseq().
+//
+// The instructions are split into basic blocks, and the local variable slots
+// are put in SSA form (Braun et al., "Simple and Efficient Construction of
+// Static Single Assignment Form"), so every read of a local knows which
+// store(s) it can see. Values on the operand stack are followed by simulating
+// each block's stack. From that, the passes are:
+//
+// * constant propagation of locals, and folding of numeric constants
+// * number type inference, for the specialized OP_*_NUM instructions
+// * common subexpression elimination of pure operations, within a block
+// * removal of unused pure expressions and of dead stores to locals
+// * copy propagation (`SET_LOCAL x; POP; GET_LOCAL x` => `SET_LOCAL x`)
+// * hoisting of pure loop-invariant expressions into a temporary local
+//
+// Locals that are closed over through an ObjUpvalue (Compiler.sharedSlots)
+// are left alone. Functions that can see their locals changed from outside
+// (eval, Binding, catch tables) or that have code entered in the middle
+// (default and keyword params) are skipped entirely. The debugger can still
+// show optimized values, run with --disable-bopt to debug.
+
+#define OPT_MAX_INSNS 4000
+#define OPT_MAX_ROUNDS 3
+
+typedef enum OptValKind {
+    OVAL_OPAQUE = 0, // unknown
+    OVAL_CONST, // OP_CONSTANT, OP_TRUE, OP_FALSE or OP_NIL
+    OVAL_OP, // result of an operator
+    OVAL_PHI,
+} OptValKind;
+
+// A value computed by the function
+typedef struct OptVal {
+    OptValKind kind;
+    bytecode_t code; // load instruction (OVAL_CONST) or generic opcode (OVAL_OP)
+    bytecode_t constIdx; // OP_CONSTANT's operand
+    Value constVal;
+    int a, b; // operands of OVAL_OP, b is -1 for unary ops
+    int def; // OVAL_PHI's definition
+    bool isNum;
+    int vn; // value number, -1 if not computed yet
+} OptVal;
+
+typedef enum OptDefKind {
+    ODEF_ENTRY = 0, // slot's value on function entry
+    ODEF_STORE,
+    ODEF_PHI,
+} OptDefKind;
+
+// A definition of a local variable slot
+typedef struct OptDef {
+    OptDefKind kind;
+    int slot;
+    int val;
+    int block; // -1 for ODEF_ENTRY
+    int replacedBy; // trivial phis are replaced by their only operand
+    vec_int_t ops; // ODEF_PHI operands, in the order of the block's preds
+    bool live;
+} OptDef;
+
+typedef struct OptBlock {
+    int start;
+    int end; // exclusive
+    vec_int_t preds; // -1 is the function's entry
+    int succs[2];
+    int numSuccs;
+    bool filled;
+    bool sealed;
+    vec_int_t incompletePhis;
+} OptBlock;
+
+typedef vec_t(OptVal) vec_optval_t;
+typedef vec_t(OptDef) vec_optdef_t;
+
+typedef struct OptStats {
+    int constProp;
+    int folded;
+    int specialized;
+    int cse;
+    int dce;
+    int dse;
+    int copyProp;
+    int hoisted;
+} OptStats;
+
+typedef struct OptFunc {
+    Compiler *compiler;
+    Iseq *seq;
+    int numInsns;
+    Insn **insns;
+    int *target; // index of the jump's target instruction, or -1
+    bool *pseudo; // the isLocal/index operand pairs after OP_CLOSURE
+    bool *rm; // removed by the current pass
+    int *blockOf;
+    int numBlocks;
+    OptBlock *blocks;
+    int numSlots;
+    int *curDefs; // [block*numSlots+slot]
+    int *entryDefs;
+    vec_optval_t vals;
+    vec_optdef_t defs;
+    vec_int_t extraUses; // defs read by something other than OP_GET_LOCAL
+    int *insnVal; // value pushed by the instruction, or -1
+    int *insnDef; // def read by OP_GET_LOCAL or written by OP_SET_LOCAL, or -1
+    int *stack;
+} OptFunc;
+
+// operand stack entry during the rewrite, spanning instructions [start, end]
+typedef struct OptEntry {
+    int val;
+    int start; // -1 if not known, ex: it was pushed by another block
+    int end;
+    bool pure; // the instructions can be removed without changing behavior
+    bool inv; // loop invariant
+} OptEntry;
+
+static bool isCondJump(bytecode_t code) {
+    switch (code) {
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE_PEEK:
+        case OP_JUMP_IF_TRUE_PEEK:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isBranch(bytecode_t code) {
+    return isCondJump(code) || code == OP_JUMP || code == OP_LOOP ||
+        code == OP_BREAK;
+}
+
+static bool isTerminator(bytecode_t code) {
+    switch (code) {
+        case OP_RETURN:
+        case OP_LEAVE:
+        case OP_THROW:
+        case OP_BLOCK_BREAK:
+        case OP_BLOCK_CONTINUE:
+        case OP_BLOCK_RETURN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bytecode_t genericOp(bytecode_t code) {
+    switch (code) {
+        case OP_ADD_NUM: return OP_ADD;
+        case OP_SUBTRACT_NUM: return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM: return OP_MULTIPLY;
+        case OP_DIVIDE_NUM: return OP_DIVIDE;
+        case OP_LESS_NUM: return OP_LESS;
+        case OP_GREATER_NUM: return OP_GREATER;
+        case OP_LESS_EQUAL_NUM: return OP_LESS_EQUAL;
+        case OP_GREATER_EQUAL_NUM: return OP_GREATER_EQUAL;
+        default: return code;
+    }
+}
+
+// specialized version of a generic instruction, or 0 if there isn't one
+static bytecode_t numOp(bytecode_t code) {
+    switch (code) {
+        case OP_ADD: return OP_ADD_NUM;
+        case OP_SUBTRACT: return OP_SUBTRACT_NUM;
+        case OP_MULTIPLY: return OP_MULTIPLY_NUM;
+        case OP_DIVIDE: return OP_DIVIDE_NUM;
+        case OP_LESS: return OP_LESS_NUM;
+        case OP_GREATER: return OP_GREATER_NUM;
+        case OP_LESS_EQUAL: return OP_LESS_EQUAL_NUM;
+        case OP_GREATER_EQUAL: return OP_GREATER_EQUAL_NUM;
+        default: return 0;
+    }
+}
+
+// operators that give a number when their operands are numbers
+static bool isArithOp(bytecode_t code) {
+    switch (code) {
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_BITOR:
+        case OP_BITAND:
+        case OP_BITXOR:
+        case OP_SHOVEL_L:
+        case OP_SHOVEL_R:
+        case OP_NEGATE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isBinaryOp(bytecode_t code) {
+    switch (code) {
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_BITOR:
+        case OP_BITAND:
+        case OP_BITXOR:
+        case OP_SHOVEL_L:
+        case OP_SHOVEL_R:
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_LESS_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Number of values the instruction pops and pushes. Returns false if it's not
+// known statically, then the stack simulation starts over after it.
+static bool stackEffect(Insn *in, int *pops, int *pushes) {
+    *pops = 0;
+    *pushes = 0;
+    switch (in->code) {
+        case OP_CONSTANT:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_CAPTURED:
+        case OP_GET_GLOBAL:
+        case OP_GET_CONST:
+        case OP_GET_THIS:
+        case OP_GET_SUPER:
+        case OP_STRING:
+        case OP_DUPARRAY:
+        case OP_DUPMAP:
+        case OP_REGEX:
+        case OP_CLOSURE:
+        case OP_ITER_NEXT:
+            *pushes = 1;
+            return true;
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_PROP_GET:
+        case OP_GET_CONST_UNDER:
+        case OP_TO_BLOCK:
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_SET_CONST:
+            *pops = 1;
+            *pushes = 1;
+            return true;
+        case OP_AND:
+        case OP_OR:
+        case OP_INDEX_GET:
+        case OP_PROP_SET:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_LESS_NUM:
+        case OP_GREATER_NUM:
+        case OP_LESS_EQUAL_NUM:
+        case OP_GREATER_EQUAL_NUM:
+            *pops = 2;
+            *pushes = 1;
+            return true;
+        case OP_INDEX_SET:
+            *pops = 3;
+            *pushes = 1;
+            return true;
+        case OP_ARRAY:
+        case OP_MAP:
+        case OP_STRING_INTERP:
+            *pops = (int)in->operands[0];
+            *pushes = 1;
+            return true;
+        case OP_CALL:
+        case OP_CALL_SIMPLE:
+        case OP_TAIL_CALL:
+            *pops = (int)in->operands[0]+1;
+            *pushes = 1;
+            return true;
+        case OP_INVOKE:
+        case OP_INVOKE_SIMPLE:
+        case OP_TAIL_INVOKE:
+            *pops = (int)in->operands[1]+1;
+            *pushes = 1;
+            return true;
+        case OP_POP:
+        case OP_POP_DEBUG:
+        case OP_PRINT:
+        case OP_DEFINE_GLOBAL:
+        case OP_CLOSE_UPVALUE:
+        case OP_THROW:
+        case OP_RETURN:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            *pops = 1;
+            return true;
+        case OP_POP_N:
+            *pops = (int)in->operands[0];
+            return true;
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_BREAK:
+        case OP_JUMP_IF_FALSE_PEEK:
+        case OP_JUMP_IF_TRUE_PEEK:
+        case OP_LEAVE:
+        case OP_BLOCK_BREAK:
+        case OP_BLOCK_CONTINUE:
+        case OP_BLOCK_RETURN:
+            return true;
+        default:
+            if (isBinaryOp(in->code)) {
+                *pops = 2;
+                *pushes = 1;
+                return true;
+            }
+            return false;
+    }
+}
+
+static inline OptVal *val(OptFunc *f, int v) {
+    return &f->vals.data[v];
+}
+
+static inline OptDef *def(OptFunc *f, int d) {
+    return &f->defs.data[d];
+}
+
+static inline bool isShared(OptFunc *f, int slot) {
+    return f->compiler->sharedSlots[slot];
+}
+
+static int newVal(OptFunc *f, OptValKind kind, bytecode_t code) {
+    OptVal v;
+    memset(&v, 0, sizeof(v));
+    v.kind = kind;
+    v.code = code;
+    v.a = v.b = v.def = -1;
+    v.vn = -1;
+    vec_push(&f->vals, v);
+    return f->vals.length-1;
+}
+
+static int newConstVal(OptFunc *f, bytecode_t code, bytecode_t constIdx) {
+    int v = newVal(f, OVAL_CONST, code);
+    switch (code) {
+        case OP_CONSTANT:
+            val(f, v)->constIdx = constIdx;
+            val(f, v)->constVal = f->seq->constants->values[constIdx];
+            break;
+        case OP_TRUE:
+            val(f, v)->constVal = BOOL_VAL(true);
+            break;
+        case OP_FALSE:
+            val(f, v)->constVal = BOOL_VAL(false);
+            break;
+        default:
+            val(f, v)->constVal = NIL_VAL;
+            break;
+    }
+    return v;
+}
+
+static int newDef(OptFunc *f, OptDefKind kind, int slot, int v, int block) {
+    OptDef d;
+    memset(&d, 0, sizeof(d));
+    d.kind = kind;
+    d.slot = slot;
+    d.val = v;
+    d.block = block;
+    d.replacedBy = -1;
+    vec_init(&d.ops);
+    vec_push(&f->defs, d);
+    return f->defs.length-1;
+}
+
+static int findDef(OptFunc *f, int d) {
+    while (def(f, d)->replacedBy >= 0) {
+        d = def(f, d)->replacedBy;
+    }
+    return d;
+}
+
+// Values of phis that turned out to be trivial are the value of what they
+// were replaced by
+static int valFind(OptFunc *f, int v) {
+    while (v >= 0 && val(f, v)->kind == OVAL_PHI) {
+        int d = findDef(f, val(f, v)->def);
+        if (d == val(f, v)->def) break;
+        v = def(f, d)->val;
+    }
+    return v;
+}
+
+static int entryDef(OptFunc *f, int slot) {
+    if (f->entryDefs[slot] < 0) {
+        f->entryDefs[slot] = newDef(f, ODEF_ENTRY, slot,
+            newVal(f, OVAL_OPAQUE, 0), -1);
+    }
+    return f->entryDefs[slot];
+}
+
+static inline void writeVariable(OptFunc *f, int slot, int block, int d) {
+    f->curDefs[block*f->numSlots+slot] = d;
+}
+
+static int readVariable(OptFunc *f, int slot, int block);
+
+static int newPhi(OptFunc *f, int slot, int block) {
+    int v = newVal(f, OVAL_PHI, 0);
+    int d = newDef(f, ODEF_PHI, slot, v, block);
+    val(f, v)->def = d;
+    return d;
+}
+
+static int tryRemoveTrivialPhi(OptFunc *f, int phi) {
+    int same = -1;
+    OptDef *d = def(f, phi);
+    for (int i = 0; i < d->ops.length; i++) {
+        int op = findDef(f, d->ops.data[i]);
+        if (op == same || op == phi) continue;
+        if (same >= 0) return phi; // merges at least 2 values
+        same = op;
+    }
+    if (same < 0) {
+        same = entryDef(f, def(f, phi)->slot); // unreachable
+    }
+    def(f, phi)->replacedBy = same;
+    return same;
+}
+
+static int addPhiOperands(OptFunc *f, int phi) {
+    OptBlock *blk = &f->blocks[def(f, phi)->block];
+    int slot = def(f, phi)->slot;
+    for (int i = 0; i < blk->preds.length; i++) {
+        int op = readVariable(f, slot, blk->preds.data[i]);
+        vec_push(&def(f, phi)->ops, op);
+    }
+    return tryRemoveTrivialPhi(f, phi);
+}
+
+static int readVariableRecursive(OptFunc *f, int slot, int block) {
+    OptBlock *blk = &f->blocks[block];
+    int d;
+    if (!blk->sealed) {
+        d = newPhi(f, slot, block);
+        vec_push(&blk->incompletePhis, d);
+    } else if (blk->preds.length == 1) {
+        d = readVariable(f, slot, blk->preds.data[0]);
+    } else {
+        d = newPhi(f, slot, block);
+        writeVariable(f, slot, block, d); // breaks cycles
+        d = addPhiOperands(f, d);
+    }
+    writeVariable(f, slot, block, d);
+    return d;
+}
+
+static int readVariable(OptFunc *f, int slot, int block) {
+    if (block < 0) {
+        return entryDef(f, slot);
+    }
+    int d = f->curDefs[block*f->numSlots+slot];
+    if (d >= 0) {
+        return findDef(f, d);
+    }
+    return readVariableRecursive(f, slot, block);
+}
+
+static void sealBlock(OptFunc *f, int block) {
+    OptBlock *blk = &f->blocks[block];
+    blk->sealed = true;
+    for (int i = 0; i < blk->incompletePhis.length; i++) {
+        addPhiOperands(f, blk->incompletePhis.data[i]);
+    }
+}
+
+static bool predsFilled(OptFunc *f, int block) {
+    OptBlock *blk = &f->blocks[block];
+    for (int i = 0; i < blk->preds.length; i++) {
+        int p = blk->preds.data[i];
+        if (p >= 0 && !f->blocks[p].filled) return false;
+    }
+    return true;
+}
+
+static ObjFunction *closureFunction(OptFunc *f, Insn *in) {
+    Value funcVal = f->seq->constants->values[in->operands[0]];
+    ASSERT(IS_FUNCTION(funcVal));
+    return AS_FUNCTION(funcVal);
+}
+
+static void freeOptFunc(OptFunc *f) {
+    for (int i = 0; i < f->numBlocks; i++) {
+        vec_deinit(&f->blocks[i].preds);
+        vec_deinit(&f->blocks[i].incompletePhis);
+    }
+    for (int i = 0; i < f->defs.length; i++) {
+        vec_deinit(&f->defs.data[i].ops);
+    }
+    vec_deinit(&f->vals);
+    vec_deinit(&f->defs);
+    vec_deinit(&f->extraUses);
+    xfree(f->insns);
+    xfree(f->target);
+    xfree(f->pseudo);
+    xfree(f->rm);
+    xfree(f->blockOf);
+    xfree(f->blocks);
+    xfree(f->curDefs);
+    xfree(f->entryDefs);
+    xfree(f->insnVal);
+    xfree(f->insnDef);
+    xfree(f->stack);
+    memset(f, 0, sizeof(*f));
+}
+
+// Builds the instruction array and the CFG. Returns false if the function
+// can't be optimized.
+static bool buildCFG(OptFunc *f) {
+    Iseq *seq = f->seq;
+    int n = seq->count;
+    if (n == 0 || n > OPT_MAX_INSNS) return false;
+    f->numInsns = n;
+    f->insns = xcalloc(n, sizeof(Insn*));
+    f->target = xcalloc(n, sizeof(int));
+    f->pseudo = xcalloc(n, sizeof(bool));
+    f->rm = xcalloc(n, sizeof(bool));
+    f->blockOf = xcalloc(n, sizeof(int));
+    f->insnVal = xcalloc(n, sizeof(int));
+    f->insnDef = xcalloc(n, sizeof(int));
+    f->stack = xcalloc(n+1, sizeof(int));
+    ASSERT_MEM(f->insns && f->target && f->pseudo && f->rm && f->blockOf &&
+        f->insnVal && f->insnDef && f->stack);
+    vec_init(&f->vals);
+    vec_init(&f->defs);
+    vec_init(&f->extraUses);
+
+    int *pos = xcalloc(n, sizeof(int));
+    // the peephole optimizer doesn't always keep seq->wordCount up to date
+    int totalWords = 0;
+    for (Insn *in = seq->insns; in; in = in->next) {
+        totalWords += in->numOperands+1;
+    }
+    int *atWord = xcalloc(totalWords+1, sizeof(int));
+    ASSERT_MEM(pos && atWord);
+    for (int i = 0; i <= totalWords; i++) atWord[i] = -1;
+    bool ok = true;
+    int numSlots = f->compiler->localCountMax;
+    int pseudoLeft = 0;
+    int words = 0;
+    int i = 0;
+    for (Insn *in = seq->insns; in; in = in->next, i++) {
+        f->insns[i] = in;
+        f->target[i] = -1;
+        f->insnVal[i] = -1;
+        f->insnDef[i] = -1;
+        pos[i] = words;
+        atWord[words] = i;
+        words += in->numOperands+1;
+        if (pseudoLeft > 0) {
+            f->pseudo[i] = true;
+            pseudoLeft--;
+            continue;
+        }
+        int maxSlot = -1;
+        switch (in->code) {
+            case OP_CLOSURE: {
+                ObjFunction *func = closureFunction(f, in);
+                pseudoLeft = 2*(func->upvalueCount+func->capturedCount);
+                break;
+            }
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_UNPACK_SET_LOCAL:
+                maxSlot = in->operands[0];
+                break;
+            case OP_ITER:
+                maxSlot = in->operands[0]+1;
+                break;
+            case OP_ITER_NEXT:
+                maxSlot = in->operands[0]+in->operands[1]-1;
+                break;
+            case OP_GET_THROWN:
+            case OP_RETHROW_IF_ERR:
+            case OP_CHECK_KEYWORD:
+                ok = false;
+                break;
+            default:
+                break;
+        }
+        if (maxSlot >= numSlots) numSlots = maxSlot+1;
+    }
+    ASSERT(i == n);
+    if (numSlots > LX_MAX_LOCALS) ok = false;
+    f->numSlots = numSlots;
+
+    // jump targets
+    for (i = 0; ok && i < n; i++) {
+        if (f->pseudo[i] || !isBranch(f->insns[i]->code)) continue;
+        Insn *in = f->insns[i];
+        int t;
+        if (in->code == OP_LOOP) {
+            t = pos[i] - (int)in->operands[0];
+        } else if (in->code == OP_BREAK) {
+            t = pos[i] + (int)in->operands[0];
+        } else {
+            t = pos[i] + 1 + (int)in->operands[0];
+        }
+        if (t < 0 || t >= words || atWord[t] < 0 || f->pseudo[atWord[t]]) {
+            ok = false;
+            break;
+        }
+        f->target[i] = atWord[t];
+    }
+    xfree(pos);
+    xfree(atWord);
+    if (!ok) return false;
+
+    // basic blocks
+    bool *leader = xcalloc(n, sizeof(bool));
+    ASSERT_MEM(leader);
+    leader[0] = true;
+    for (i = 0; i < n; i++) {
+        if (f->pseudo[i]) continue;
+        if (f->target[i] >= 0) leader[f->target[i]] = true;
+        bytecode_t code = f->insns[i]->code;
+        if ((isBranch(code) || isTerminator(code)) && i+1 < n) {
+            leader[i+1] = true;
+        }
+    }
+    int numBlocks = 0;
+    for (i = 0; i < n; i++) {
+        if (leader[i]) numBlocks++;
+    }
+    f->numBlocks = numBlocks;
+    f->blocks = xcalloc(numBlocks, sizeof(OptBlock));
+    ASSERT_MEM(f->blocks);
+    int b = -1;
+    for (i = 0; i < n; i++) {
+        if (leader[i]) {
+            b++;
+            f->blocks[b].start = i;
+            vec_init(&f->blocks[b].preds);
+            vec_init(&f->blocks[b].incompletePhis);
+        }
+        f->blockOf[i] = b;
+        f->blocks[b].end = i+1;
+    }
+    xfree(leader);
+    for (b = 0; b < numBlocks; b++) {
+        OptBlock *blk = &f->blocks[b];
+        int last = blk->end-1;
+        bytecode_t code = f->insns[last]->code;
+        bool fallsThrough = true;
+        if (!f->pseudo[last]) {
+            if (code == OP_JUMP || code == OP_LOOP || code == OP_BREAK) {
+                blk->succs[blk->numSuccs++] = f->blockOf[f->target[last]];
+                fallsThrough = false;
+            } else if (isCondJump(code)) {
+                blk->succs[blk->numSuccs++] = f->blockOf[f->target[last]];
+            } else if (isTerminator(code)) {
+                fallsThrough = false;
+            }
+        }
+        if (fallsThrough && b+1 < numBlocks &&
+                (blk->numSuccs == 0 || blk->succs[0] != b+1)) {
+            blk->succs[blk->numSuccs++] = b+1;
+        }
+    }
+    vec_push(&f->blocks[0].preds, -1);
+    for (b = 0; b < numBlocks; b++) {
+        for (int s = 0; s < f->blocks[b].numSuccs; s++) {
+            vec_push(&f->blocks[f->blocks[b].succs[s]].preds, b);
+        }
+    }
+    return true;
+}
+
+// Simulates the block's operand stack to find the values each instruction
+// pushes, and builds the SSA form of the locals along the way.
+static void fillBlock(OptFunc *f, int b) {
+    OptBlock *blk = &f->blocks[b];
+    int *stack = f->stack;
+    int sp = 0;
+#define SIM_PUSH(v) (stack[sp++] = (v))
+#define SIM_POP() (sp > 0 ? stack[--sp] : newVal(f, OVAL_OPAQUE, 0))
+    for (int i = blk->start; i < blk->end; i++) {
+        if (f->pseudo[i]) continue;
+        Insn *in = f->insns[i];
+        bytecode_t code = in->code;
+        int v = -1;
+        switch (code) {
+            case OP_CONSTANT:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_NIL:
+                v = newConstVal(f, code, code == OP_CONSTANT ? in->operands[0] : 0);
+                SIM_PUSH(v);
+                break;
+            case OP_GET_LOCAL: {
+                int slot = in->operands[0];
+                if (isShared(f, slot)) {
+                    v = newVal(f, OVAL_OPAQUE, code);
+                } else {
+                    int d = readVariable(f, slot, b);
+                    f->insnDef[i] = d;
+                    v = def(f, d)->val;
+                }
+                SIM_PUSH(v);
+                break;
+            }
+            case OP_SET_LOCAL: {
+                int slot = in->operands[0];
+                if (sp == 0) SIM_PUSH(newVal(f, OVAL_OPAQUE, 0));
+                if (!isShared(f, slot)) {
+                    int d = newDef(f, ODEF_STORE, slot, stack[sp-1], b);
+                    writeVariable(f, slot, b, d);
+                    f->insnDef[i] = d;
+                }
+                break;
+            }
+            case OP_UNPACK_SET_LOCAL: {
+                int slot = in->operands[0];
+                sp = 0; // can push nils
+                if (!isShared(f, slot)) {
+                    writeVariable(f, slot, b, newDef(f, ODEF_STORE, slot,
+                        newVal(f, OVAL_OPAQUE, code), b));
+                }
+                break;
+            }
+            case OP_ITER: {
+                int slot = in->operands[0];
+                sp = 0; // can push nils
+                for (int s = slot; s < slot+2; s++) {
+                    if (isShared(f, s)) continue;
+                    writeVariable(f, s, b, newDef(f, ODEF_STORE, s,
+                        newVal(f, OVAL_OPAQUE, code), b));
+                }
+                break;
+            }
+            case OP_ITER_NEXT: {
+                // reads the iterable and cursor, sets the cursor and the
+                // loop variables
+                int slot = in->operands[0];
+                int numVars = in->operands[1];
+                for (int s = slot-2; s < slot; s++) {
+                    if (s >= 0 && !isShared(f, s)) {
+                        vec_push(&f->extraUses, readVariable(f, s, b));
+                    }
+                }
+                for (int s = slot-1; s < slot+numVars; s++) {
+                    if (s < 0 || isShared(f, s)) continue;
+                    writeVariable(f, s, b, newDef(f, ODEF_STORE, s,
+                        newVal(f, OVAL_OPAQUE, code), b));
+                }
+                v = newVal(f, OVAL_OPAQUE, code);
+                SIM_PUSH(v);
+                break;
+            }
+            case OP_CLOSURE: {
+                // values captured by copy are read from the slots
+                ObjFunction *func = closureFunction(f, in);
+                int p = i+1+2*func->upvalueCount;
+                for (int c = 0; c < func->capturedCount; c++, p += 2) {
+                    bool isLocal = f->insns[p]->code;
+                    int slot = f->insns[p+1]->code;
+                    if (isLocal && !isShared(f, slot)) {
+                        vec_push(&f->extraUses, readVariable(f, slot, b));
+                    }
+                }
+                v = newVal(f, OVAL_OPAQUE, code);
+                SIM_PUSH(v);
+                break;
+            }
+            case OP_NEGATE:
+            case OP_NOT: {
+                int a = SIM_POP();
+                v = newVal(f, OVAL_OP, code);
+                val(f, v)->a = a;
+                SIM_PUSH(v);
+                break;
+            }
+            default: {
+                bytecode_t gcode = genericOp(code);
+                if (isBinaryOp(gcode)) {
+                    int bv = SIM_POP();
+                    int av = SIM_POP();
+                    v = newVal(f, OVAL_OP, gcode);
+                    val(f, v)->a = av;
+                    val(f, v)->b = bv;
+                    SIM_PUSH(v);
+                    break;
+                }
+                int pops, pushes;
+                if (!stackEffect(in, &pops, &pushes)) {
+                    sp = 0;
+                    break;
+                }
+                sp -= (pops > sp ? sp : pops);
+                for (int p = 0; p < pushes; p++) {
+                    v = newVal(f, OVAL_OPAQUE, code);
+                    SIM_PUSH(v);
+                }
+                break;
+            }
+        }
+        f->insnVal[i] = v;
+    }
+#undef SIM_PUSH
+#undef SIM_POP
+}
+
+static void markLive(OptFunc *f, int d) {
+    vec_int_t work;
+    vec_init(&work);
+    vec_push(&work, d);
+    while (work.length > 0) {
+        int cur = findDef(f, vec_pop(&work));
+        if (def(f, cur)->live) continue;
+        def(f, cur)->live = true;
+        if (def(f, cur)->kind == ODEF_PHI) {
+            for (int i = 0; i < def(f, cur)->ops.length; i++) {
+                vec_push(&work, def(f, cur)->ops.data[i]);
+            }
+        }
+    }
+    vec_deinit(&work);
+}
+
+static bool isNumVal(OptFunc *f, int v) {
+    v = valFind(f, v);
+    return v >= 0 && val(f, v)->isNum;
+}
+
+// Optimistic number type inference: everything that can be a number starts
+// out as one, then values are demoted until nothing changes.
+static void inferTypes(OptFunc *f) {
+    for (int v = 0; v < f->vals.length; v++) {
+        OptVal *ov = val(f, v);
+        switch (ov->kind) {
+            case OVAL_CONST:
+                ov->isNum = IS_NUMBER(ov->constVal);
+                break;
+            case OVAL_OP:
+                ov->isNum = isArithOp(ov->code);
+                break;
+            case OVAL_PHI:
+                ov->isNum = true;
+                break;
+            default:
+                ov->isNum = false;
+                break;
+        }
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int v = 0; v < f->vals.length; v++) {
+            OptVal *ov = val(f, v);
+            if (!ov->isNum) continue;
+            bool isNum = true;
+            if (ov->kind == OVAL_OP) {
+                isNum = isNumVal(f, ov->a) && (ov->b < 0 || isNumVal(f, ov->b));
+            } else if (ov->kind == OVAL_PHI) {
+                OptDef *d = def(f, ov->def);
+                if (d->replacedBy >= 0) {
+                    isNum = isNumVal(f, def(f, findDef(f, ov->def))->val);
+                } else {
+                    for (int i = 0; i < d->ops.length && isNum; i++) {
+                        isNum = isNumVal(f, def(f, findDef(f, d->ops.data[i]))->val);
+                    }
+                }
+            }
+            if (!isNum) {
+                val(f, v)->isNum = false;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool analyze(OptFunc *f, Compiler *compiler) {
+    memset(f, 0, sizeof(*f));
+    f->compiler = compiler;
+    f->seq = &compiler->iseq;
+    if (!buildCFG(f)) {
+        freeOptFunc(f);
+        return false;
+    }
+    int cells = f->numBlocks*f->numSlots;
+    f->curDefs = xcalloc(cells > 0 ? cells : 1, sizeof(int));
+    f->entryDefs = xcalloc(f->numSlots > 0 ? f->numSlots : 1, sizeof(int));
+    ASSERT_MEM(f->curDefs && f->entryDefs);
+    for (int i = 0; i < cells; i++) f->curDefs[i] = -1;
+    for (int i = 0; i < f->numSlots; i++) f->entryDefs[i] = -1;
+
+    for (int b = 0; b < f->numBlocks; b++) {
+        if (!f->blocks[b].sealed && predsFilled(f, b)) {
+            sealBlock(f, b);
+        }
+        fillBlock(f, b);
+        f->blocks[b].filled = true;
+        for (int s = 0; s < f->blocks[b].numSuccs; s++) {
+            int succ = f->blocks[b].succs[s];
+            if (!f->blocks[succ].sealed && predsFilled(f, succ)) {
+                sealBlock(f, succ);
+            }
+        }
+    }
+    for (int b = 0; b < f->numBlocks; b++) {
+        if (!f->blocks[b].sealed) sealBlock(f, b);
+    }
+
+    // liveness of stores
+    for (int i = 0; i < f->numInsns; i++) {
+        if (!f->pseudo[i] && f->insns[i]->code == OP_GET_LOCAL && f->insnDef[i] >= 0) {
+            markLive(f, f->insnDef[i]);
+        }
+    }
+    for (int i = 0; i < f->extraUses.length; i++) {
+        markLive(f, f->extraUses.data[i]);
+    }
+    inferTypes(f);
+    return true;
+}
+
+// Value numbering. Equal constants and pure operators with the same operands
+// get the same number.
+typedef struct VNTable {
+    uint64_t *keys; // 2 per entry
+    int *nums;
+    int capa;
+    int next;
+} VNTable;
+
+static void initVNTable(VNTable *t, int numVals) {
+    t->capa = 64;
+    while (t->capa < numVals*2) t->capa <<= 1;
+    t->keys = xcalloc(t->capa*2, sizeof(uint64_t));
+    t->nums = xcalloc(t->capa, sizeof(int));
+    ASSERT_MEM(t->keys && t->nums);
+    for (int i = 0; i < t->capa; i++) t->nums[i] = -1;
+    t->next = 0;
+}
+
+static void freeVNTable(VNTable *t) {
+    xfree(t->keys);
+    xfree(t->nums);
+    memset(t, 0, sizeof(*t));
+}
+
+static int vnLookup(VNTable *t, uint64_t k1, uint64_t k2) {
+    uint64_t h = (k1 * 0x9E3779B97F4A7C15ULL) ^ (k2 + (k2 << 6) + (k1 >> 2));
+    int idx = (int)(h & (uint64_t)(t->capa-1));
+    while (t->nums[idx] >= 0) {
+        if (t->keys[idx*2] == k1 && t->keys[idx*2+1] == k2) {
+            return t->nums[idx];
+        }
+        idx = (idx+1) & (t->capa-1);
+    }
+    t->keys[idx*2] = k1;
+    t->keys[idx*2+1] = k2;
+    t->nums[idx] = t->next++;
+    return t->nums[idx];
+}
+
+static int vnOf(OptFunc *f, VNTable *t, int v) {
+    v = valFind(f, v);
+    if (v < 0) return -1;
+    if (val(f, v)->vn >= 0) return val(f, v)->vn;
+    OptVal *ov = val(f, v);
+    int vn;
+    if (ov->kind == OVAL_CONST) {
+        vn = vnLookup(t, ((uint64_t)1 << 56) | ov->code, (uint64_t)ov->constVal);
+    } else if (ov->kind == OVAL_OP) {
+        bytecode_t code = ov->code;
+        int a = vnOf(f, t, ov->a);
+        int b = ov->b >= 0 ? vnOf(f, t, ov->b) : -1;
+        vn = vnLookup(t, ((uint64_t)2 << 56) | ((uint64_t)code << 32) | (uint32_t)a,
+            (uint64_t)(uint32_t)(b+1));
+    } else {
+        vn = t->next++; // unique
+    }
+    val(f, v)->vn = vn;
+    return vn;
+}
+
+static bool isNumConstInsn(OptFunc *f, int i) {
+    Insn *in = f->insns[i];
+    return in->code == OP_CONSTANT &&
+        IS_NUMBER(f->seq->constants->values[in->operands[0]]);
+}
+
+static double numConstInsn(OptFunc *f, int i) {
+    return AS_NUMBER(f->seq->constants->values[f->insns[i]->operands[0]]);
+}
+
+// same as the VM does, see BINARY_OP
+static bool foldNumbers(bytecode_t code, double a, double b, double *out) {
+    switch (code) {
+        case OP_ADD: *out = a + b; return true;
+        case OP_SUBTRACT: *out = a - b; return true;
+        case OP_MULTIPLY: *out = a * b; return true;
+        case OP_DIVIDE:
+            if (b == 0.00) return false; // throws
+            *out = a / b;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether the operator can't have side effects or throw. Generic operators
+// call methods on instances, so their operands need to be numbers.
+static bool isPureOp(OptFunc *f, bytecode_t gcode, bool numA, bool numB, OptEntry *eb) {
+    switch (gcode) {
+        case OP_NOT:
+            return true;
+        case OP_NEGATE:
+            return numA;
+        case OP_DIVIDE:
+            return numA && numB && eb->start >= 0 && eb->start == eb->end &&
+                isNumConstInsn(f, eb->start) && numConstInsn(f, eb->start) != 0.00;
+        case OP_MODULO: // the operands are cast to int
+            return numA && numB && eb->start >= 0 && eb->start == eb->end &&
+                isNumConstInsn(f, eb->start) && fabs(numConstInsn(f, eb->start)) >= 1.0;
+        default:
+            return isBinaryOp(gcode) && numA && numB;
+    }
+}
+
+// every instruction in (a, b) was removed
+static bool adjacent(OptFunc *f, int a, int b) {
+    for (int i = a+1; i < b; i++) {
+        if (!f->rm[i]) return false;
+    }
+    return true;
+}
+
+static int nextInsn(OptFunc *f, int i) {
+    for (i = i+1; i < f->numInsns; i++) {
+        if (!f->rm[i] && !f->pseudo[i]) return i;
+    }
+    return -1;
+}
+
+static int prevInsn(OptFunc *f, int i, int start) {
+    for (i = i-1; i >= start; i--) {
+        if (!f->rm[i] && !f->pseudo[i]) return i;
+    }
+    return -1;
+}
+
+// last instruction of the one at `i`, including OP_CLOSURE's operand pairs
+static int insnEnd(OptFunc *f, int i) {
+    while (i+1 < f->numInsns && f->pseudo[i+1]) i++;
+    return i;
+}
+
+static void setInsn(Insn *in, bytecode_t code, int numOperands, bytecode_t op1, bytecode_t op2) {
+    in->code = code;
+    in->numOperands = numOperands;
+    in->operands[0] = op1;
+    in->operands[1] = op2;
+    in->flags &= ~INSN_FL_NUMBER;
+}
+
+// Constant propagation and folding, number specialization, CSE, removal of
+// unused expressions and dead stores, and copy propagation. Returns the
+// number of changes.
+static int rewrite(OptFunc *f, OptStats *stats) {
+    int changes = 0;
+    int ns = f->numSlots;
+    OptEntry *stack = xcalloc(f->numInsns+1, sizeof(OptEntry));
+    int *slotVal = xcalloc(ns > 0 ? ns : 1, sizeof(int));
+    bytecode_t *slotName = xcalloc(ns > 0 ? ns : 1, sizeof(bytecode_t));
+    VNTable vnt;
+    initVNTable(&vnt, f->vals.length);
+    ASSERT_MEM(stack && slotVal && slotName);
+    bool canRmExprs = !compilerOpts.noRemoveUnusedExpressions &&
+        f->compiler->type != FUN_TYPE_BLOCK;
+    OptEntry unknown = { .val = -1, .start = -1, .end = -1, .pure = false, .inv = false };
+
+#define ENT_PUSH(e) (stack[sp++] = (e))
+#define ENT_POP() (sp > 0 ? stack[--sp] : unknown)
+
+    for (int b = 0; b < f->numBlocks; b++) {
+        OptBlock *blk = &f->blocks[b];
+        int sp = 0;
+        for (int s = 0; s < ns; s++) slotVal[s] = -1;
+        for (int i = blk->start; i < blk->end; i++) {
+            if (f->pseudo[i] || f->rm[i]) continue;
+            Insn *in = f->insns[i];
+            bytecode_t code = in->code;
+            bytecode_t gcode = genericOp(code);
+            int v = valFind(f, f->insnVal[i]);
+
+            switch (gcode) {
+            case OP_CONSTANT:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_NIL:
+            case OP_GET_CAPTURED:
+            case OP_GET_THIS: {
+                OptEntry e = { .val = v, .start = i, .end = i, .pure = true, .inv = true };
+                ENT_PUSH(e);
+                break;
+            }
+            case OP_GET_UPVALUE: {
+                OptEntry e = { .val = v, .start = i, .end = i, .pure = true, .inv = false };
+                ENT_PUSH(e);
+                break;
+            }
+            case OP_GET_LOCAL: {
+                int slot = in->operands[0];
+                OptEntry e = { .val = v, .start = i, .end = i, .pure = true, .inv = false };
+                if (!isShared(f, slot)) {
+                    slotVal[slot] = v;
+                    slotName[slot] = in->operands[1];
+                    if (v >= 0 && val(f, v)->kind == OVAL_CONST) {
+                        OptVal *cv = val(f, v);
+                        if (cv->code == OP_CONSTANT) {
+                            setInsn(in, OP_CONSTANT, 1, cv->constIdx, 0);
+                            if (IS_NUMBER(cv->constVal)) in->flags |= INSN_FL_NUMBER;
+                        } else {
+                            setInsn(in, cv->code, 0, 0, 0);
+                        }
+                        stats->constProp++;
+                        changes++;
+                    }
+                }
+                ENT_PUSH(e);
+                break;
+            }
+            case OP_SET_LOCAL: {
+                int slot = in->operands[0];
+                if (sp == 0) ENT_PUSH(unknown);
+                OptEntry *e = &stack[sp-1];
+                e->end = i;
+                if (isShared(f, slot)) {
+                    e->pure = false;
+                    break;
+                }
+                ASSERT(f->insnDef[i] >= 0);
+                if (!def(f, f->insnDef[i])->live) { // dead store
+                    f->rm[i] = true;
+                    slotVal[slot] = -1;
+                    stats->dse++;
+                    changes++;
+                    break;
+                }
+                slotVal[slot] = e->val;
+                slotName[slot] = in->operands[1];
+                e->pure = false;
+                break;
+            }
+            case OP_POP: {
+                // SET_LOCAL x; POP; GET_LOCAL x => SET_LOCAL x
+                int prev = prevInsn(f, i, blk->start);
+                int next = nextInsn(f, i);
+                if (prev >= 0 && next >= 0 && next < blk->end &&
+                        f->insns[prev]->code == OP_SET_LOCAL &&
+                        f->insns[next]->code == OP_GET_LOCAL &&
+                        f->insns[prev]->operands[0] == f->insns[next]->operands[0] &&
+                        !isShared(f, f->insns[next]->operands[0]) &&
+                        !in->isLabel && !f->insns[next]->isLabel) {
+                    f->rm[i] = true;
+                    f->rm[next] = true;
+                    if (sp > 0) stack[sp-1].end = next;
+                    stats->copyProp++;
+                    changes++;
+                    i = next;
+                    break;
+                }
+                OptEntry e = ENT_POP();
+                if (canRmExprs && e.pure && e.start >= 0 && adjacent(f, e.end, i) &&
+                        (next < 0 || f->insns[next]->code != OP_BLOCK_CONTINUE)) {
+                    for (int k = e.start; k <= i; k++) {
+                        f->rm[k] = true;
+                    }
+                    stats->dce++;
+                    changes++;
+                }
+                break;
+            }
+            case OP_NEGATE:
+            case OP_NOT:
+            default: {
+                bool unary = gcode == OP_NEGATE || gcode == OP_NOT;
+                if (!unary && !isBinaryOp(gcode)) {
+                    int pops, pushes;
+                    if (!stackEffect(in, &pops, &pushes)) {
+                        sp = 0;
+                        if (code == OP_UNPACK_SET_LOCAL || code == OP_ITER) {
+                            for (int s = 0; s < ns; s++) slotVal[s] = -1;
+                        }
+                        break;
+                    }
+                    if (code == OP_ITER_NEXT) {
+                        for (int s = 0; s < ns; s++) slotVal[s] = -1;
+                    }
+                    sp -= (pops > sp ? sp : pops);
+                    for (int p = 0; p < pushes; p++) {
+                        OptEntry e = { .val = v, .start = -1, .end = insnEnd(f, i), .pure = false, .inv = false };
+                        ENT_PUSH(e);
+                    }
+                    break;
+                }
+                OptEntry eb = unary ? unknown : ENT_POP();
+                OptEntry ea = ENT_POP();
+                bool numA = ea.val >= 0 && isNumVal(f, ea.val);
+                bool numB = !unary && eb.val >= 0 && isNumVal(f, eb.val);
+                bool contiguous;
+                if (unary) {
+                    contiguous = ea.start >= 0 && adjacent(f, ea.end, i);
+                } else {
+                    contiguous = ea.start >= 0 && eb.start >= 0 &&
+                        adjacent(f, ea.end, eb.start) && adjacent(f, eb.end, i);
+                }
+
+                // constant folding
+                double folded;
+                if (!unary && contiguous && ea.start == ea.end && eb.start == eb.end &&
+                        !f->insns[eb.start]->isLabel && !in->isLabel &&
+                        isNumConstInsn(f, ea.start) && isNumConstInsn(f, eb.start) &&
+                        foldNumbers(gcode, numConstInsn(f, ea.start),
+                            numConstInsn(f, eb.start), &folded)) {
+                    int constIdx = iseqAddConstant(f->seq, NUMBER_VAL(folded));
+                    setInsn(f->insns[ea.start], OP_CONSTANT, 1, constIdx, 0);
+                    f->insns[ea.start]->flags |= INSN_FL_NUMBER;
+                    f->rm[eb.start] = true;
+                    f->rm[i] = true;
+                    int cv = newConstVal(f, OP_CONSTANT, constIdx);
+                    val(f, cv)->isNum = true;
+                    OptEntry e = { .val = cv, .start = ea.start, .end = i, .pure = true, .inv = true };
+                    ENT_PUSH(e);
+                    stats->folded++;
+                    changes++;
+                    break;
+                }
+
+                bytecode_t spec = numOp(gcode);
+                if (spec && code != spec && (numA || numB)) {
+                    in->code = spec;
+                    stats->specialized++;
+                    changes++;
+                }
+
+                OptEntry e = { .val = v, .start = -1, .end = i, .pure = false, .inv = false };
+                if (contiguous) {
+                    e.start = ea.start;
+                    e.pure = ea.pure && (unary || eb.pure) &&
+                        isPureOp(f, gcode, numA, numB, &eb);
+                }
+                // common subexpression, the value is already in a local
+                if (e.pure && e.start < i && v >= 0) {
+                    int vn = vnOf(f, &vnt, v);
+                    for (int s = 0; s < ns; s++) {
+                        if (slotVal[s] < 0 || isShared(f, s)) continue;
+                        if (vnOf(f, &vnt, slotVal[s]) != vn) continue;
+                        setInsn(f->insns[e.start], OP_GET_LOCAL, 2, s, slotName[s]);
+                        for (int k = e.start+1; k <= i; k++) {
+                            f->rm[k] = true;
+                        }
+                        e.val = slotVal[s];
+                        stats->cse++;
+                        changes++;
+                        break;
+                    }
+                }
+                ENT_PUSH(e);
+                break;
+            }
+            }
+        }
+    }
+#undef ENT_PUSH
+#undef ENT_POP
+    xfree(stack);
+    xfree(slotVal);
+    xfree(slotName);
+    freeVNTable(&vnt);
+    return changes;
+}
+
+// Unlinks the removed instructions and recomputes the jump offsets. Jumps to
+// a removed instruction go to the next one that's left.
+static void relinearize(OptFunc *f) {
+    Iseq *seq = f->seq;
+    for (int i = 0; i < f->numInsns; i++) {
+        if (f->pseudo[i] || f->rm[i] || f->target[i] < 0) continue;
+        int t = f->target[i];
+        while (t < f->numInsns && f->rm[t]) t++;
+        ASSERT(t < f->numInsns); // the last instruction is never removed
+        f->insns[i]->jumpTo = f->insns[t];
+        f->insns[i]->jumpToPrev = NULL;
+    }
+    for (int i = 0; i < f->numInsns; i++) {
+        if (!f->rm[i]) continue;
+        Insn *in = f->insns[i];
+        if (in->prev) {
+            in->prev->next = in->next;
+        } else {
+            seq->insns = in->next;
+        }
+        if (in->next) {
+            in->next->prev = in->prev;
+        } else {
+            seq->tail = in->prev;
+        }
+        xfree(in);
+        f->insns[i] = NULL;
+    }
+
+    // word positions, kept in `extra` until the offsets are patched
+    int count = 0;
+    int words = 0;
+    int pseudoLeft = 0;
+    for (Insn *in = seq->insns; in; in = in->next) {
+        in->extra = words;
+        in->isLabel = false;
+        words += in->numOperands+1;
+        count++;
+    }
+    seq->count = count;
+    seq->wordCount = words;
+    for (Insn *in = seq->insns; in; in = in->next) {
+        if (pseudoLeft > 0) {
+            pseudoLeft--;
+            continue;
+        }
+        if (in->code == OP_CLOSURE) {
+            ObjFunction *func = closureFunction(f, in);
+            pseudoLeft = 2*(func->upvalueCount+func->capturedCount);
+            continue;
+        }
+        if (!isBranch(in->code)) continue;
+        ASSERT(in->jumpTo);
+        int from = in->extra;
+        int to = in->jumpTo->extra;
+        if (in->code == OP_LOOP) {
+            ASSERT(to < from);
+            in->operands[0] = from - to;
+        } else if (in->code == OP_BREAK) {
+            ASSERT(to > from);
+            in->operands[0] = to - from;
+        } else {
+            ASSERT(to > from+1);
+            in->operands[0] = to - from - 1;
+        }
+        in->jumpTo->isLabel = true;
+    }
+    for (Insn *in = seq->insns; in; in = in->next) {
+        in->extra = 0;
+    }
+}
+
+// Loop-invariant code motion. Pure expressions in a loop whose operands are
+// constants or locals set before the loop are computed once before it, into
+// a new local. Only loops entered by falling into their first block are
+// handled, that's where the new code goes.
+static int hoistInvariants(OptFunc *f, OptStats *stats) {
+    Compiler *compiler = f->compiler;
+    int hoisted = 0;
+    OptEntry *stack = xcalloc(f->numInsns+1, sizeof(OptEntry));
+    vec_int_t cands; // pairs of start, end
+    vec_int_t tmpVns; // value numbers of the loop's hoisted expressions
+    vec_int_t tmpSlots;
+    vec_init(&cands);
+    vec_init(&tmpVns);
+    vec_init(&tmpSlots);
+    VNTable vnt;
+    initVNTable(&vnt, f->vals.length);
+    ASSERT_MEM(stack);
+    OptEntry unknown = { .val = -1, .start = -1, .end = -1, .pure = false, .inv = false };
+    bytecode_t tmpName = 0;
+    bool haveTmpName = false;
+
+    for (int l = 0; l < f->numInsns; l++) {
+        if (f->pseudo[l] || f->insns[l]->code != OP_LOOP) continue;
+        int hb = f->blockOf[f->target[l]];
+        int lb = f->blockOf[l];
+        if (hb == 0 || hb > lb) continue;
+        OptBlock *pre = &f->blocks[hb-1];
+        int preLast = pre->end-1;
+        if (!f->pseudo[preLast] && (isBranch(f->insns[preLast]->code) ||
+                    isTerminator(f->insns[preLast]->code))) {
+            continue;
+        }
+        bool single = true;
+        for (int b = hb; b <= lb && single; b++) {
+            OptBlock *blk = &f->blocks[b];
+            for (int p = 0; p < blk->preds.length; p++) {
+                int pred = blk->preds.data[p];
+                if (pred >= hb && pred <= lb) continue;
+                if (b == hb && pred == hb-1) continue;
+                single = false;
+            }
+        }
+        if (!single) continue;
+
+        vec_clear(&cands);
+        for (int b = hb; b <= lb; b++) {
+            OptBlock *blk = &f->blocks[b];
+            int sp = 0;
+            for (int i = blk->start; i < blk->end; i++) {
+                if (f->pseudo[i] || f->rm[i]) continue;
+                Insn *in = f->insns[i];
+                bytecode_t code = in->code;
+                bytecode_t gcode = genericOp(code);
+                int v = valFind(f, f->insnVal[i]);
+                OptEntry e = { .val = v, .start = i, .end = i, .pure = true, .inv = true };
+                switch (gcode) {
+                case OP_CONSTANT:
+                case OP_TRUE:
+                case OP_FALSE:
+                case OP_NIL:
+                case OP_GET_CAPTURED:
+                case OP_GET_THIS:
+                    stack[sp++] = e;
+                    break;
+                case OP_GET_LOCAL: {
+                    int d = f->insnDef[i];
+                    e.inv = false;
+                    if (d >= 0) {
+                        d = findDef(f, d);
+                        int db = def(f, d)->block;
+                        e.inv = db < hb || db > lb;
+                    }
+                    stack[sp++] = e;
+                    break;
+                }
+                default: {
+                    bool unary = gcode == OP_NEGATE || gcode == OP_NOT;
+                    if (unary || isBinaryOp(gcode)) {
+                        OptEntry eb = unary ? unknown : (sp > 0 ? stack[--sp] : unknown);
+                        OptEntry ea = sp > 0 ? stack[--sp] : unknown;
+                        bool numA = ea.val >= 0 && isNumVal(f, ea.val);
+                        bool numB = !unary && eb.val >= 0 && isNumVal(f, eb.val);
+                        bool contiguous = ea.start >= 0 && (unary ||
+                            (eb.start >= 0 && adjacent(f, ea.end, eb.start))) &&
+                            adjacent(f, unary ? ea.end : eb.end, i);
+                        e.start = contiguous ? ea.start : -1;
+                        e.pure = contiguous && ea.pure && (unary || eb.pure) &&
+                            isPureOp(f, gcode, numA, numB, &eb);
+                        e.inv = e.pure && ea.inv && (unary || eb.inv);
+                        if (!e.inv) {
+                            if (ea.inv && ea.start < ea.end) {
+                                vec_push(&cands, ea.start); vec_push(&cands, ea.end);
+                            }
+                            if (!unary && eb.inv && eb.start < eb.end) {
+                                vec_push(&cands, eb.start); vec_push(&cands, eb.end);
+                            }
+                        }
+                        stack[sp++] = e;
+                        break;
+                    }
+                    int pops, pushes;
+                    if (!stackEffect(in, &pops, &pushes)) {
+                        sp = 0;
+                        break;
+                    }
+                    for (int p = 0; p < pops && sp > 0; p++) {
+                        OptEntry *pe = &stack[sp-1];
+                        if (pe->inv && pe->start < pe->end) {
+                            vec_push(&cands, pe->start); vec_push(&cands, pe->end);
+                        }
+                        sp--;
+                    }
+                    for (int p = 0; p < pushes; p++) {
+                        OptEntry pe = { .val = v, .start = -1, .end = insnEnd(f, i), .pure = false, .inv = false };
+                        stack[sp++] = pe;
+                    }
+                    break;
+                }
+                }
+            }
+        }
+        if (cands.length == 0) continue;
+
+        Insn *header = f->insns[f->blocks[hb].start];
+        vec_clear(&tmpVns);
+        vec_clear(&tmpSlots);
+        for (int c = 0; c < cands.length; c += 2) {
+            int start = cands.data[c];
+            int end = cands.data[c+1];
+            if (f->rm[start]) continue;
+            // same value as an expression already hoisted out of this loop
+            int vn = vnOf(f, &vnt, f->insnVal[end]);
+            int reuse = -1;
+            for (int t = 0; t < tmpVns.length; t++) {
+                if (tmpVns.data[t] == vn) reuse = tmpSlots.data[t];
+            }
+            if (reuse >= 0) {
+                setInsn(f->insns[start], OP_GET_LOCAL, 2, reuse, tmpName);
+                for (int k = start+1; k <= end; k++) {
+                    f->rm[k] = true;
+                }
+                stats->cse++;
+                continue;
+            }
+            if (compiler->localCountMax >= LX_MAX_LOCALS) break;
+            if (!haveTmpName) {
+                ObjString *name = INTERN("(hoisted)");
+                STRING_SET_STATIC(name);
+                tmpName = iseqAddConstant(f->seq, OBJ_VAL(name));
+                haveTmpName = true;
+            }
+            int tmp = compiler->localCountMax++;
+            vec_push(&tmpVns, vn);
+            vec_push(&tmpSlots, tmp);
+            // <expr>; SET_LOCAL tmp; POP before the loop
+            Insn *copies[3];
+            int lineno = f->insns[start]->lineno;
+            for (int k = start; k <= end; k++) {
+                if (f->rm[k]) continue;
+                Insn *copy = xcalloc(1, sizeof(Insn));
+                ASSERT_MEM(copy);
+                memcpy(copy, f->insns[k], sizeof(Insn));
+                copy->isLabel = false;
+                copy->jumpTo = copy->jumpToPrev = NULL;
+                copy->prev = header->prev;
+                copy->next = header;
+                header->prev->next = copy;
+                header->prev = copy;
+                f->seq->count++;
+                f->seq->wordCount += copy->numOperands+1;
+            }
+            copies[0] = xcalloc(1, sizeof(Insn));
+            copies[1] = xcalloc(1, sizeof(Insn));
+            ASSERT_MEM(copies[0] && copies[1]);
+            setInsn(copies[0], OP_SET_LOCAL, 2, tmp, tmpName);
+            setInsn(copies[1], OP_POP, 0, 0, 0);
+            for (int k = 0; k < 2; k++) {
+                copies[k]->lineno = lineno;
+                copies[k]->nlvl = f->insns[start]->nlvl;
+                copies[k]->prev = header->prev;
+                copies[k]->next = header;
+                header->prev->next = copies[k];
+                header->prev = copies[k];
+                f->seq->count++;
+                f->seq->wordCount += copies[k]->numOperands+1;
+            }
+            // the expression in the loop becomes GET_LOCAL tmp
+            setInsn(f->insns[start], OP_GET_LOCAL, 2, tmp, tmpName);
+            for (int k = start+1; k <= end; k++) {
+                f->rm[k] = true;
+            }
+            stats->hoisted++;
+            hoisted++;
+        }
+    }
+    vec_deinit(&cands);
+    vec_deinit(&tmpVns);
+    vec_deinit(&tmpSlots);
+    freeVNTable(&vnt);
+    xfree(stack);
+    return hoisted;
+}
+
+// Functions the optimizer can't see all the reads and writes of locals in
+static const char *optSkipReason(Compiler *compiler) {
+    ObjFunction *func = compiler->function;
+    if (compiler->type == FUN_TYPE_EVAL) return "eval";
+    if (compiler->iseq.catchTbl) return "catch table";
+    if (func->numDefaultArgs > 0 || func->numKwargs > 0) return "default params";
+    ValueArray *constants = compiler->iseq.constants;
+    for (int i = 0; i < constants->count; i++) {
+        Value c = constants->values[i];
+        if (!IS_STRING(c)) continue;
+        char *name = AS_CSTRING(c);
+        if (strcmp(name, "eval") == 0 || strcmp(name, "instanceEval") == 0 ||
+                strcmp(name, "Binding") == 0 || strcmp(name, "debugger") == 0) {
+            return "uses eval, Binding or debugger";
+        }
+    }
+    return NULL;
+}
+
+static bool canHoist(Compiler *compiler) {
+    if (compiler->type == FUN_TYPE_BLOCK) return false; // locals aren't popped
+    int pseudoLeft = 0;
+    for (Insn *in = compiler->iseq.insns; in; in = in->next) {
+        if (pseudoLeft > 0) {
+            pseudoLeft--;
+            continue;
+        }
+        switch (in->code) {
+            case OP_CLOSURE: {
+                ObjFunction *func = AS_FUNCTION(compiler->iseq.constants->values[in->operands[0]]);
+                pseudoLeft = 2*(func->upvalueCount+func->capturedCount);
+                break;
+            }
+            // the stack holds the class while its body runs, the temporary
+            // local would be written over it
+            case OP_CLASS:
+            case OP_SUBCLASS:
+            case OP_MODULE:
+            case OP_IN:
+                return false;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+static const char *optFuncName(Compiler *compiler) {
+    ObjFunction *func = compiler->function;
+    if (func->name) return func->name->chars;
+    switch (compiler->type) {
+        case FUN_TYPE_TOP_LEVEL: return "(script)";
+        case FUN_TYPE_BLOCK: return "(block)";
+        default: return "(anon)";
+    }
+}
+
+void optimizeIseqSSA(Compiler *compiler) {
+    const char *skip = optSkipReason(compiler);
+    if (skip) {
+        if (GET_OPTION(optStats)) {
+            fprintf(stderr, "[OPT] %s: %d insns, skipped (%s)\n",
+                optFuncName(compiler), compiler->iseq.count, skip);
+        }
+        return;
+    }
+    int before = compiler->iseq.count;
+    OptStats stats;
+    memset(&stats, 0, sizeof(stats));
+    OptFunc f;
+    for (int round = 0; round < OPT_MAX_ROUNDS; round++) {
+        if (!analyze(&f, compiler)) break;
+        int changes = rewrite(&f, &stats);
+        relinearize(&f);
+        freeOptFunc(&f);
+        if (changes == 0) break;
+    }
+    if (canHoist(compiler) && analyze(&f, compiler)) {
+        hoistInvariants(&f, &stats);
+        relinearize(&f);
+        freeOptFunc(&f);
+    }
+    if (GET_OPTION(optStats)) {
+        fprintf(stderr, "[OPT] %s: %d -> %d insns (constprop=%d fold=%d "
+            "num=%d cse=%d dce=%d dse=%d copy=%d licm=%d)\n",
+            optFuncName(compiler), before, compiler->iseq.count,
+            stats.constProp, stats.folded, stats.specialized, stats.cse,
+            stats.dce, stats.dse, stats.copyProp, stats.hoisted);
+    }
+}
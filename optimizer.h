@@ -0,0 +1,18 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "compiler.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Runs the SSA-based passes over the compiler's instruction sequence, after
+// the peephole optimizer (optimizeIseq()) in the compiler.
+void optimizeIseqSSA(Compiler *compiler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
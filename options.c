@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "compiler.h"
 #include "nodes.h"
+#include "jit.h"
 
 static CloxOptions options;
 int origArgc = -1;
@@ -18,6 +19,7 @@ char *boolOptNames[] = { // order doesn't matter
     "debugBytecode",
     "traceCompiler",
     "disableBcodeOptimizer",
+    "optStats",
     "disableGC",
     "profileGC",
 #if GEN_GC
@@ -41,6 +43,9 @@ char *intOptNames[] = { // order doesn't matter
     "debugVMLvl",
     "debugRegexLvl",
     "debugOptimizerLvl",
+    "maxStack",
+    "maxFrames",
+    "jitThreshold",
     NULL
 };
 
@@ -63,6 +68,7 @@ void initOptions(int argc, char **argv) {
     options.parseOnly = false;
     options.compileOnly = false;
     options.disableBcodeOptimizer = false;
+    options.optStats = false;
 
     options.disableGC = false;
     options.profileGC = false;
@@ -80,6 +86,10 @@ void initOptions(int argc, char **argv) {
     options.debugRegexLvl = 0;
     options.debugOptimizerLvl = 0;
 
+    options.maxStack = 0;
+    options.maxFrames = 0;
+    options.jitThreshold = JIT_DEFAULT_THRESHOLD;
+
     options._inited = true;
     options.index = 1;
     options.end = false;
@@ -138,6 +148,9 @@ static void help(FILE *f) {
   fprintf(f, "- (read script code from stdin)\n");
   fprintf(f, "--parse-only (check syntax of file)\n");
   fprintf(f, "--compile-only (check syntax and semantics)\n");
+  fprintf(f, "--max-stack N (max values on each thread's stack)\n");
+  fprintf(f, "--max-frames N (max call frames on each thread's stack)\n");
+  fprintf(f, "--jit-threshold N (calls before a function is compiled to native code, 0 to disable)\n");
   fprintf(f, "-- (end of clox options)\n");
   fprintf(f, "-DTRACE_PARSER_CALLS (debug option)\n");
   fprintf(f, "-DTRACE_COMPILER (debug option)\n");
@@ -154,6 +167,7 @@ static void help(FILE *f) {
   fprintf(f, "--debug-bopt (debug option)\n");
   fprintf(f, "--debug-threads (debug option)\n");
   fprintf(f, "--disable-bopt (debug option)\n");
+  fprintf(f, "--opt-stats (debug option)\n");
   fprintf(f, "--disable-GC (debug option)\n");
   fprintf(f, "--profile-GC (debug option)\n");
   #if GEN_GC
@@ -196,6 +210,31 @@ static int doParseOption(char **argv, int i) {
         }
     }
 
+    if (strcmp(argv[i], "--max-stack") == 0 || strcmp(argv[i], "--max-frames") == 0) {
+        bool isStack = argv[i][6] == 's';
+        int max = argv[i+1] ? atoi(argv[i+1]) : 0;
+        if (max <= 0) {
+            fprintf(stderr, "[WARN]: Expected positive number after %s, ignoring\n", argv[i]);
+            return argv[i+1] ? 2 : 1;
+        }
+        if (isStack) {
+            SET_OPTION(maxStack, max);
+        } else {
+            SET_OPTION(maxFrames, max);
+        }
+        return 2;
+    }
+
+    if (strcmp(argv[i], "--jit-threshold") == 0) {
+        int threshold = argv[i+1] ? atoi(argv[i+1]) : -1;
+        if (threshold < 0) {
+            fprintf(stderr, "[WARN]: Expected number after %s, ignoring\n", argv[i]);
+            return argv[i+1] ? 2 : 1;
+        }
+        SET_OPTION(jitThreshold, threshold);
+        return 2;
+    }
+
     if (strcmp(argv[i], "--") == 0) {
         options.end = true;
         return 1;
@@ -266,6 +305,10 @@ static int doParseOption(char **argv, int i) {
         compilerOpts.noOptimize = true;
         return 1;
     }
+    if (strcmp(argv[i], "--opt-stats") == 0) {
+        SET_OPTION(optStats, true);
+        return 1;
+    }
     if (strcmp(argv[i], "--disable-GC") == 0) {
         SET_OPTION(disableGC, true);
         return 1;
@@ -20,8 +20,12 @@ typedef struct sCloxOptions {
     int debugRegexLvl;
     int debugOptimizerLvl;
     int traceGCLvl;
+    int maxStack; // per thread, 0 means the default
+    int maxFrames;
+    int jitThreshold; // calls or loop iterations before a function is compiled, 0 to disable
     bool traceCompiler;
     bool disableBcodeOptimizer;
+    bool optStats; // print what the bytecode optimizer did, per function
     bool disableGC;
     bool stressGCYoung;
     bool stressGCFull;
@@ -1446,41 +1446,6 @@ static Node *call() {
     return expr;
 }
 
-// FIXME: this creates right-associative binary operations, not left-associative
-static Node *stringTogetherNodesBinop(vec_void_t *nodes, TokenType ttype, char *lexeme) {
-    Node *ret = NULL;
-    Node *last = NULL;
-    int len = nodes->length;
-    Node *n = NULL; int i = 0;
-    vec_foreach(nodes, n, i) {
-        if (i == len-1) {
-            nodeAddChild(last, n);
-        } else {
-            node_type_t binop_T = {
-                .type = NODE_EXPR,
-                .kind = BINARY_EXPR,
-            };
-            Token tok;
-            tok.line = getScanner()->line;
-            tok.lexeme = lexeme;
-            tok.startIdx = 0;
-            tok.length = strlen(lexeme);
-            tok.type = ttype;
-            tok.alloced = false;
-            Node *binop = createNode(binop_T, tok, NULL);
-            nodeAddChild(binop, n);
-            if (last) {
-                nodeAddChild(last, binop);
-            }
-            if (i == 0) {
-                ret = binop;
-            }
-            last = binop;
-        }
-    }
-    return ret;
-}
-
 static Node *primary() {
     TRACE_START("primary");
     if (match(TOKEN_STRING_DQUOTE) || match(TOKEN_STRING_SQUOTE)) {
@@ -1540,22 +1505,14 @@ static Node *primary() {
             litTok.type = TOKEN_STRING_DQUOTE;
             litTok.lexeme = before;
             litTok.alloced = true;
-            Node *litNode = createNode(nType, litTok, NULL);
-            vec_push(&vnodes, litNode);
-            node_type_t callT = {
-                .type = NODE_EXPR,
-                .kind = CALL_EXPR,
-            };
-            // stringify the expression by calling String() on the expr result
-            Node *toStringCall = createNode(callT, syntheticToken("String"), NULL);
-            node_type_t varT = {
-                .type = NODE_EXPR,
-                .kind = CONSTANT_EXPR,
-            };
-            Node *toStringVar = createNode(varT, syntheticToken("String"), NULL);
-            nodeAddChild(toStringCall, toStringVar);
-            nodeAddChild(toStringCall, inner);
-            vec_push(&vnodes, toStringCall);
+            if (litTok.length > 0) {
+                Node *litNode = createNode(nType, litTok, NULL);
+                vec_push(&vnodes, litNode);
+            } else {
+                xfree(before);
+            }
+            // the VM stringifies the expression result like String() does
+            vec_push(&vnodes, inner);
             beg = end+1;
         }
         if (vnodes.length > 0) {
@@ -1577,9 +1534,12 @@ static Node *primary() {
                 .kind = LITERAL_EXPR,
                 .litKind = STRING_TYPE,
             };
-            Node *litNode = createNode(nType, litTok, NULL);
-            vec_push(&vnodes, litNode);
-
+            if (litTok.length > 0) {
+                Node *litNode = createNode(nType, litTok, NULL);
+                vec_push(&vnodes, litNode);
+            } else {
+                xfree(rest);
+            }
         }
 
         setScanner(oldScan);
@@ -1587,12 +1547,16 @@ static Node *primary() {
 
         Node *ret = NULL;
         if (vnodes.length > 0) {
-            ASSERT(vnodes.length > 1);
-            ret = stringTogetherNodesBinop(&vnodes, TOKEN_PLUS, "+");
-            /*fprintf(stderr, "Interpolation AST inner\n");*/
-            /*char *output = outputASTString(ret, 0);*/
-            /*fprintf(stderr, output);*/
-            /*fprintf(stderr, "\n");*/
+            // the parts are concatenated into one new string by the VM
+            node_type_t interpT = {
+                .type = NODE_EXPR,
+                .kind = STRING_INTERP_EXPR,
+            };
+            ret = createNode(interpT, strTok, NULL);
+            Node *part = NULL; int partIdx = 0;
+            vec_foreach(&vnodes, part, partIdx) {
+                nodeAddChild(ret, part);
+            }
             vec_deinit(&vnodes);
         } else {
             node_type_t nType = {
@@ -25,23 +25,30 @@ const char pathSeparator =
                             '/';
 #endif
 
-void addGlobalFunction(const char *name, NativeFn func) {
+ObjNative *addGlobalFunction(const char *name, NativeFn func) {
     ObjString *funcName = INTERNED(name, strlen(name));
     ObjNative *natFn = newNative(funcName, func, NEWOBJ_FLAG_OLD);
     hideFromGC((Obj*)natFn);
     if (*name >= 'A' && *name <= 'Z') {
-        ASSERT(tableSet(&vm.constants, OBJ_VAL(funcName), OBJ_VAL(natFn)));
+        addGlobalConstant(funcName, OBJ_VAL(natFn));
     } else {
-        ASSERT(tableSet(&vm.globals, OBJ_VAL(funcName), OBJ_VAL(natFn)));
+        setGlobal(funcName, OBJ_VAL(natFn));
     }
     unhideFromGC((Obj*)natFn);
+    return natFn;
+}
+
+ObjNative *addLeafGlobalFunction(const char *name, NativeFn func) {
+    ObjNative *natFn = addGlobalFunction(name, func);
+    natFn->flags |= NATIVE_FL_LEAF;
+    return natFn;
 }
 
 ObjClass *addGlobalClass(const char *name, ObjClass *super) {
     ObjString *className = INTERNED(name, strlen(name));
     ObjClass *objClass = newClass(className, super, NEWOBJ_FLAG_OLD);
     hideFromGC((Obj*)objClass);
-    ASSERT(tableSet(&vm.constants, OBJ_VAL(className), OBJ_VAL(objClass)));
+    addGlobalConstant(className, OBJ_VAL(objClass));
     unhideFromGC((Obj*)objClass);
     return objClass;
 }
@@ -56,7 +63,7 @@ ObjModule *addGlobalModule(const char *name) {
     ObjString *modName = INTERNED(name, strlen(name));
     ObjModule *mod = newModule(modName, NEWOBJ_FLAG_OLD);
     hideFromGC((Obj*)mod);
-    ASSERT(tableSet(&vm.constants, OBJ_VAL(modName), OBJ_VAL(mod)));
+    addGlobalConstant(modName, OBJ_VAL(mod));
     unhideFromGC((Obj*)mod);
     return mod;
 }
@@ -73,6 +80,7 @@ ObjNative *addNativeMethod(void *klass, const char *name, NativeFn func) {
     }
     hideFromGC((Obj*)natFn);
     ASSERT(tableSet(CLASSINFO(klass)->methods, OBJ_VAL(mname), OBJ_VAL(natFn)));
+    vm.methodSerial++;
     unhideFromGC((Obj*)natFn);
     return natFn;
 }
@@ -102,15 +110,45 @@ ObjNative *addNativeSetter(void *klass, const char *name, NativeFn func) {
 }
 
 
+ObjNative *addLeafNativeMethod(void *klass, const char *name, NativeFn func) {
+    ObjNative *natFn = addNativeMethod(klass, name, func);
+    natFn->flags |= NATIVE_FL_LEAF;
+    return natFn;
+}
+
+ObjNative *addLeafNativeGetter(void *klass, const char *name, NativeFn func) {
+    ObjNative *natFn = addNativeGetter(klass, name, func);
+    natFn->flags |= NATIVE_FL_LEAF;
+    return natFn;
+}
+
+ObjNative *addKwargsNativeMethod(void *klass, const char *name, NativeFn func) {
+    ObjNative *natFn = addNativeMethod(klass, name, func);
+    natFn->flags |= NATIVE_FL_KWARGS;
+    return natFn;
+}
+
+ObjNative *addLoopIterNativeMethod(void *klass, const char *name, NativeFn func, LoopIterOp op) {
+    ObjNative *natFn = addNativeMethod(klass, name, func);
+    natFn->loopIter = op;
+    return natFn;
+}
+
 void addConstantUnder(const char *name, Value constVal, Value owner) {
     ASSERT(IS_CLASS(owner) || IS_MODULE(owner));
     OBJ_WRITE(owner, constVal);
     tableSet(CLASSINFO(AS_CLASS(owner))->constants, OBJ_VAL(INTERN(name)), constVal);
+    vm.constantSerial++;
     if (IS_CLASS(constVal)) {
       CLASSINFO(AS_CLASS(constVal))->under = AS_OBJ(owner);
     }
 }
 
+void addGlobalConstant(ObjString *name, Value constVal) {
+    tableSet(&vm.constants, OBJ_VAL(name), constVal);
+    vm.constantSerial++;
+}
+
 // NOTE: `klass` can be NULL, in which case only `vm.constants` is checked.
 // Also, `name` can be a qualified constant, ex: `My::Error`.
 bool findConstantUnder(ObjClass *klass, ObjString *name, Value *valOut) {
@@ -300,16 +338,18 @@ static inline ObjClosure *closureFromFn(ObjFunction *func) {
     return newClosure(func, NEWOBJ_FLAG_NONE);
 }
 
-static inline CallFrame *getOuterClosureFrame() {
-    CallFrame *frame = getFrame()->prev;
-    while (frame) {
-        if (!frame->closure) {
-            frame = frame->prev;
-            continue;
-        }
-        return frame;
+// The closest frame running Lox code, starting at `frame`.
+CallFrame *closureFrameFrom(CallFrame *frame) {
+    while (frame && !frame->closure) {
+        frame = frame->prev;
     }
-    return NULL;
+    return frame;
+}
+
+// The frame of the Lox function a block literal given to `frame`'s call is
+// written in.
+static inline CallFrame *blockOuterFrame(CallFrame *frame) {
+    return closureFrameFrom(frame->prev);
 }
 
 static void fillClosureUpvalues(ObjClosure *block, ObjClosure *outer, CallFrame *frame) {
@@ -326,31 +366,39 @@ static void fillClosureUpvalues(ObjClosure *block, ObjClosure *outer, CallFrame
             DBG_ASSERT(block->upvalues[i]);
         }
     }
+    for (int i = 0; i < blockFn->capturedCount; i++) {
+        uint8_t index = blockFn->capturedInfo[i].index;
+        Value val = blockFn->capturedInfo[i].isLocal ? frame->slots[index] :
+                                                       outer->captured[index];
+        block->captured[i] = val;
+        OBJ_WRITE(OBJ_VAL(block), val);
+    }
 }
 
-static ObjClosure *getCFrameBlockClosure() {
-    BlockStackEntry *bentry = vec_last_or(&THREAD()->v_blockStack, NULL);
-    Obj *block = NULL;
-    if (bentry) {
-        block = bentry->callable;
-    }
-    if (!block) {
-        throwErrorFmt(lxErrClass, "Cannot yield, no block given");
-    }
-    if (bentry->cachedBlockClosure) {
-        return bentry->cachedBlockClosure;
-    }
-    ObjClosure *blockClosure = closureFromFn((ObjFunction*)block);
+// Makes the closure for the block literal `blockFn`, written in the function
+// running in `outerFrame`.
+ObjClosure *newBlockClosure(ObjFunction *blockFn, CallFrame *outerFrame) {
+    ObjClosure *blockClosure = closureFromFn(blockFn);
     blockClosure->isBlock = true;
-    CallFrame *frame = getOuterClosureFrame();
-    ASSERT(frame);
-    ObjClosure *lastClosure = frame->closure;
-    ASSERT(lastClosure);
-    fillClosureUpvalues(blockClosure, lastClosure, frame);
-    bentry->cachedBlockClosure = blockClosure;
+    push(OBJ_VAL(blockClosure)); // capturing upvalues allocates
+    fillClosureUpvalues(blockClosure, outerFrame->closure, outerFrame);
+    pop();
     return blockClosure;
 }
 
+// The block closure can't escape a yield to it, so the first yield from
+// `frame` makes it and later ones reuse it. The variables it captures stay
+// the same, the outer frame can't leave their scope while `frame` is
+// running.
+static ObjClosure *yieldBlockClosure(CallFrame *frame) {
+    if (!frame->blockClosure) {
+        CallFrame *outerFrame = blockOuterFrame(frame);
+        ASSERT(outerFrame);
+        frame->blockClosure = newBlockClosure(frame->callInfo->blockFunction, outerFrame);
+    }
+    return frame->blockClosure;
+}
+
 Value lxYield(int argCount, Value *args) {
     CallFrame *frame = getFrame()->prev;
     ASSERT(frame->callInfo);
@@ -361,14 +409,7 @@ Value lxYield(int argCount, Value *args) {
     Value callable = NIL_VAL;
     if (block) {
         DBG_ASSERT(IS_FUNCTION(OBJ_VAL(block)));
-        ObjClosure *blockClosure = NULL;
-        blockClosure = closureFromFn((ObjFunction*)block);
-        blockClosure->isBlock = true;
-        CallFrame *outerFrame = getOuterClosureFrame();
-        ObjClosure *outerClosure = outerFrame->closure;
-        ASSERT(outerClosure);
-        fillClosureUpvalues(blockClosure, outerClosure, outerFrame);
-        callable = OBJ_VAL(blockClosure);
+        callable = OBJ_VAL(yieldBlockClosure(frame));
         push(callable);
     } else if (frame->callInfo->blockInstance) {
         ObjInstance *blockInst = frame->callInfo->blockInstance;
@@ -386,28 +427,13 @@ Value lxYield(int argCount, Value *args) {
     memset(&cinfo, 0, sizeof(cinfo));
     cinfo.argc = argCount;
     cinfo.isYield = true; // tell callCallable to adjust frame stack in popFrame()
-    volatile int status = 0;
-    volatile LxThread *th = THREAD();
-    volatile BlockStackEntry *bentry = NULL;
-    if (block) { // is native function if !block
-        SETUP_BLOCK(block, bentry, status, th->errInfo)
-            if (status == TAG_NONE) {
-            } else if (status == TAG_RAISE) {
-                ObjInstance *errInst = AS_INSTANCE(THREAD()->lastErrorThrown);
-                ASSERT(errInst);
-                if (errInst->klass == lxBreakBlockErrClass) {
-                    return NIL_VAL;
-                } else if (errInst->klass == lxContinueBlockErrClass) { // continue
-                    return getProp(THREAD()->lastErrorThrown, INTERN("ret"));
-                } else if (errInst->klass == lxReturnBlockErrClass) {
-                    return getProp(THREAD()->lastErrorThrown, INTERN("ret"));
-                } else {
-                    throwError(th->lastErrorThrown);
-                }
-            }
-    }
+    cinfo.yieldStatus = true;
     callCallable(callable, argCount, false, &cinfo);
-    return pop(); // yielded a native function
+    Value ret = pop();
+    if (cinfo.blockStatus == BLOCK_ST_BREAK) {
+        return NIL_VAL;
+    }
+    return ret;
 }
 
 bool blockGiven() {
@@ -434,7 +460,7 @@ Value yieldBlock(int argCount, Value *args) {
 Value yieldBlockCatch(int argCount, Value *args, Value *err) {
     volatile int status = 0;
     volatile LxThread *th = vm.curThread;
-    volatile BlockStackEntry *bentry = NULL;
+    BlockStackEntry * volatile bentry = NULL;
     CallFrame *frame = getFrame();
 
     volatile Obj *block = (Obj*)frame->callInfo->blockFunction;
@@ -444,14 +470,7 @@ Value yieldBlockCatch(int argCount, Value *args, Value *err) {
     volatile Value callable = NIL_VAL;
     if (block) {
         DBG_ASSERT(IS_FUNCTION(OBJ_VAL(block)));
-        ObjClosure *blockClosure = NULL;
-        blockClosure = closureFromFn((ObjFunction*)block);
-        blockClosure->isBlock = true;
-        CallFrame *outerFrame = getOuterClosureFrame();
-        ObjClosure *outerClosure = outerFrame->closure;
-        ASSERT(outerClosure);
-        fillClosureUpvalues(blockClosure, outerClosure, outerFrame);
-        callable = OBJ_VAL(blockClosure);
+        callable = OBJ_VAL(yieldBlockClosure(frame));
         push(callable);
     } else if (frame->callInfo->blockInstance) {
         ObjInstance *blockInst = frame->callInfo->blockInstance;
@@ -468,44 +487,58 @@ Value yieldBlockCatch(int argCount, Value *args, Value *err) {
         if (status == TAG_NONE) {
             // do nothing
         } else if (status == TAG_RAISE) {
-            ObjInstance *errInst = AS_INSTANCE(th->lastErrorThrown);
-            ASSERT(errInst);
-            if (errInst->klass == lxBreakBlockErrClass) {
-                return NIL_VAL;
-            } else if (errInst->klass == lxContinueBlockErrClass) {
-                Value retVal = getProp(th->lastErrorThrown, INTERN("ret"));
-                return retVal;
-            } else if (errInst->klass == lxReturnBlockErrClass) {
-                Value retVal = getProp(th->lastErrorThrown, INTERN("ret"));
-                return retVal;
-            } else {
-                *err = th->lastErrorThrown;
-                return NIL_VAL;
-            }
+            *err = th->lastErrorThrown;
+            return NIL_VAL;
         }
     }
     CallInfo cinfo;
     memset(&cinfo, 0, sizeof(cinfo));
     cinfo.isYield = true,
     cinfo.argc = argCount;
+    cinfo.yieldStatus = true;
     for (int i = 0; i < argCount; i++) {
         push(args[i]);
     }
     callCallable(callable, argCount, false, &cinfo);
-    return pop(); // native function returned
+    Value ret = pop();
+    if (block) {
+        TEARDOWN_BLOCK(bentry);
+    }
+    if (cinfo.blockStatus == BLOCK_ST_BREAK) {
+        return NIL_VAL;
+    }
+    return ret;
 }
 
-Value yieldFromC(int argCount, Value *args, ObjInstance *blockObj) {
-    Value callable;
+// Returns the block given to the current native function as a callable to
+// pass to yieldFromC(). Natives that yield more than once should get it once
+// and keep it on the stack.
+Value blockCallableFromC(ObjInstance *blockObj) {
     if (blockObj) {
-        Obj *blkCallable = NULL;
-        blkCallable = blockCallable(OBJ_VAL(blockObj));
-        callable = OBJ_VAL(blkCallable);
-    } else {
-        ObjClosure *blkClosure = NULL;
-        blkClosure = getCFrameBlockClosure();
-        callable = OBJ_VAL(blkClosure);
+        return OBJ_VAL(blockCallable(OBJ_VAL(blockObj)));
     }
+    CallInfo *cinfo = getFrame()->callInfo;
+    if (!cinfo || !cinfo->blockFunction) {
+        throwErrorFmt(lxErrClass, "no block given");
+    }
+    return OBJ_VAL(yieldBlockClosure(getFrame()));
+}
+
+// Sets up `yinfo` for yielding to the block `blockObj` (NULL for a block
+// literal) with yieldFromC(). Natives that yield more than once set it up
+// once and reuse it for every yield.
+void initYieldInfo(CallInfo *yinfo, ObjInstance *blockObj) {
+    memset(yinfo, 0, sizeof(*yinfo));
+    yinfo->isYield = true; // tell callCallable to adjust frame stack in popFrame()
+    yinfo->blockInstance = blockObj;
+    yinfo->yieldStatus = true;
+}
+
+// Calls the block `callable` (see blockCallableFromC()) with the given
+// arguments. The block's 'continue', 'break' and 'return' don't throw, the
+// block frame returns here and `status` (can be NULL) is set to how it
+// exited.
+Value yieldFromC(Value callable, int argCount, Value *args, CallInfo *yinfo, BlockStatus *status) {
     push(callable);
     for (int i = 0; i < argCount; i++) {
         push(args[i]);
@@ -516,15 +549,20 @@ Value yieldFromC(int argCount, Value *args, ObjInstance *blockObj) {
         push(cinfoIn->blockArgsExtra[i]);
         argCount++;
     }
-    CallInfo cinfo;
-    memset(&cinfo, 0, sizeof(cinfo));
-    cinfo.argc = argCount,
-    cinfo.blockFunction = NULL,
-    cinfo.isYield = true, // tell callCallable to adjust frame stack in popFrame()
-    cinfo.blockIterFunc = NULL,
-    cinfo.blockInstance = blockObj,
-    callCallable(callable, argCount, false, &cinfo);
-    return pop(); // if got here, was a native function
+    ObjInstance *blockObj = yinfo->blockInstance;
+    yinfo->argc = argCount;
+    yinfo->blockStatus = BLOCK_ST_CONTINUE;
+    if (IS_CLOSURE(callable)) {
+        callBlockClosure(callable, argCount, yinfo);
+    } else {
+        callCallable(callable, argCount, false, yinfo);
+    }
+    // callCallable() replaces it if the last argument is a block
+    yinfo->blockInstance = blockObj;
+    if (status) {
+        *status = yinfo->blockStatus;
+    }
+    return pop();
 }
 
 // Register atExit handler for process
@@ -588,7 +626,7 @@ Value lxAlias(int argCount, Value *args) {
     }
     Value newName = args[1];
     CHECK_ARG_IS_A(newName, lxStringClass, 2);
-    tableSet(&vm.globals, OBJ_VAL(dupString(AS_STRING(newName))), func);
+    setGlobal(INTERNED(AS_STRING(newName)->chars, AS_STRING(newName)->length), func);
     return NIL_VAL;
 }
 
@@ -1178,7 +1216,7 @@ Value lxClassDefineMethod(int argCount, Value *args) {
 
 typedef struct Iterator {
     int index; // # of times iterator was called with 'next' - 1
-    int lastRealIndex; // for iterating over maps, not yet used
+    int lastRealIndex; // position in the map's dense entries, for maps
     ObjInstance *instance; // the array/map/instance we're iterating over
     int flags;
 } Iterator;
@@ -1207,7 +1245,7 @@ Value lxIteratorInit(int argCount, Value *args) {
     ObjInstance *selfObj = AS_INSTANCE(self);
     Iterator *iter = ALLOCATE(Iterator, 1);
     iter->index = -1;
-    iter->lastRealIndex = -1;
+    iter->lastRealIndex = 0;
     iter->instance = AS_INSTANCE(iterable);
     OBJ_WRITE(self, iterable);
     iter->flags = 0;
@@ -1248,22 +1286,15 @@ Value lxIteratorNext(int argCount, Value *args) {
         }
     } else if (iter->flags & FLAG_ITER_MAP) {
         Table *map = AS_MAP(iterable)->table;
-        int nextIdx = ++(iter->index);
-        if (nextIdx >= map->count) {
+        Entry e;
+        if (!tableNext(map, &iter->lastRealIndex, &e)) {
             return NIL_VAL;
-        } else {
-            int realIndex = -1;
-            Entry e = tableNthEntry(map, nextIdx, &realIndex);
-            if (realIndex >= 0) {
-                Value ary = newArray();
-                arrayPush(ary, e.key);
-                arrayPush(ary, e.value);
-                return ary;
-            } else {
-                UNREACHABLE("bug");
-                return NIL_VAL; // shouldn't reach here
-            }
         }
+        iter->index++;
+        Value ary = newArray();
+        arrayPush(ary, e.key);
+        arrayPush(ary, e.value);
+        return ary;
     } else if (iter->flags & FLAG_ITER_INSTANCE) {
         return callMethod(AS_OBJ(iterable), INTERN("iterNext"), 0, NULL, NULL);
     } else {
@@ -1290,6 +1321,12 @@ Value lxErrInit(int argCount, Value *args) {
     return self;
 }
 
+// Only called while the backtrace field isn't set, see errorBacktrace()
+Value lxErrGetBacktrace(int argCount, Value *args) {
+    CHECK_ARITY("Error#backtrace", 1, 1, argCount);
+    return errorBacktrace(*args);
+}
+
 Value lxGCStats(int argCount, Value *args) {
     CHECK_ARITY("GC.stats", 1, 1, argCount);
     Value map = newMap();
@@ -1334,6 +1371,26 @@ Value lxGCOn(int argCount, Value *args) {
     return BOOL_VAL(prevOn);
 }
 
+// GC.setMarkBitmap(bool): keep GC mark bits in side bitmaps instead of
+// object headers. Returns the previous setting.
+Value lxGCSetMarkBitmap(int argCount, Value *args) {
+    CHECK_ARITY("GC.setMarkBitmap", 2, 2, argCount);
+    bool prev = GCMarkBitmapOn();
+    GCSetMarkBitmap(isTruthy(args[1]));
+    return BOOL_VAL(prev);
+}
+
+// GC.prepareFork(): collect and make the survivors old, using mark bitmaps
+// from now on, so that forked children don't write to the shared heap pages
+// when they collect.
+Value lxGCPrepareFork(int argCount, Value *args) {
+    CHECK_ARITY("GC.prepareFork", 1, 1, argCount);
+    bool prevOn = turnGCOn();
+    GCPrepareFork();
+    setGCOnOff(prevOn);
+    return NIL_VAL;
+}
+
 Value lxGCSetFinalizer(int argCount, Value *args) {
     CHECK_ARITY("GC.setFinalizer", 3, 3, argCount);
     Value objVal = args[1];
@@ -1373,6 +1430,39 @@ void checkArgIsInstanceOf(Value arg, ObjClass *klass, int argnum) {
     }
 }
 
+// Returns the keyword argument `name` given to a native, or `defaultVal`.
+// `kwargs` is the native's args[argCount] (see NATIVE_FL_KWARGS).
+Value nativeKwarg(Value kwargs, const char *name, Value defaultVal) {
+    Value val;
+    if (!IS_NIL(kwargs) && MAP_GET(kwargs, OBJ_VAL(INTERN(name)), &val)) {
+        return val;
+    }
+    return defaultVal;
+}
+
+// ex: checkNativeKwargs("Array#sort", args[argCount], "reverse", NULL);
+void checkNativeKwargs(const char *func, Value kwargs, ...) {
+    if (IS_NIL(kwargs)) return;
+    Table *map = AS_MAP(kwargs)->table;
+    Entry entry; int i = 0;
+    TABLE_FOREACH(map, entry, i, {
+        bool known = false;
+        va_list names;
+        va_start(names, kwargs);
+        const char *name = NULL;
+        while ((name = va_arg(names, const char*)) != NULL) {
+            if (strcmp(name, AS_CSTRING(entry.key)) == 0) {
+                known = true;
+                break;
+            }
+        }
+        va_end(names);
+        if (!known) {
+            throwArgErrorFmt("%s: unknown keyword argument '%s'", func, AS_CSTRING(entry.key));
+        }
+    })
+}
+
 void checkArgIsA(Value arg, ObjClass *klass, int argnum) {
     if (UNLIKELY(!is_value_a_p(arg, klass))) {
         const char *typeExpect = className(klass);
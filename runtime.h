@@ -5,8 +5,10 @@
  * Functions used for builtin lox functions and methods for builtin classes
  */
 
+#include <string.h>
 #include "value.h"
 #include "vm.h"
+#include "compiler.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -29,12 +31,18 @@ void checkArgIsA(Value arg, ObjClass *klass, int argnum);
 
 static inline void CHECK_ARITY(const char *func, int min, int max, int actual) {
     (void)func;
-    CallFrame *frame = NULL;
-    if (vm.inited) {
-        frame = getFrame();
-    }
     if (UNLIKELY(!checkArity(min, max, actual))) {
-        if (frame && frame->instance) {
+        CallFrame *frame = NULL;
+        bool isLeafMethod = false;
+        if (vm.inited) {
+            frame = getFrame();
+            // leaf natives run without their own frame (see NATIVE_FL_LEAF)
+            if (!frame->isCCall) {
+                frame = NULL;
+                isLeafMethod = strchr(func, '#') != NULL;
+            }
+        }
+        if ((frame && frame->instance) || isLeafMethod) {
             min--; max--; actual--;
         }
         if (min == max) {
@@ -69,7 +77,11 @@ Value lxSleep(int argCount, Value *args);
 void threadSleepNano(LxThread *th, int secs);
 Value lxYield(int argCount, Value *args);
 Value lxBlockGiven(int argCount, Value *args);
-Value yieldFromC(int argCount, Value *args, ObjInstance *blkObj);
+Value blockCallableFromC(ObjInstance *blkObj);
+CallFrame *closureFrameFrom(CallFrame *frame);
+ObjClosure *newBlockClosure(ObjFunction *blockFn, CallFrame *outerFrame);
+void initYieldInfo(CallInfo *yinfo, ObjInstance *blkObj);
+Value yieldFromC(Value callable, int argCount, Value *args, CallInfo *yinfo, BlockStatus *status);
 Value lxExit(int argCount, Value *args);
 Value lx_Exit(int argCount, Value *args);
 Value lxNewThread(int argCount, Value *args);
@@ -159,9 +171,12 @@ Value lxGCCollectYoung(int argCount, Value *args);
 Value lxGCSetFinalizer(int argCount, Value *args);
 Value lxGCOff(int argCount, Value *args);
 Value lxGCOn(int argCount, Value *args);
+Value lxGCSetMarkBitmap(int argCount, Value *args);
+Value lxGCPrepareFork(int argCount, Value *args);
 
 // class Error
 Value lxErrInit(int argCount, Value *args);
+Value lxErrGetBacktrace(int argCount, Value *args);
 extern ObjNative *nativeErrorInit;
 ObjClass *sysErrClass(int err);
 
@@ -178,6 +193,9 @@ LxFile *fileGetHidden(Value io);
 LxFile *fileGetInternal(Value io);
 LxFile *initIOAfterOpen(Value io, ObjString *fname, int fd, int mode, int oflags);
 size_t IOWrite(Value io, const void *buf, size_t count);
+size_t IOCopyFd(int srcFd, int dstFd, ssize_t len);
+size_t IOWritev(Value io, Value *strs, int count);
+void IOPinStrings(Value *strs, int count);
 void IOClose(Value io);
 ObjString *IORead(Value io, size_t bytesMax, bool untilEOF, bool nonblock);
 ObjString *IOReadFd(int fd, size_t bytesMax, bool untilEOF, bool nonblock);
@@ -188,6 +206,7 @@ void Init_FileClass(void);
 void Init_DirClass(void);
 void Init_ProcessModule(void);
 void Init_SignalModule(void);
+void Init_WorkerPoolModule(void);
 // random()/srandom() functions
 void Init_rand(void);
 void Init_ThreadClass(void);
@@ -198,16 +217,26 @@ void Init_BindingClass(void);
 void Init_ErrorClasses(void);
 
 // API for adding classes/modules/methods
-void addGlobalFunction(const char *name, NativeFn func);
+ObjNative *addGlobalFunction(const char *name, NativeFn func);
+ObjNative *addLeafGlobalFunction(const char *name, NativeFn func);
 ObjClass *addGlobalClass(const char *name, ObjClass *super);
 ObjClass *createClass(const char *name, ObjClass *super);
 ObjModule *addGlobalModule(const char *name);
 ObjNative *addNativeMethod(void *klass, const char *name, NativeFn func);
 ObjNative *addNativeGetter(void *klass, const char *name, NativeFn func);
 ObjNative *addNativeSetter(void *klass, const char *name, NativeFn func);
+ObjNative *addLeafNativeMethod(void *klass, const char *name, NativeFn func);
+ObjNative *addLeafNativeGetter(void *klass, const char *name, NativeFn func);
+ObjNative *addKwargsNativeMethod(void *klass, const char *name, NativeFn func);
+ObjNative *addLoopIterNativeMethod(void *klass, const char *name, NativeFn func, LoopIterOp op);
+
+// API for natives taking keyword arguments (see NATIVE_FL_KWARGS)
+Value nativeKwarg(Value kwargs, const char *name, Value defaultVal);
+void checkNativeKwargs(const char *func, Value kwargs, ...);
 
 // API for adding constants
 void addConstantUnder(const char *name, Value constVal, Value owner);
+void addGlobalConstant(ObjString *name, Value constVal);
 bool findConstantUnder(ObjClass *klass, ObjString *name, Value *valOut);
 int constantQualifiedParts(ObjString *name);
 ObjString *constantQualifiedPart(ObjString *name, int npart);
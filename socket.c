@@ -3,15 +3,26 @@
 #include "runtime.h"
 #include "socket.h"
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 ObjClass *lxSocketClass;
 ObjClass *lxAddrInfoClass;
+ObjClass *lxTCPSocketClass;
+ObjClass *lxTCPServerClass;
+ObjClass *lxUNIXSocketClass;
+ObjClass *lxUNIXServerClass;
+
+#define SOCKET_DEFAULT_BACKLOG 128
 
 static void markInternalSocket(Obj *obj) {
     // do nothing
@@ -131,6 +142,155 @@ static Value lxSocketSend(int argCount, Value *args) {
     return callMethod(AS_OBJ(self), INTERN("write"), 1, &string, NULL);
 }
 
+#define SOCKET_MMSG_MAX 1024
+#define SOCKET_RECV_MAXLEN 65536
+#define SOCKET_RECV_BUFSZ_MAX (4*1024*1024)
+
+// Socket#sendmmsg([strs...])
+// Sends each string as its own datagram on a connected datagram socket,
+// using as few sendmmsg(2) calls as possible. The iovecs point directly at
+// the strings' buffers. Returns the number of datagrams sent.
+static Value lxSocketSendmmsg(int argCount, Value *args) {
+    CHECK_ARITY("Socket#sendmmsg", 2, 2, argCount);
+    Value self = args[0];
+    CHECK_ARG_IS_A(args[1], lxAryClass, 1);
+    LxFile *f = checkSocket(self);
+    ValueArray *strs = &AS_ARRAY(args[1])->valAry;
+    int count = strs->count;
+    Value el; int idx = 0;
+    VALARRAY_FOREACH(strs, el, idx) {
+        if (!IS_A_STRING(el)) {
+            throwErrorFmt(lxArgErrClass, "Socket#sendmmsg: expected array of Strings, element %d is a %s",
+                    idx, typeOfVal(el));
+        }
+    }
+    if (count <= 0) return NUMBER_VAL(0);
+    IOPinStrings(strs->values, count);
+    struct iovec *iov = ALLOCATE(struct iovec, count);
+    for (int i = 0; i < count; i++) {
+        ObjString *str = AS_STRING(strs->values[i]);
+        iov[i].iov_base = str->chars;
+        iov[i].iov_len = str->length;
+    }
+#ifdef __linux__
+    struct mmsghdr *msgs = ALLOCATE(struct mmsghdr, count);
+    memset(msgs, 0, sizeof(struct mmsghdr)*count);
+    for (int i = 0; i < count; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+    int sent = 0;
+    int err = 0;
+    releaseGVL(THREAD_STOPPED);
+    while (sent < count) {
+#ifdef __linux__
+        int batch = count - sent > SOCKET_MMSG_MAX ? SOCKET_MMSG_MAX : count - sent;
+        int res = sendmmsg(f->fd, msgs+sent, batch, 0);
+#else
+        int res = send(f->fd, iov[sent].iov_base, iov[sent].iov_len, 0) < 0 ? -1 : 1;
+#endif
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            err = errno;
+            break;
+        }
+        sent += res;
+    }
+    acquireGVL();
+#ifdef __linux__
+    FREE_ARRAY(struct mmsghdr, msgs, count);
+#endif
+    FREE_ARRAY(struct iovec, iov, count);
+    if (err != 0 && sent == 0) {
+        throwErrorFmt(sysErrClass(err), "Error during sendmmsg: %s", strerror(err));
+    }
+    return NUMBER_VAL(sent);
+}
+
+// Socket#recvmmsg(maxMsgs, [maxLen])
+// Blocks until at least 1 datagram is available, then returns an array of
+// up to `maxMsgs` datagrams (as Strings) received with a single recvmmsg(2)
+// call. Datagrams longer than `maxLen` bytes (default 65536) are truncated.
+// The receive buffers are allocated up front, so fewer than `maxMsgs` are
+// asked for when they'd take more than SOCKET_RECV_BUFSZ_MAX bytes.
+static Value lxSocketRecvmmsg(int argCount, Value *args) {
+    CHECK_ARITY("Socket#recvmmsg", 2, 3, argCount);
+    Value self = args[0];
+    CHECK_ARG_BUILTIN_TYPE(args[1], IS_NUMBER_FUNC, "number", 1);
+    LxFile *f = checkSocket(self);
+    int maxMsgs = (int)AS_NUMBER(args[1]);
+    size_t maxLen = SOCKET_RECV_MAXLEN;
+    if (argCount == 3) {
+        CHECK_ARG_BUILTIN_TYPE(args[2], IS_NUMBER_FUNC, "number", 2);
+        maxLen = (size_t)AS_NUMBER(args[2]);
+    }
+    if (maxMsgs <= 0 || maxLen == 0) {
+        throwArgErrorFmt("Socket#recvmmsg: invalid arguments (maxMsgs=%d, maxLen=%d)", maxMsgs, (int)maxLen);
+    }
+    if (maxMsgs > SOCKET_MMSG_MAX) maxMsgs = SOCKET_MMSG_MAX;
+    if ((size_t)maxMsgs*(maxLen+1) > SOCKET_RECV_BUFSZ_MAX) {
+        maxMsgs = SOCKET_RECV_BUFSZ_MAX / (maxLen+1);
+        if (maxMsgs == 0) maxMsgs = 1;
+    }
+    // one extra byte per message for the NUL terminator
+    char *bufs = ALLOCATE(char, maxMsgs*(maxLen+1));
+    struct iovec *iov = ALLOCATE(struct iovec, maxMsgs);
+    size_t *lens = ALLOCATE(size_t, maxMsgs);
+    for (int i = 0; i < maxMsgs; i++) {
+        iov[i].iov_base = bufs + i*(maxLen+1);
+        iov[i].iov_len = maxLen;
+    }
+#ifdef __linux__
+    struct mmsghdr *msgs = ALLOCATE(struct mmsghdr, maxMsgs);
+    memset(msgs, 0, sizeof(struct mmsghdr)*maxMsgs);
+    for (int i = 0; i < maxMsgs; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+    int received = 0;
+    int err = 0;
+    releaseGVL(THREAD_STOPPED);
+    while (true) {
+#ifdef __linux__
+        received = recvmmsg(f->fd, msgs, maxMsgs, MSG_WAITFORONE, NULL);
+        for (int i = 0; i < received; i++) {
+            lens[i] = msgs[i].msg_len;
+        }
+#else
+        ssize_t res = recv(f->fd, iov[0].iov_base, maxLen, 0);
+        received = res < 0 ? -1 : 1;
+        if (res >= 0) lens[0] = res;
+#endif
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            err = errno;
+        }
+        break;
+    }
+    acquireGVL();
+    Value ret = NIL_VAL;
+    if (err == 0) {
+        ret = newArray();
+        for (int i = 0; i < received; i++) {
+            char *msg = iov[i].iov_base;
+            msg[lens[i]] = '\0';
+            arrayPush(ret, OBJ_VAL(copyString(msg, lens[i], NEWOBJ_FLAG_NONE)));
+        }
+    }
+#ifdef __linux__
+    FREE_ARRAY(struct mmsghdr, msgs, maxMsgs);
+#endif
+    FREE_ARRAY(size_t, lens, maxMsgs);
+    FREE_ARRAY(struct iovec, iov, maxMsgs);
+    FREE_ARRAY(char, bufs, maxMsgs*(maxLen+1));
+    if (err != 0) {
+        throwErrorFmt(sysErrClass(err), "Error during recvmmsg: %s", strerror(err));
+    }
+    return ret;
+}
+
 static Value lxSocketBind(int argCount, Value *args) {
     CHECK_ARITY("Socket#bind", 2, 3, argCount);
     Value self = args[0];
@@ -150,7 +310,7 @@ static Value lxSocketBind(int argCount, Value *args) {
       }
 
       // TODO: make listen a separate call?
-      if (listen(fd, 50) == -1) {
+      if (sock->type == SOCK_STREAM && listen(fd, 50) == -1) {
         throwErrorFmt(sysErrClass(errno), "Error during listen: %s", strerror(errno));
       }
 
@@ -179,7 +339,7 @@ static Value lxSocketBind(int argCount, Value *args) {
       }
 
       // TODO: make listen() a separate call
-      if (listen(fd, 50) == -1) {
+      if (sock->type == SOCK_STREAM && listen(fd, 50) == -1) {
         acquireGVL();
         throwErrorFmt(sysErrClass(errno), "Error during listen: %s", strerror(errno));
       }
@@ -189,36 +349,363 @@ static Value lxSocketBind(int argCount, Value *args) {
     return self;
 }
 
-static Value newSocketFromAccept(Value serverSock, int newFd, struct sockaddr *peer_addr, size_t addr_size) {
+static Value newSocketFromAccept(Value serverSock, ObjClass *klass, int newFd, struct sockaddr *peer_addr, size_t addr_size) {
   // NOTE: call newInstance directly to avoid call to Socket#init, which calls
   // the socket(2) system call
-  ObjInstance *newSockObj = newInstance(lxSocketClass, NEWOBJ_FLAG_NONE);
+  ObjInstance *newSockObj = newInstance(klass, NEWOBJ_FLAG_NONE);
   LxFile *servFile = FILE_GETHIDDEN(serverSock);
   LxSocket *servSock = servFile->sock;
   Value newSock = OBJ_VAL(newSockObj);
   // TODO: save peer information in new socket's servSock
   initSocketFromFd(newSock, servSock->domain, servSock->type, servSock->proto, newFd);
+  FILE_GETHIDDEN(newSock)->sock->connected = true;
   return newSock;
 }
 
+// accept(2) a connection, retrying on EINTR. With `nonblock`, the new socket
+// is created with O_NONBLOCK. New sockets are always close-on-exec. Releases
+// the GVL while blocked in the kernel. Returns -1 with errno set on error.
+static int acceptFd(int sfd, struct sockaddr *peer_addr, socklen_t *addr_size, bool nonblock) {
+    int newFd = -1;
+    releaseGVL(THREAD_STOPPED);
+    do {
+#ifdef __linux__
+        newFd = accept4(sfd, peer_addr, addr_size, SOCK_CLOEXEC|(nonblock ? SOCK_NONBLOCK : 0));
+#else
+        newFd = accept(sfd, peer_addr, addr_size);
+        if (newFd >= 0) {
+            fcntl(newFd, F_SETFD, FD_CLOEXEC);
+            if (nonblock) {
+                fcntl(newFd, F_SETFL, fcntl(newFd, F_GETFL) | O_NONBLOCK);
+            }
+        }
+#endif
+    } while (newFd == -1 && errno == EINTR);
+    acquireGVL();
+    return newFd;
+}
+
+static Value socketAccept(Value self, ObjClass *newSockClass) {
+    LxFile *f = checkSocket(self);
+    struct sockaddr_storage peer;
+    socklen_t addr_size = sizeof(peer);
+    int newFd = acceptFd(f->fd, (struct sockaddr*)&peer, &addr_size, false);
+    if (newFd == -1) {
+      throwErrorFmt(sysErrClass(errno), "Error during accept: %s", strerror(errno));
+    }
+    return newSocketFromAccept(self, newSockClass, newFd, (struct sockaddr*)&peer, addr_size);
+}
+
+// Returns IO::EWouldBlock if there's no pending connection. Otherwise the
+// new socket is non-blocking. The listening socket's flags are left alone,
+// they're shared by every process that inherited it. If several processes
+// call this on a shared blocking listening socket, the losers of the race
+// wait in accept(2) (without the GVL) for the next connection. Make the
+// listening socket non-blocking or use TCPServer's `reusePort` to get
+// IO::EWouldBlock instead.
+static Value socketAcceptNonBlock(Value self, ObjClass *newSockClass) {
+    LxFile *f = checkSocket(self);
+    struct pollfd pfd;
+    pfd.fd = f->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) == 0) {
+        return OBJ_VAL(lxEWouldBlockClass);
+    }
+    struct sockaddr_storage peer;
+    socklen_t addr_size = sizeof(peer);
+    int newFd = acceptFd(f->fd, (struct sockaddr*)&peer, &addr_size, true);
+    if (newFd == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return OBJ_VAL(lxEWouldBlockClass);
+      }
+      throwErrorFmt(sysErrClass(errno), "Error during accept: %s", strerror(errno));
+    }
+    return newSocketFromAccept(self, newSockClass, newFd, (struct sockaddr*)&peer, addr_size);
+}
+
 static Value lxSocketAccept(int argCount, Value *args) {
     CHECK_ARITY("Socket#accept", 1, 1, argCount);
+    return socketAccept(args[0], lxSocketClass);
+}
+
+// Socket#listen(backlog)
+// Can be called again on a listening socket to change the backlog.
+static Value lxSocketListen(int argCount, Value *args) {
+    CHECK_ARITY("Socket#listen", 2, 2, argCount);
     Value self = args[0];
+    CHECK_ARG_BUILTIN_TYPE(args[1], IS_NUMBER_FUNC, "number", 1);
     LxFile *f = checkSocket(self);
-    int sfd = f->fd;
-    struct sockaddr *peer_addr;
-    struct sockaddr_in in_peer_addr; // TODO: support unix
-    peer_addr = (struct sockaddr*)&in_peer_addr;
-    socklen_t addr_size = sizeof(struct sockaddr_in);
+    if (listen(f->fd, (int)AS_NUMBER(args[1])) == -1) {
+        throwErrorFmt(sysErrClass(errno), "Error during listen: %s", strerror(errno));
+    }
+    f->sock->server = true;
+    return self;
+}
+
+static void setIntSockopt(int fd, int level, int optname, int val) {
+    if (setsockopt(fd, level, optname, &val, sizeof(val)) == -1) {
+        throwErrorFmt(sysErrClass(errno), "Error during setsockopt: %s", strerror(errno));
+    }
+}
+
+// Socket#setsockopt(level, optname, intval)
+// ex: sock.setsockopt(Socket::SOL_SOCKET, Socket::SO_KEEPALIVE, 1);
+static Value lxSocketSetsockopt(int argCount, Value *args) {
+    CHECK_ARITY("Socket#setsockopt", 4, 4, argCount);
+    Value self = args[0];
+    CHECK_ARG_BUILTIN_TYPE(args[1], IS_NUMBER_FUNC, "number", 1);
+    CHECK_ARG_BUILTIN_TYPE(args[2], IS_NUMBER_FUNC, "number", 2);
+    int val = 0;
+    if (IS_BOOL(args[3])) {
+        val = AS_BOOL(args[3]) ? 1 : 0;
+    } else {
+        CHECK_ARG_BUILTIN_TYPE(args[3], IS_NUMBER_FUNC, "number", 3);
+        val = (int)AS_NUMBER(args[3]);
+    }
+    LxFile *f = checkSocket(self);
+    setIntSockopt(f->fd, (int)AS_NUMBER(args[1]), (int)AS_NUMBER(args[2]), val);
+    return self;
+}
+
+// Socket#getsockopt(level, optname), for integer options
+static Value lxSocketGetsockopt(int argCount, Value *args) {
+    CHECK_ARITY("Socket#getsockopt", 3, 3, argCount);
+    Value self = args[0];
+    CHECK_ARG_BUILTIN_TYPE(args[1], IS_NUMBER_FUNC, "number", 1);
+    CHECK_ARG_BUILTIN_TYPE(args[2], IS_NUMBER_FUNC, "number", 2);
+    LxFile *f = checkSocket(self);
+    int val = 0;
+    socklen_t len = sizeof(val);
+    if (getsockopt(f->fd, (int)AS_NUMBER(args[1]), (int)AS_NUMBER(args[2]), &val, &len) == -1) {
+        throwErrorFmt(sysErrClass(errno), "Error during getsockopt: %s", strerror(errno));
+    }
+    return NUMBER_VAL(val);
+}
 
+static int newSocketFd(int domain, int type) {
     releaseGVL(THREAD_STOPPED);
-    int newFd = accept(sfd, peer_addr, &addr_size);
+#ifdef SOCK_CLOEXEC
+    int fd = socket(domain, type|SOCK_CLOEXEC, 0);
+#else
+    int fd = socket(domain, type, 0);
+    if (fd >= 0) fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
     acquireGVL();
-    if (newFd == -1) {
-      throwErrorFmt(sysErrClass(errno), "Error during accept: %s", strerror(errno));
+    if (fd == -1) {
+        throwErrorFmt(sysErrClass(errno), "Error creating socket: %s", strerror(errno));
+    }
+    return fd;
+}
+
+// Resolves an IPv4 host name or address (ex: "localhost", "0.0.0.0"). The
+// GVL is released during the lookup.
+static void resolveInetAddr(const char *host, int port, bool passive, struct sockaddr_in *out) {
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    releaseGVL(THREAD_STOPPED);
+    int st = getaddrinfo(host, NULL, &hints, &res);
+    acquireGVL();
+    if (st != 0) {
+        throwErrorFmt(lxArgErrClass, "Unable to resolve address '%s': %s", host, gai_strerror(st));
     }
-    Value newSock = newSocketFromAccept(self, newFd, peer_addr, addr_size);
-    return newSock;
+    memcpy(out, res->ai_addr, sizeof(struct sockaddr_in));
+    out->sin_port = htons(port);
+    freeaddrinfo(res);
+}
+
+// Connect or bind+listen, closing the fd on error
+static void socketSetupOrClose(int fd, struct sockaddr *addr, socklen_t addrlen, bool server, int backlog, const char *desc) {
+    int res = 0;
+    const char *op = server ? "bind" : "connect";
+    releaseGVL(THREAD_STOPPED);
+    if (server) {
+        res = bind(fd, addr, addrlen);
+        if (res == 0) {
+            op = "listen";
+            res = listen(fd, backlog);
+        }
+    } else {
+        do {
+            res = connect(fd, addr, addrlen);
+        } while (res == -1 && errno == EINTR);
+    }
+    acquireGVL();
+    if (res == -1) {
+        int err = errno;
+        close(fd);
+        throwErrorFmt(sysErrClass(err), "Error during %s for %s: %s", op, desc, strerror(err));
+    }
+}
+
+static int checkBacklogArg(int argCount, Value *args, int argIdx) {
+    if (argCount <= argIdx || IS_NIL(args[argIdx])) {
+        return SOCKET_DEFAULT_BACKLOG;
+    }
+    CHECK_ARG_BUILTIN_TYPE(args[argIdx], IS_NUMBER_FUNC, "number", argIdx);
+    return (int)AS_NUMBER(args[argIdx]);
+}
+
+// TCPSocket(host, port)
+// Connected TCP client socket. Connecting releases the GVL.
+static Value lxTCPSocketInit(int argCount, Value *args) {
+    CHECK_ARITY("TCPSocket#init", 3, 3, argCount);
+    Value self = args[0];
+    CHECK_ARG_IS_A(args[1], lxStringClass, 1);
+    CHECK_ARG_BUILTIN_TYPE(args[2], IS_NUMBER_FUNC, "number", 2);
+    struct sockaddr_in addr;
+    resolveInetAddr(AS_CSTRING(args[1]), (int)AS_NUMBER(args[2]), false, &addr);
+    int fd = newSocketFd(AF_INET, SOCK_STREAM);
+    socketSetupOrClose(fd, (struct sockaddr*)&addr, sizeof(addr), false, 0, "TCPSocket");
+    initSocketFromFd(self, AF_INET, SOCK_STREAM, 0, fd);
+    FILE_GETHIDDEN(self)->sock->connected = true;
+    return self;
+}
+
+// TCPSocket#setNoDelay(bool): disable/enable Nagle's algorithm
+static Value lxTCPSocketSetNoDelay(int argCount, Value *args) {
+    CHECK_ARITY("TCPSocket#setNoDelay", 2, 2, argCount);
+    LxFile *f = checkSocket(args[0]);
+    setIntSockopt(f->fd, IPPROTO_TCP, TCP_NODELAY, isTruthy(args[1]) ? 1 : 0);
+    return args[0];
+}
+
+// TCPSocket#setKeepAlive(bool)
+static Value lxTCPSocketSetKeepAlive(int argCount, Value *args) {
+    CHECK_ARITY("TCPSocket#setKeepAlive", 2, 2, argCount);
+    LxFile *f = checkSocket(args[0]);
+    setIntSockopt(f->fd, SOL_SOCKET, SO_KEEPALIVE, isTruthy(args[1]) ? 1 : 0);
+    return args[0];
+}
+
+// Local port the socket is bound to (useful when binding to port 0)
+static Value lxTCPSocketPort(int argCount, Value *args) {
+    CHECK_ARITY("TCPSocket#port", 1, 1, argCount);
+    LxFile *f = checkSocket(args[0]);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(f->fd, (struct sockaddr*)&addr, &len) == -1) {
+        throwErrorFmt(sysErrClass(errno), "Error during getsockname: %s", strerror(errno));
+    }
+    return NUMBER_VAL(ntohs(addr.sin_port));
+}
+
+// TCPServer(host, port, backlog=128, reusePort=false)
+// With `reusePort`, SO_REUSEPORT is set so that several processes (ex:
+// forked workers) can each bind their own listening socket to the same
+// port, and the kernel load-balances connections between their accept
+// queues.
+static Value lxTCPServerInit(int argCount, Value *args) {
+    CHECK_ARITY("TCPServer#init", 3, 5, argCount);
+    Value self = args[0];
+    CHECK_ARG_IS_A(args[1], lxStringClass, 1);
+    CHECK_ARG_BUILTIN_TYPE(args[2], IS_NUMBER_FUNC, "number", 2);
+    int backlog = checkBacklogArg(argCount, args, 3);
+    bool reusePort = argCount == 5 && isTruthy(args[4]);
+    struct sockaddr_in addr;
+    resolveInetAddr(AS_CSTRING(args[1]), (int)AS_NUMBER(args[2]), true, &addr);
+    int fd = newSocketFd(AF_INET, SOCK_STREAM);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reusePort) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+            int err = errno;
+            close(fd);
+            throwErrorFmt(sysErrClass(err), "Error setting SO_REUSEPORT: %s", strerror(err));
+        }
+#else
+        close(fd);
+        throwErrorFmt(lxErrClass, "SO_REUSEPORT is not supported on this platform");
+#endif
+    }
+    socketSetupOrClose(fd, (struct sockaddr*)&addr, sizeof(addr), true, backlog, "TCPServer");
+    initSocketFromFd(self, AF_INET, SOCK_STREAM, 0, fd);
+    FILE_GETHIDDEN(self)->sock->server = true;
+    return self;
+}
+
+// Blocks (with the GVL released) until a client connects, returns a TCPSocket
+static Value lxTCPServerAccept(int argCount, Value *args) {
+    CHECK_ARITY("TCPServer#accept", 1, 1, argCount);
+    return socketAccept(args[0], lxTCPSocketClass);
+}
+
+static Value lxTCPServerAcceptNonBlock(int argCount, Value *args) {
+    CHECK_ARITY("TCPServer#acceptNonBlock", 1, 1, argCount);
+    return socketAcceptNonBlock(args[0], lxTCPSocketClass);
+}
+
+static void unixAddr(const char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        throwArgErrorFmt("UNIX socket path too long: '%s'", path);
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path)-1);
+}
+
+// UNIXSocket(path)
+static Value lxUNIXSocketInit(int argCount, Value *args) {
+    CHECK_ARITY("UNIXSocket#init", 2, 2, argCount);
+    Value self = args[0];
+    CHECK_ARG_IS_A(args[1], lxStringClass, 1);
+    struct sockaddr_un addr;
+    unixAddr(AS_CSTRING(args[1]), &addr);
+    int fd = newSocketFd(AF_UNIX, SOCK_STREAM);
+    socketSetupOrClose(fd, (struct sockaddr*)&addr, sizeof(addr), false, 0, "UNIXSocket");
+    initSocketFromFd(self, AF_UNIX, SOCK_STREAM, 0, fd);
+    FILE_GETHIDDEN(self)->sock->connected = true;
+    return self;
+}
+
+// Removes the socket file at `addr` if no server is listening on it
+// anymore, ex: the process that created it was killed.
+static void unlinkStaleUnixSocket(struct sockaddr_un *addr) {
+    int last = errno;
+    struct stat st;
+    if (lstat(addr->sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd != -1) {
+            if (connect(fd, (struct sockaddr*)addr, sizeof(*addr)) == -1 && errno == ECONNREFUSED) {
+                unlink(addr->sun_path);
+            }
+            close(fd);
+        }
+    }
+    errno = last;
+}
+
+// UNIXServer(path, backlog=128)
+// A socket file left at `path` by a server that's gone is replaced, one
+// that's still accepting connections gives EADDRINUSE.
+static Value lxUNIXServerInit(int argCount, Value *args) {
+    CHECK_ARITY("UNIXServer#init", 2, 3, argCount);
+    Value self = args[0];
+    CHECK_ARG_IS_A(args[1], lxStringClass, 1);
+    int backlog = checkBacklogArg(argCount, args, 2);
+    struct sockaddr_un addr;
+    unixAddr(AS_CSTRING(args[1]), &addr);
+    unlinkStaleUnixSocket(&addr);
+    int fd = newSocketFd(AF_UNIX, SOCK_STREAM);
+    socketSetupOrClose(fd, (struct sockaddr*)&addr, sizeof(addr), true, backlog, "UNIXServer");
+    initSocketFromFd(self, AF_UNIX, SOCK_STREAM, 0, fd);
+    FILE_GETHIDDEN(self)->sock->server = true;
+    return self;
+}
+
+static Value lxUNIXServerAccept(int argCount, Value *args) {
+    CHECK_ARITY("UNIXServer#accept", 1, 1, argCount);
+    return socketAccept(args[0], lxUNIXSocketClass);
+}
+
+static Value lxUNIXServerAcceptNonBlock(int argCount, Value *args) {
+    CHECK_ARITY("UNIXServer#acceptNonBlock", 1, 1, argCount);
+    return socketAcceptNonBlock(args[0], lxUNIXSocketClass);
 }
 
 static Value lxSocketGetFd(int argCount, Value *args) {
@@ -425,14 +912,50 @@ void Init_SocketClass(void) {
     addNativeMethod(lxSocketClass, "init", lxSocketInit);
     addNativeMethod(lxSocketClass, "connect", lxSocketConnect);
     addNativeMethod(lxSocketClass, "send", lxSocketSend);
+    addNativeMethod(lxSocketClass, "sendmmsg", lxSocketSendmmsg);
+    addNativeMethod(lxSocketClass, "recvmmsg", lxSocketRecvmmsg);
     addNativeMethod(lxSocketClass, "bind", lxSocketBind);
     addNativeMethod(lxSocketClass, "accept", lxSocketAccept);
+    addNativeMethod(lxSocketClass, "listen", lxSocketListen);
+    addNativeMethod(lxSocketClass, "setsockopt", lxSocketSetsockopt);
+    addNativeMethod(lxSocketClass, "getsockopt", lxSocketGetsockopt);
     addNativeGetter(lxSocketClass, "fd", lxSocketGetFd);
 
+    lxTCPSocketClass = addGlobalClass("TCPSocket", lxSocketClass);
+    addNativeMethod(lxTCPSocketClass, "init", lxTCPSocketInit);
+    addNativeMethod(lxTCPSocketClass, "setNoDelay", lxTCPSocketSetNoDelay);
+    addNativeMethod(lxTCPSocketClass, "setKeepAlive", lxTCPSocketSetKeepAlive);
+    addNativeMethod(lxTCPSocketClass, "port", lxTCPSocketPort);
+
+    lxTCPServerClass = addGlobalClass("TCPServer", lxTCPSocketClass);
+    addNativeMethod(lxTCPServerClass, "init", lxTCPServerInit);
+    addNativeMethod(lxTCPServerClass, "accept", lxTCPServerAccept);
+    addNativeMethod(lxTCPServerClass, "acceptNonBlock", lxTCPServerAcceptNonBlock);
+
+    lxUNIXSocketClass = addGlobalClass("UNIXSocket", lxSocketClass);
+    addNativeMethod(lxUNIXSocketClass, "init", lxUNIXSocketInit);
+
+    lxUNIXServerClass = addGlobalClass("UNIXServer", lxUNIXSocketClass);
+    addNativeMethod(lxUNIXServerClass, "init", lxUNIXServerInit);
+    addNativeMethod(lxUNIXServerClass, "accept", lxUNIXServerAccept);
+    addNativeMethod(lxUNIXServerClass, "acceptNonBlock", lxUNIXServerAcceptNonBlock);
+
     addConstantUnder("AF_UNIX", NUMBER_VAL(AF_UNIX), sockVal);
     addConstantUnder("AF_LOCAL", NUMBER_VAL(AF_LOCAL), sockVal);
     addConstantUnder("AF_INET", NUMBER_VAL(AF_INET), sockVal);
 
     addConstantUnder("SOCK_STREAM", NUMBER_VAL(SOCK_STREAM), sockVal);
     addConstantUnder("SOCK_DGRAM", NUMBER_VAL(SOCK_DGRAM), sockVal);
+
+    // socket options (see Socket#setsockopt)
+    addConstantUnder("SOL_SOCKET", NUMBER_VAL(SOL_SOCKET), sockVal);
+    addConstantUnder("SO_REUSEADDR", NUMBER_VAL(SO_REUSEADDR), sockVal);
+#ifdef SO_REUSEPORT
+    addConstantUnder("SO_REUSEPORT", NUMBER_VAL(SO_REUSEPORT), sockVal);
+#endif
+    addConstantUnder("SO_KEEPALIVE", NUMBER_VAL(SO_KEEPALIVE), sockVal);
+    addConstantUnder("SO_RCVBUF", NUMBER_VAL(SO_RCVBUF), sockVal);
+    addConstantUnder("SO_SNDBUF", NUMBER_VAL(SO_SNDBUF), sockVal);
+    addConstantUnder("IPPROTO_TCP", NUMBER_VAL(IPPROTO_TCP), sockVal);
+    addConstantUnder("TCP_NODELAY", NUMBER_VAL(TCP_NODELAY), sockVal);
 }
@@ -3,8 +3,8 @@
 #include "runtime.h"
 #include "table.h"
 #include "memory.h"
+#include "string_simd.h"
 #include <string.h>
-#include <ctype.h>
 
 ObjClass *lxStringClass;
 
@@ -27,14 +27,17 @@ static Value lxStringInit(int argCount, Value *args) {
             otherStr = AS_STRING(args[1]);
         }
     }
+    stringContentsChanged(selfStr);
     selfStr->capacity = otherStr->capacity;
     selfStr->hash = otherStr->hash;
     selfStr->length = otherStr->length;
     OBJ_UNSET_FROZEN(selfStr);
+    selfStr->parent = NULL;
     if (STRING_IS_INTERNED(otherStr) && otherStr->chars) {
         selfStr->chars = otherStr->chars;
         STRING_SET_SHARED(selfStr);
     } else {
+        STRING_UNSET_SHARED(selfStr);
         if (otherStr->chars) {
             selfStr->chars = ALLOCATE(char, otherStr->capacity+1);
             memcpy(selfStr->chars, otherStr->chars, selfStr->length+1);
@@ -84,10 +87,7 @@ static Value lxStringOpAdd(int argCount, Value *args) {
         throwErrorFmt(lxTypeErrClass, "String#+ (opAdd) called with non-string argument. Type: %s",
                 typeOfVal(rhs));
     }
-    ObjString *lhsBuf = dupString(AS_STRING(self));
-    ObjString *rhsBuf = AS_STRING(rhs);
-    pushObjString(lhsBuf, rhsBuf);
-    return OBJ_VAL(lhsBuf);
+    return OBJ_VAL(concatStrings(AS_STRING(self), AS_STRING(rhs)));
 }
 
 static Value lxStringOpMul(int argCount, Value *args) {
@@ -114,6 +114,7 @@ static inline void dedupString(ObjString *shared) {
         shared->chars = ALLOCATE(char, shared->capacity+1);
         memcpy(shared->chars, cpy, shared->length+1);
         STRING_UNSET_SHARED(shared);
+        shared->parent = NULL;
     }
 }
 
@@ -140,6 +141,9 @@ static Value lxStringDup(int argCount, Value *args) {
     STRING_UNSET_STATIC(dupStr);
     STRING_UNSET_INTERNED(dupStr);
     OBJ_UNSET_FROZEN(dupStr);
+    STRING_UNSET_SHARED(dupStr);
+    dupStr->parent = NULL;
+    stringContentsChanged(dupStr);
     dupStr->capacity = selfStr->capacity;
     dupStr->hash = selfStr->hash;
     dupStr->length = selfStr->length;
@@ -159,7 +163,6 @@ static Value lxStringClear(int argCount, Value *args) {
     return self;
 }
 
-// NOTE: works on bytes, not codepoints for multibyte chars
 static Value lxStringInsertAt(int argCount, Value *args) {
     CHECK_ARITY("String#insertAt", 3, 3, argCount);
     Value self = args[0];
@@ -168,11 +171,10 @@ static Value lxStringInsertAt(int argCount, Value *args) {
     CHECK_ARG_IS_A(insert, lxStringClass, 1);
     CHECK_ARG_BUILTIN_TYPE(at, IS_NUMBER_FUNC, "number", 2);
     dedupString(AS_STRING(self));
-    stringInsertAt(self, insert, (int)AS_NUMBER(at), false);
+    stringInsertAt(self, insert, (size_t)AS_NUMBER(at), false);
     return self;
 }
 
-// NOTE: works on bytes, not codepoints for multibyte chars
 static Value lxStringSubstr(int argCount, Value *args) {
     CHECK_ARITY("String#substr", 3, 3, argCount);
     Value self = args[0];
@@ -183,7 +185,6 @@ static Value lxStringSubstr(int argCount, Value *args) {
     return stringSubstr(self, AS_NUMBER(startIdx), AS_NUMBER(len));
 }
 
-// NOTE: works on bytes, not codepoints for multibyte chars
 static Value lxStringOpIndexGet(int argCount, Value *args) {
     CHECK_ARITY("String#[]", 2, 2, argCount);
     Value self = args[0];
@@ -192,7 +193,6 @@ static Value lxStringOpIndexGet(int argCount, Value *args) {
     return stringIndexGet(self, AS_NUMBER(index));
 }
 
-// NOTE: works on bytes, not codepoints for multibyte chars
 static Value lxStringOpIndexSet(int argCount, Value *args) {
     CHECK_ARITY("String#[]=", 3, 3, argCount);
     Value self = args[0];
@@ -200,14 +200,16 @@ static Value lxStringOpIndexSet(int argCount, Value *args) {
     CHECK_ARG_BUILTIN_TYPE(index, IS_NUMBER_FUNC, "number", 1);
     Value chrStr = args[2];
     CHECK_ARG_IS_A(chrStr, lxStringClass, 3);
-    dedupString(AS_STRING(self));
-    // TODO: allow string longer than 1 char, or check size of given string
-    char *chars = VAL_TO_STRING(chrStr)->chars;
-    char chr = chars[0];
-    if (strlen(chars) == 1) {
-      stringIndexSet(self, AS_NUMBER(index), chr);
+    ObjString *selfStr = AS_STRING(self);
+    ObjString *chrBuf = AS_STRING(chrStr);
+    dedupString(selfStr);
+    size_t charIdx = (size_t)AS_NUMBER(index);
+    size_t byteIdx = stringCharOffset(selfStr, charIdx);
+    // replacing one byte with another doesn't move anything
+    if (chrBuf->length == 1 && stringCharWidth(selfStr, byteIdx) <= 1) {
+      stringIndexSet(self, byteIdx, chrBuf->chars[0]);
     } else {
-      stringInsertAt(self, chrStr, (int)AS_NUMBER(index), true);
+      stringInsertAt(self, chrStr, charIdx, true);
     }
     return self;
 }
@@ -217,26 +219,39 @@ static Value lxStringOpEquals(int argCount, Value *args) {
     return BOOL_VAL(stringEquals(args[0], args[1]));
 }
 
+// The parts share one copy of the string's characters, with a NUL byte
+// written over the start of each separator to terminate the part before it.
 static Value lxStringSplit(int argCount, Value *args) {
     CHECK_ARITY("String#split", 2, 2, argCount);
     Value self = args[0];
     Value pat = args[1];
     CHECK_ARG_IS_A(pat, lxStringClass, 1);
     Value ret = newArray();
-    char *hay = AS_CSTRING(self);
-    char *needle = AS_CSTRING(pat);
-    char *end = hay + strlen(hay);
+    ObjString *selfStr = AS_STRING(self);
+    ObjString *patStr = AS_STRING(pat);
+    char *hay = selfStr->chars;
+    char *start = hay;
+    char *end = hay + selfStr->length;
+    if (hay == end) {
+      return ret;
+    }
+    char *bufChars = ALLOCATE(char, selfStr->length+1);
+    memcpy(bufChars, hay, selfStr->length+1);
+    ObjString *buf = takeString(bufChars, selfStr->length, NEWOBJ_FLAG_FROZEN);
 
-    char *res = NULL;
+    const char *res = NULL;
     // ex: hay: "hello,,there", needle: ",,"
     // TODO: support regexes as pat
-    while (hay < end && (res = strstr(hay, needle)) != NULL) {
-      ObjString *part = copyString(hay, res - hay, NEWOBJ_FLAG_NONE);
-      hay = res + strlen(needle);
-      arrayPush(ret, OBJ_VAL(part));
+    while (patStr->length > 0 && hay < end &&
+            (res = strFind(hay, end - hay, patStr->chars, patStr->length)) != NULL) {
+      char *partChars = bufChars + (hay - start);
+      size_t partLen = res - hay;
+      partChars[partLen] = '\0';
+      arrayPush(ret, OBJ_VAL(sharedSlice(buf, partChars, partLen)));
+      hay += partLen + patStr->length;
     }
     if (hay != end) {
-      ObjString *part = copyString(hay, end - hay, NEWOBJ_FLAG_NONE);
+      ObjString *part = sharedSlice(buf, bufChars + (hay - start), end - hay);
       arrayPush(ret, OBJ_VAL(part));
     }
     return ret;
@@ -252,14 +267,16 @@ static Value lxStringPadRight(int argCount, Value *args) {
     ObjString *selfStr = AS_STRING(self);
     ObjString *padStr = AS_STRING(padChar);
     int newLen = AS_NUMBER(lenVal);
-    int oldLen = selfStr->length;
-    if (newLen <= oldLen) {
+    int oldLen = stringCharLength(selfStr);
+    size_t padWidth = stringCharWidth(padStr, 0);
+    if (newLen <= oldLen || padWidth == 0) {
       return self;
     }
-    int bytesToPad = newLen - oldLen;
-    while (bytesToPad > 0) {
-      pushCString(selfStr, padStr->chars, 1);
-      bytesToPad--;
+    dedupString(selfStr);
+    int charsToPad = newLen - oldLen;
+    while (charsToPad > 0) {
+      pushCString(selfStr, padStr->chars, padWidth);
+      charsToPad--;
     }
     return self;
 }
@@ -271,14 +288,19 @@ static Value lxStringRest(int argCount, Value *args) {
     ObjString *selfStr = AS_STRING(self);
     CHECK_ARG_BUILTIN_TYPE(startVal, IS_NUMBER_FUNC, "number", 1);
     int start = AS_NUMBER(startVal);
-    if (start < 0 || (size_t)start >= selfStr->length) {
+    if (start < 0 || (size_t)start >= stringCharLength(selfStr)) {
       return OBJ_VAL(emptyString());
     }
-    ObjString *ret = copyString(selfStr->chars+start, selfStr->length-start, NEWOBJ_FLAG_NONE);
+    ObjString *ret = stringSuffix(selfStr, stringCharOffset(selfStr, start));
     return OBJ_VAL(ret);
 }
 
 static Value lxStringGetSize(int argCount, Value *args) {
+    ObjString *str = AS_STRING(*args);
+    return NUMBER_VAL(stringCharLength(str));
+}
+
+static Value lxStringGetBytesize(int argCount, Value *args) {
     ObjString *str = AS_STRING(*args);
     return NUMBER_VAL(str->length);
 }
@@ -287,69 +309,99 @@ static Value lxStringEndsWith(int argCount, Value *args) {
     CHECK_ARITY("String#endsWith", 2, 2, argCount);
     Value self = args[0];
     Value endsPat = args[1];
-    bool endsWith = false;
     CHECK_ARG_IS_A(endsPat, lxStringClass, 1);
-    char *hay = AS_CSTRING(self);
-    char *needle = AS_CSTRING(endsPat);
-    if (strlen(needle) > strlen(hay)) {
+    ObjString *hay = AS_STRING(self);
+    ObjString *needle = AS_STRING(endsPat);
+    if (needle->length > hay->length) {
       return BOOL_VAL(false);
     }
-    char *hayEnd = hay + strlen(hay);
-    char *hayStart = hayEnd - strlen(needle);
-    if (strncmp(hayStart, needle, strlen(needle)) == 0) {
-      endsWith = true;
-    }
-
-    return BOOL_VAL(endsWith);
+    char *hayStart = hay->chars + hay->length - needle->length;
+    return BOOL_VAL(memcmp(hayStart, needle->chars, needle->length) == 0);
 }
 
 static Value lxStringCompact(int argCount, Value *args) {
     CHECK_ARITY("String#compact", 1, 1, argCount);
-    Value self = args[0];
-    char *orig = AS_CSTRING(self);
-    ObjString *new = copyString("", 0, NEWOBJ_FLAG_NONE);
-    char *start = orig;
-    char *end = start + strlen(orig)-1;
-    while (start < end && isspace(*start)) {
-      start++;
-    }
-    while (end > start && isspace(*end)) {
-      end--;
-    }
-    if (start < end) {
-      pushCString(new, start, end-start+1);
-    }
-    return OBJ_VAL(new);
+    ObjString *orig = AS_STRING(args[0]);
+    size_t lead = strSpanSpace(orig->chars, orig->length);
+    size_t trail = strSpanSpaceBack(orig->chars+lead, orig->length-lead);
+    return OBJ_VAL(copyString(orig->chars+lead, orig->length-lead-trail, NEWOBJ_FLAG_NONE));
 }
 
 static Value lxStringCompactLeft(int argCount, Value *args) {
     CHECK_ARITY("String#compactLeft", 1, 1, argCount);
-    Value self = args[0];
-    char *orig = AS_CSTRING(self);
-    ObjString *new = copyString("", 0, NEWOBJ_FLAG_NONE);
-    char *start = orig;
-    char *end = start + strlen(orig)-1;
-    while (start < end && isspace(*start)) {
-      start++;
-    }
-    if (start < end) {
-      pushCString(new, start, end-start+1);
-    }
-    return OBJ_VAL(new);
+    ObjString *orig = AS_STRING(args[0]);
+    size_t lead = strSpanSpace(orig->chars, orig->length);
+    return OBJ_VAL(stringSuffix(orig, lead));
 }
 
 static Value lxStringIndex(int argCount, Value *args) {
     CHECK_ARITY("String#index", 2, 2, argCount);
     Value self = args[0];
     Value needleVal = args[1];
-    char *hay = AS_CSTRING(self);
-    char *needle = AS_CSTRING(needleVal);
-    char *found = strstr(hay, needle);
+    CHECK_ARG_IS_A(needleVal, lxStringClass, 1);
+    ObjString *hay = AS_STRING(self);
+    ObjString *needle = AS_STRING(needleVal);
+    const char *found = strFind(hay->chars, hay->length, needle->chars, needle->length);
     if (found == NULL) {
       return NIL_VAL;
     } else {
-      return NUMBER_VAL(found-hay);
+      return NUMBER_VAL(stringCharIndexAt(hay, found-hay->chars));
+    }
+}
+
+// Characters are codepoints in UTF-8 strings, see stringCharOffset()
+// ex: "abc".chars() => ["a", "b", "c"]
+static Value lxStringChars(int argCount, Value *args) {
+    CHECK_ARITY("String#chars", 1, 1, argCount);
+    ObjString *selfStr = AS_STRING(args[0]);
+    Value ret = newArray();
+    size_t i = 0;
+    while (i < selfStr->length) {
+      size_t width = stringCharWidth(selfStr, i);
+      arrayPush(ret, OBJ_VAL(stringCharAt(selfStr, i, width)));
+      i += width;
+    }
+    return ret;
+}
+
+// ex: "abc".eachChar() -> (c) { print c; };
+static Value lxStringEachChar(int argCount, Value *args) {
+    CHECK_ARITY("String#eachChar", 1, 1, argCount);
+    Value self = *args;
+    ObjString *selfStr = AS_STRING(self);
+    CallInfo *cinfo = getFrame()->callInfo;
+    BlockIterFunc fn = cinfo->blockIterFunc;
+    ObjInstance *blockInstance = getBlockArg(getFrame());
+    Value block = blockCallableFromC(blockInstance);
+    push(block); // keep it reachable between yields
+    CallInfo yinfo;
+    initYieldInfo(&yinfo, blockInstance);
+    Value ret = self;
+    size_t i = 0;
+    while (i < selfStr->length) {
+        size_t width = stringCharWidth(selfStr, i);
+        Value chr = OBJ_VAL(stringCharAt(selfStr, i, width));
+        i += width;
+        BlockStatus status;
+        Value blockRet = yieldFromC(block, 1, &chr, &yinfo, &status);
+        if (status == BLOCK_ST_BREAK) {
+            ret = NIL_VAL;
+            break;
+        }
+        if (fn) {
+            int iterFlags = 0;
+            fn(1, &chr, blockRet, cinfo, &iterFlags);
+            if (iterFlags & ITER_FLAG_STOP) {
+                ret = NIL_VAL;
+                break;
+            }
+        } else if (status == BLOCK_ST_RETURN) {
+            ret = blockRet;
+            break;
+        }
     }
+    pop();
+    return ret;
 }
 
 static Value lxStringStaticParseInt(int argCount, Value *args) {
@@ -370,28 +422,31 @@ void Init_StringClass() {
     addNativeMethod(stringClassStatic, "parseInt", lxStringStaticParseInt);
 
     // methods
-    addNativeMethod(stringClass, "toString", lxStringToString);
+    addLeafNativeMethod(stringClass, "toString", lxStringToString);
     addNativeMethod(stringClass, "inspect", lxStringInspect);
-    addNativeMethod(stringClass, "opAdd", lxStringOpAdd);
-    addNativeMethod(stringClass, "opMul", lxStringOpMul);
-    addNativeMethod(stringClass, "opIndexGet", lxStringOpIndexGet);
-    addNativeMethod(stringClass, "opIndexSet", lxStringOpIndexSet);
-    addNativeMethod(stringClass, "opEquals", lxStringOpEquals);
-    addNativeMethod(stringClass, "push", lxStringPush);
-    addNativeMethod(stringClass, "opShovelLeft", lxStringPush);
-    addNativeMethod(stringClass, "clear", lxStringClear);
-    addNativeMethod(stringClass, "insertAt", lxStringInsertAt);
-    addNativeMethod(stringClass, "substr", lxStringSubstr);
+    addLeafNativeMethod(stringClass, "opAdd", lxStringOpAdd);
+    addLeafNativeMethod(stringClass, "opMul", lxStringOpMul);
+    addLeafNativeMethod(stringClass, "opIndexGet", lxStringOpIndexGet);
+    addLeafNativeMethod(stringClass, "opIndexSet", lxStringOpIndexSet);
+    addLeafNativeMethod(stringClass, "opEquals", lxStringOpEquals);
+    addLeafNativeMethod(stringClass, "push", lxStringPush);
+    addLeafNativeMethod(stringClass, "opShovelLeft", lxStringPush);
+    addLeafNativeMethod(stringClass, "clear", lxStringClear);
+    addLeafNativeMethod(stringClass, "insertAt", lxStringInsertAt);
+    addLeafNativeMethod(stringClass, "substr", lxStringSubstr);
     addNativeMethod(stringClass, "dup", lxStringDup);
-    addNativeMethod(stringClass, "split", lxStringSplit);
-    addNativeMethod(stringClass, "endsWith", lxStringEndsWith);
-    addNativeMethod(stringClass, "compact", lxStringCompact);
-    addNativeMethod(stringClass, "compactLeft", lxStringCompactLeft);
-    addNativeMethod(stringClass, "padRight", lxStringPadRight);
-    addNativeMethod(stringClass, "rest", lxStringRest);
-    addNativeMethod(stringClass, "index", lxStringIndex);
+    addLeafNativeMethod(stringClass, "split", lxStringSplit);
+    addLeafNativeMethod(stringClass, "endsWith", lxStringEndsWith);
+    addLeafNativeMethod(stringClass, "compact", lxStringCompact);
+    addLeafNativeMethod(stringClass, "compactLeft", lxStringCompactLeft);
+    addLeafNativeMethod(stringClass, "padRight", lxStringPadRight);
+    addLeafNativeMethod(stringClass, "rest", lxStringRest);
+    addLeafNativeMethod(stringClass, "index", lxStringIndex);
+    addLeafNativeMethod(stringClass, "chars", lxStringChars);
+    addLoopIterNativeMethod(stringClass, "eachChar", lxStringEachChar, LOOP_ITER_EACH);
     // TODO: add startsWith, rindex
 
     // getters
-    addNativeGetter(stringClass, "size", lxStringGetSize);
+    addLeafNativeGetter(stringClass, "size", lxStringGetSize);
+    addLeafNativeGetter(stringClass, "bytesize", lxStringGetBytesize);
 }
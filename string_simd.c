@@ -0,0 +1,243 @@
+#include <string.h>
+#include "string_simd.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define STRING_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+static inline int isSpaceByte(unsigned char c) {
+    return c == ' ' || (unsigned char)(c - '\t') <= ('\r' - '\t');
+}
+
+static const char *findScalar(const char *hay, size_t hayLen, const char *needle, size_t needleLen) {
+    const char *last = hay + hayLen - needleLen;
+    const char *p = hay;
+    while (p <= last) {
+        p = (const char*)memchr(p, needle[0], last - p + 1);
+        if (p == NULL) return NULL;
+        if (memcmp(p + 1, needle + 1, needleLen - 1) == 0) return p;
+        p++;
+    }
+    return NULL;
+}
+
+#ifdef STRING_SIMD_X86
+// Candidate positions are the ones where both the first and the last byte
+// of the needle match, only those get a memcmp(). Needle is at least 2
+// bytes and no longer than the haystack.
+static const char *findSSE2(const char *hay, size_t hayLen, const char *needle, size_t needleLen) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needleLen-1]);
+    size_t i = 0;
+    for (; i + needleLen - 1 + 16 <= hayLen; i += 16) {
+        __m128i blockFirst = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i blockLast = _mm_loadu_si128((const __m128i*)(hay + i + needleLen - 1));
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(first, blockFirst),
+                                   _mm_cmpeq_epi8(last, blockLast));
+        unsigned mask = (unsigned)_mm_movemask_epi8(eq);
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, needleLen - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return findScalar(hay + i, hayLen - i, needle, needleLen);
+}
+
+__attribute__((target("avx2")))
+static const char *findAVX2(const char *hay, size_t hayLen, const char *needle, size_t needleLen) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needleLen-1]);
+    size_t i = 0;
+    // 64 bytes per iteration while there are no candidates
+    for (; i + needleLen - 1 + 64 <= hayLen; i += 64) {
+        const char *p = hay + i;
+        __m256i eq0 = _mm256_and_si256(
+            _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i*)p)),
+            _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i*)(p + needleLen - 1))));
+        __m256i eq1 = _mm256_and_si256(
+            _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i*)(p + 32))),
+            _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i*)(p + 32 + needleLen - 1))));
+        __m256i any = _mm256_or_si256(eq0, eq1);
+        if (_mm256_testz_si256(any, any)) continue;
+        uint64_t mask = (uint64_t)(uint32_t)_mm256_movemask_epi8(eq0) |
+            ((uint64_t)(uint32_t)_mm256_movemask_epi8(eq1) << 32);
+        while (mask) {
+            unsigned bit = __builtin_ctzll(mask);
+            if (memcmp(p + bit + 1, needle + 1, needleLen - 2) == 0) {
+                return p + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    for (; i + needleLen - 1 + 32 <= hayLen; i += 32) {
+        __m256i blockFirst = _mm256_loadu_si256((const __m256i*)(hay + i));
+        __m256i blockLast = _mm256_loadu_si256((const __m256i*)(hay + i + needleLen - 1));
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst),
+                                      _mm256_cmpeq_epi8(last, blockLast));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(eq);
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, needleLen - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return findSSE2(hay + i, hayLen - i, needle, needleLen);
+}
+
+typedef const char *(*FindFn)(const char *hay, size_t hayLen, const char *needle, size_t needleLen);
+static const char *findResolve(const char *hay, size_t hayLen, const char *needle, size_t needleLen);
+static FindFn findImpl = findResolve;
+
+static const char *findResolve(const char *hay, size_t hayLen, const char *needle, size_t needleLen) {
+    __builtin_cpu_init();
+    findImpl = __builtin_cpu_supports("avx2") ? findAVX2 : findSSE2;
+    return findImpl(hay, hayLen, needle, needleLen);
+}
+
+// bytes of `block` that are whitespace, as a bitmask
+static inline unsigned spaceMaskSSE2(__m128i block) {
+    __m128i ctl = _mm_sub_epi8(block, _mm_set1_epi8('\t'));
+    __m128i isCtl = _mm_cmpeq_epi8(_mm_min_epu8(ctl, _mm_set1_epi8('\r' - '\t')), ctl);
+    __m128i isSpace = _mm_cmpeq_epi8(block, _mm_set1_epi8(' '));
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(isCtl, isSpace));
+}
+#else
+static const char *(*findImpl)(const char *, size_t, const char *, size_t) = findScalar;
+#endif
+
+const char *strFind(const char *hay, size_t hayLen, const char *needle, size_t needleLen) {
+    if (needleLen == 0) return hay;
+    if (needleLen > hayLen) return NULL;
+    if (needleLen == 1) return (const char*)memchr(hay, needle[0], hayLen);
+    return findImpl(hay, hayLen, needle, needleLen);
+}
+
+size_t strSpanSpace(const char *s, size_t len) {
+    size_t i = 0;
+#ifdef STRING_SIMD_X86
+    for (; i + 16 <= len; i += 16) {
+        unsigned notSpace = ~spaceMaskSSE2(_mm_loadu_si128((const __m128i*)(s + i))) & 0xFFFF;
+        if (notSpace) return i + __builtin_ctz(notSpace);
+    }
+#endif
+    while (i < len && isSpaceByte(s[i])) i++;
+    return i;
+}
+
+size_t strSpanSpaceBack(const char *s, size_t len) {
+    size_t i = len;
+#ifdef STRING_SIMD_X86
+    for (; i >= 16; i -= 16) {
+        unsigned notSpace = ~spaceMaskSSE2(_mm_loadu_si128((const __m128i*)(s + i - 16))) & 0xFFFF;
+        if (notSpace) return len - (i - 16) - (32 - __builtin_clz(notSpace));
+    }
+#endif
+    while (i > 0 && isSpaceByte(s[i-1])) i--;
+    return len - i;
+}
+
+size_t strAsciiSpan(const char *s, size_t len) {
+    size_t i = 0;
+#ifdef STRING_SIMD_X86
+    for (; i + 64 <= len; i += 64) {
+        __m128i b0 = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(s + i + 16));
+        __m128i b2 = _mm_loadu_si128((const __m128i*)(s + i + 32));
+        __m128i b3 = _mm_loadu_si128((const __m128i*)(s + i + 48));
+        __m128i any = _mm_or_si128(_mm_or_si128(b0, b1), _mm_or_si128(b2, b3));
+        if (_mm_movemask_epi8(any)) break;
+    }
+    for (; i + 16 <= len; i += 16) {
+        unsigned high = (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s + i)));
+        if (high) return i + __builtin_ctz(high);
+    }
+#endif
+    while (i < len && (unsigned char)s[i] < 0x80) i++;
+    return i;
+}
+
+bool strValidUtf8(const char *str, size_t len) {
+    const unsigned char *s = (const unsigned char*)str;
+    size_t i = 0;
+    while (i < len) {
+        i += strAsciiSpan(str + i, len - i);
+        if (i == len) break;
+        unsigned char c = s[i];
+        size_t numCont;
+        uint32_t cp, min;
+        if (c >= 0xC2 && c <= 0xDF) {
+            numCont = 1; cp = c & 0x1F; min = 0x80;
+        } else if ((c & 0xF0) == 0xE0) {
+            numCont = 2; cp = c & 0x0F; min = 0x800;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            numCont = 3; cp = c & 0x07; min = 0x10000;
+        } else {
+            return false;
+        }
+        if (len - i <= numCont) return false;
+        for (size_t k = 1; k <= numCont; k++) {
+            if ((s[i+k] & 0xC0) != 0x80) return false;
+            cp = (cp << 6) | (s[i+k] & 0x3F);
+        }
+        if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+            return false;
+        }
+        i += numCont + 1;
+    }
+    return true;
+}
+
+static inline uint64_t read64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// wyhash-style mixing: 64x64->128 bit multiply, folded
+static inline uint64_t mix64(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t r = a * (b | 1);
+    return r ^ (r >> 32) ^ b;
+#endif
+}
+
+#define HASH_S0 0xa0761d6478bd642full
+#define HASH_S1 0xe7037ed1a0b428dbull
+#define HASH_S2 0x8ebc6af09c88c6e3ull
+#define HASH_S3 0x589965cc75374cc3ull
+
+uint32_t strHashLong(const char *key, size_t len) {
+    const char *p = key;
+    size_t i = len;
+    uint64_t seed = HASH_S0 ^ len;
+    if (i > 48) {
+        uint64_t seed1 = seed, seed2 = seed;
+        do {
+            seed = mix64(read64(p) ^ HASH_S1, read64(p + 8) ^ seed);
+            seed1 = mix64(read64(p + 16) ^ HASH_S2, read64(p + 24) ^ seed1);
+            seed2 = mix64(read64(p + 32) ^ HASH_S3, read64(p + 40) ^ seed2);
+            p += 48;
+            i -= 48;
+        } while (i > 48);
+        seed ^= seed1 ^ seed2;
+    }
+    while (i > 16) {
+        seed = mix64(read64(p) ^ HASH_S1, read64(p + 8) ^ seed);
+        p += 16;
+        i -= 16;
+    }
+    // the last 16 bytes, overlapping what's already mixed in if needed
+    uint64_t a = read64(p + i - 16);
+    uint64_t b = read64(p + i - 8);
+    uint64_t h = mix64(HASH_S1 ^ len, mix64(a ^ HASH_S1, b ^ seed));
+    return (uint32_t)(h ^ (h >> 32));
+}
@@ -0,0 +1,35 @@
+#ifndef clox_string_simd_h
+#define clox_string_simd_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Length-aware byte string primitives. On x86-64 they scan 16 or 32 bytes
+ * at a time with SSE2/AVX2 (picked at runtime), elsewhere they fall back to
+ * scalar loops. None of them stop at NUL bytes.
+ */
+
+// First occurrence of `needle` in `hay`, or NULL
+const char *strFind(const char *hay, size_t hayLen, const char *needle, size_t needleLen);
+// Number of leading whitespace bytes (as isspace() in the C locale)
+size_t strSpanSpace(const char *s, size_t len);
+// Number of trailing whitespace bytes
+size_t strSpanSpaceBack(const char *s, size_t len);
+// Number of leading bytes below 0x80
+size_t strAsciiSpan(const char *s, size_t len);
+// Whether `s` is well-formed UTF-8: no overlong forms, surrogates or
+// codepoints past U+10FFFF
+bool strValidUtf8(const char *s, size_t len);
+// Hash for strings of 16 bytes or more, reads 8 bytes at a time
+uint32_t strHashLong(const char *key, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,15 +7,11 @@
 #include "value.h"
 #include "debug.h"
 
-#define TABLE_MAX_LOAD 0.75
-
-/**
- * TODO: if two different values (not valEqual) hash to the same number, the first is
- * overridden. This is an implementation issue, `table->entries` should be a 2
- * dimensional array, backed by a dynamic array for each hash bucket.
- *
- * NOTE: iteration order isn't necessarily the insertion order.
- */
+#define INDEX_EMPTY (-1)
+#define INDEX_DELETED (-2)
+#define INDEX_MIN_SIZE 8
+// At most 2/3 of the index slots are in use, which keeps probe sequences short
+#define USABLE_ENTRIES(indexSize) (((indexSize)*2)/3)
 
 // sentinel value for NULL key
 #ifdef NAN_TAGGING
@@ -39,140 +35,197 @@ Entry TBL_EMPTY_ENTRY = {
 };
 #endif
 
+static inline size_t indexSlotWidth(int indexSize) {
+    if (indexSize <= 128) return sizeof(int8_t);
+    if (indexSize <= 32768) return sizeof(int16_t);
+    return sizeof(int32_t);
+}
+
+// entries, hashes and index share one allocation
+static inline size_t tableAllocSize(int indexSize) {
+    int entriesCapa = USABLE_ENTRIES(indexSize);
+    return (sizeof(Entry)+sizeof(uint32_t))*entriesCapa +
+        indexSlotWidth(indexSize)*indexSize;
+}
+
+static inline int32_t indexGet(Table *table, uint32_t slot) {
+    int indexSize = table->capacityMask+1;
+    if (indexSize <= 128) return ((int8_t*)table->index)[slot];
+    if (indexSize <= 32768) return ((int16_t*)table->index)[slot];
+    return ((int32_t*)table->index)[slot];
+}
+
+static inline void indexSet(Table *table, uint32_t slot, int32_t val) {
+    int indexSize = table->capacityMask+1;
+    if (indexSize <= 128) {
+        ((int8_t*)table->index)[slot] = (int8_t)val;
+    } else if (indexSize <= 32768) {
+        ((int16_t*)table->index)[slot] = (int16_t)val;
+    } else {
+        ((int32_t*)table->index)[slot] = val;
+    }
+}
+
 void initTable(Table *table) {
     table->count = 0;
-    // There are, at most, capacityMask+1 existing entry pointers in the table
+    // There are, at most, capacityMask+1 existing index slots in the table
     table->capacityMask = -1;
+    table->used = 0;
+    table->entriesCapa = 0;
     table->entries = NULL;
+    table->hashes = NULL;
+    table->index = NULL;
+}
+
+static void allocTable(Table *table, int indexSize) {
+    uint8_t *mem = ALLOCATE(uint8_t, tableAllocSize(indexSize));
+    table->capacityMask = indexSize-1;
+    table->entriesCapa = USABLE_ENTRIES(indexSize);
+    table->entries = (Entry*)mem;
+    table->hashes = (uint32_t*)(mem + sizeof(Entry)*table->entriesCapa);
+    table->index = table->hashes + table->entriesCapa;
+    memset(table->index, 0xff, indexSlotWidth(indexSize)*indexSize); // INDEX_EMPTY
+}
+
+static int indexSizeFor(size_t numEntries) {
+    int indexSize = INDEX_MIN_SIZE;
+    while ((size_t)USABLE_ENTRIES(indexSize) < numEntries) {
+        indexSize *= 2;
+    }
+    return indexSize;
 }
 
 void initTableWithCapa(Table *table, size_t capa) {
+    initTable(table);
     if (capa == 0) {
-        initTable(table);
         return;
     }
-    table->count = 0;
-    // There are, at most, capacityMask+1 existing entry pointers in the table
-    table->capacityMask = (int)(capa-1);
-    Entry *entries = ALLOCATE(Entry, capa);
-    for (size_t i = 0 ; i < capa; i++) {
-        memcpy(entries+i, &TBL_EMPTY_ENTRY, sizeof(Entry));
-    }
-    table->entries = entries;
+    allocTable(table, indexSizeFor(capa));
 }
 
 size_t tableCapacity(Table *table) {
-    return (size_t)(table->capacityMask+1);
+    return (size_t)table->entriesCapa;
 }
 
 void freeTable(Table *table) {
-    FREE_ARRAY(Entry, table->entries, table->capacityMask + 1);
+    if (table->entries) {
+        FREE_ARRAY(uint8_t, table->entries, tableAllocSize(table->capacityMask+1));
+    }
     initTable(table);
 }
 
-uint32_t findEntry(Entry *entries, int capacityMask, Value key) {
-    // NOTE: valHash() can call method `hashKey()` if key is an instance
-    uint32_t index = valHash(key) & capacityMask;
-
-    // We don't worry about an infinite loop here because resize() ensures
-    // there are empty slots in the array.
+// Returns the index slot that points to `key`'s entry, filling `entryIdx`
+// with the entry's position, or if `key` isn't in the table returns the slot
+// it should be inserted in and sets `entryIdx` to -1. We don't worry about an
+// infinite loop because there are always empty slots in the index.
+static uint32_t findSlot(Table *table, Value key, uint32_t hash, int32_t *entryIdx) {
+    uint32_t slot = hash & table->capacityMask;
+    int64_t firstDeleted = -1;
     for (;;) {
-        Entry *entry = &entries[index];
-
+        int32_t ix = indexGet(table, slot);
+        if (ix == INDEX_EMPTY) {
+            *entryIdx = -1;
+            return firstDeleted >= 0 ? (uint32_t)firstDeleted : slot;
+        } else if (ix == INDEX_DELETED) {
+            if (firstDeleted < 0) firstDeleted = slot;
         // NOTE: valEqual() can call `opEquals()` if entry key is an instance
-        if ((IS_UNDEF(entry->key)) || (valEqual(entry->key, key))) {
-            return index;
+        } else if (table->hashes[ix] == hash && valEqual(table->entries[ix].key, key)) {
+            *entryIdx = ix;
+            return slot;
         }
-
-        index = (index + 1) & capacityMask;
+        slot = (slot + 1) & table->capacityMask;
     }
 }
 
-static void resize(Table *table, int capacityMask) {
-    /*fprintf(stderr, "Resize\n");*/
-    Entry *entries = ALLOCATE(Entry, capacityMask + 1);
-    for (int i = 0; i <= capacityMask; i++) {
-        memcpy(entries+i, &TBL_EMPTY_ENTRY, sizeof(Entry));
-    }
+int tableFindIndex(Table *table, Value key) {
+    if (table->count == 0) return -1;
+    // NOTE: valHash() can call method `hashKey()` if key is an instance
+    uint32_t hash = valHash(key);
+    int32_t ix = -1;
+    findSlot(table, key, hash, &ix);
+    return ix;
+}
 
+// Copy the live entries into a new allocation big enough for `numEntries`,
+// dropping tombstones. Uses the cached hashes, so no hashKey() or opEquals()
+// methods get called.
+static void rebuild(Table *table, size_t numEntries) {
+    Table old = *table;
+    // grow by 2x when the table is full of live entries, stay the same size
+    // when it's mostly tombstones
+    allocTable(table, indexSizeFor(numEntries > (size_t)(old.count*3/2) ? numEntries : (size_t)(old.count*3/2)));
+    table->used = 0;
     table->count = 0;
-    for (int i = 0; i <= table->capacityMask; i++) {
-        Entry *entry = &table->entries[i];
+    for (int i = 0; i < old.used; i++) {
+        Entry *entry = &old.entries[i];
         if (IS_UNDEF(entry->key)) continue;
-
-        uint32_t index = findEntry(entries, capacityMask, entry->key);
-        Entry *dest = &entries[index];
-        dest->key = entry->key;
-        dest->value = entry->value;
+        uint32_t hash = old.hashes[i];
+        uint32_t slot = hash & table->capacityMask;
+        while (indexGet(table, slot) != INDEX_EMPTY) {
+            slot = (slot + 1) & table->capacityMask;
+        }
+        indexSet(table, slot, table->used);
+        table->entries[table->used] = *entry;
+        table->hashes[table->used] = hash;
+        table->used++;
         table->count++;
     }
-
-    /*fprintf(stderr, "/Resize freearray\n");*/
-    FREE_ARRAY(Entry, table->entries, table->capacityMask + 1);
-    /*fprintf(stderr, "/Resize freearray\n");*/
-    table->entries = entries;
-    table->capacityMask = capacityMask;
-    /*fprintf(stderr, "/Resize\n");*/
+    if (old.entries) {
+        FREE_ARRAY(uint8_t, old.entries, tableAllocSize(old.capacityMask+1));
+    }
 }
 
 bool tableSet(Table *table, Value key, Value value) {
-    /*fprintf(stderr, "tableSet\n");*/
-    if (table->count + 1 > (table->capacityMask + 1) * TABLE_MAX_LOAD) {
-        // Figure out the new table size.
-        int capacityMask = GROW_CAPACITY(table->capacityMask + 1) - 1;
-        resize(table, capacityMask);
+    uint32_t hash = valHash(key);
+    int32_t ix = -1;
+    uint32_t slot = 0;
+    if (table->entries) {
+        slot = findSlot(table, key, hash, &ix);
+        if (ix >= 0) {
+            table->entries[ix].key = key;
+            table->entries[ix].value = value;
+            return false;
+        }
+    }
+    if (table->used >= table->entriesCapa) {
+        rebuild(table, table->count+1);
+        slot = findSlot(table, key, hash, &ix);
     }
+    ix = table->used++;
+    indexSet(table, slot, ix);
+    table->entries[ix].key = key;
+    table->entries[ix].value = value;
+    table->hashes[ix] = hash;
+    table->count++;
+    return true;
+}
 
-    /*fprintf(stderr, "findEntry\n");*/
-    uint32_t index = findEntry(table->entries, table->capacityMask, key);
-    /*fprintf(stderr, "/findEntry\n");*/
-    Entry *entry = &table->entries[index];
-    bool isNewKey = IS_UNDEF(entry->key);
-    entry->key = key;
-    entry->value = value;
-
-    if (isNewKey) table->count++;
-    /*fprintf(stderr, "/tableSet\n");*/
-    return isNewKey;
+static void deleteAt(Table *table, uint32_t slot, int32_t ix) {
+    indexSet(table, slot, INDEX_DELETED);
+    table->entries[ix] = TBL_EMPTY_ENTRY;
+    table->count--;
+    if (table->count == 0) {
+        // nothing to keep, start over from the beginning of the arrays
+        int indexSize = table->capacityMask+1;
+        memset(table->index, 0xff, indexSlotWidth(indexSize)*indexSize);
+        table->used = 0;
+    }
 }
 
 bool tableDelete(Table* table, Value key) {
     if (table->count == 0) return false;
 
-    uint32_t index = findEntry(table->entries, table->capacityMask, key);
-    Entry *entry = &table->entries[index];
-    if (IS_UNDEF(entry->key)) return false;
-
-    // Remove the entry.
-    entry->key = TBL_EMPTY_KEY;
-    entry->value = NIL_VAL;
-    table->count--;
-
-    // Later entries may have been pushed past this one and may need to be pushed
-    // up to fill the hole. The simplest way to handle that is to just re-add
-    // them all until we hit an empty entry.
-    for (;;) {
-        index = (index + 1) & table->capacityMask;
-        entry = &table->entries[index];
-
-        if (IS_UNDEF(entry->key)) break;
-
-        Value tempKey = entry->key;
-        Value tempValue = entry->value;
-        entry->key = TBL_EMPTY_KEY;
-        entry->value = NIL_VAL;
-        table->count--;
-
-        tableSet(table, tempKey, tempValue);
-    }
-
+    uint32_t hash = valHash(key);
+    int32_t ix = -1;
+    uint32_t slot = findSlot(table, key, hash, &ix);
+    if (ix < 0) return false;
+    deleteAt(table, slot, ix);
     return true;
 }
 
 void tableEachEntry(Table *table, TableEntryCb cb) {
-    int numEntrySlots = table->capacityMask+1;
     if (table->count == 0) return;
-    for (int i = 0; i < numEntrySlots; i++) {
+    for (int i = 0; i < table->used; i++) {
         Entry e = table->entries[i];
         if (!IS_UNDEF(e.key)) {
             cb(&e);
@@ -180,9 +233,21 @@ void tableEachEntry(Table *table, TableEntryCb cb) {
     }
 }
 
+// Replace the contents of `to` with a copy of `from`. Because the layout
+// doesn't depend on where the table lives, this is a plain memory copy.
+void tableCopy(Table *from, Table *to) {
+    freeTable(to);
+    if (from->count == 0) return;
+    size_t sz = tableAllocSize(from->capacityMask+1);
+    allocTable(to, from->capacityMask+1);
+    memcpy(to->entries, from->entries, sz);
+    to->count = from->count;
+    to->used = from->used;
+}
+
 void tableAddAll(Table *from, Table *to) {
-    if (from->entries == NULL) return;
-    for (int i = 0; i <= from->capacityMask; i++) {
+    if (from->count == 0) return;
+    for (int i = 0; i < from->used; i++) {
         Entry *entry = &from->entries[i];
         if (!IS_UNDEF(entry->key)) {
             tableSet(to, entry->key, entry->value);
@@ -190,46 +255,97 @@ void tableAddAll(Table *from, Table *to) {
     }
 }
 
-ObjString *tableFindString(Table *table, const char* chars, size_t length,
-        uint32_t hash) {
-    // If the table is empty, we definitely won't find it.
-    if (table->entries == NULL) return NULL;
+#define INTERN_MIN_SIZE 256
+
+void initInternTable(InternTable *table) {
+    table->count = 0;
+    table->capacityMask = -1;
+    table->entries = NULL;
+}
 
-    uint32_t index = hash & table->capacityMask;
+void freeInternTable(InternTable *table) {
+    if (table->entries) {
+        FREE_ARRAY(InternEntry, table->entries, table->capacityMask+1);
+    }
+    initInternTable(table);
+}
 
-    for (;;) {
-        Entry *entry = &table->entries[index];
+static inline bool internEntryMatches(InternEntry *entry, const char *chars,
+        size_t length, uint32_t hash) {
+    return entry->hash == hash && entry->length == (uint32_t)length &&
+        entry->string->length == length &&
+        memcmp(entry->string->chars, chars, length) == 0;
+}
 
-        if (UNLIKELY(IS_UNDEF(entry->key))) return NULL;
-        if (IS_STRING(entry->key)) {
-            ObjString *stringKey = AS_STRING(entry->key);
-            if (stringKey->hash && stringKey->hash == hash) {
-                return stringKey;
-            }
-            if (stringKey->length == length &&
-                    memcmp(stringKey->chars, chars, length) == 0) {
-                // We found it.
-                return stringKey;
-            }
+ObjString *internTableFind(InternTable *table, const char *chars, size_t length,
+        uint32_t hash) {
+    if (table->count == 0) return NULL;
+    uint32_t slot = hash & table->capacityMask;
+    for (;;) {
+        InternEntry *entry = &table->entries[slot];
+        if (entry->string == NULL) return NULL;
+        if (internEntryMatches(entry, chars, length, hash)) {
+            return entry->string;
         }
+        slot = (slot + 1) & table->capacityMask;
+    }
+}
+
+static void internTableInsert(InternEntry *entries, int capacityMask,
+        ObjString *string, uint32_t hash) {
+    uint32_t slot = hash & capacityMask;
+    while (entries[slot].string != NULL) {
+        slot = (slot + 1) & capacityMask;
+    }
+    entries[slot].hash = hash;
+    entries[slot].length = (uint32_t)string->length;
+    entries[slot].string = string;
+}
 
-        // Try the next slot.
-        index = (index + 1) & table->capacityMask;
+// `string` must not be in the table yet. Keeps the table at most half full.
+void internTableAdd(InternTable *table, ObjString *string, uint32_t hash) {
+    if ((table->count+1)*2 > table->capacityMask+1) {
+        int oldSize = table->capacityMask+1;
+        int newSize = oldSize == 0 ? INTERN_MIN_SIZE : oldSize*2;
+        InternEntry *entries = ALLOCATE(InternEntry, newSize);
+        memset(entries, 0, sizeof(InternEntry)*newSize);
+        for (int i = 0; i < oldSize; i++) {
+            InternEntry *entry = &table->entries[i];
+            if (entry->string == NULL) continue;
+            internTableInsert(entries, newSize-1, entry->string, entry->hash);
+        }
+        if (table->entries) {
+            FREE_ARRAY(InternEntry, table->entries, oldSize);
+        }
+        table->entries = entries;
+        table->capacityMask = newSize-1;
     }
+    internTableInsert(table->entries, table->capacityMask, string, hash);
+    table->count++;
+}
 
-    return NULL;
+// Interned strings live as long as the VM: C code and VM fields hold on to
+// them without marking them.
+void grayInternTable(InternTable *table) {
+    for (int i = 0; i <= table->capacityMask; i++) {
+        if (table->entries[i].string) {
+            grayObject((Obj*)table->entries[i].string);
+        }
+    }
 }
 
 Entry tableNthEntry(Table *table, int n, int *entryIndex) {
     Entry e = TBL_EMPTY_ENTRY; int entryIdx = 0;
     int validEntryIdx = 0;
-    TABLE_FOREACH(table, e, entryIdx, {
+    for (entryIdx = 0; entryIdx < table->used; entryIdx++) {
+        e = table->entries[entryIdx];
+        if (IS_UNDEF(e.key)) continue;
         if (n == validEntryIdx) {
             *entryIndex = entryIdx;
             return e;
         }
         validEntryIdx++;
-    })
+    }
     *entryIndex = -1;
     return e; // trashed data in this case, caller should always check entryIndex out value
 }
@@ -237,24 +353,30 @@ Entry tableNthEntry(Table *table, int n, int *entryIndex) {
 // remove unmarked object keys from table
 void tableRemoveWhite(Table *table) {
     if (table->count == 0) return;
-    for (int i = 0; i <= table->capacityMask; i++) {
+    for (int i = 0; i < table->used; i++) {
         Entry *entry = &table->entries[i];
         if (IS_UNDEF(entry->key)) {
             continue;
         }
-        if (IS_OBJ(entry->key) && !OBJ_IS_DARK(AS_OBJ(entry->key))) {
-            tableDelete(table, entry->key);
+        if (IS_OBJ(entry->key) && !GCIsMarked(AS_OBJ(entry->key))) {
+            // find the index slot through the cached hash, we can't call
+            // hashKey() or opEquals() during GC
+            uint32_t slot = table->hashes[i] & table->capacityMask;
+            while (indexGet(table, slot) != i) {
+                slot = (slot + 1) & table->capacityMask;
+            }
+            deleteAt(table, slot, i);
+            if (table->count == 0) return;
         }
     }
 }
 
 void grayTable(Table *table) {
     if (table->count == 0) return;
-    for (int i = 0; i <= table->capacityMask; i++) {
+    for (int i = 0; i < table->used; i++) {
         ASSERT(table->entries);
         Entry *entry = &table->entries[i];
-        ASSERT(entry);
-        if (!entry || (IS_UNDEF(entry->key))) continue;
+        if (IS_UNDEF(entry->key)) continue;
         grayValue(entry->key);
         grayValue(entry->value);
     }
@@ -262,11 +384,10 @@ void grayTable(Table *table) {
 
 void blackenTable(Table *table) {
     if (table->count == 0) return;
-    for (int i = 0; i <= table->capacityMask; i++) {
+    for (int i = 0; i < table->used; i++) {
         ASSERT(table->entries);
         Entry *entry = &table->entries[i];
-        if (!entry || (IS_UNDEF(entry->key))) continue;
-        ASSERT(entry);
+        if (IS_UNDEF(entry->key)) continue;
         if (IS_OBJ(entry->key)) {
             blackenObject(AS_OBJ(entry->key));
         }
@@ -8,8 +8,14 @@
 extern "C" {
 #endif
 
-/* Value table, maps values to values. Doesn't preserve insertion order during
- * iteration. */
+/* Value table, maps values to values. Iteration follows insertion order.
+ *
+ * Entries are kept in a dense array in insertion order, along with the cached
+ * hash of each key. A separate sparse index (open addressing, linear probing)
+ * maps hashes to positions in the dense array. Index slots are 8, 16 or 32
+ * bits wide depending on the size of the table. Deleting leaves a tombstone
+ * (UNDEF key) in the dense array, tombstones are dropped the next time the
+ * table is rebuilt. */
 
 typedef struct Entry {
   Value key;
@@ -17,9 +23,13 @@ typedef struct Entry {
 } Entry;
 
 typedef struct Table {
-  int count;
-  int capacityMask;
-  Entry *entries;
+  int count; // number of live entries
+  int capacityMask; // number of index slots - 1
+  int used; // number of dense entries in use, including tombstones
+  int entriesCapa; // number of dense entries allocated
+  Entry *entries; // dense, in insertion order
+  uint32_t *hashes; // hash of each dense entry's key
+  void *index; // sparse index into `entries`. Shares an allocation with them.
 } Table;
 
 typedef void (*TableEntryCb)(Entry *e);
@@ -28,79 +38,88 @@ void initTable(Table *table);
 void initTableWithCapa(Table *table, size_t capa);
 void freeTable(Table *table); // free internal table structures, not table itself
 
-uint32_t findEntry(Entry *entries, int capacityMask, Value key);
+// Returns the position of `key` in `table->entries`, or -1
+int tableFindIndex(Table *table, Value key);
+// fills given Value with found value, if any
 static inline bool tableGet(Table *table, Value key, Value *value) {
     // If the table is empty, we definitely won't find it.
-    if (table->entries == NULL) return false;
+    if (table->count == 0) return false;
 
-    uint32_t index = findEntry(table->entries, table->capacityMask, key);
-    Entry *entry = &table->entries[index];
-    if (IS_UNDEF(entry->key)) return false;
-    *value = entry->value;
+    int index = tableFindIndex(table, key);
+    if (index < 0) return false;
+    *value = table->entries[index].value;
     return true;
 }
-// fills given Value with found value, if any
 bool tableSet(Table *table, Value key, Value value);
 bool tableDelete(Table *table, Value key);
 void tableAddAll(Table *from, Table *to);
+void tableCopy(Table *from, Table *to);
 void tableEachEntry(Table *table, TableEntryCb func);
 Entry tableNthEntry(Table *table, int n, int *entryIdx);
 
+// Iterate in insertion order with a cursor that starts at 0. Fills `entry`
+// with the next live entry at or after the cursor and moves the cursor past
+// it. Returns false when there are no more entries.
+static inline bool tableNext(Table *table, int *iter, Entry *entry) {
+    while (*iter < table->used) {
+        Entry *e = &table->entries[(*iter)++];
+        if (!IS_UNDEF(e->key)) {
+            *entry = *e;
+            return true;
+        }
+    }
+    return false;
+}
+
 size_t tableCapacity(Table *table);
 
-#ifdef NAN_TAGGING
-#define TABLE_FOREACH(tbl, entry, idx, exec)\
-  idx = 0;\
-  if ((tbl)->count > 0) {\
-    for (int _i = 0;\
-         ((_i < (tbl)->capacityMask+1) &&\
-         (entry = (tbl)->entries[_i]).key != QNAN); _i++) {\
-        if (entry.key == UNDEF_VAL) { continue; } else {\
-            exec\
-            idx++;\
-        }\
-    }\
-  }
-#define TABLE_FOREACH_IDX(tbl, entry, idx, exec)\
-  if ((tbl)->count > 0) {\
-    for (;\
-         (((idx) < (tbl)->capacityMask+1) &&\
-         (entry = (tbl)->entries[idx]).key != QNAN); (idx)++) {\
-        if (entry.key == UNDEF_VAL) { continue; } else {\
-            exec\
-        }\
-    }\
-  }
-#else
-// NOTE: condition with value '555' uses this value just so that the rhs of
-// the expression results in a valid test expression, instead of just the
-// assignment itself. This test always returns true.
 #define TABLE_FOREACH(tbl, entry, idx, exec)\
   idx = 0;\
-  if ((tbl)->count > 0) {\
-    for (int _i = 0;\
-         ((_i < (tbl)->capacityMask+1) &&\
-         (entry = (tbl)->entries[_i]).key.type != 555); _i++) {\
-        if (entry.key.type == VAL_T_UNDEF) { continue; } else {\
-            exec\
-            idx++;\
-        }\
-    }\
+  for (int _i = 0; _i < (tbl)->used; _i++) {\
+      entry = (tbl)->entries[_i];\
+      if (IS_UNDEF(entry.key)) { continue; } else {\
+          exec\
+          idx++;\
+      }\
   }
+// `idx` is a position in the dense entries array
 #define TABLE_FOREACH_IDX(tbl, entry, idx, exec)\
-  if ((tbl)->count > 0) {\
-    for (;\
-         (((idx) < (tbl)->capacityMask+1) &&\
-         (entry = (tbl)->entries[idx]).key.type != 555); (idx)++) {\
-        if (entry.key.type == VAL_T_UNDEF) { continue; } else {\
-            exec\
-        }\
-    }\
+  for (; (idx) < (tbl)->used; (idx)++) {\
+      entry = (tbl)->entries[idx];\
+      if (IS_UNDEF(entry.key)) { continue; } else {\
+          exec\
+      }\
   }
-#endif
 
-struct ObjString *tableFindString(Table* table, const char* chars, size_t length,
+/* Set of interned strings, open addressing with linear probing. Each slot
+ * keeps the string's hash and length next to it, so probing only touches
+ * the characters of strings that match both. */
+typedef struct InternEntry {
+  uint32_t hash;
+  uint32_t length; // truncated, full length is checked on the string
+  struct ObjString *string; // NULL if the slot is empty
+} InternEntry;
+
+typedef struct InternTable {
+  int count;
+  int capacityMask; // number of slots - 1
+  InternEntry *entries;
+} InternTable;
+
+void initInternTable(InternTable *table);
+void freeInternTable(InternTable *table);
+struct ObjString *internTableFind(InternTable *table, const char *chars, size_t length,
                            uint32_t hash);
+void internTableAdd(InternTable *table, struct ObjString *string, uint32_t hash);
+void grayInternTable(InternTable *table);
+
+#define INTERN_TABLE_FOREACH(tbl, str, exec)\
+  for (int _i = 0; _i <= (tbl)->capacityMask; _i++) {\
+      str = (tbl)->entries[_i].string;\
+      if (str == NULL) { continue; } else {\
+          exec\
+      }\
+  }
 
 void tableRemoveWhite(Table *table);
 void grayTable(Table *table);
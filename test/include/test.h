@@ -204,7 +204,9 @@ static inline void parseTestOptions(int argc, char *argv[]) {
     vec_init(skips);
     while (argv[i] != NULL) {
         if (i == 0) { i+= 1; continue; } // program name
-        if ((incrOpt = parseOption(argv, i)) > 0) {
+        if (strcmp(argv[i], "--") == 0) { // end of cmdline options
+          break;
+        } else if ((incrOpt = parseOption(argv, i)) > 0) {
             i+=incrOpt;
         } else if (strcmp(argv[i], "--only") == 0) {
             vec_push(onlies, argv[i+1]);
@@ -212,8 +214,6 @@ static inline void parseTestOptions(int argc, char *argv[]) {
         } else if (strcmp(argv[i], "--skip") == 0) {
             vec_push(skips, argv[i+1]);
             i += 2;
-        } else if (strcmp(argv[i], "--") == 0) { // end of cmdline options
-          break;
         } else {
             die("Invalid option\n");
         }
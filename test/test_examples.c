@@ -65,8 +65,8 @@ static int stringDiff(ObjString *actual, ObjString *expect) {
 static int test_run_example_files(void) {
     DIR *d = getDir("./examples");
     char *onlyFile = NULL; // run only the given example file (cmdline option)
-    if (mainArgc > 1) {
-      onlyFile = mainArgv[mainArgc-1]; // last given cmdline word
+    if (mainArgc > 2 && strcmp(mainArgv[mainArgc-2], "--") == 0) {
+      onlyFile = mainArgv[mainArgc-1]; // ex: test_examples --jit-threshold 1 -- jit.lox
     }
     char fbuf[FILENAME_BUFSZ] = { '\0' };
     if (d == NULL) {
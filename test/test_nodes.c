@@ -486,7 +486,7 @@ static int test_parser_string_interpolation(void) {
     T_ASSERT(!parser.panicMode);
     char *output = outputASTString(program, 0);
     /*fprintf(stderr, "\n'%s'\n", output);*/
-    char *expected = "(+ \"Hey \" (+ (call (const String) ((var name) ) \", how's it going?\"))\n";
+    char *expected = "(interp \"Hey \" (var name) \", how's it going?\")\n";
     T_ASSERT_STREQ(expected, output);
 cleanup:
     return 0;
@@ -2,6 +2,7 @@
 #include "object.h"
 #include "vm.h"
 #include "memory.h"
+#include "string_simd.h"
 
 static int test_string_object(void) {
     ObjString *string = copyString("", 0, NEWOBJ_FLAG_NONE);
@@ -27,12 +28,104 @@ cleanup:
     return 0;
 }
 
+static const char *naiveFind(const char *hay, size_t hayLen, const char *needle, size_t needleLen) {
+    for (size_t i = 0; i + needleLen <= hayLen; i++) {
+        if (memcmp(hay + i, needle, needleLen) == 0) return hay + i;
+    }
+    return NULL;
+}
+
+// needles at every offset of haystacks around the 16 and 32 byte block sizes
+static int test_string_find(void) {
+    char hay[200];
+    for (size_t hayLen = 0; hayLen < sizeof(hay); hayLen++) {
+        for (size_t i = 0; i < hayLen; i++) {
+            hay[i] = 'a' + (i % 3);
+        }
+        const char *needles[] = { "b", "ca", "abd", "cabca", "abcabcabcabcabcabcd", "bcabcabcabcabcabcabcabcabcabcabcabca" };
+        for (size_t n = 0; n < sizeof(needles)/sizeof(needles[0]); n++) {
+            size_t needleLen = strlen(needles[n]);
+            T_ASSERT_EQ(naiveFind(hay, hayLen, needles[n], needleLen),
+                        strFind(hay, hayLen, needles[n], needleLen));
+        }
+        if (hayLen > 0) {
+            hay[hayLen-1] = 'z';
+            T_ASSERT_EQ(hay+hayLen-1, strFind(hay, hayLen, "z", 1));
+            if (hayLen > 1) {
+                T_ASSERT_EQ(hay+hayLen-2, strFind(hay, hayLen, hay+hayLen-2, 2));
+            }
+        }
+    }
+cleanup:
+    return 0;
+}
+
+static int test_string_span_space(void) {
+    char buf[100];
+    for (size_t len = 0; len < sizeof(buf); len++) {
+        for (size_t spaces = 0; spaces <= len; spaces++) {
+            memset(buf, 'x', len);
+            for (size_t i = 0; i < spaces; i++) {
+                buf[i] = " \t\n\v\f\r"[i % 6];
+                buf[len-1-i] = " \t\n\v\f\r"[i % 6];
+            }
+            size_t expected = 2*spaces >= len ? len : spaces;
+            T_ASSERT_EQ(expected, strSpanSpace(buf, len));
+            T_ASSERT_EQ(expected, strSpanSpaceBack(buf, len));
+        }
+    }
+cleanup:
+    return 0;
+}
+
+static int test_string_hash_long(void) {
+    char buf[128];
+    memset(buf, 'a', sizeof(buf));
+    for (size_t len = 16; len < sizeof(buf); len++) {
+        uint32_t hash = hashString(buf, len);
+        buf[len-1] = 'b';
+        T_ASSERT(hash != hashString(buf, len));
+        buf[len-1] = 'a';
+        T_ASSERT(hash != hashString(buf, len-1));
+        T_ASSERT_EQ(hash, hashString(buf, len));
+    }
+cleanup:
+    return 0;
+}
+
+static int test_string_interning(void) {
+    ObjString *a = INTERNED("interned", 8);
+    T_ASSERT(a == INTERNED("interned", 8));
+    T_ASSERT(a != INTERNED("interned", 7));
+    T_ASSERT(a != INTERNED("internee", 8));
+    // grow the table past a few resizes, earlier entries must still be found
+    char buf[32];
+    for (int i = 0; i < 2000; i++) {
+        snprintf(buf, sizeof(buf), "interned_%d", i);
+        INTERN(buf);
+    }
+    T_ASSERT(a == INTERNED("interned", 8));
+    T_ASSERT(INTERN("interned_1999") == INTERN("interned_1999"));
+    // equal hashes with different contents aren't equal
+    ObjString *b = copyString("abc", 3, NEWOBJ_FLAG_NONE);
+    ObjString *c = copyString("xyz", 3, NEWOBJ_FLAG_NONE);
+    b->hash = c->hash = 42;
+    T_ASSERT(!objStringEquals(b, c));
+    T_ASSERT(!valEqual(OBJ_VAL(b), OBJ_VAL(c)));
+cleanup:
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     parseTestOptions(argc, argv);
     initVM();
     INIT_TESTS("test_object");
     RUN_TEST(test_string_object);
     RUN_TEST(test_string_pushCStringFmt);
+    RUN_TEST(test_string_find);
+    RUN_TEST(test_string_span_space);
+    RUN_TEST(test_string_hash_long);
+    RUN_TEST(test_string_interning);
     freeVM();
     END_TESTS();
 }
@@ -5,6 +5,7 @@
 #include "runtime.h"
 #include "table.h"
 #include "memory.h"
+#include "options.h"
 
 ObjClass *lxThreadClass;
 ObjClass *lxMutexClass;
@@ -128,18 +129,21 @@ static void LxThreadSetup(LxThread *th) {
     th->status = THREAD_STOPPED;
     th->ec = NULL;
     vec_init(&th->v_ecs);
+    th->stackMax = GET_OPTION(maxStack) > 0 ? GET_OPTION(maxStack) : STACK_MAX_DEFAULT;
+    th->framesMax = GET_OPTION(maxFrames) > 0 ? GET_OPTION(maxFrames) : FRAMES_MAX_DEFAULT;
     th->openUpvalues = NULL;
     th->thisObj = NULL;
     vec_init(&th->v_thisStack);
-    vec_reserve(&th->v_thisStack, FRAMES_MAX);
+    vec_reserve(&th->v_thisStack, FRAMES_INITIAL);
     vec_init(&th->v_crefStack);
-    vec_reserve(&th->v_crefStack, FRAMES_MAX);
+    vec_reserve(&th->v_crefStack, FRAMES_INITIAL);
     vec_init(&th->v_blockStack);
-    vec_reserve(&th->v_blockStack, FRAMES_MAX);
+    vec_reserve(&th->v_blockStack, FRAMES_INITIAL);
     vec_init(&th->stackObjects);
     th->lastValue = NULL;
     th->hadError = false;
     th->errInfo = NULL;
+    th->freeErrInfos = NULL;
     th->lastErrorThrown = NIL_VAL;
     th->errorToThrow = NIL_VAL;
     th->inCCall = 0;
@@ -165,6 +169,11 @@ static void LxThreadSetup(LxThread *th) {
 }
 
 static void LxThreadCleanup(LxThread *th) {
+    while (th->freeErrInfos) {
+        ErrTagInfo *next = th->freeErrInfos->prev;
+        FREE(ErrTagInfo, th->freeErrInfos);
+        th->freeErrInfos = next;
+    }
     vec_deinit(&th->v_ecs);
     vec_deinit(&th->v_thisStack);
     vec_deinit(&th->v_crefStack);
@@ -183,7 +192,7 @@ typedef struct NewThreadArgs {
 
 // NOTE: This thread is not running yet, this is just setting it up.
 // It doesn't have a thread id (tid) or its own stack yet.
-static ObjInstance *newThreadSetup(LxThread *parentThread) {
+static ObjInstance *newThreadSetup(LxThread *parentThread, size_t stackMax, size_t framesMax) {
     ASSERT(parentThread);
     THREAD_DEBUG(3, "New thread setup");
     ObjInstance *thInstance = newInstance(lxThreadClass, NEWOBJ_FLAG_OLD|NEWOBJ_FLAG_HIDDEN);
@@ -192,6 +201,8 @@ static ObjInstance *newThreadSetup(LxThread *parentThread) {
     thInstance->internal = internalObj;
     LxThread *th = ALLOCATE(LxThread, 1);
     LxThreadSetup(th);
+    if (stackMax > 0) th->stackMax = stackMax;
+    if (framesMax > 0) th->framesMax = framesMax;
     internalObj->data = th;
 
     // set thread state from current (last) thread
@@ -199,13 +210,21 @@ static ObjInstance *newThreadSetup(LxThread *parentThread) {
     vec_foreach(&parentThread->v_ecs, ctx, ctxIdx) {
         VMExecContext *newCtx = ALLOCATE(VMExecContext, 1);
         memcpy(newCtx, ctx, sizeof(VMExecContext));
-        newCtx->stack = ALLOCATE(Value, ctx->stack_capa);
-        newCtx->stack_capa = ctx->stack_capa;
-        memcpy(newCtx->stack, ctx->stack, sizeof(Value)*newCtx->stack_capa);
-        newCtx->frames = ALLOCATE(CallFrame, ctx->frames_capa);
-        newCtx->frames_capa = ctx->frames_capa;
-        memcpy(newCtx->frames, ctx->frames, sizeof(CallFrame)*ctx->frames_capa);
-        newCtx->stackTop = newCtx->stack + (ctx->stackTop-ctx->stack);
+        size_t stackUsed = ctx->stackTop - ctx->stack;
+        if (stackUsed >= th->stackMax) {
+            throwArgErrorFmt("Thread stack max (%d) is too small, %d values are in use",
+                    (int)th->stackMax, (int)stackUsed);
+        }
+        newCtx->stack = reserveStackArea(VALUE_STACK_BYTES(th->stackMax));
+        newCtx->stack_capa = th->stackMax;
+        newCtx->stackEnd = newCtx->stack + newCtx->stack_capa;
+        newCtx->stackAllocated = true;
+        memcpy(newCtx->stack, ctx->stack, sizeof(Value)*stackUsed);
+        newCtx->frames = reserveStackArea(FRAMES_BYTES(th->framesMax));
+        newCtx->frames_capa = th->framesMax;
+        memcpy(newCtx->frames, ctx->frames, sizeof(CallFrame));
+        newCtx->framesPeak = 1;
+        newCtx->stackTop = newCtx->stack + stackUsed;
         newCtx->stackTop--; // for the two current stack objects that newThread() creates
         newCtx->stackTop--;
         newCtx->frameCount = 1;
@@ -277,14 +296,25 @@ static void *runCallableInNewThread(void *arg) {
 }
 
 
-// usage: newThread(fun() { ... });
+// usage: newThread(fun() { ... }, maxStack=nil, maxFrames=nil);
+// maxStack and maxFrames limit the new thread's stacks, default is the
+// --max-stack and --max-frames options.
 Value lxNewThread(int argCount, Value *args) {
-    CHECK_ARITY("newThread", 1, 1, argCount);
+    CHECK_ARITY("newThread", 1, 3, argCount);
     Value closure = *args;
     CHECK_ARG_BUILTIN_TYPE(closure, IS_CLOSURE_FUNC, "function", 1);
     ObjClosure *func = AS_CLOSURE(closure);
+    size_t limits[2] = {0, 0};
+    for (int i = 1; i < argCount; i++) {
+        if (IS_NIL(args[i])) continue;
+        CHECK_ARG_BUILTIN_TYPE(args[i], IS_NUMBER_FUNC, "number", i+1);
+        if (AS_NUMBER(args[i]) < 1) {
+            throwArgErrorFmt("Expected argument %d to be a positive number", i+1);
+        }
+        limits[i-1] = (size_t)AS_NUMBER(args[i]);
+    }
     pthread_t tnew;
-    ObjInstance *threadInst = newThreadSetup(vm.curThread);
+    ObjInstance *threadInst = newThreadSetup(vm.curThread, limits[0], limits[1]);
     LxThread *th = (LxThread*)threadInst->internal->data;
     ASSERT(th);
     // Argument to pthread_create not called right away, only called when new
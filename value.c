@@ -382,7 +382,7 @@ const char *typeOfVal(Value val) {
 }
 
 // Taken from wren lang
-/*static inline uint32_t hashBits(DoubleBits bits) {
+static inline uint32_t hashBits(DoubleBits bits) {
     uint32_t result = bits.bits32[0] ^ bits.bits32[1];
 
     // Slosh the bits around some. Due to the way doubles are represented, small
@@ -399,7 +399,7 @@ const char *typeOfVal(Value val) {
     result ^= (result >> 20) ^ (result >> 12);
     result ^= (result >> 7) ^ (result >> 4);
     return result;
-}*/
+}
 
 static Value valHashRecursive(Value obj, Value arg, int recurse) {
     (void)arg;
@@ -430,21 +430,11 @@ uint32_t valHash(Value val) {
                 }
                 return (uint32_t)AS_NUMBER(hashKey);
             }
-// TODO: use the hashBits function, and change Map to use an ordered table.
-// Right now the table in table.c does not preserve insertion order, but it
-// turns out it works when we hash the pointer repr of the object (at least,
-// depending on the malloc() implementation and the OS).
-#if 0
-            // Hash the raw bits of the unboxed value.
+            // Hash the object's address. Tables keep insertion order, so
+            // this doesn't affect iteration order.
             DoubleBits bits;
-            bits.bits64 = val;
+            bits.bits64 = (uint64_t)(uintptr_t)AS_OBJ(val);
             return hashBits(bits);
-#else
-            // XXX: hack
-            char buf[20] = {'\0'};
-            snprintf(buf, 20, "%p", AS_OBJ(val));
-            return hashString(buf, strlen(buf)); // hash the pointer string, easiest way but brittle, because an object is not equal to its string pointer repr...
-#endif
         }
     } else {
 #if 0
@@ -484,12 +474,7 @@ bool valEqual(Value a, Value b) {
             return false;
         default: {
             if (IS_STRING(a) && IS_STRING(b)) {
-                ObjString *aStr = AS_STRING(a);
-                ObjString *bStr = AS_STRING(b);
-                if (aStr->hash && bStr->hash) {
-                    return aStr->hash == bStr->hash;
-                }
-                return aStr->length == bStr->length && strcmp(aStr->chars, bStr->chars) == 0;
+                return objStringEquals(AS_STRING(a), AS_STRING(b));
             }
             if (IS_INSTANCE_LIKE(a)) {
                 return AS_BOOL(callMethod(AS_OBJ(a), vm.opEqualsString, 1, &b, NULL));
@@ -509,8 +494,7 @@ bool valEqual(Value a, Value b) {
             return b.type == VAL_T_NUMBER && AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_T_OBJ: {
             if (IS_STRING(a) && IS_STRING(b)) {
-                return strcmp(VAL_TO_STRING(a)->chars,
-                        VAL_TO_STRING(b)->chars) == 0;
+                return objStringEquals(AS_STRING(a), AS_STRING(b));
             }
             if (IS_INSTANCE_LIKE(a)) {
                 return AS_BOOL(callMethod(AS_OBJ(a), vm.opEqualsString, 1, &b, NULL));
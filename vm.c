@@ -2,6 +2,8 @@
 #include <setjmp.h>
 #include <signal.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
 #include "common.h"
 #include "vm.h"
 #include "debug.h"
@@ -10,6 +12,7 @@
 #include "memory.h"
 #include "compiler.h"
 #include "nodes.h"
+#include "jit.h"
 
 VM vm;
 
@@ -76,22 +79,54 @@ char *unredefinableGlobals[] = {
     NULL,
 };
 
-static bool isUnredefinableGlobal(char *name) {
-    ASSERT(name);
+// Returns the slot of global variable `name`, adding an undefined one if
+// it doesn't have one yet.
+int globalSlot(ObjString *name) {
+    Value slot;
+    if (tableGet(&vm.globals, OBJ_VAL(name), &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+    int idx = vm.globalValues.count;
+    writeValueArrayEnd(&vm.globalValues, UNDEF_VAL);
+    tableSet(&vm.globals, OBJ_VAL(name), NUMBER_VAL(idx));
+    return idx;
+}
+
+void setGlobal(ObjString *name, Value val) {
+    int slot = globalSlot(name); // can grow globalValues
+    vm.globalValues.values[slot] = val;
+}
+
+bool getGlobal(ObjString *name, Value *valOut) {
+    Value slot;
+    if (!tableGet(&vm.globals, OBJ_VAL(name), &slot)) {
+        return false;
+    }
+    Value val = vm.globalValues.values[(int)AS_NUMBER(slot)];
+    if (IS_UNDEF(val)) return false;
+    *valOut = val;
+    return true;
+}
+
+// The unredefinable globals and the read-only ones from the exec context
+// (__FILE__, __DIR__, __FUNC__) get the first slots, so the VM only has to
+// compare the slot index when a script assigns to a global.
+static void reserveGlobalSlots(void) {
     char **glbl = unredefinableGlobals;
     while (*glbl != NULL) {
-        if (strcmp(name, *glbl) == 0) {
-            return true;
-        }
+        globalSlot(INTERN(*glbl));
         glbl++;
     }
-    return false;
+    globalSlot(vm.fileString);
+    globalSlot(vm.dirString);
+    globalSlot(vm.funcString);
+    vm.numReservedGlobals = vm.globalValues.count;
 }
 
 static void defineNativeFunctions(void) {
-    addGlobalFunction("clock", lxClock);
-    addGlobalFunction("typeof", lxTypeof);
-    addGlobalFunction("classof", lxClassof);
+    addLeafGlobalFunction("clock", lxClock);
+    addLeafGlobalFunction("typeof", lxTypeof);
+    addLeafGlobalFunction("classof", lxClassof);
     addGlobalFunction("loadScript", lxLoadScript);
     addGlobalFunction("requireScript", lxRequireScript);
     addGlobalFunction("autoload", lxAutoload);
@@ -221,6 +256,7 @@ static void defineNativeClasses(void) {
     ObjClass *errClass = addGlobalClass("Error", objClass);
     lxErrClass = errClass;
     nativeErrorInit = addNativeMethod(errClass, "init", lxErrInit);
+    addNativeGetter(errClass, "backtrace", lxErrGetBacktrace);
 
     // class ArgumentError
     ObjClass *argErrClass = addGlobalClass("ArgumentError", errClass);
@@ -268,12 +304,15 @@ static void defineNativeClasses(void) {
     addNativeMethod(GCClassStatic, "on", lxGCOn);
     addNativeMethod(GCClassStatic, "off", lxGCOff);
     addNativeMethod(GCClassStatic, "setFinalizer", lxGCSetFinalizer);
+    addNativeMethod(GCClassStatic, "setMarkBitmap", lxGCSetMarkBitmap);
+    addNativeMethod(GCClassStatic, "prepareFork", lxGCPrepareFork);
     lxGCModule = GCModule;
 
     // order of initialization not important here
     Init_RegexClass();
     Init_ProcessModule();
     Init_SignalModule();
+    Init_WorkerPoolModule();
     Init_IOClass();
     Init_FileClass();
     Init_DirClass();
@@ -302,7 +341,7 @@ static void defineGlobalVariables(void) {
     ASSERT(IS_ARRAY(loadPathVal));
     lxLoadPath = AS_ARRAY(loadPathVal);
     ObjString *loadPathStr = INTERN("loadPath");
-    ASSERT(tableSet(&vm.globals, OBJ_VAL(loadPathStr), loadPathVal));
+    setGlobal(loadPathStr, loadPathVal);
 
     addToDefaultLoadPath(loadPathVal, "lib");
     addToDefaultLoadPath(loadPathVal, "ext");
@@ -323,7 +362,7 @@ static void defineGlobalVariables(void) {
     Value argvVal = newArray();
     ASSERT(IS_ARRAY(argvVal));
     lxArgv = AS_ARRAY(argvVal);
-    ASSERT(tableSet(&vm.constants, OBJ_VAL(argvStr), argvVal));
+    addGlobalConstant(argvStr, argvVal);
     ASSERT(origArgv);
     ASSERT(origArgc >= 1);
     for (int i = getOptions()->index; i < origArgc; i++) {
@@ -386,8 +425,65 @@ Value createIterator(Value iterable) {
 static jmp_buf rootVMLoopJumpBuf;
 static bool rootVMLoopJumpBufSet = false;
 
+// Where errors caught by a frame run by a vm_run() invocation land. Lox
+// functions called from the dispatch loop run in the caller's invocation, so
+// there's one pad per native entry into the VM, not one per call frame. The
+// pad is armed (setjmp) the first time the invocation enters a chunk with a
+// catch table, so calling a function containing `try` costs the same as
+// calling any other function.
+typedef struct VMRunPad {
+    jmp_buf jmpBuf;
+    bool armed;
+    int vmRunLvl;
+    int inCCall; // th->inCCall when the invocation started
+    // call info of the block frames of the iterators this invocation runs
+    // (see runLoopIter()), set up by the first one. Nested ones share it,
+    // a block frame's exit status is used as soon as it returns.
+    bool loopBlockInfoSet;
+    CallInfo loopBlockInfo;
+} VMRunPad;
+
 static int curLine = 1; // TODO: per thread
 
+static size_t stackPageSize(void) {
+    static size_t pageSize = 0;
+    if (pageSize == 0) pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    return pageSize;
+}
+
+// Value stacks and call frames are reserved at their maximum size, and the
+// OS only backs the pages that get touched. They grow without moving, so
+// CallFrame.slots, open upvalues and the `args` pointers given to natives
+// stay valid. An inaccessible guard page follows the area.
+void *reserveStackArea(size_t size) {
+    size_t pageSize = stackPageSize();
+    size = (size + pageSize - 1) & ~(pageSize - 1);
+    char *area = mmap(NULL, size + pageSize, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) {
+        die("Unable to reserve VM stack of %lu bytes: %s", (unsigned long)size, strerror(errno));
+    }
+    mprotect(area + size, pageSize, PROT_NONE);
+    return area;
+}
+
+void releaseStackArea(void *area, size_t size) {
+    size_t pageSize = stackPageSize();
+    size = (size + pageSize - 1) & ~(pageSize - 1);
+    munmap(area, size + pageSize);
+}
+
+// Give back the pages of [from, to) to the OS. They read as zeroes if
+// they're touched again.
+static void discardStackPages(void *from, void *to) {
+    uintptr_t pageSize = stackPageSize();
+    uintptr_t start = ((uintptr_t)from + pageSize - 1) & ~(pageSize - 1);
+    uintptr_t end = (uintptr_t)to & ~(pageSize - 1);
+    if (end > start) {
+        madvise((void*)start, end - start, MADV_DONTNEED);
+    }
+}
+
 // Add and use a new execution context. Execution contexts
 // hold the value stack.
 static inline void push_EC(bool allocateStack) {
@@ -397,13 +493,14 @@ static inline void push_EC(bool allocateStack) {
     initTable(&ectx->roGlobals);
     ectx->frameCount = 0;
     if (allocateStack) {
-      ectx->stack = ALLOCATE(Value, STACK_INITIAL);
-      ectx->stack_capa = STACK_INITIAL;
+      ectx->stack = reserveStackArea(VALUE_STACK_BYTES(th->stackMax));
+      ectx->stack_capa = th->stackMax;
+      ectx->stackEnd = ectx->stack + ectx->stack_capa;
       ectx->stackAllocated = true;
       ectx->stackTop = ectx->stack;
     }
-    ectx->frames = ALLOCATE(CallFrame, FRAMES_INITIAL);
-    ectx->frames_capa = FRAMES_INITIAL;
+    ectx->frames = reserveStackArea(FRAMES_BYTES(th->framesMax));
+    ectx->frames_capa = th->framesMax;
     vec_push(&th->v_ecs, ectx);
     th->ec = ectx; // EC = ectx
 }
@@ -414,9 +511,9 @@ static inline void pop_EC(void) {
     ASSERT(th->v_ecs.length > 0);
     VMExecContext *ctx = (VMExecContext*)vec_pop(&th->v_ecs);
     if (ctx->stackAllocated) {
-      FREE_SIZE(sizeof(Value)*ctx->stack_capa, ctx->stack);
+      releaseStackArea(ctx->stack, VALUE_STACK_BYTES(ctx->stack_capa));
     }
-    FREE_SIZE(sizeof(CallFrame)*ctx->frames_capa, ctx->frames);
+    releaseStackArea(ctx->frames, FRAMES_BYTES(ctx->frames_capa));
     freeTable(&ctx->roGlobals);
     FREE(VMExecContext, ctx);
     if (th->v_ecs.length == 0) {
@@ -441,6 +538,40 @@ void resetStack(void) {
     EC->frameCount = 0;
 }
 
+// don't bother giving back less than this
+#define STACK_SHRINK_MIN (64*1024)
+
+/**
+ * Gives the pages of `th`'s stacks and call frames that are above what's in
+ * use back to the OS, if the thread used a lot more than it uses now. Called
+ * when the thread releases the GVL, so threads that are idle after deep
+ * recursion don't keep their peak stack memory. Only the call depth is
+ * tracked (CallFrame pushes are counted, value pushes aren't), and the value
+ * stack is shrunk along with the frames.
+ */
+void shrinkThreadStacks(LxThread *th) {
+    VMExecContext *ctx = NULL; int ctxIdx = 0;
+    Value *liveTop = NULL; // eval contexts share their parent's value stack
+    bool shrinkValues = false;
+    for (ctxIdx = th->v_ecs.length-1; ctxIdx >= 0; ctxIdx--) {
+        ctx = th->v_ecs.data[ctxIdx];
+        if (ctx->stackTop > liveTop) liveTop = ctx->stackTop;
+        if (ctx->framesPeak > ctx->frameCount &&
+                sizeof(CallFrame)*(ctx->framesPeak - ctx->frameCount) >= STACK_SHRINK_MIN) {
+            discardStackPages(ctx->frames + ctx->frameCount,
+                    (char*)ctx->frames + FRAMES_BYTES(ctx->frames_capa));
+            ctx->framesPeak = ctx->frameCount;
+            shrinkValues = true;
+        }
+        if (!ctx->stackAllocated) continue;
+        if (shrinkValues) {
+            discardStackPages(liveTop, (char*)ctx->stack + VALUE_STACK_BYTES(ctx->stack_capa));
+        }
+        liveTop = NULL;
+        shrinkValues = false;
+    }
+}
+
 static ObjInstance *initMainThread(void) {
     if (pthread_mutex_init(&vm.GVLock, NULL) != 0) {
         die("Global VM lock unable to initialize");
@@ -485,9 +616,15 @@ void initVM() {
     vm.grayStack = NULL;
 
     initTable(&vm.globals);
-    initTable(&vm.strings); // interned strings
+    initValueArray(&vm.globalValues);
+    vm.numReservedGlobals = 0;
+    initInternTable(&vm.strings);
     initTable(&vm.regexLiterals);
     initTable(&vm.constants);
+    vm.constantSerial = 1; // 0 is an empty ConstCache
+    vm.methodSerial = 1;
+    vm.stringInitSerial = 0;
+    vm.stringInitIsNative = false;
     initTable(&vm.autoloadTbl);
     vec_init(&vm.hiddenObjs);
 
@@ -505,6 +642,7 @@ void initVM() {
     vec_init(&vm.exitHandlers);
 
     initDebugger(&vm.debugger);
+    initJit();
     vm.instructionStepperOn = CLOX_OPTION_T(stepVMExecution);
 
     vm.inited = true; // NOTE: VM has to be inited before creation of strings
@@ -526,6 +664,7 @@ void initVM() {
     vm.opIndexSetString = INTERN("opIndexSet");
     vm.opEqualsString = INTERN("opEquals");
     vm.opCmpString = INTERN("opCmp");
+    reserveGlobalSlots();
 
     pushFrame(NULL);
 
@@ -537,10 +676,9 @@ void initVM() {
     popFrame();
 
     // Some of these strings were created Before lxStringClass was assigned to.
-    Entry e;
-    int strIdx = 0;
-    TABLE_FOREACH(&vm.strings, e, strIdx, {
-        AS_STRING(e.key)->klass = lxStringClass;
+    ObjString *str = NULL;
+    INTERN_TABLE_FOREACH(&vm.strings, str, {
+        str->klass = lxStringClass;
     })
 
     resetStack();
@@ -570,8 +708,10 @@ void freeVM(void) {
     rootVMLoopJumpBufSet = false;
 
     freeTable(&vm.globals);
+    freeValueArray(&vm.globalValues);
+    vm.numReservedGlobals = 0;
     freeTable(&vm.regexLiterals);
-    freeTable(&vm.strings);
+    freeInternTable(&vm.strings);
     freeTable(&vm.constants);
     freeTable(&vm.autoloadTbl);
     vm.initString = NULL;
@@ -654,7 +794,7 @@ bool VMLoadedScript(char *fname) {
     return false;
 }
 
-#define ASSERT_VALID_STACK() DBG_ASSERT(EC->stackTop >= EC->stack && EC->stackTop < EC->stack + STACK_MAX)
+#define ASSERT_VALID_STACK() DBG_ASSERT(EC->stackTop >= EC->stack && EC->stackTop <= EC->stackEnd + STACK_RED_ZONE)
 
 static inline bool isOpStackEmpty(void) {
     ASSERT_VALID_STACK();
@@ -670,17 +810,13 @@ static inline bool isOpStackEmpty(void) {
 void push(Value value) {
     ASSERT_VALID_STACK();
     register VMExecContext *ctx = EC;
-    if (UNLIKELY(ctx->stackTop >= ctx->stack + STACK_MAX)) {
+    if (UNLIKELY(ctx->stackTop >= ctx->stackEnd + STACK_RED_ZONE)) {
         errorPrintScriptBacktrace("Stack overflow.");
         int status = 1;
         vm.curThread->status = THREAD_ZOMBIE;
         vm.numLivingThreads--;
         pthread_exit(&status);
     }
-    if (UNLIKELY(ctx->stackTop >= ctx->stack + ctx->stack_capa)) {
-        ctx->stack = GROW_ARRAY(ctx->stack, Value, ctx->stack_capa, ctx->stack_capa*2);
-        ctx->stack_capa *= 2;
-    }
     if (IS_OBJ(value)) {
         DBG_ASSERT(AS_OBJ(value)->type != OBJ_T_NONE);
         OBJ_SET_PUSHED_VM_STACK(AS_OBJ(value)); // for gen gc
@@ -689,15 +825,9 @@ void push(Value value) {
     ctx->stackTop++;
 }
 
+// NOTE: overflow is checked in pushFrame(), see STACK_RED_ZONE
 static inline void vm_push(register LxThread *th, register VMExecContext *ctx, Value value) {
     ASSERT_VALID_STACK();
-    if (UNLIKELY(ctx->stackTop >= ctx->stack + STACK_MAX)) {
-        errorPrintScriptBacktrace("Stack overflow.");
-        int status = 1;
-        th->status = THREAD_ZOMBIE;
-        vm.numLivingThreads--;
-        pthread_exit(&status);
-    }
     if (IS_OBJ(value)) {
         DBG_ASSERT(AS_OBJ(value)->type != OBJ_T_NONE);
         OBJ_SET_PUSHED_VM_STACK(AS_OBJ(value)); // for gen gc
@@ -950,7 +1080,11 @@ void errorPrintScriptBacktrace(const char *format, ...) {
                     fprintf(stderr, "script\n"); // top-level
                 } else {
                     char *fnName = function->name ? function->name->chars : "(anon)";
-                    fprintf(stderr, "%s()\n", fnName);
+                    fprintf(stderr, "%s()", fnName);
+                    if (frame->tailCalls > 0) {
+                        fprintf(stderr, " (%d tail calls elided)", frame->tailCalls);
+                    }
+                    fprintf(stderr, "\n");
                 }
             }
         }
@@ -973,7 +1107,7 @@ static void showUncaughtError(Value err) {
     if (!IS_NIL(msg)) {
         msgStr = VAL_TO_STRING(msg)->chars;
     }
-    Value bt = getProp(err, INTERN("backtrace"));
+    Value bt = errorBacktrace(err);
     ASSERT(!IS_NIL(bt));
     int btSz = ARRAY_SIZE(bt);
     fprintf(stderr, "Uncaught error, class: %s\n", className);
@@ -995,6 +1129,67 @@ static inline bool isBlockControlFlow(Value err) {
     return IS_A(err, lxBlockIterErrClass);
 }
 
+// Frame of a backtrace, captured when an error is thrown. The backtrace's
+// strings are only made if it's read (see errorBacktrace()), so errors
+// that are caught and dropped don't pay for them.
+typedef struct BacktraceFrame {
+    Obj *callable; // ObjFunction or ObjNative, NULL for unknown native or test frames
+    ObjString *file;
+    int line;
+    int tailCalls; // caller frames elided by tail calls
+    bool isNative;
+} BacktraceFrame;
+
+static void markRawBacktrace(Obj *internalObj) {
+    ObjInternal *internal = (ObjInternal*)internalObj;
+    BacktraceFrame *frames = internal->data;
+    int numFrames = (int)(internal->dataSz / sizeof(BacktraceFrame));
+    for (int i = 0; i < numFrames; i++) {
+        if (frames[i].callable) grayObject(frames[i].callable);
+        grayObject(TO_OBJ(frames[i].file));
+    }
+}
+
+static void freeRawBacktrace(Obj *internalObj) {
+    ObjInternal *internal = (ObjInternal*)internalObj;
+    FREE_SIZE(internal->dataSz, internal->data);
+}
+
+static inline bool hasRawBacktrace(ObjInstance *err) {
+    return err->internal && err->internal->freeFunc == freeRawBacktrace;
+}
+
+static Value formatBacktrace(BacktraceFrame *frames, int numFrames) {
+    Value ret = newArray();
+    hideFromGC(AS_OBJ(ret));
+    for (int i = 0; i < numFrames; i++) {
+        BacktraceFrame *frame = &frames[i];
+        ObjString *outBuf = hiddenString("", 0, NEWOBJ_FLAG_NONE);
+        pushCStringFmt(outBuf, "%s:%d in ", frame->file->chars, frame->line);
+        if (frame->isNative) {
+            ObjNative *nativeFunc = (ObjNative*)frame->callable;
+            pushCStringFmt(outBuf, "<%s (native)>\n",
+                    nativeFunc ? nativeFunc->name->chars : "?unknown?");
+        } else {
+            ObjFunction *function = (ObjFunction*)frame->callable;
+            if (!function || function->name == NULL) {
+                pushCString(outBuf, "<script>", 8); // top-level
+            } else {
+                pushCStringFmt(outBuf, "<%s>", function->name->chars);
+            }
+            if (frame->tailCalls > 0) {
+                pushCStringFmt(outBuf, " (%d tail call%s elided)", frame->tailCalls,
+                        frame->tailCalls == 1 ? "" : "s");
+            }
+            pushCString(outBuf, "\n", 1);
+        }
+        arrayPush(ret, OBJ_VAL(outBuf));
+        unhideFromGC(TO_OBJ(outBuf));
+    }
+    unhideFromGC(AS_OBJ(ret));
+    return ret;
+}
+
 void setBacktrace(Value err) {
     if (isBlockControlFlow(err)) {
         return;
@@ -1002,48 +1197,67 @@ void setBacktrace(Value err) {
     VM_DEBUG(2, "Setting backtrace");
     LxThread *th = vm.curThread;
     DBG_ASSERT(IS_AN_ERROR(err));
-    Value ret = newArray();
-    setProp(err, INTERN("backtrace"), ret);
+    ObjInstance *errInst = AS_INSTANCE(err);
     int numECs = th->v_ecs.length;
     VMExecContext *ctx;
+    int numFrames = 0;
+    for (int i = 0; i < numECs; i++) {
+        numFrames += ((VMExecContext*)th->v_ecs.data[i])->frameCount;
+    }
+    BacktraceFrame *frames = ALLOCATE(BacktraceFrame, numFrames);
+    BacktraceFrame *out = frames;
     for (int i = numECs-1; i >= 0; i--) {
         ctx = th->v_ecs.data[i];
         DBG_ASSERT(ctx);
         for (int j = ctx->frameCount - 1; j >= 0; j--) {
             CallFrame *frame = &ctx->frames[j];
-            int line = frame->callLine;
-            ObjString *file = frame->file;
-            ASSERT(file);
-            ObjString *outBuf = hiddenString("", 0, NEWOBJ_FLAG_NONE);
-            Value out = OBJ_VAL(outBuf);
+            ASSERT(frame->file);
+            out->file = frame->file;
+            out->line = frame->callLine;
+            out->tailCalls = frame->tailCalls;
+            out->isNative = frame->isCCall;
             if (frame->isCCall) {
-                ObjNative *nativeFunc = frame->nativeFunc;
-                pushCStringFmt(outBuf, "%s:%d in ", file->chars, line);
-                if (nativeFunc) {
-                    pushCStringFmt(outBuf, "<%s (native)>\n",
-                            nativeFunc->name->chars);
-                } else {
-                    pushCStringFmt(outBuf, "<%s (native)>\n", "?unknown?");
-                }
+                out->callable = TO_OBJ(frame->nativeFunc);
             } else {
-                ObjFunction *function = NULL;
-                function = frame->closure ? frame->closure->function : NULL;
-                pushCStringFmt(outBuf, "%s:%d in ", file->chars, line);
-                // NOTE: function can be null in test cases
-                if (!function || function->name == NULL) {
-                    pushCString(outBuf, "<script>\n", 9); // top-level
-                } else {
-                    char *fnName = function->name ? function->name->chars : (char*)"(anon)";
-                    pushCStringFmt(outBuf, "<%s>\n", fnName);
-                }
+                // NOTE: closure can be null in test cases
+                out->callable = frame->closure ? TO_OBJ(frame->closure->function) : NULL;
             }
-            arrayPush(ret, out);
-            unhideFromGC(TO_OBJ(outBuf));
+            out++;
+        }
+    }
+    if (errInst->internal) { // error class with its own internal data
+        setProp(err, INTERN("backtrace"), formatBacktrace(frames, numFrames));
+        FREE_ARRAY(BacktraceFrame, frames, numFrames);
+        return;
+    }
+    ObjInternal *internal = newInternalObject(false, frames,
+            numFrames * sizeof(BacktraceFrame), markRawBacktrace,
+            freeRawBacktrace, NEWOBJ_FLAG_NONE);
+    errInst->internal = internal;
+    if (IS_OLD_OBJ(TO_OBJ(errInst))) {
+        for (int i = 0; i < numFrames; i++) {
+            if (frames[i].callable) OBJ_WRITE(err, OBJ_VAL(frames[i].callable));
+            OBJ_WRITE(err, OBJ_VAL(frames[i].file));
         }
     }
     VM_DEBUG(2, "/Setting backtrace");
 }
 
+// The backtrace of a thrown error as an array of strings, one per frame.
+// It's made from the frames captured by setBacktrace() the first time it's
+// asked for. Returns nil if the error was never thrown.
+Value errorBacktrace(Value err) {
+    Value ret = getProp(err, INTERN("backtrace"));
+    ObjInstance *errInst = AS_INSTANCE(err);
+    if (!IS_NIL(ret) || !hasRawBacktrace(errInst)) {
+        return ret;
+    }
+    ObjInternal *internal = errInst->internal;
+    ret = formatBacktrace(internal->data, (int)(internal->dataSz / sizeof(BacktraceFrame)));
+    setProp(err, INTERN("backtrace"), ret);
+    return ret;
+}
+
 static inline bool isThrowable(Value val) {
     return IS_AN_ERROR(val);
 }
@@ -1080,6 +1294,62 @@ bool lookupMethod(ObjInstance *obj, Obj *klass, ObjString *propName, MethodType
 static InterpretResult vm_run0(void);
 static InterpretResult vm_run(void);
 
+// Is `frame` the frame of a block called by a yielder that catches block
+// control flow errors (see SETUP_BLOCK)? Functions called from inside the
+// block return normally.
+static inline bool isBlockEntryFrame(LxThread *th, CallFrame *frame) {
+    BlockStackEntry *bentry = vec_last_or(&th->v_blockStack, NULL);
+    return bentry && bentry->frame == frame;
+}
+
+// Block frames called by yieldFromC() don't throw to exit, they return to
+// the yielder and tell it how the block exited.
+#define IS_YIELD_STATUS_FRAME(frame) ((frame)->callInfo && (frame)->callInfo->yieldStatus)
+// The ones pushed by the returning vm_run()'s own loop are called by an
+// iterator it runs (see runLoopIter()), which goes on to its next element.
+#define BLOCK_FRAME_RETURN(st, ret) do {\
+    Value _ret = (ret);\
+    CallFrame *_frame = getFrame();\
+    Value *_newTop = _frame->slots;\
+    _frame->callInfo->blockStatus = (st);\
+    popFrame();\
+    EC->stackTop = _newTop;\
+    VM_PUSH(_ret);\
+    if (EC->frameCount >= baseFrameCount) {\
+        runLoopIter(th, _newTop - LOOP_ITER_SLOTS, true, (st), &pad);\
+        VM_CHECK_INTS(th);\
+        LOAD_FRAME();\
+        if (UNLIKELY(ch->catchTbl != NULL && !pad.armed)) goto armPad;\
+        DISPATCH_BOTTOM();\
+    }\
+    (th->vmRunLvl)--;\
+    return INTERPRET_OK;\
+} while (0)
+
+// Sets the number of active C calls after an unwind, objects allocated by
+// C code are only kept on the stackObjects list while there's one.
+static inline void setInCCall(LxThread *th, int inCCall) {
+    th->inCCall = inCCall;
+    if (inCCall == 0) {
+        vec_clear(&th->stackObjects);
+    }
+}
+
+// Calls a leaf native without a frame. It's still a C call, so the objects
+// it allocates are rooted until it returns (see allocateObject()).
+static inline Value callLeafFunction(LxThread *th, ObjNative *native, int argCount, Value *args) {
+    int lenBefore = th->stackObjects.length;
+    th->inCCall++;
+    Value ret = native->function(argCount, args);
+    th->inCCall--;
+    if (th->inCCall == 0) {
+        vec_clear(&th->stackObjects);
+    } else {
+        th->stackObjects.length = lenBefore;
+    }
+    return ret;
+}
+
 Value propertyGet(ObjInstance *obj, ObjString *propName) {
     Value ret;
     Obj *method = NULL;
@@ -1089,6 +1359,10 @@ Value propertyGet(ObjInstance *obj, ObjString *propName) {
         return ret;
     } else if ((getter = instanceFindGetter(obj, propName))) {
         VM_DEBUG(3, "getter found (propertyGet)");
+        if (getter->type == OBJ_T_NATIVE_FUNCTION && (TO_NATIVE(getter)->flags & NATIVE_FL_LEAF)) {
+            Value self = OBJ_VAL(obj);
+            return callLeafFunction(vm.curThread, TO_NATIVE(getter), 1, &self);
+        }
         callVMMethod(obj, OBJ_VAL(getter), 0, NULL, NULL);
         if (vm.curThread->hadError) {
             return NIL_VAL;
@@ -1156,6 +1430,7 @@ void defineMethod(Value classOrMod, ObjString *name, Value method) {
         (void)klassName;
         VM_DEBUG(2, "defining method '%s' in class '%s'", name->chars, klassName);
         tableSet(CLASSINFO(klass)->methods, OBJ_VAL(name), method);
+        vm.methodSerial++;
         OBJ_WRITE(OBJ_VAL(klass), method);
         GC_OLD(AS_OBJ(method));
         Value methodName = OBJ_VAL(name);
@@ -1166,6 +1441,7 @@ void defineMethod(Value classOrMod, ObjString *name, Value method) {
         (void)modName;
         VM_DEBUG(2, "defining method '%s' in module '%s'", name->chars, modName);
         tableSet(CLASSINFO(mod)->methods, OBJ_VAL(name), method);
+        vm.methodSerial++;
         OBJ_WRITE(OBJ_VAL(mod), method);
         GC_OLD(AS_OBJ(method));
     } else {
@@ -1309,6 +1585,18 @@ Value callFunctionValue(Value callable, int argCount, Value *args) {
     return pop();
 }
 
+// A tag info from `th`'s free list (see freeErrInfo()), or a new one. Not
+// inlined into addErrInfo()'s callers: its local would live across their
+// setjmp().
+NOINLINE ErrTagInfo *newErrInfo(LxThread *th) {
+    ErrTagInfo *info = th->freeErrInfos;
+    if (LIKELY(info != NULL)) {
+        th->freeErrInfos = info->prev;
+        return info;
+    }
+    return ALLOCATE(ErrTagInfo, 1);
+}
+
 static void unwindErrInfo(CallFrame *frame) {
     ErrTagInfo *info = vm.curThread->errInfo;
     while (info && info->frame == frame) {
@@ -1317,7 +1605,7 @@ static void unwindErrInfo(CallFrame *frame) {
             popBlockEntry(info->bentry);
         }
         ErrTagInfo *prev = info->prev;
-        FREE(ErrTagInfo, info);
+        freeErrInfo(vm.curThread, info);
         info = prev;
     }
     vm.curThread->errInfo = info;
@@ -1356,17 +1644,7 @@ void popFrame(void) {
     frame->scope = NULL;
     EC->frameCount--;
     frame = getFrameOrNull(); // prev frame
-    VM_DEBUG(3, "setting roglobals");
     if (LIKELY(frame != NULL)) {
-        if (frame->name) {
-            tableSet(&EC->roGlobals, OBJ_VAL(vm.funcString), OBJ_VAL(frame->name));
-        } else {
-            if (EC->frameCount == 1) {
-                tableSet(&EC->roGlobals, OBJ_VAL(vm.funcString), OBJ_VAL(vm.mainString));
-            } else {
-                tableSet(&EC->roGlobals, OBJ_VAL(vm.funcString), OBJ_VAL(vm.anonString));
-            }
-        }
         if (stackAdjust > 0) {
             if (EC->stackTop-stackAdjust > EC->stack) {
                 EC->stackTop -= stackAdjust;
@@ -1377,29 +1655,57 @@ void popFrame(void) {
     ASSERT_VALID_STACK();
 }
 
+static NORETURN void throwStackOverflow(const char *what, size_t max) {
+    VMExecContext *ec = EC;
+    size_t framesMax = ec->frames_capa;
+    Value *stackEnd = ec->stackEnd;
+    char buf[100];
+    snprintf(buf, sizeof(buf), "Stackoverflow, max number of %s (%d)", what, (int)max);
+    // constructing the error pushes frames and values too
+    ec->frames_capa += FRAMES_OVERFLOW_SLACK;
+    ec->stackEnd += STACK_RED_ZONE;
+    ObjString *msg = copyString(buf, strlen(buf), NEWOBJ_FLAG_NONE);
+    hideFromGC(TO_OBJ(msg));
+    Value err = newError(lxErrClass, OBJ_VAL(msg));
+    unhideFromGC(TO_OBJ(msg));
+    ec->frames_capa = framesMax;
+    ec->stackEnd = stackEnd;
+    vm.curThread->lastErrorThrown = err;
+    throwError(err);
+}
+
+static NORETURN void throwFramesOverflow(void) {
+    throwStackOverflow("call frames", EC->frames_capa);
+}
+
 CallFrame *pushFrame(ObjFunction *userFunc) {
     DBG_ASSERT(vm.inited);
     register VMExecContext *ec = EC;
-    if (UNLIKELY(ec->frameCount >= FRAMES_MAX)) {
-        throwErrorFmt(lxErrClass, "Stackoverflow, max number of call frames (%d)", FRAMES_MAX);
+    if (UNLIKELY(ec->frameCount >= ec->frames_capa)) {
+        throwFramesOverflow();
         UNREACHABLE_RETURN(NULL);
     }
-    if (UNLIKELY(ec->frameCount >= ec->frames_capa)) {
-        ec->frames = GROW_ARRAY(ec->frames, CallFrame, ec->frames_capa, ec->frames_capa*2);
-        ec->frames_capa *= 2;
+    if (UNLIKELY(ec->stackTop >= ec->stackEnd)) {
+        throwStackOverflow("stack values", ec->stackEnd - ec->stack);
+        UNREACHABLE_RETURN(NULL);
     }
     CallFrame *prev = getFrameOrNull();
     CallFrame *frame = &ec->frames[ec->frameCount++];
-    memset(frame, 0, sizeof(*frame));
-    frame->callLine = curLine;
-    frame->file = ec->filename;
-    frame->prev = prev;
+    if (UNLIKELY(ec->frameCount > ec->framesPeak)) {
+        ec->framesPeak = ec->frameCount;
+    }
+    *frame = (CallFrame){
+        .callLine = curLine,
+        .file = ec->filename,
+        .prev = prev,
+    };
     BlockStackEntry *bentry = vec_last_or(&vm.curThread->v_blockStack, NULL);
     if (bentry && bentry->frame == NULL) {
         bentry->frame = frame;
     }
     if (userFunc) {
         frame->scope = newScope(userFunc);
+        jitCountUse(userFunc);
     } else {
         frame->scope = NULL;
     }
@@ -1413,13 +1719,59 @@ const char *callFrameName(CallFrame *frame) {
     return fnName ? fnName->chars : "<main>";
 }
 
+// Are string literals created by the builtin String#init? If so, OP_STRING
+// doesn't need to call String(). Only looked up again after methods change.
+static inline bool isStringInitNative(void) {
+    if (UNLIKELY(vm.stringInitSerial != vm.methodSerial)) {
+        vm.stringInitIsNative =
+            findMethod(TO_OBJ(lxStringClass), vm.initString) == TO_OBJ(nativeStringInit) &&
+            findMethod(TO_OBJ(lxObjClass), vm.initString) == TO_OBJ(nativeObjectInit);
+        vm.stringInitSerial = vm.methodSerial;
+    }
+    return vm.stringInitIsNative;
+}
+
+// Value of __FUNC__ in the given (non-native) frame. It's computed when read
+// instead of being set in roGlobals on every frame push and pop.
+static ObjString *frameFuncName(CallFrame *frame) {
+    if (frame->name) {
+        return frame->name;
+    }
+    return frame == EC->frames ? vm.mainString : vm.anonString;
+}
+
+static void fillConstCache(Value cacheVal, ObjClass *cref, Value val) {
+    ConstCache *cache = internalGetData(AS_INTERNAL(cacheVal));
+    cache->serial = vm.constantSerial;
+    cache->cref = TO_OBJ(cref);
+    cache->value = val;
+    if (cref) OBJ_WRITE(cacheVal, OBJ_VAL(cref));
+    OBJ_WRITE(cacheVal, val);
+}
+
+// OP_GET_GLOBAL for a name whose slot isn't defined: the exec context's
+// read-only globals, then global constants (for try/catch).
+static Value getUndefinedGlobal(CallFrame *frame, ObjString *name) {
+    Value val;
+    if (UNLIKELY(name == vm.funcString)) {
+        return OBJ_VAL(dupString(frameFuncName(frame)));
+    } else if (tableGet(&EC->roGlobals, OBJ_VAL(name), &val)) {
+        if (IS_STRING(val)) {
+            return OBJ_VAL(dupString(AS_STRING(val)));
+        }
+        return val;
+    } else if (tableGet(&vm.constants, OBJ_VAL(name), &val)) {
+        return val;
+    }
+    throwErrorFmt(lxNameErrClass, "Undefined global variable '%s'.", name->chars);
+}
+
 static void pushNativeFrame(ObjNative *native) {
     DBG_ASSERT(vm.inited);
     DBG_ASSERT(native);
     VM_DEBUG(2, "Pushing native callframe for %s", native->name->chars);
-    if (UNLIKELY(EC->frameCount == FRAMES_MAX)) {
-        errorPrintScriptBacktrace("Stack overflow.");
-        return;
+    if (UNLIKELY(EC->frameCount >= EC->frames_capa)) {
+        throwFramesOverflow();
     }
     CallFrame *prevFrame = getFrame();
     CallFrame *newFrame = pushFrame(NULL);
@@ -1445,6 +1797,9 @@ static Value captureNativeError(ObjNative *nativeFunc, int argCount, Value *args
         DBG_ASSERT(argCount > 0); // at least the block argument
         argCount--; // block arg is implicit
     }
+    if (nativeFunc->flags & NATIVE_FL_KWARGS) {
+        argCount--; // keyword args map is at args[argCount]
+    }
     if (th->inCCall == 0) {
         VM_DEBUG(2, "setting VM/C error jump buf");
         int jumpRes = setjmp(th->cCallJumpBuf);
@@ -1468,6 +1823,46 @@ static Value captureNativeError(ObjNative *nativeFunc, int argCount, Value *args
     }
 }
 
+/**
+ * For natives taking keyword arguments, replaces the keyword argument values
+ * on the stack with a Map of them (or nil if none were given). The block
+ * argument, if any, stays on top. Other natives can't be given keyword
+ * arguments. Returns the new argument count.
+ */
+static int pushNativeKwargs(ObjNative *native, int argCount, CallInfo *cinfo) {
+    int numKwargs = cinfo ? cinfo->numKwargs : 0;
+    if (!(native->flags & NATIVE_FL_KWARGS)) {
+        if (UNLIKELY(numKwargs > 0)) {
+            if (native->klass) {
+                throwArgErrorFmt("%s#%s: doesn't take keyword arguments",
+                        className(TO_CLASS(native->klass)), native->name->chars);
+            } else {
+                throwArgErrorFmt("%s: doesn't take keyword arguments", native->name->chars);
+            }
+        }
+        return argCount;
+    }
+    int numBlock = (cinfo && cinfo->blockInstance) ? 1 : 0;
+    Value *kwStart = EC->stackTop - numBlock - numKwargs;
+    Value kwargs = NIL_VAL;
+    if (numKwargs > 0) {
+        kwargs = newMap();
+        hideFromGC(AS_OBJ(kwargs));
+        for (int i = 0; i < numKwargs; i++) {
+            ObjString *kwName = INTERN(tokStr(cinfo->kwargNames+i));
+            mapSet(kwargs, OBJ_VAL(kwName), kwStart[i]);
+        }
+    }
+    Value blockArg = numBlock ? EC->stackTop[-1] : NIL_VAL;
+    kwStart[0] = kwargs;
+    if (numBlock) kwStart[1] = blockArg;
+    EC->stackTop = kwStart + 1 + numBlock;
+    if (numKwargs > 0) {
+        unhideFromGC(AS_OBJ(kwargs));
+    }
+    return argCount - numKwargs + 1;
+}
+
 static inline bool checkFunctionArity(ObjFunction *func, int argCount, CallInfo *cinfo) {
     int arityMin = func->arity;
     int arityMax = arityMin + func->numDefaultArgs + func->numKwargs + (func->hasBlockArg ? 1 : 0);
@@ -1528,12 +1923,59 @@ void growLocalsTable(ObjScope *scope, int size) {
   }
 }
 
+/**
+ * Matches the keyword arguments given at the call site `cinfo` to the
+ * keyword params of `func`, returning the param index for each argument.
+ * The result is cached on the call site for the last function called from
+ * it, so names are only compared on the first call.
+ */
+static const signed char *kwargParamIndexes(ObjFunction *func, CallInfo *cinfo) {
+    if (LIKELY(cinfo->kwFunc == func)) {
+        return cinfo->kwParamIdx;
+    }
+    vec_nodep_t *params = (vec_nodep_t*)nodeGetData(func->funcNode);
+    cinfo->kwFunc = NULL;
+    int numMatched = 0;
+    for (int i = 0; i < cinfo->numKwargs; i++) {
+        char *kwname = tokStr(cinfo->kwargNames+i);
+        int idx = -1;
+        int kwi = 0;
+        Node *param = NULL; int pi = 0;
+        vec_foreach(params, param, pi) {
+            if (param->type.kind != PARAM_NODE_KWARG) continue;
+            if (strcmp(kwname, tokStr(&param->tok)) == 0) {
+                idx = kwi;
+                break;
+            }
+            kwi++;
+        }
+        if (UNLIKELY(idx == -1)) {
+            throwArgErrorFmt("%s: unknown keyword argument '%s'",
+                    func->name ? func->name->chars : "(anon)", kwname);
+        }
+        for (int j = 0; j < i; j++) {
+            if (UNLIKELY(cinfo->kwParamIdx[j] == idx)) {
+                throwArgErrorFmt("%s: keyword argument '%s' given twice",
+                        func->name ? func->name->chars : "(anon)", kwname);
+            }
+        }
+        cinfo->kwParamIdx[i] = (signed char)idx;
+        numMatched++;
+    }
+    cinfo->kwAllGiven = numMatched == func->numKwargs;
+    cinfo->kwFunc = func;
+    return cinfo->kwParamIdx;
+}
+
 // Arguments are expected to be pushed on to stack by caller, including the
 // callable object. Argcount does NOT include the instance argument, ex: a method with no arguments will have an
 // argCount of 0. If the callable is a class (constructor), this function creates the
 // new instance and puts it in the proper spot in the stack. The return value
 // is pushed to the stack.
-static bool doCallCallable(Value callable, int argCount, bool isMethod, CallInfo *callInfo) {
+// If `loopFrame` is given and the callable is a Lox function that can run in
+// the caller's dispatch loop, its frame is pushed and returned there instead
+// of being run here.
+static bool doCallCallable(Value callable, int argCount, bool isMethod, CallInfo *callInfo, CallFrame **loopFrame) {
     LxThread *th = vm.curThread;
     Value blockInstance = NIL_VAL;
     bool blockInstancePopped = false;
@@ -1642,7 +2084,7 @@ static bool doCallCallable(Value callable, int argCount, bool isMethod, CallInfo
         Obj *callable = bmethod->callable; // native function or user-defined function (ObjClosure)
         instanceVal = bmethod->receiver;
         EC->stackTop[-argCount - 1] = instanceVal;
-        return doCallCallable(OBJ_VAL(callable), argCount, true, callInfo);
+        return doCallCallable(OBJ_VAL(callable), argCount, true, callInfo, loopFrame);
     } else if (IS_NATIVE_FUNCTION(callable)) {
 #ifndef NDEBUG
         if (GET_OPTION(debugVMLvl) >= 2) {
@@ -1652,6 +2094,7 @@ static bool doCallCallable(Value callable, int argCount, bool isMethod, CallInfo
         }
 #endif
         volatile ObjNative *native = AS_NATIVE_FUNCTION(callable);
+        argCount = pushNativeKwargs(TO_NATIVE(native), argCount, callInfo);
         int argCountActual = argCount; // includes the callable on the stack, or the receiver if it's a method
         if (isMethod) {
             argCount++;
@@ -1711,9 +2154,8 @@ static bool doCallCallable(Value callable, int argCount, bool isMethod, CallInfo
         UNREACHABLE("bad callable value given to callCallable: %s", typeOfVal(callable));
     }
 
-    if (UNLIKELY(EC->frameCount >= FRAMES_MAX)) {
-        errorPrintScriptBacktrace("Stack overflow.");
-        return false;
+    if (UNLIKELY(EC->frameCount >= EC->frames_capa)) {
+        throwFramesOverflow();
     }
 
     VM_DEBUG(2, "doCallCallable found closure");
@@ -1728,34 +2170,28 @@ static bool doCallCallable(Value callable, int argCount, bool isMethod, CallInfo
 
     vec_nodep_t *params = (vec_nodep_t*)nodeGetData(func->funcNode);
 
-    Value kwargsMap = NIL_VAL;
-    // keyword arg processing
-    if (func->numKwargs > 0 && callInfo) {
+    // keyword arg processing: the given ones are taken off the stack here and
+    // put in the callee's keyword param slots below
+    int numKwargsGiven = 0;
+    const signed char *kwIdx = NULL;
+    Value kwVals[LX_MAX_KWARGS];
+    if (callInfo && callInfo->numKwargs > 0) {
         ASSERT(params);
+        kwIdx = kwargParamIndexes(func, callInfo);
         if (!IS_NIL(blockInstance) && IS_A_BLOCK(peek(0))) {
             argCount--;
             poppedBlockInstance = pop();
             hideFromGC(AS_OBJ(poppedBlockInstance));
             blockInstancePopped = true;
         }
-        kwargsMap = newMap();
-        hideFromGC(AS_OBJ(kwargsMap)); // unhidden when pushed below
-        Node *param = NULL;
-        int pi = 0;
-        for (int i = callInfo->numKwargs-1; i >= 0; i--) {
-            vec_foreach(params, param, pi) {
-                if (param->type.kind == PARAM_NODE_KWARG) {
-                    char *kwname = tokStr(&param->tok);
-                    ObjString *kwStr = INTERN(kwname);
-                    // keyword argument given, is on stack, we pop it off
-                    if (strcmp(kwname, tokStr(callInfo->kwargNames+i)) == 0) {
-                        mapSet(kwargsMap, OBJ_VAL(kwStr), pop());
-                    }
-                    // when keyword argument not given, we need to add UNDEF_VAL to
-                    // stack later
-                }
+        numKwargsGiven = callInfo->numKwargs;
+        for (int i = numKwargsGiven-1; i >= 0; i--) {
+            kwVals[i] = pop();
+            if (IS_OBJ(kwVals[i])) { // rooted until the call returns
+                vec_push(&th->stackObjects, AS_OBJ(kwVals[i]));
             }
         }
+        argCount -= numKwargsGiven;
     }
 
     if (func->numDefaultArgs > 0 && !IS_NIL(blockInstance) && !blockInstancePopped && IS_A_BLOCK(peek(0))) {
@@ -1800,22 +2236,14 @@ static bool doCallCallable(Value callable, int argCount, bool isMethod, CallInfo
         argCountWithRestAry++;
     }
 
-    int numKwargsNotGiven = 0;
-    if (func->numKwargs > 0 && callInfo) {
-        Node *param = NULL;
-        int pi = 0;
-        vec_foreach(params, param, pi) {
-            if (param->type.kind == PARAM_NODE_KWARG) {
-                char *kwname = tokStr(&param->tok);
-                ObjString *kwStr = INTERN(kwname);
-                Value val;
-                if (MAP_GET(kwargsMap, OBJ_VAL(kwStr), &val)) {
-                    push(val);
-                } else {
-                    push(UNDEF_VAL);
-                    numKwargsNotGiven++;
-                }
-            }
+    // keyword params not given are UNDEF, see OP_CHECK_KEYWORD
+    if (func->numKwargs > 0) {
+        Value *kwSlots = EC->stackTop;
+        for (int i = 0; i < func->numKwargs; i++) {
+            push(UNDEF_VAL);
+        }
+        for (int i = 0; i < numKwargsGiven; i++) {
+            kwSlots[kwIdx[i]] = kwVals[i];
         }
     }
 
@@ -1831,34 +2259,33 @@ static bool doCallCallable(Value callable, int argCount, bool isMethod, CallInfo
         "kwargsAvail: %d, kwargsGiven: %d",
         func->arity, func->numDefaultArgs, numDefaultArgsUsed,
         numDefaultArgsUnused, numRestArgs, argCount,
-        func->numKwargs, func->numKwargs-numKwargsNotGiven
+        func->numKwargs, numKwargsGiven
     );
 
-    // skip default argument code in function that's unused
-    if (numDefaultArgsUnused > 0) {
+    if (func->numKwargs > 0 && numDefaultArgsUsed == 0 && kwIdx && callInfo->kwAllGiven) {
+        // every param with default code was given, skip all of it
+        funcOffset = func->kwargsEnd;
+    } else if (numDefaultArgsUnused > 0) {
+        // skip the code of the leading default params that were given
         ASSERT(func->funcNode);
         Node *param = NULL;
         int pi = 0;
         int unused = numDefaultArgsUnused;
-        vec_foreach_rev(params, param, pi) {
-            if (param->type.kind == PARAM_NODE_SPLAT) continue;
-            if (param->type.kind == PARAM_NODE_BLOCK) continue;
-            if (param->type.kind == PARAM_NODE_DEFAULT_ARG) {
-                size_t offset = ((ParamNodeInfo*)param->data)->defaultArgIPOffset;
-                VM_DEBUG(2, "default param found: offset=%d", (int)offset);
-                funcOffset += offset;
-                unused--;
-                if (unused == 0) break;
-            } else {
-                ASSERT(0); // unreachable, default args should be last args, not including splat or block arg
-                break;
-            }
+        vec_foreach(params, param, pi) {
+            if (param->type.kind != PARAM_NODE_DEFAULT_ARG) continue;
+            size_t offset = ((ParamNodeInfo*)param->data)->defaultArgIPOffset;
+            VM_DEBUG(2, "default param found: offset=%d", (int)offset);
+            funcOffset += offset;
+            unused--;
+            if (unused == 0) break;
         }
     }
 
     if (func->hasBlockArg && callInfo->blockFunction && IS_NIL(blockInstance)) {
-        // TODO: get closure created here with upvals!
-        Value blockClosure = OBJ_VAL(newClosure(callInfo->blockFunction, NEWOBJ_FLAG_NONE));
+        // the caller's frame is still on top, the block is written in it
+        CallFrame *outerFrame = closureFrameFrom(getFrame());
+        ASSERT(outerFrame);
+        Value blockClosure = OBJ_VAL(newBlockClosure(callInfo->blockFunction, outerFrame));
         hideFromGC(AS_OBJ(blockClosure));
         Obj *blkClosure = AS_OBJ(blockClosure);
         push(newBlock(blkClosure));
@@ -1876,8 +2303,7 @@ static bool doCallCallable(Value callable, int argCount, bool isMethod, CallInfo
     }
 
     if (func->numKwargs > 0) {
-        push(kwargsMap);
-        unhideFromGC(AS_OBJ(kwargsMap));
+        push(NIL_VAL); // slot of the (unused) keyword map
     }
 
     // add frame
@@ -1913,12 +2339,14 @@ static bool doCallCallable(Value callable, int argCount, bool isMethod, CallInfo
     }
     // +1 to include either the called function (for non-methods) or the receiver (for methods)
     frame->slots = EC->stackTop - (argCountWithRestAry + numDefaultArgsUsed + 1) -
-        (func->numKwargs > 0 ? numKwargsNotGiven+1 : 0);
+        (func->numKwargs > 0 ? func->numKwargs+1 : 0);
     setupLocalsTable(frame);
-    if (frame->name) {
-        tableSet(&EC->roGlobals, OBJ_VAL(vm.funcString), OBJ_VAL(frame->name));
-    } else {
-        tableSet(&EC->roGlobals, OBJ_VAL(vm.funcString), OBJ_VAL(vm.anonString));
+    // Blocks and functions taking blocks run in their own vm_run(), their
+    // frames are looked up by the yielder (see SETUP_BLOCK).
+    if (loopFrame && !closure->isBlock && !func->hasBlockArg &&
+            (!callInfo || (!callInfo->isYield && !callInfo->blockInstance && !callInfo->blockFunction))) {
+        *loopFrame = frame;
+        return true;
     }
     // NOTE: the frame is popped on OP_RETURN or non-local jump
     vm_run(); // actually run the function until return
@@ -1934,7 +2362,7 @@ bool callCallable(Value callable, int argCount, bool isMethod, CallInfo *info) {
     DBG_ASSERT(vm.inited);
     LxThread *th = vm.curThread;
     int lenBefore = th->stackObjects.length;
-    bool ret = doCallCallable(callable, argCount, isMethod, info);
+    bool ret = doCallCallable(callable, argCount, isMethod, info, NULL);
 
     // allow collection of new stack-created objects if they're not rooted now
     th->stackObjects.length = lenBefore;
@@ -1942,6 +2370,392 @@ bool callCallable(Value callable, int argCount, bool isMethod, CallInfo *info) {
     return ret;
 }
 
+/**
+ * For OP_TAIL_CALL and OP_TAIL_INVOKE: `callee` was just pushed by
+ * doCallCallable() for a call in `caller`'s return statement. If nothing
+ * refers to the caller's frame anymore, the callee's frame and stack window
+ * are moved down into it, so tail recursion runs in constant space.
+ * Otherwise both frames are kept and it's a regular call. Returns the
+ * callee's frame.
+ */
+static CallFrame *replaceTailCallerFrame(LxThread *th, CallFrame *caller, CallFrame *callee) {
+    VMExecContext *ec = EC;
+    DBG_ASSERT(callee == getFrame() && callee->prev == caller);
+    if (caller->isCCall || caller->isEval || caller->blockEntry ||
+            caller->stackAdjustOnPop != 0 || caller->closure->isBlock ||
+            caller->closure->function->chunk->catchTbl != NULL ||
+            IS_YIELD_STATUS_FRAME(caller)) {
+        return callee;
+    }
+    BlockStackEntry *bentry = vec_last_or(&th->v_blockStack, NULL);
+    if (bentry && (bentry->frame == caller || bentry->frame == callee)) {
+        return callee;
+    }
+    // closures and ensure/catch handlers that refer to the caller's locals
+    if (th->openUpvalues && th->openUpvalues->value >= caller->slots) {
+        return callee;
+    }
+    if (th->errInfo && th->errInfo->frame == caller) {
+        return callee;
+    }
+    // `this` and the cref are popped along with their frame, a method can
+    // only be replaced by another method.
+    if ((caller->instance && !callee->instance) || (caller->klass && !callee->klass)) {
+        return callee;
+    }
+    if (caller->instance) {
+        vec_splice(&th->v_thisStack, th->v_thisStack.length-2, 1);
+    }
+    if (caller->klass) {
+        vec_splice(&th->v_crefStack, th->v_crefStack.length-2, 1);
+    }
+    int numValues = ec->stackTop - callee->slots;
+    memmove(caller->slots, callee->slots, sizeof(Value)*numValues);
+    ec->stackTop = caller->slots + numValues;
+    CallFrame moved = *callee;
+    moved.slots = caller->slots;
+    moved.prev = caller->prev;
+    moved.start = caller->start;
+    moved.tailCalls = caller->tailCalls + 1;
+    ec->frameCount--;
+    *caller = moved;
+    return caller;
+}
+
+// Can OP_CALL_SIMPLE/OP_INVOKE_SIMPLE push a frame for `callable` without
+// the argument processing in doCallCallable()? The compiler only emits these
+// ops for sites with positional arguments, but a Block object can still be
+// given as the last one, and arity errors are left to doCallCallable().
+static inline ObjClosure *simpleCallee(Obj *callable, int argCount, CallInfo *cinfo) {
+    if (callable->type != OBJ_T_CLOSURE) return NULL;
+    ObjClosure *closure = (ObjClosure*)callable;
+    ObjFunction *func = closure->function;
+    if (UNLIKELY(!func->isSimple || closure->isBlock || func->arity != argCount ||
+                cinfo->blockInstance != NULL)) {
+        return NULL;
+    }
+    if (argCount > 0 && UNLIKELY(IS_A_BLOCK(peek(0)))) {
+        return NULL;
+    }
+    return closure;
+}
+
+// Can OP_CALL_SIMPLE/OP_INVOKE_SIMPLE call `callable` directly, without a
+// frame (see NATIVE_FL_LEAF)?
+static inline ObjNative *leafNative(Obj *callable, int argCount, CallInfo *cinfo) {
+    if (callable->type != OBJ_T_NATIVE_FUNCTION) return NULL;
+    ObjNative *native = (ObjNative*)callable;
+    if (!(native->flags & NATIVE_FL_LEAF) || UNLIKELY(cinfo->blockInstance != NULL)) {
+        return NULL;
+    }
+    if (argCount > 0 && UNLIKELY(IS_A_BLOCK(peek(0)))) {
+        return NULL;
+    }
+    return native;
+}
+
+// Calls a leaf native with the arguments on the stack, and replaces them and
+// the callable (or receiver, for methods) with its return value.
+static inline void callLeafNative(LxThread *th, ObjNative *native, int argCount, bool isMethod) {
+    Value *slots = EC->stackTop - argCount - 1;
+    Value ret = isMethod ? callLeafFunction(th, native, argCount+1, slots) :
+                           callLeafFunction(th, native, argCount, slots+1);
+    EC->stackTop = slots;
+    push(ret);
+}
+
+/**
+ * Pushes the frame for a call to a simple closure (see simpleCallee()) from
+ * `caller`'s dispatch loop. The callable (or receiver, if `instance` is
+ * given) and the arguments must be on the stack. This is the frame
+ * doCallCallable() would push, minus the argument processing.
+ */
+static inline CallFrame *pushSimpleFrame(LxThread *th, CallFrame *caller, ObjClosure *closure,
+        int argCount, ObjInstance *instance, CallInfo *cinfo) {
+    ObjFunction *func = closure->function;
+    int parentStart = caller->ip - caller->closure->function->chunk->code - 2;
+    CallFrame *frame = pushFrame(func);
+    if (instance) {
+        frame->instance = instance;
+        frame->klass = instance->klass;
+        th->thisObj = TO_OBJ(instance);
+        vec_push(&th->v_thisStack, TO_OBJ(instance));
+        pushCref(frame->klass);
+    }
+    frame->callInfo = cinfo;
+    frame->closure = closure;
+    frame->name = func->name;
+    frame->ip = func->chunk->code;
+    frame->start = parentStart;
+    frame->slots = EC->stackTop - (argCount + 1);
+    setupLocalsTable(frame);
+    return frame;
+}
+
+// Does the block function take only positional parameters, so calling it
+// is just pushing its frame?
+static inline bool isSimpleBlockFunction(ObjFunction *func) {
+    return func->numKwargs == 0 && func->numDefaultArgs == 0 &&
+        !func->hasRestArg && !func->hasBlockArg;
+}
+
+// Can callBlockClosure() push a frame for this block, or does it need the
+// argument processing in doCallCallable()?
+static inline bool isSimpleBlockClosure(ObjClosure *closure) {
+    return closure->isBlock && isSimpleBlockFunction(closure->function);
+}
+
+/**
+ * Calls the block closure `callable` from a native iterator (see
+ * yieldFromC()). The callable and the arguments must be pushed to the stack,
+ * like for callCallable(). Blocks don't check their arity and simple ones
+ * take no keyword, default, rest or block arguments, so the frame is pushed
+ * directly, the same as doCallCallable() would push it.
+ */
+bool callBlockClosure(Value callable, int argCount, CallInfo *cinfo) {
+    DBG_ASSERT(IS_CLOSURE(callable));
+    DBG_ASSERT(cinfo);
+    ObjClosure *closure = AS_CLOSURE(callable);
+    if (UNLIKELY(!isSimpleBlockClosure(closure) || (argCount > 0 && IS_A_BLOCK(peek(0))))) {
+        return callCallable(callable, argCount, false, cinfo);
+    }
+    LxThread *th = vm.curThread;
+    int lenBefore = th->stackObjects.length;
+    if (cinfo->blockInstance) {
+        push(OBJ_VAL(cinfo->blockInstance));
+        argCount++;
+    }
+    if (UNLIKELY(EC->frameCount >= EC->frames_capa)) {
+        throwFramesOverflow();
+    }
+    CallFrame *f = getFrame();
+    int parentStart = f->ip - f->closure->function->chunk->code - 2;
+    ASSERT(parentStart >= 0);
+
+    ObjFunction *func = closure->function;
+    CallFrame *frame = pushFrame(func);
+    frame->callInfo = cinfo;
+    frame->closure = closure;
+    frame->name = func->name;
+    frame->ip = func->chunk->code;
+    frame->start = parentStart;
+    if (cinfo->isYield) {
+        frame->stackAdjustOnPop = (cinfo->argc+1);
+    }
+    frame->slots = EC->stackTop - (argCount + 1);
+    setupLocalsTable(frame);
+    vm_run();
+
+    th->stackObjects.length = lenBefore;
+    return true;
+}
+
+/**
+ * Native iterators (see LoopIterOp) given a block literal by OP_INVOKE are
+ * run by the dispatch loop instead: their state is kept on the caller's
+ * stack, above the receiver and arguments, and each call of the block is a
+ * frame push. When the block frame returns (see BLOCK_FRAME_RETURN),
+ * runLoopIter() uses its result and pushes the frame for the next element,
+ * or replaces the receiver with the iterator's return value. Break, continue
+ * and return in the block work like they do when the native yields to it.
+ */
+typedef enum LoopIterSrc {
+    LOOP_SRC_ARRAY = 0,
+    LOOP_SRC_MAP,
+    LOOP_SRC_STRING,
+} LoopIterSrc;
+
+// stack slots of the iteration state
+enum {
+    LOOP_SLOT_KIND = 0, // LoopIterOp | (LoopIterSrc << 4)
+    LOOP_SLOT_CURSOR, // next element's index (byte offset for strings, cursor for maps)
+    LOOP_SLOT_ACC, // array being built, or reduce's memo
+    LOOP_SLOT_BLOCK, // block closure
+    LOOP_SLOT_ELEM, // element given to the block
+    LOOP_ITER_SLOTS,
+};
+
+/**
+ * Uses the value returned by the block for the current element (on top of
+ * the stack, if `blockReturned`) and pushes the block's frame for the next
+ * one, or finishes the iteration.
+ */
+static void runLoopIter(LxThread *th, Value *state, bool blockReturned, BlockStatus st, VMRunPad *pad) {
+    int kind = (int)AS_NUMBER(state[LOOP_SLOT_KIND]);
+    LoopIterOp op = (LoopIterOp)(kind & 0xf);
+    LoopIterSrc src = (LoopIterSrc)(kind >> 4);
+    Value *recvSlot = state - (op == LOOP_ITER_REDUCE ? 2 : 1);
+    Value ret;
+    while (true) {
+        if (blockReturned) {
+            Value blockRet = pop();
+            DBG_ASSERT(EC->stackTop == state + LOOP_ITER_SLOTS);
+            if (st == BLOCK_ST_BREAK) {
+                ret = NIL_VAL;
+                goto finish;
+            }
+            Value el = state[LOOP_SLOT_ELEM];
+            switch (op) {
+                case LOOP_ITER_EACH:
+                    if (st == BLOCK_ST_RETURN) {
+                        ret = blockRet;
+                        goto finish;
+                    }
+                    break;
+                case LOOP_ITER_MAP:
+                    arrayPush(state[LOOP_SLOT_ACC], blockRet);
+                    break;
+                case LOOP_ITER_SELECT:
+                    if (isTruthy(blockRet)) arrayPush(state[LOOP_SLOT_ACC], el);
+                    break;
+                case LOOP_ITER_REJECT:
+                    if (!isTruthy(blockRet)) arrayPush(state[LOOP_SLOT_ACC], el);
+                    break;
+                case LOOP_ITER_FIND:
+                    if (isTruthy(blockRet)) {
+                        ret = el;
+                        goto finish;
+                    }
+                    break;
+                case LOOP_ITER_REDUCE:
+                    if (!IS_NUMBER(el)) {
+                        throwErrorFmt(lxTypeErrClass, "Return value from reduce() must be a number");
+                    }
+                    state[LOOP_SLOT_ACC] = blockRet;
+                    break;
+                default:
+                    UNREACHABLE("bad loop iterator op: %d", op);
+            }
+        }
+        blockReturned = true;
+
+        int argc = 1;
+        switch (src) {
+            case LOOP_SRC_ARRAY: {
+                ObjArray *ary = AS_ARRAY(*recvSlot);
+                int i = (int)AS_NUMBER(state[LOOP_SLOT_CURSOR]);
+                if (i >= ary->valAry.count) goto done;
+                state[LOOP_SLOT_ELEM] = ary->valAry.values[i];
+                state[LOOP_SLOT_CURSOR] = NUMBER_VAL(i+1);
+                push(state[LOOP_SLOT_BLOCK]);
+                push(state[LOOP_SLOT_ELEM]);
+                break;
+            }
+            case LOOP_SRC_MAP: {
+                // the block can add entries, which could reallocate the table
+                Table *map = AS_MAP(*recvSlot)->table;
+                int cursor = (int)AS_NUMBER(state[LOOP_SLOT_CURSOR]);
+                Entry e;
+                if (!tableNext(map, &cursor, &e)) goto done;
+                state[LOOP_SLOT_CURSOR] = NUMBER_VAL(cursor);
+                push(state[LOOP_SLOT_BLOCK]);
+                push(e.key);
+                push(e.value);
+                argc = 2;
+                break;
+            }
+            case LOOP_SRC_STRING: {
+                ObjString *str = AS_STRING(*recvSlot);
+                size_t i = (size_t)AS_NUMBER(state[LOOP_SLOT_CURSOR]);
+                if (i >= str->length) goto done;
+                size_t width = stringCharWidth(str, i);
+                state[LOOP_SLOT_CURSOR] = NUMBER_VAL(i+width);
+                state[LOOP_SLOT_ELEM] = OBJ_VAL(stringCharAt(str, i, width));
+                push(state[LOOP_SLOT_BLOCK]);
+                push(state[LOOP_SLOT_ELEM]);
+                break;
+            }
+            default:
+                UNREACHABLE("bad loop iterator source: %d", src);
+        }
+        if (op == LOOP_ITER_REDUCE) {
+            push(state[LOOP_SLOT_ACC]);
+            argc++;
+        }
+
+        if (LIKELY(!IS_A_BLOCK(peek(0)))) {
+            CallFrame *frame = pushSimpleFrame(th, getFrame(), AS_CLOSURE(state[LOOP_SLOT_BLOCK]),
+                    argc, NULL, &pad->loopBlockInfo);
+            frame->stackAdjustOnPop = argc+1;
+            frame->runPad = pad;
+            return;
+        }
+        // doCallCallable() gives a Block as the last argument to the block as
+        // its block argument
+        CallInfo yinfo;
+        memset(&yinfo, 0, sizeof(yinfo));
+        yinfo.isYield = true;
+        yinfo.yieldStatus = true;
+        yinfo.argc = argc;
+        yinfo.blockStatus = BLOCK_ST_CONTINUE;
+        callCallable(state[LOOP_SLOT_BLOCK], argc, false, &yinfo);
+        st = yinfo.blockStatus;
+    }
+
+done:
+    switch (op) {
+        case LOOP_ITER_EACH: ret = *recvSlot; break;
+        case LOOP_ITER_FIND: ret = NIL_VAL; break;
+        default: ret = state[LOOP_SLOT_ACC]; break;
+    }
+finish:
+    EC->stackTop = recvSlot;
+    push(ret);
+}
+
+/**
+ * Starts running the iterator `native` for the receiver and arguments on top
+ * of the stack in the dispatch loop (see runLoopIter()). Returns false if
+ * the native has to be called instead.
+ */
+static bool startLoopIter(LxThread *th, ObjInstance *recv, ObjNative *native,
+        int numArgs, CallInfo *cinfo, VMRunPad *pad) {
+    LoopIterOp op = native->loopIter;
+    ObjFunction *blockFn = cinfo->blockFunction;
+    if (!blockFn || cinfo->blockInstance || cinfo->numKwargs > 0 || cinfo->usesSplat ||
+            !isSimpleBlockFunction(blockFn) || numArgs != (op == LOOP_ITER_REDUCE ? 1 : 0)) {
+        return false;
+    }
+    Value recvVal = OBJ_VAL(recv);
+    LoopIterSrc src;
+    if (IS_AN_ARRAY(recvVal)) {
+        src = LOOP_SRC_ARRAY;
+    } else if (IS_A_MAP(recvVal)) {
+        src = LOOP_SRC_MAP;
+    } else if (IS_A_STRING(recvVal)) {
+        src = LOOP_SRC_STRING;
+    } else {
+        return false;
+    }
+    // the other iterators call the receiver's #each
+    if (op != LOOP_ITER_EACH) {
+        Obj *each = instanceFindMethod(recv, INTERN("each"));
+        if (!each || each->type != OBJ_T_NATIVE_FUNCTION ||
+                TO_NATIVE(each)->loopIter != LOOP_ITER_EACH) {
+            return false;
+        }
+    }
+
+    if (!pad->loopBlockInfoSet) {
+        memset(&pad->loopBlockInfo, 0, sizeof(CallInfo));
+        pad->loopBlockInfo.isYield = true;
+        pad->loopBlockInfo.yieldStatus = true;
+        pad->loopBlockInfoSet = true;
+    }
+    Value *state = EC->stackTop;
+    push(NUMBER_VAL(op | (src << 4)));
+    push(NUMBER_VAL(0));
+    push(op == LOOP_ITER_REDUCE ? state[-1] : NIL_VAL);
+    push(NIL_VAL);
+    push(NIL_VAL);
+    if (op == LOOP_ITER_MAP || op == LOOP_ITER_SELECT || op == LOOP_ITER_REJECT) {
+        state[LOOP_SLOT_ACC] = newArray();
+    }
+    state[LOOP_SLOT_BLOCK] = OBJ_VAL(newBlockClosure(blockFn, getFrame()));
+    runLoopIter(th, state, false, BLOCK_ST_CONTINUE, pad);
+    return true;
+}
+
 Obj *findMethod(Obj *klass, ObjString *methodName) {
     Value method;
     Obj *classLookup = klass;
@@ -2112,13 +2926,20 @@ static ErrTagInfo *findErrTag(ObjClass *klass) {
     return NULL;
 }
 
-NORETURN void throwError(Value self) {
+/**
+ * Unwinds the VM to the catch (or ensure) row for the error `self` and
+ * returns the pad of the vm_run() invocation running the catching frame,
+ * whose ip is set to the row's target. Returns NULL if the error isn't
+ * caught. Errors caught by native code (vm_protect(), SETUP_BLOCK) or thrown
+ * inside a native call longjmp from here.
+ */
+static VMRunPad *unwindToCatch(Value self) {
     VM_DEBUG(2, "throwing error");
     ASSERT(vm.inited);
     ASSERT(IS_INSTANCE(self));
     LxThread *th = vm.curThread;
     th->lastErrorThrown = self;
-    if (IS_NIL(getProp(self, INTERN("backtrace")))) {
+    if (!hasRawBacktrace(AS_INSTANCE(self)) && IS_NIL(getProp(self, INTERN("backtrace")))) {
         setBacktrace(self);
     }
     // error from VM
@@ -2143,8 +2964,17 @@ NORETURN void throwError(Value self) {
         catchRow->lastThrownValue = self;
         getFrame()->ip = ipNew;
         DBG_ASSERT(getFrame()->closure->function->chunk->catchTbl);
-        DBG_ASSERT(getFrame()->jmpBufSet);
-        longjmp(getFrame()->jmpBuf, JUMP_PERFORMED);
+        DBG_ASSERT(getFrame()->runPad && getFrame()->runPad->armed);
+        return getFrame()->runPad;
+    }
+    return NULL;
+}
+
+// Jumps to the catch pad returned by unwindToCatch(), or to the root VM
+// loop if the error wasn't caught
+static NORETURN void jumpToCatch(VMRunPad *pad) {
+    if (pad) {
+        longjmp(pad->jmpBuf, JUMP_PERFORMED);
     } else {
         ASSERT(rootVMLoopJumpBufSet);
         longjmp(rootVMLoopJumpBuf, JUMP_PERFORMED);
@@ -2152,6 +2982,10 @@ NORETURN void throwError(Value self) {
     UNREACHABLE("after longjmp");
 }
 
+NORETURN void throwError(Value self) {
+    jumpToCatch(unwindToCatch(self));
+}
+
 void popErrInfo(void) {
     DBG_ASSERT(vm.curThread->errInfo);
     vm.curThread->errInfo = vm.curThread->errInfo->prev;
@@ -2313,6 +3147,76 @@ static Value unpackValue(Value val, bytecode_t idx) {
     }
 }
 
+static inline void setForeachVar(CallFrame *frame, int slot, Value val) {
+    ObjScope *scope = frame->scope;
+    if (slot+1 > scope->localsTable.size) {
+        growLocalsTable(scope, slot+1);
+    }
+    scope->localsTable.tbl[slot] = val;
+    frame->slots[slot] = val;
+}
+
+static void setForeachVars(CallFrame *frame, int slot, int numVars, Value val) {
+    if (numVars == 1) {
+        setForeachVar(frame, slot, val);
+        return;
+    }
+    if (UNLIKELY(!IS_AN_ARRAY(val))) {
+        throwErrorFmt(lxTypeErrClass, "Can't unpack %s into %d 'foreach' variables",
+                typeOfVal(val), numVars);
+    }
+    for (int i = 0; i < numVars; i++) {
+        setForeachVar(frame, slot+i, unpackValue(val, i));
+    }
+}
+
+// Sets the next value(s) of a foreach loop into the loop variables starting
+// at `slot`. The iterable lives 2 slots below them, followed by the cursor.
+// Arrays and maps are walked using the cursor directly, so unlike user
+// iterators they don't allocate and nil or false elements don't end the
+// loop. Returns false once iteration is done.
+static bool foreachNext(CallFrame *frame, int slot, int numVars) {
+    Value iterable = frame->slots[slot-2];
+    Value *cursor = &frame->slots[slot-1];
+    if (IS_AN_ARRAY(iterable)) {
+        int idx = (int)AS_NUMBER(*cursor);
+        if (idx >= ARRAY_SIZE(iterable)) {
+            return false;
+        }
+        *cursor = NUMBER_VAL(idx+1);
+        setForeachVars(frame, slot, numVars, ARRAY_GET(iterable, idx));
+        return true;
+    } else if (IS_A_MAP(iterable)) {
+        int idx = (int)AS_NUMBER(*cursor);
+        Entry e;
+        if (!tableNext(AS_MAP(iterable)->table, &idx, &e)) {
+            return false;
+        }
+        *cursor = NUMBER_VAL(idx);
+        if (numVars == 1) {
+            // the loop variable is a new [key, value] array, that the loop
+            // body can keep
+            setForeachVar(frame, slot, newArrayPair(e.key, e.value));
+        } else {
+            setForeachVar(frame, slot, e.key);
+            setForeachVar(frame, slot+1, e.value);
+            for (int i = 2; i < numVars; i++) {
+                setForeachVar(frame, slot+i, NIL_VAL);
+            }
+        }
+        return true;
+    } else {
+        DBG_ASSERT(isIterator(iterable));
+        Value next = iteratorNext(iterable);
+        ASSERT(!IS_UNDEF(next));
+        if (!isTruthy(next)) {
+            return false;
+        }
+        setForeachVars(frame, slot, numVars, next);
+        return true;
+    }
+}
+
 static ObjString *methodNameForBinop(OpCode code) {
     switch (code) {
     case OP_ADD:
@@ -2360,24 +3264,68 @@ static InterpretResult vm_run() {
     Chunk *ch = currentChunk();
     Value *constantSlots = ch->constants->values;
     CallFrame *frame = getFrame();
-    ObjScope *scope = frame->scope;
     VMExecContext *ctx = EC;
-    th->vmRunLvl++;
+    JitCode *jitCode = frame->closure->function->jitCode;
+    bool jitSkip = false; // native code just exited at this instruction
+    // frames above this one were called from this invocation's dispatch loop
+    unsigned baseFrameCount = ctx->frameCount;
+    if (UNLIKELY(th->vmRunLvl >= VM_RUN_LVL_MAX)) {
+        // each level uses native stack, natives calling back into Lox can't recurse forever
+        throwErrorFmt(lxErrClass, "Stackoverflow, max VM run level (%d)", VM_RUN_LVL_MAX);
+    }
+    VMRunPad pad;
+    pad.armed = false;
+    pad.loopBlockInfoSet = false;
+    bool tailCall = false; // set by OP_TAIL_CALL and OP_TAIL_INVOKE for their call
+    pad.vmRunLvl = ++th->vmRunLvl;
+    pad.inCCall = th->inCCall;
+    frame->runPad = &pad;
+
+// Switch to the frame on top of the frame stack
+#define LOAD_FRAME() do {\
+    frame = getFrame();\
+    ch = frame->closure->function->chunk;\
+    constantSlots = ch->constants->values;\
+    jitCode = frame->closure->function->jitCode;\
+} while (0)
+
     if (ch->catchTbl != NULL) {
-        int jumpRes = setjmp(frame->jmpBuf);
-        if (jumpRes == JUMP_SET) {
-            frame->jmpBufSet = true;
-            VM_DEBUG(2, "VM set catch table for call frame (vm_run lvl %d)", th->vmRunLvl-1);
+armPad:
+        if (setjmp(pad.jmpBuf) == JUMP_SET) {
+            pad.armed = true;
+            VM_DEBUG(2, "VM armed catch pad (vm_run lvl %d)", th->vmRunLvl-1);
         } else {
-            VM_DEBUG(2, "VM caught error for call frame (vm_run lvl %d)", th->vmRunLvl-1);
+            VM_DEBUG(2, "VM caught error for call frame (vm_run lvl %d)", pad.vmRunLvl-1);
             th = THREAD(); // clobbered
             th->hadError = false;
-            ch = currentChunk(); // clobbered
-            constantSlots = ch->constants->values; // clobbered
-            frame = getFrame(); // clobbered
-            // stack is already unwound to proper frame
+            th->vmRunLvl = pad.vmRunLvl;
+            // a leaf native that threw is still counted in inCCall
+            setInCCall(th, pad.inCCall);
+            tailCall = false;
+            jitSkip = false;
+            ctx = EC;
+            // stack is already unwound to the catching frame
+            LOAD_FRAME();
         }
     }
+
+// Lox functions called from the loop get their frame pushed by
+// doCallCallable() and run here, without a nested vm_run().
+#define VM_CALL(callable, argc, isMethod, cinfo) do {\
+    CallFrame *_pushed = NULL;\
+    int _lenBefore = th->stackObjects.length;\
+    doCallCallable(callable, argc, isMethod, cinfo, &_pushed);\
+    th->stackObjects.length = _lenBefore;\
+    if (_pushed) {\
+        _pushed->runPad = &pad;\
+        if (UNLIKELY(tailCall)) replaceTailCallerFrame(th, frame, _pushed);\
+        tailCall = false;\
+        LOAD_FRAME();\
+        if (UNLIKELY(ch->catchTbl != NULL && !pad.armed)) goto armPad;\
+    } else {\
+        tailCall = false;\
+    }\
+} while (0)
 #define READ_WORD() (*(frame->ip++))
 #define READ_CONSTANT() (constantSlots[READ_WORD()])
 #define BINARY_OP(op, opcode, type) \
@@ -2406,6 +3354,33 @@ static InterpretResult vm_run() {
       }\
     } while (0)
 
+#define NUM_BINARY_OP(op, generic, genericLabel) \
+    do { \
+      Value b = VM_PEEK(0);\
+      Value a = VM_PEEK(1);\
+      if (UNLIKELY(!IS_NUMBER(a) || !IS_NUMBER(b))) {\
+          instruction = generic;\
+          goto genericLabel;\
+      }\
+      VM_POP();\
+      VM_PUSHSWAP(NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)));\
+    } while (0)
+// `cmp` is in terms of numA and numB, and must agree with cmpValues() (NaN
+// compares greater than everything)
+#define NUM_CMP_OP(cmp, generic, genericLabel) \
+    do { \
+      Value b = VM_PEEK(0);\
+      Value a = VM_PEEK(1);\
+      if (UNLIKELY(!IS_NUMBER(a) || !IS_NUMBER(b))) {\
+          instruction = generic;\
+          goto genericLabel;\
+      }\
+      double numA = AS_NUMBER(a);\
+      double numB = AS_NUMBER(b);\
+      VM_POP();\
+      VM_PUSHSWAP((cmp) ? trueValue() : falseValue());\
+    } while (0)
+
   /*fprintf(stderr, "VM run level: %d\n", vmRunLvl);*/
   /* Main vm loop */
 vmLoop:
@@ -2435,15 +3410,17 @@ vmLoop:
 
       int wordCount = (int)(frame->ip - ch->code);
       curLine = ch->lines[wordCount];
-      int lastLine = -1;
-      int ndepth = ch->ndepths[wordCount];
-      int nwidth = ch->nwidths[wordCount];
-      /*fprintf(stderr, "line: %d, depth: %d, width: %d\n", curLine, ndepth, nwidth);*/
-      if (wordCount > 0) {
-          lastLine = ch->lines[wordCount-1];
-      }
-      if (UNLIKELY(shouldEnterDebugger(&vm.debugger, "", curLine, lastLine, ndepth, nwidth))) {
-          enterDebugger(&vm.debugger, "", curLine, ndepth, nwidth);
+      if (UNLIKELY(debuggerArmed(&vm.debugger))) {
+          int lastLine = -1;
+          int ndepth = ch->ndepths[wordCount];
+          int nwidth = ch->nwidths[wordCount];
+          /*fprintf(stderr, "line: %d, depth: %d, width: %d\n", curLine, ndepth, nwidth);*/
+          if (wordCount > 0) {
+              lastLine = ch->lines[wordCount-1];
+          }
+          if (shouldEnterDebugger(&vm.debugger, "", curLine, lastLine, ndepth, nwidth)) {
+              enterDebugger(&vm.debugger, "", curLine, ndepth, nwidth);
+          }
       }
 
 #ifndef NDEBUG
@@ -2491,6 +3468,19 @@ vmLoop:
     #define DISPATCH_BOTTOM() goto vmLoop
 #endif
 
+    if (UNLIKELY(jitCode != NULL)) {
+        void *entry;
+        if (jitSkip) {
+            // run the instruction native code stopped at here, then go back
+            jitSkip = false;
+        } else if ((entry = jitCode->entries[frame->ip - ch->code]) != NULL &&
+                !debuggerArmed(&vm.debugger)) {
+            jitEnter(jitCode, ctx, frame, entry, th);
+            jitSkip = true;
+            goto vmLoop;
+        }
+    }
+
     bytecode_t instruction = READ_WORD();
 #ifndef NDEBUG
     th->lastOp = instruction;
@@ -2506,16 +3496,45 @@ vmLoop:
           VM_PUSH(constant);
           DISPATCH_BOTTOM();
       }
-      CASE_OP(ADD):      BINARY_OP(+,OP_ADD, double); DISPATCH_BOTTOM();
-      CASE_OP(SUBTRACT): BINARY_OP(-,OP_SUBTRACT, double); DISPATCH_BOTTOM();
-      CASE_OP(MULTIPLY): BINARY_OP(*,OP_MULTIPLY, double); DISPATCH_BOTTOM();
-      CASE_OP(DIVIDE):   BINARY_OP(/,OP_DIVIDE, double); DISPATCH_BOTTOM();
+      CASE_OP(ADD):
+opAdd:
+          BINARY_OP(+,OP_ADD, double); DISPATCH_BOTTOM();
+      CASE_OP(SUBTRACT):
+opSubtract:
+          BINARY_OP(-,OP_SUBTRACT, double); DISPATCH_BOTTOM();
+      CASE_OP(MULTIPLY):
+opMultiply:
+          BINARY_OP(*,OP_MULTIPLY, double); DISPATCH_BOTTOM();
+      CASE_OP(DIVIDE):
+opDivide:
+          BINARY_OP(/,OP_DIVIDE, double); DISPATCH_BOTTOM();
       CASE_OP(MODULO):   BINARY_OP(%,OP_MODULO, int); DISPATCH_BOTTOM();
       CASE_OP(BITOR):    BINARY_OP(|,OP_BITOR, int); DISPATCH_BOTTOM();
       CASE_OP(BITAND):   BINARY_OP(&,OP_BITAND, int); DISPATCH_BOTTOM();
       CASE_OP(BITXOR):   BINARY_OP(^,OP_BITXOR, int); DISPATCH_BOTTOM();
       CASE_OP(SHOVEL_L): BINARY_OP(<<,OP_SHOVEL_L,int); DISPATCH_BOTTOM();
       CASE_OP(SHOVEL_R): BINARY_OP(>>,OP_SHOVEL_R,int); DISPATCH_BOTTOM();
+      // The optimizer emits these when it infers both operands are numbers.
+      // Anything it can't see (eval, the debugger) falls back to the
+      // generic instruction.
+      CASE_OP(ADD_NUM):      NUM_BINARY_OP(+, OP_ADD, opAdd); DISPATCH_BOTTOM();
+      CASE_OP(SUBTRACT_NUM): NUM_BINARY_OP(-, OP_SUBTRACT, opSubtract); DISPATCH_BOTTOM();
+      CASE_OP(MULTIPLY_NUM): NUM_BINARY_OP(*, OP_MULTIPLY, opMultiply); DISPATCH_BOTTOM();
+      CASE_OP(DIVIDE_NUM): {
+          Value b = VM_PEEK(0);
+          Value a = VM_PEEK(1);
+          if (UNLIKELY(!IS_NUMBER(a) || !IS_NUMBER(b) || AS_NUMBER(b) == 0.00)) {
+              instruction = OP_DIVIDE;
+              goto opDivide;
+          }
+          VM_POP();
+          VM_PUSHSWAP(NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b)));
+          DISPATCH_BOTTOM();
+      }
+      CASE_OP(LESS_NUM):          NUM_CMP_OP(numA < numB, OP_LESS, opLess); DISPATCH_BOTTOM();
+      CASE_OP(GREATER_NUM):       NUM_CMP_OP(!(numA <= numB), OP_GREATER, opGreater); DISPATCH_BOTTOM();
+      CASE_OP(LESS_EQUAL_NUM):    NUM_CMP_OP(numA <= numB, OP_LESS_EQUAL, opLessEqual); DISPATCH_BOTTOM();
+      CASE_OP(GREATER_EQUAL_NUM): NUM_CMP_OP(!(numA < numB), OP_GREATER_EQUAL, opGreaterEqual); DISPATCH_BOTTOM();
       CASE_OP(NEGATE): {
           Value val = VM_PEEK(0);
           if (UNLIKELY(!IS_NUMBER(val))) {
@@ -2525,7 +3544,8 @@ vmLoop:
           VM_PUSHSWAP(NUMBER_VAL(-AS_NUMBER(val)));
           DISPATCH_BOTTOM();
       }
-      CASE_OP(LESS): {
+      CASE_OP(LESS):
+opLess: {
           Value rhs = VM_POP(); // rhs
           Value lhs = VM_PEEK(0); // lhs
           if (UNLIKELY(!canCmpValues(lhs, rhs, instruction))) {
@@ -2541,7 +3561,8 @@ vmLoop:
           }
           DISPATCH_BOTTOM();
       }
-      CASE_OP(GREATER): {
+      CASE_OP(GREATER):
+opGreater: {
         Value rhs = VM_POP();
         Value lhs = VM_PEEK(0);
         if (UNLIKELY(!canCmpValues(lhs, rhs, instruction))) {
@@ -2582,7 +3603,8 @@ vmLoop:
           VM_PUSHSWAP(BOOL_VAL(!isTruthy(val)));
           DISPATCH_BOTTOM();
       }
-      CASE_OP(GREATER_EQUAL): {
+      CASE_OP(GREATER_EQUAL):
+opGreaterEqual: {
           Value rhs = VM_POP();
           Value lhs = VM_PEEK(0);
           if (UNLIKELY(!canCmpValues(lhs, rhs, instruction))) {
@@ -2598,7 +3620,8 @@ vmLoop:
           }
           DISPATCH_BOTTOM();
       }
-      CASE_OP(LESS_EQUAL): {
+      CASE_OP(LESS_EQUAL):
+opLessEqual: {
           Value rhs = VM_POP();
           Value lhs = VM_PEEK(0);
           if (UNLIKELY(!canCmpValues(lhs, rhs, instruction))) {
@@ -2637,50 +3660,44 @@ vmLoop:
           DISPATCH_BOTTOM();
       }
       CASE_OP(DEFINE_GLOBAL): {
-          Value varName = READ_CONSTANT();
-          char *name = AS_CSTRING(varName);
-          if (UNLIKELY(isUnredefinableGlobal(name))) {
+          bytecode_t nameIdx = READ_WORD();
+          bytecode_t slot = READ_WORD();
+          if (UNLIKELY((int)slot < vm.numReservedGlobals)) {
               VM_POP();
-              throwErrorFmt(lxNameErrClass, "Can't redefine global variable '%s'", name);
+              throwErrorFmt(lxNameErrClass, "Can't redefine global variable '%s'",
+                      AS_CSTRING(constantSlots[nameIdx]));
           }
-          Value val = VM_PEEK(0);
-          tableSet(&vm.globals, varName, val);
-          VM_POP();
+          vm.globalValues.values[slot] = VM_POP();
           DISPATCH_BOTTOM();
       }
       CASE_OP(GET_GLOBAL): {
-          Value varName = READ_CONSTANT();
-          Value val;
-          if (tableGet(&EC->roGlobals, varName, &val)) {
-              if (IS_STRING(val)) {
-                  VM_PUSH(OBJ_VAL(dupString(AS_STRING(val))));
-              } else {
-                  VM_PUSH(val);
-              }
-          } else if (tableGet(&vm.globals, varName, &val)) {
-              VM_PUSH(val);
-          } else if (tableGet(&vm.constants, varName, &val)) { // for try/catch
-              VM_PUSH(val);
-          } else {
-              throwErrorFmt(lxNameErrClass, "Undefined global variable '%s'.", AS_STRING(varName)->chars);
+          bytecode_t nameIdx = READ_WORD();
+          Value val = vm.globalValues.values[READ_WORD()];
+          if (UNLIKELY(IS_UNDEF(val))) {
+              val = getUndefinedGlobal(frame, AS_STRING(constantSlots[nameIdx]));
           }
+          VM_PUSH(val);
           DISPATCH_BOTTOM();
       }
       CASE_OP(UNPACK_DEFINE_GLOBAL): {
-          Value varName = READ_CONSTANT();
+          bytecode_t nameIdx = READ_WORD();
+          bytecode_t slot = READ_WORD();
           bytecode_t unpackIdx = READ_WORD();
-          Value val = unpackValue(peek(0), unpackIdx);
-          tableSet(&vm.globals, varName, val);
+          if (UNLIKELY((int)slot < vm.numReservedGlobals)) {
+              throwErrorFmt(lxNameErrClass, "Can't redefine global variable '%s'",
+                      AS_CSTRING(constantSlots[nameIdx]));
+          }
+          vm.globalValues.values[slot] = unpackValue(peek(0), unpackIdx);
           DISPATCH_BOTTOM();
       }
       CASE_OP(SET_GLOBAL): {
-          Value val = VM_PEEK(0);
-          Value varName = READ_CONSTANT();
-          char *name = AS_CSTRING(varName);
-          if (UNLIKELY(isUnredefinableGlobal(name))) {
-              throwErrorFmt(lxNameErrClass, "Can't redefine global variable '%s'", name);
+          bytecode_t nameIdx = READ_WORD();
+          bytecode_t slot = READ_WORD();
+          if (UNLIKELY((int)slot < vm.numReservedGlobals)) {
+              throwErrorFmt(lxNameErrClass, "Can't redefine global variable '%s'",
+                      AS_CSTRING(constantSlots[nameIdx]));
           }
-          tableSet(&vm.globals, varName, val);
+          vm.globalValues.values[slot] = VM_PEEK(0);
           DISPATCH_BOTTOM();
       }
       CASE_OP(NIL): {
@@ -2738,6 +3755,7 @@ vmLoop:
           bytecode_t slot = READ_WORD();
           bytecode_t varName = READ_WORD(); // for debugging
           (void)varName;
+          ObjScope *scope = frame->scope;
           if ((int)slot+1 > scope->localsTable.size) {
             growLocalsTable(scope, (int)slot+1);
           }
@@ -2766,6 +3784,7 @@ vmLoop:
           bytecode_t slot = READ_WORD();
           bytecode_t varName = READ_WORD(); // for debugging
           (void)varName;
+          ObjScope *scope = frame->scope;
           if (scope->localsTable.size > (int)slot) {
             VM_PUSH(scope->localsTable.tbl[slot]);
           } else {
@@ -2787,6 +3806,13 @@ vmLoop:
           *frame->closure->upvalues[slot]->value = peek(0);
           DISPATCH_BOTTOM();
       }
+      CASE_OP(GET_CAPTURED): {
+          bytecode_t slot = READ_WORD();
+          bytecode_t varName = READ_WORD(); // for debugging
+          (void)varName;
+          VM_PUSH(frame->closure->captured[slot]);
+          DISPATCH_BOTTOM();
+      }
       CASE_OP(CLOSE_UPVALUE): {
           closeUpvalues(EC->stackTop - 1); // close over the top of stack value
           VM_POP(); // pop the variable off the stack frame
@@ -2794,12 +3820,19 @@ vmLoop:
       }
       CASE_OP(GET_CONST): {
           Value varName = READ_CONSTANT();
+          Value cacheVal = READ_CONSTANT();
+          ConstCache *cache = internalGetData(AS_INTERNAL(cacheVal));
           Value val;
           ObjClass *cref = NULL;
           if (th->v_crefStack.length > 0) {
               cref = TO_CLASS(vec_last(&th->v_crefStack));
           }
+          if (LIKELY(cache->serial == vm.constantSerial && cache->cref == TO_OBJ(cref))) {
+              VM_PUSH(cache->value);
+              DISPATCH_BOTTOM();
+          }
           if (findConstantUnder(cref, AS_STRING(varName), &val)) {
+              fillConstCache(cacheVal, cref, val);
               VM_PUSH(val);
               DISPATCH_BOTTOM();
           }
@@ -2807,9 +3840,10 @@ vmLoop:
           Value autoloadPath;
           if (tableGet(&vm.autoloadTbl, varName, &autoloadPath)) {
               Value requireScriptFn = NIL_VAL;
-              tableGet(&vm.globals, OBJ_VAL(INTERN("requireScript")), &requireScriptFn);
+              getGlobal(INTERN("requireScript"), &requireScriptFn);
               callFunctionValue(requireScriptFn, 1, &autoloadPath);
               if (findConstantUnder(cref, AS_STRING(varName), &val)) {
+                  fillConstCache(cacheVal, cref, val);
                   VM_PUSH(val);
                   DISPATCH_BOTTOM();
               }
@@ -2850,7 +3884,7 @@ vmLoop:
               Value ownerKlass = OBJ_VAL(vec_last(&th->v_crefStack));
               addConstantUnder(AS_STRING(constName)->chars, val, ownerKlass);
           } else {
-              tableSet(&vm.constants, constName, val);
+              addGlobalConstant(AS_STRING(constName), val);
           }
           DISPATCH_BOTTOM();
       }
@@ -2872,6 +3906,13 @@ vmLoop:
                   closure->upvalues[i] = getFrame()->closure->upvalues[index];
               }
           }
+          for (int i = 0; i < closure->capturedCount; i++) {
+              bytecode_t isLocal = READ_WORD();
+              bytecode_t index = READ_WORD();
+              Value val = isLocal ? frame->slots[index] : frame->closure->captured[index];
+              closure->captured[i] = val;
+              OBJ_WRITE(OBJ_VAL(closure), val);
+          }
           DISPATCH_BOTTOM();
       }
       CASE_OP(JUMP_IF_FALSE): {
@@ -2927,6 +3968,11 @@ vmLoop:
           // add 1 for the instruction we just read, and 1 to go 1 before the
           // instruction we want to execute next.
           frame->ip -= (ipOffset+2);
+          // long-running loops get compiled too, not only functions called often
+          if (UNLIKELY(jitCode == NULL)) {
+              jitCountUse(frame->closure->function);
+              jitCode = frame->closure->function->jitCode;
+          }
           VM_CHECK_INTS(th);
           DISPATCH_BOTTOM();
       }
@@ -2942,26 +3988,35 @@ vmLoop:
           DISPATCH_BOTTOM();
       }
       CASE_OP(BLOCK_BREAK): {
+          if (IS_YIELD_STATUS_FRAME(getFrame())) {
+              BLOCK_FRAME_RETURN(BLOCK_ST_BREAK, NIL_VAL);
+          }
           Value err = newError(lxBreakBlockErrClass, NIL_VAL);
           throwError(err); // blocks catch this, not propagated
           DISPATCH_BOTTOM();
       }
       CASE_OP(BLOCK_CONTINUE): {
           Value ret;
-          ObjString *key = INTERN("ret");
           if (th->lastValue) {
               ret = *th->lastValue;
           } else {
               ret = NIL_VAL;
           }
+          if (IS_YIELD_STATUS_FRAME(getFrame())) {
+              BLOCK_FRAME_RETURN(BLOCK_ST_CONTINUE, ret);
+          }
+          ObjString *key = INTERN("ret");
           Value err = newError(lxContinueBlockErrClass, NIL_VAL);
           setProp(err, key, ret);
           throwError(err); // blocks catch this, not propagated
           DISPATCH_BOTTOM();
       }
       CASE_OP(BLOCK_RETURN): {
-          ObjString *key = INTERN("ret");
           Value ret = VM_PEEK(0);
+          if (IS_YIELD_STATUS_FRAME(getFrame())) {
+              BLOCK_FRAME_RETURN(BLOCK_ST_RETURN, ret);
+          }
+          ObjString *key = INTERN("ret");
           Value err = newError(lxReturnBlockErrClass, NIL_VAL);
           setProp(err, key, ret);
           VM_POP();
@@ -2980,6 +4035,9 @@ vmLoop:
           VM_PUSHSWAP(newBlock(AS_OBJ(func)));
           DISPATCH_BOTTOM();
       }
+      CASE_OP(TAIL_CALL):
+          tailCall = true;
+          /* fallthrough */
       CASE_OP(CALL): {
           bytecode_t numArgs = READ_WORD();
           if (th->lastSplatNumArgs >= 0) {
@@ -2996,24 +4054,26 @@ vmLoop:
           }
           Value callInfoVal = READ_CONSTANT();
           CallInfo *callInfo = internalGetData(AS_INTERNAL(callInfoVal));
-          callCallable(callableVal, numArgs, false, callInfo);
+          VM_CALL(callableVal, numArgs, false, callInfo);
           ASSERT_VALID_STACK();
           DISPATCH_BOTTOM();
       }
       CASE_OP(CHECK_KEYWORD): {
-          Value kwMap = VM_PEEK(0);
-          ASSERT(IS_T_MAP(kwMap));
           bytecode_t kwSlot = READ_WORD();
           bytecode_t mapSlot = READ_WORD();
           (void)mapSlot; // unused
-          if (IS_UNDEF(getFrame()->slots[kwSlot])) {
+          if (IS_UNDEF(frame->slots[kwSlot])) {
               VM_PUSH(BOOL_VAL(false));
           } else {
               VM_PUSH(BOOL_VAL(true));
           }
           DISPATCH_BOTTOM();
       }
+      CASE_OP(TAIL_INVOKE):
+          tailCall = true;
+          /* fallthrough */
       CASE_OP(INVOKE): { // invoke methods (includes static methods)
+invokeGeneric:;
           Value methodName = READ_CONSTANT();
           ObjString *mname = AS_STRING(methodName);
           bytecode_t numArgs = READ_WORD();
@@ -3059,7 +4119,7 @@ find_class_method:
                   throwErrorFmt(lxErrClass, "%s method '%s.%s' not found", modStr, classStr, mname->chars);
               }
               /*ctx->stackTop[-numArgs-1] = instanceVal;*/
-              callCallable(OBJ_VAL(callable), numArgs, true, callInfo);
+              VM_CALL(OBJ_VAL(callable), numArgs, true, callInfo);
           } else if (IS_INSTANCE_LIKE(instanceVal)) {
               bool methodMissingTried = false;
               ObjInstance *inst = AS_INSTANCE(instanceVal);
@@ -3091,13 +4151,87 @@ find_instance_method:
                   const char *classStr = className->chars ? className->chars : "(anon)";
                   throwErrorFmt(lxErrClass, "instance method '%s#%s' not found", classStr, mname->chars);
               }
-              callCallable(OBJ_VAL(callable), numArgs, true, callInfo);
+              if (callable->type == OBJ_T_NATIVE_FUNCTION && TO_NATIVE(callable)->loopIter &&
+                      startLoopIter(th, inst, TO_NATIVE(callable), numArgs, callInfo, &pad)) {
+                  tailCall = false; // the caller's frame holds the iteration
+                  LOAD_FRAME();
+                  if (UNLIKELY(ch->catchTbl != NULL && !pad.armed)) goto armPad;
+                  DISPATCH_BOTTOM();
+              }
+              VM_CALL(OBJ_VAL(callable), numArgs, true, callInfo);
           } else {
               throwErrorFmt(lxTypeErrClass, "Tried to invoke method '%s' on non-instance (type=%s)", mname->chars, typeOfVal(instanceVal));
           }
           ASSERT_VALID_STACK();
           DISPATCH_BOTTOM();
       }
+      CASE_OP(CALL_SIMPLE): {
+          bytecode_t numArgs = READ_WORD();
+          Value callInfoVal = READ_CONSTANT();
+          CallInfo *callInfo = internalGetData(AS_INTERNAL(callInfoVal));
+          DBG_ASSERT(th->lastSplatNumArgs < 0);
+          Value callableVal = VM_PEEK(numArgs);
+          ObjClosure *closure = NULL;
+          if (IS_OBJ(callableVal)) {
+              closure = simpleCallee(AS_OBJ(callableVal), numArgs, callInfo);
+              ObjNative *native = NULL;
+              if (!closure && (native = leafNative(AS_OBJ(callableVal), numArgs, callInfo))) {
+                  callLeafNative(th, native, numArgs, false);
+                  DISPATCH_BOTTOM();
+              }
+          }
+          if (UNLIKELY(!closure)) {
+              if (UNLIKELY(!isCallable(callableVal))) {
+                  for (int i = 0; i < (int)numArgs; i++) {
+                      VM_POP();
+                  }
+                  throwErrorFmt(lxTypeErrClass, "Tried to call uncallable object (type=%s)", typeOfVal(callableVal));
+              }
+              VM_CALL(callableVal, numArgs, false, callInfo);
+              ASSERT_VALID_STACK();
+              DISPATCH_BOTTOM();
+          }
+          CallFrame *pushed = pushSimpleFrame(th, frame, closure, numArgs, NULL, callInfo);
+          pushed->runPad = &pad;
+          LOAD_FRAME();
+          if (UNLIKELY(ch->catchTbl != NULL && !pad.armed)) goto armPad;
+          DISPATCH_BOTTOM();
+      }
+      CASE_OP(INVOKE_SIMPLE): {
+          Value methodName = READ_CONSTANT();
+          bytecode_t numArgs = READ_WORD();
+          Value callInfoVal = READ_CONSTANT();
+          CallInfo *callInfo = internalGetData(AS_INTERNAL(callInfoVal));
+          DBG_ASSERT(th->lastSplatNumArgs < 0);
+          Value instanceVal = VM_PEEK(numArgs);
+          ObjClosure *closure = NULL;
+          ObjInstance *inst = NULL;
+          if (IS_INSTANCE_LIKE(instanceVal) && !IS_CLASS(instanceVal) && !IS_MODULE(instanceVal)) {
+              inst = AS_INSTANCE(instanceVal);
+              Obj *callable = instanceFindMethod(inst, AS_STRING(methodName));
+              if (!callable && numArgs == 0) {
+                  callable = instanceFindGetter(inst, AS_STRING(methodName));
+              }
+              if (callable) {
+                  closure = simpleCallee(callable, numArgs, callInfo);
+                  ObjNative *native = NULL;
+                  if (!closure && (native = leafNative(callable, numArgs, callInfo))) {
+                      callLeafNative(th, native, numArgs, true);
+                      DISPATCH_BOTTOM();
+                  }
+              }
+          }
+          if (UNLIKELY(!closure)) {
+              // getters, methodMissing, class methods and errors
+              frame->ip -= 3;
+              goto invokeGeneric;
+          }
+          CallFrame *pushed = pushSimpleFrame(th, frame, closure, numArgs, inst, callInfo);
+          pushed->runPad = &pad;
+          LOAD_FRAME();
+          if (UNLIKELY(ch->catchTbl != NULL && !pad.armed)) goto armPad;
+          DISPATCH_BOTTOM();
+      }
       CASE_OP(GET_THIS): {
           if (!th->thisObj) {
               VM_PUSH(NIL_VAL);
@@ -3164,7 +4298,11 @@ find_instance_method:
       CASE_OP(RETURN): {
           // this is if we're in a block given by (&block), and we returned
           // (explicitly or implicitly)
-          if (!getFrame()->isEval && th->v_blockStack.length > 0) {
+          if (!getFrame()->isEval && IS_YIELD_STATUS_FRAME(getFrame())) {
+              VM_POP();
+              BLOCK_FRAME_RETURN(BLOCK_ST_CONTINUE, th->lastValue ? *th->lastValue : NIL_VAL);
+          }
+          if (!getFrame()->isEval && isBlockEntryFrame(th, getFrame())) {
               ObjString *key = INTERN("ret");
               VM_POP();
               Value ret;
@@ -3187,27 +4325,38 @@ find_instance_method:
           popFrame();
           EC->stackTop = newTop;
           VM_PUSH(result);
+          if (EC->frameCount >= baseFrameCount) { // back in a frame run by this loop
+              LOAD_FRAME();
+              DISPATCH_BOTTOM();
+          }
           (th->vmRunLvl)--;
           return INTERPRET_OK;
       }
       CASE_OP(ITER): {
-          Value iterable = VM_PEEK(0);
+          bytecode_t slot = READ_WORD();
+          Value iterable = VM_PEEK(1); // below the cursor
           if (UNLIKELY(!isIterableType(iterable))) {
               throwErrorFmt(lxTypeErrClass, "Non-iterable value given to 'foreach' statement. Type found: %s",
                       typeOfVal(iterable));
           }
-          Value iterator = createIterator(iterable);
-          DBG_ASSERT(isIterator(iterator));
-          DBG_ASSERT(isIterableType(VM_PEEK(0)));
-          VM_PUSHSWAP(iterator);
+          // Arrays and maps are iterated in place (see foreachNext)
+          if (!IS_AN_ARRAY(iterable) && !IS_A_MAP(iterable)) {
+              iterable = createIterator(iterable);
+              DBG_ASSERT(isIterator(iterable));
+          }
+          // The iterable and cursor were normally just pushed into their
+          // slots, but blocks don't pop their locals so the stack can be
+          // above them. The slots are what OP_ITER_NEXT uses.
+          DBG_ASSERT(EC->stackTop >= frame->slots+slot+2);
+          frame->slots[slot] = iterable;
+          frame->slots[slot+1] = NUMBER_VAL(0); // cursor
           DISPATCH_BOTTOM();
       }
       CASE_OP(ITER_NEXT): {
-          Value iterator = VM_PEEK(0);
-          ASSERT(isIterator(iterator));
-          Value next = iteratorNext(iterator);
-          ASSERT(!IS_UNDEF(next));
-          VM_PUSH(next);
+          bytecode_t slot = READ_WORD();
+          bytecode_t numVars = READ_WORD();
+          bool more = foreachNext(frame, slot, numVars);
+          VM_PUSH(BOOL_VAL(more));
           DISPATCH_BOTTOM();
       }
       CASE_OP(CLASS): { // add or re-open class
@@ -3239,7 +4388,7 @@ find_instance_method:
               addConstantUnder(className(klass), OBJ_VAL(klass), ownerClass);
               CLASSINFO(klass)->under = AS_OBJ(ownerClass);
           } else {
-              tableSet(&vm.constants, classNm, OBJ_VAL(klass));
+              addGlobalConstant(AS_STRING(classNm), OBJ_VAL(klass));
           }
           pushCref(klass);
           DISPATCH_BOTTOM();
@@ -3272,7 +4421,7 @@ find_instance_method:
               addConstantUnder(className(TO_CLASS(mod)), OBJ_VAL(mod), ownerClass);
               CLASSINFO(mod)->under = AS_OBJ(ownerClass);
           } else {
-              tableSet(&vm.constants, modName, OBJ_VAL(mod));
+              addGlobalConstant(AS_STRING(modName), OBJ_VAL(mod));
           }
           pushCref(TO_CLASS(mod));
           DISPATCH_BOTTOM();
@@ -3311,7 +4460,7 @@ find_instance_method:
               addConstantUnder(AS_STRING(classNm)->chars, OBJ_VAL(klass), ownerClass);
               CLASSINFO(klass)->under = AS_OBJ(ownerClass);
           } else {
-              tableSet(&vm.constants, classNm, OBJ_VAL(klass));
+              addGlobalConstant(AS_STRING(classNm), OBJ_VAL(klass));
           }
           VM_PUSH(OBJ_VAL(klass));
           setThis(0);
@@ -3419,8 +4568,15 @@ find_instance_method:
                   "Type found: %s", typeOfVal(throwable)
               );
           }
-          throwError(throwable);
-          UNREACHABLE("after throw"); // should longjmp
+          // caught in a frame of this loop: no longjmp needed
+          VMRunPad *catchPad = unwindToCatch(throwable);
+          if (catchPad == &pad) {
+              th->vmRunLvl = pad.vmRunLvl;
+              LOAD_FRAME();
+              DISPATCH_BOTTOM();
+          }
+          // the stack is already unwound and ensure blocks run, don't throw again
+          jumpToCatch(catchPad);
       }
       CASE_OP(GET_THROWN): {
           Value catchTblIdx = READ_CONSTANT();
@@ -3448,8 +4604,19 @@ find_instance_method:
           Value strLit = READ_CONSTANT();
           DBG_ASSERT(IS_STRING(strLit));
           bytecode_t isStatic = READ_WORD();
-          VM_PUSH(OBJ_VAL(lxStringClass));
           ObjString *buf = AS_STRING(strLit);
+          if (LIKELY(isStringInitNative())) {
+              // same as String(lit), without the call
+              ObjString *str = stringLiteralCopy(buf);
+              if (UNLIKELY(isStatic)) {
+                  STRING_SET_STATIC(buf);
+                  objFreeze(TO_OBJ(str));
+                  STRING_SET_STATIC(str);
+              }
+              VM_PUSH(OBJ_VAL(str));
+              DISPATCH_BOTTOM();
+          }
+          VM_PUSH(OBJ_VAL(lxStringClass));
           if (UNLIKELY(isStatic)) {
               STRING_SET_STATIC(buf);
               VM_PUSH(OBJ_VAL(buf));
@@ -3463,6 +4630,21 @@ find_instance_method:
           }
           DISPATCH_BOTTOM();
       }
+      CASE_OP(STRING_INTERP): {
+          int numParts = (int)READ_WORD();
+          // stringify objects first, toString() can run lox code
+          for (int i = 0; i < numParts; i++) {
+              Value part = EC->stackTop[i-numParts];
+              if (IS_OBJ(part) && !IS_STRING(part)) {
+                  ObjString *partStr = valueToString(part, copyString, NEWOBJ_FLAG_NONE);
+                  EC->stackTop[i-numParts] = OBJ_VAL(partStr);
+              }
+          }
+          ObjString *str = concatValues(EC->stackTop-numParts, numParts);
+          EC->stackTop -= numParts;
+          VM_PUSH(OBJ_VAL(str));
+          DISPATCH_BOTTOM();
+      }
       CASE_OP(ARRAY): {
           bytecode_t numEls = READ_WORD();
           Value aryVal = newArray();
@@ -3490,6 +4672,7 @@ find_instance_method:
           Value mapVal = newMap();
           hideFromGC(AS_OBJ(mapVal));
           Table *map = AS_MAP(mapVal)->table;
+          initTableWithCapa(map, numKeyVals/2);
           for (int i = 0; i < (int)numKeyVals; i+=2) {
               Value key = VM_POP();
               Value val = VM_POP();
@@ -3542,6 +4725,8 @@ find_instance_method:
   UNREACHABLE_RETURN(INTERPRET_RUNTIME_ERROR);
 #undef READ_CONSTANT
 #undef BINARY_OP
+#undef LOAD_FRAME
+#undef VM_CALL
 }
 
 static void setupPerScriptROGlobals(char *filename) {
@@ -3552,8 +4737,6 @@ static void setupPerScriptROGlobals(char *filename) {
     tableSet(&EC->roGlobals, OBJ_VAL(vm.fileString), fileString);
     unhideFromGC(AS_OBJ(fileString));
 
-    tableSet(&EC->roGlobals, OBJ_VAL(vm.funcString), OBJ_VAL(vm.mainString));
-
     if (filename[0] == pathSeparator) {
         char *lastSep = rindex(filename, pathSeparator);
         int len = lastSep - filename;
@@ -3649,7 +4832,8 @@ static Value doVMEval(char *src, char *filename, int lineno, ObjInstance *instan
     VMExecContext *ectx = EC;
     ectx->evalContext = true;
     ectx->stack = oldFrame->slots;
-    ectx->stack_capa = old_ectx->stack_capa;
+    ectx->stack_capa = old_ectx->stack_capa - (oldFrame->slots - old_ectx->stack);
+    ectx->stackEnd = old_ectx->stackEnd;
     ectx->stackTop = old_ectx->stackTop;
     VM_DEBUG(1, "VM eval called in func '%s', ip: %d", callFrameName(prevFrame),
         prevFrame->ip - prevFrame->closure->function->chunk->code);
@@ -3833,12 +5017,13 @@ void unwindJumpRecover(ErrTagInfo *info) {
         f = f->prev;
         popFrame();
     }
+    setInCCall(th, info->inCCall);
     while (th->errInfo != info) {
         VM_DEBUG(2, "freeing Errinfo");
         DBG_ASSERT(th->errInfo);
         ErrTagInfo *prev = th->errInfo->prev;
         DBG_ASSERT(prev);
-        FREE(ErrTagInfo, th->errInfo);
+        freeErrInfo(th, th->errInfo);
         th->errInfo = prev;
     }
 }
@@ -3897,7 +5082,7 @@ void *vm_protect(vm_cb_func func, void *arg, ObjClass *errClass, ErrTag *status)
         ErrTagInfo *prev = errInfo->prev;
         void *res = func(arg);
         if (getFrameOrNull() == frame) { // frame was not popped, so we unwind the errinfo
-          FREE(ErrTagInfo, (ErrTagInfo*)errInfo); // was not freed by popFrame()
+          freeErrInfo(th, (ErrTagInfo*)errInfo); // was not freed by popFrame()
           th->errInfo = prev;
         }
         VM_DEBUG(1, "vm_protect after func");
@@ -4075,6 +5260,9 @@ void releaseGVL(ThreadStatus thStatus) {
         pthread_mutex_unlock(&vm.GVLock);
         return;
     }
+    if (thStatus == THREAD_STOPPED) {
+        shrinkThreadStacks(th); // about to block, don't sit on peak stack memory
+    }
     vm.GVLockStatus = 0;
     GVLOwner = 0;
     vm.curThread = NULL;
@@ -16,10 +16,22 @@
 extern "C" {
 #endif
 
-#define STACK_INITIAL 256
-#define STACK_MAX 1024
+// Value stacks and call frame arrays are reserved at their thread's maximum
+// size and grow as their pages are touched (see push_EC()). These are the
+// default maximums, see LxThread.stackMax and LxThread.framesMax.
+#define STACK_MAX_DEFAULT (1024*1024) // number of Values
+#define FRAMES_MAX_DEFAULT (64*1024)
 #define FRAMES_INITIAL 64
-#define FRAMES_MAX 1024
+// Reserved past the maximums. Value stack overflow is checked when frames are
+// pushed, not on every push, so a call can use up to STACK_RED_ZONE values
+// past the max. The frames slack is for constructing the overflow error.
+#define STACK_RED_ZONE (64*1024)
+#define FRAMES_OVERFLOW_SLACK 16
+#define VALUE_STACK_BYTES(max) (sizeof(Value)*((max)+STACK_RED_ZONE))
+#define FRAMES_BYTES(max) (sizeof(CallFrame)*((max)+FRAMES_OVERFLOW_SLACK))
+// Nested vm_run() calls (natives and blocks calling back into Lox code), each
+// of which uses native stack
+#define VM_RUN_LVL_MAX 1024
 
 #ifndef NDEBUG
 #define THREAD_DEBUG(lvl, ...) thread_debug(lvl, __VA_ARGS__)
@@ -48,12 +60,15 @@ typedef struct CallFrame {
 
     int callLine;
     ObjString *file; // full path of file the function is called from
-    jmp_buf jmpBuf; // only used if chunk associated with closure has a catch table
-    bool jmpBufSet;
+    struct VMRunPad *runPad; // vm_run() invocation executing this frame, NULL for native frames
     struct CallFrame *prev;
     struct BlockStackEntry *blockEntry; // if block, this is the block info
     int stackAdjustOnPop;
     struct CallInfo *callInfo;
+    int tailCalls; // number of caller frames this frame replaced (OP_TAIL_CALL)
+    // closure of the block literal given to this frame's call, made by the
+    // first yield to it and reused by the others (see yieldBlockClosure())
+    ObjClosure *blockClosure;
 } CallFrame; // represents a local scope (block, function, etc)
 
 typedef enum ErrTag {
@@ -69,6 +84,7 @@ typedef struct ErrTagInfo {
     struct ErrTagInfo *prev;
     struct BlockStackEntry *bentry;
     Value caughtError;
+    int inCCall; // th->inCCall when added
 } ErrTagInfo;
 
 // Execution context for VM. When loading a script, a new context is created,
@@ -77,15 +93,17 @@ typedef struct ErrTagInfo {
 // as well as the script name for the currently executing file.
 // This is per-thread
 typedef struct VMExecContext {
-    Value *stack; // allocated by push_EC()
-    size_t stack_capa;
+    Value *stack; // reserved by push_EC()
+    size_t stack_capa; // max number of values
+    Value *stackEnd; // stack + stack_capa
     Value *stackTop;
     // NOTE: the current callframe contains the closure, which contains the
     // function, which contains the chunk of bytecode for the current function
     // (or top-level)
     CallFrame *frames;
-    size_t frames_capa;
+    size_t frames_capa; // max number of frames
     unsigned frameCount;
+    unsigned framesPeak;
     Table roGlobals; // per-script readonly global vars (ex: __FILE__)
     ObjString *filename;
     Value *lastValue;
@@ -135,6 +153,7 @@ typedef struct LxThread {
     Value *lastValue;
     bool hadError;
     ErrTagInfo *errInfo;
+    ErrTagInfo *freeErrInfos; // reused by addErrInfo()
     volatile Value lastErrorThrown; // TODO: change to Obj pointer
     volatile Value errorToThrow; // error raised by other thread
     int inCCall;
@@ -143,6 +162,8 @@ typedef struct LxThread {
     jmp_buf cCallJumpBuf;
     bool cCallJumpBufSet;
     int vmRunLvl; // how many calls to vm_run() are in the current thread's native stack
+    size_t stackMax; // max values in each of the thread's execution context stacks
+    size_t framesMax; // max call frames in each execution context
     int lastSplatNumArgs;
     // stack of object pointers created during C function calls. When
     // control returns to the VM, these are popped. Stack objects aren't
@@ -179,10 +200,23 @@ void threadForceUnlockMutex(LxThread *th, struct LxMutex *m);
 void forceUnlockMutexes(LxThread *th);
 
 typedef struct VM {
-    Table globals; // global variables
-    Table strings; // interned strings
+    // Global variables are stored by slot. The compiler resolves each global
+    // name to a slot (see globalSlot()), so reading one is an array load.
+    // Slots of names that aren't defined yet hold UNDEF_VAL.
+    Table globals; // global variable name => slot index in globalValues
+    ValueArray globalValues;
+    int numReservedGlobals; // slots below this can't be assigned to by scripts
+    InternTable strings; // interned strings
     Table regexLiterals;
     Table constants; // global constants
+    // bumped whenever a constant is defined anywhere, invalidates the
+    // constant caches of OP_GET_CONST instructions
+    unsigned long constantSerial;
+    // bumped whenever an instance method is defined or a module is included,
+    // invalidates the cached answer of whether String() runs the native init
+    unsigned long methodSerial;
+    unsigned long stringInitSerial;
+    bool stringInitIsNative;
     Table autoloadTbl;
     ObjString *initString;
     ObjString *fileString;
@@ -287,11 +321,19 @@ Value *getLastValue(void);
 // script loading
 bool VMLoadedScript(char *fname);
 
+// global variables
+int globalSlot(ObjString *name);
+void setGlobal(ObjString *name, Value val);
+bool getGlobal(ObjString *name, Value *valOut);
+
 // operand stack
 void push(Value value); // push onto operand stack
 Value pop(void); // pop top of operand stack
 Value peek(unsigned);
 void resetStack(void); // reset operand stack
+void shrinkThreadStacks(LxThread *th); // give unused stack pages back to the OS
+void *reserveStackArea(size_t size);
+void releaseStackArea(void *area, size_t size);
 
 NORETURN void repl(void);
 
@@ -306,6 +348,7 @@ static inline CallFrame *getFrame(void) {
 
 // errors
 void setBacktrace(Value err);
+Value errorBacktrace(Value err);
 NORETURN void throwErrorFmt(ObjClass *klass, const char *format, ...);
 #define throwArgErrorFmt(format, ...) throwErrorFmt(lxArgErrClass, format, __VA_ARGS__)
 NORETURN void throwError(Value err);
@@ -316,18 +359,24 @@ void rethrowErrInfo(ErrTagInfo *info);
 void unsetErrInfo(void);
 void popErrInfo(void);
 void errorPrintScriptBacktrace(const char *format, ...);
+ErrTagInfo *newErrInfo(LxThread *th);
 static inline ErrTagInfo *addErrInfo(ObjClass *errClass) {
     LxThread *th = vm.curThread;
-    ErrTagInfo *info = ALLOCATE(ErrTagInfo, 1);
+    ErrTagInfo *info = newErrInfo(th);
     info->status = TAG_NONE;
     info->errClass = errClass;
     info->bentry = NULL;
     info->frame = getFrame();
+    info->inCCall = th->inCCall;
     info->prev = th->errInfo;
     th->errInfo = info;
     info->caughtError = NIL_VAL;
     return info;
 }
+static inline void freeErrInfo(LxThread *th, ErrTagInfo *info) {
+    info->prev = th->freeErrInfos;
+    th->freeErrInfos = info;
+}
 
 // blocks
 BlockStackEntry *addBlockEntry(Obj *closureOrNative);
@@ -342,6 +391,8 @@ Value yieldBlockCatch(int argCount, Value *args, Value *err);
 // callable if it's not a method, or the instance if it is. Argcount does not
 // include the instance, if it's a method. `cinfo` can be NULL.
 bool callCallable(Value callable, int argCount, bool isMethod, struct CallInfo *cinfo);
+// fast path of callCallable for yielding to a block closure from C
+bool callBlockClosure(Value callable, int argCount, struct CallInfo *cinfo);
 // higher-level call function, but callable must be provided. Return value is
 // pushed to stack. argCount does not include instance.
 Value callVMMethod(
@@ -363,7 +414,7 @@ Value callSuper(int argCount, Value *args, struct CallInfo *cinfo);
 #define SETUP_BLOCK(block, bentry, status, errInf) {\
     ASSERT(block);\
     ErrTagInfo *einfo = addErrInfo(lxErrClass);\
-    bentry = (volatile BlockStackEntry*)addBlockEntry(TO_OBJ(block));\
+    bentry = addBlockEntry(TO_OBJ(block));\
     einfo->bentry = (BlockStackEntry*)bentry;\
     int jmpres = 0;\
     if ((jmpres = setjmp(errInf->jmpBuf)) == JUMP_SET) {\
@@ -379,6 +430,15 @@ Value callSuper(int argCount, Value *args, struct CallInfo *cinfo);
     }\
 }
 
+// Undoes SETUP_BLOCK after the block returned without throwing.
+#define TEARDOWN_BLOCK(bentry) {\
+    ErrTagInfo *einfo = vm.curThread->errInfo;\
+    ASSERT(einfo && einfo->bentry == (BlockStackEntry*)bentry);\
+    vm.curThread->errInfo = einfo->prev;\
+    freeErrInfo(vm.curThread, einfo);\
+    popBlockEntry((BlockStackEntry*)bentry);\
+}
+
 // upvalues
 ObjUpvalue *captureUpvalue(Value *local);
 
@@ -0,0 +1,265 @@
+#include <unistd.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <signal.h>
+#include <time.h>
+#include "object.h"
+#include "vm.h"
+#include "runtime.h"
+#include "memory.h"
+
+// module WorkerPool, for preforking servers.
+//
+// The parent loads its code and data, then forks N workers that each call
+// the same callable with their worker index. Workers inherit the parent's
+// file descriptors, so a listening socket created before `start` is shared
+// by all of them. The parent then calls `supervise`, which restarts workers
+// that crash and forwards signals to them.
+ObjModule *lxWorkerPoolMod;
+
+#define WORKER_POOL_MAX 1024
+// A worker that dies this many times in a row less than a second after
+// being started isn't restarted again.
+#define WORKER_MAX_QUICK_CRASHES 5
+
+typedef struct WorkerPool {
+    pid_t pids[WORKER_POOL_MAX]; // 0 if the worker isn't running
+    time_t startedAt[WORKER_POOL_MAX];
+    int quickCrashes[WORKER_POOL_MAX];
+    int numWorkers;
+    Obj *callable;
+    int numRestarts;
+} WorkerPool;
+
+static WorkerPool pool;
+static volatile sig_atomic_t poolShutdown = 0;
+
+static const int forwardedSignals[] = {
+    SIGTERM, SIGINT, SIGQUIT, SIGHUP, SIGUSR1, SIGUSR2,
+};
+#define NUM_FORWARDED_SIGNALS ((int)(sizeof(forwardedSignals)/sizeof(int)))
+static struct sigaction savedActions[NUM_FORWARDED_SIGNALS];
+
+static bool isShutdownSignal(int signo) {
+    return signo == SIGTERM || signo == SIGINT || signo == SIGQUIT;
+}
+
+static void signalWorkers(int signo) {
+    for (int i = 0; i < pool.numWorkers; i++) {
+        if (pool.pids[i] > 0) {
+            kill(pool.pids[i], signo);
+        }
+    }
+}
+
+// runs in the supervisor, only does async-signal-safe work
+static void forwardSignalHandler(int signo) {
+    if (isShutdownSignal(signo)) {
+        poolShutdown = 1;
+    }
+    signalWorkers(signo);
+}
+
+static void installForwardHandlers(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = forwardSignalHandler;
+    // no SA_RESTART, waitpid(2) in the supervisor must return EINTR
+    sa.sa_flags = 0;
+    for (int i = 0; i < NUM_FORWARDED_SIGNALS; i++) {
+        sigaction(forwardedSignals[i], &sa, &savedActions[i]);
+    }
+}
+
+static void restoreHandlers(void) {
+    for (int i = 0; i < NUM_FORWARDED_SIGNALS; i++) {
+        sigaction(forwardedSignals[i], &savedActions[i], NULL);
+    }
+}
+
+static void runWorker(int workerIdx) {
+    // the child isn't a supervisor, don't let it forward signals to its siblings
+    restoreHandlers();
+    Obj *callable = pool.callable;
+    memset(&pool, 0, sizeof(pool));
+    poolShutdown = 0;
+    vm.mainThread->pid = getpid();
+    Value arg = NUMBER_VAL(workerIdx);
+    callFunctionValue(OBJ_VAL(callable), 1, &arg);
+    stopVM(0);
+}
+
+static pid_t forkWorker(int workerIdx) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        runWorker(workerIdx);
+        UNREACHABLE("worker returned");
+    }
+    pool.pids[workerIdx] = pid;
+    pool.startedAt[workerIdx] = time(NULL);
+    return pid;
+}
+
+static int workerIndexOf(pid_t pid) {
+    for (int i = 0; i < pool.numWorkers; i++) {
+        if (pool.pids[i] == pid) return i;
+    }
+    return -1;
+}
+
+static int numRunning(void) {
+    int n = 0;
+    for (int i = 0; i < pool.numWorkers; i++) {
+        if (pool.pids[i] > 0) n++;
+    }
+    return n;
+}
+
+static Value workerPids(void) {
+    Value ret = newArray();
+    for (int i = 0; i < pool.numWorkers; i++) {
+        arrayPush(ret, NUMBER_VAL(pool.pids[i]));
+    }
+    return ret;
+}
+
+/**
+ * WorkerPool.start(numWorkers, callable, prepareFork=true)
+ * Forks `numWorkers` processes that each call `callable(workerIndex)` and
+ * exit when it returns. With `prepareFork`, the heap is collected and the
+ * GC switches to mark bitmaps first (see GCPrepareFork()), so workers keep
+ * sharing the parent's heap pages copy-on-write across their own
+ * collections. Returns the array of worker pids.
+ */
+static Value lxWorkerPoolStartStatic(int argCount, Value *args) {
+    CHECK_ARITY("WorkerPool.start", 3, 4, argCount);
+    CHECK_ARG_BUILTIN_TYPE(args[1], IS_NUMBER_FUNC, "number", 1);
+    int numWorkers = (int)AS_NUMBER(args[1]);
+    Value callable = args[2];
+    if (!isCallable(callable)) {
+        throwArgErrorFmt("Expected argument 2 to be callable, is: %s", typeOfVal(callable));
+    }
+    if (numWorkers <= 0 || numWorkers > WORKER_POOL_MAX) {
+        throwArgErrorFmt("Number of workers must be between 1 and %d", WORKER_POOL_MAX);
+    }
+    if (pool.numWorkers > 0 && numRunning() > 0) {
+        throwErrorFmt(lxErrClass, "WorkerPool already started");
+    }
+    bool prepareFork = argCount < 4 || isTruthy(args[3]);
+
+    if (pool.callable) {
+        unhideFromGC(pool.callable);
+    }
+    memset(&pool, 0, sizeof(pool));
+    poolShutdown = 0;
+    pool.callable = AS_OBJ(callable);
+    GC_OLD(pool.callable);
+    hideFromGC(pool.callable);
+
+    if (prepareFork) {
+        bool prevOn = turnGCOn();
+        GCPrepareFork();
+        setGCOnOff(prevOn);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pool.numWorkers = numWorkers;
+    for (int i = 0; i < numWorkers; i++) {
+        if (forkWorker(i) == -1) {
+            int err = errno;
+            signalWorkers(SIGTERM);
+            throwErrorFmt(sysErrClass(err), "Error forking worker: %s", strerror(err));
+        }
+    }
+    return workerPids();
+}
+
+/**
+ * WorkerPool.supervise()
+ * Waits for workers, restarting any that die from a signal or exit with a
+ * non-zero status (unless they keep crashing right after starting). TERM,
+ * INT, QUIT, HUP, USR1 and USR2 sent to the supervisor are forwarded to the
+ * workers. After TERM, INT or QUIT, workers aren't restarted anymore and
+ * supervise returns once they've all exited. Also returns when all workers
+ * exit normally. Returns the number of restarts.
+ */
+static Value lxWorkerPoolSuperviseStatic(int argCount, Value *args) {
+    CHECK_ARITY("WorkerPool.supervise", 1, 1, argCount);
+    if (pool.numWorkers == 0) {
+        throwErrorFmt(lxErrClass, "WorkerPool not started");
+    }
+    installForwardHandlers();
+    while (numRunning() > 0) {
+        int wstatus = 0;
+        releaseGVL(THREAD_STOPPED);
+        pid_t pid = waitpid(-1, &wstatus, 0);
+        int err = errno;
+        acquireGVL();
+        if (pid == -1) {
+            if (err == EINTR) continue;
+            if (err == ECHILD) break;
+            restoreHandlers();
+            throwErrorFmt(sysErrClass(err), "Error waiting for workers: %s", strerror(err));
+        }
+        int idx = workerIndexOf(pid);
+        if (idx == -1) continue; // not one of ours
+        pool.pids[idx] = 0;
+        bool crashed = WIFSIGNALED(wstatus) ||
+            (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) != 0);
+        if (crashed && time(NULL) - pool.startedAt[idx] < 1) {
+            pool.quickCrashes[idx]++;
+        } else {
+            pool.quickCrashes[idx] = 0;
+        }
+        if (crashed && pool.quickCrashes[idx] >= WORKER_MAX_QUICK_CRASHES) {
+            fprintf(stderr, "WorkerPool: worker %d keeps crashing, not restarting it\n", idx);
+        } else if (crashed && !poolShutdown) {
+            fflush(stdout);
+            fflush(stderr);
+            if (forkWorker(idx) != -1) {
+                pool.numRestarts++;
+            }
+        }
+    }
+    restoreHandlers();
+    return NUMBER_VAL(pool.numRestarts);
+}
+
+/**
+ * WorkerPool.stop(signo=Signal::TERM)
+ * Sends `signo` to every running worker. Workers aren't restarted after
+ * this, even if they exit with an error.
+ */
+static Value lxWorkerPoolStopStatic(int argCount, Value *args) {
+    CHECK_ARITY("WorkerPool.stop", 1, 2, argCount);
+    int signo = SIGTERM;
+    if (argCount == 2) {
+        CHECK_ARG_BUILTIN_TYPE(args[1], IS_NUMBER_FUNC, "number", 1);
+        signo = (int)AS_NUMBER(args[1]);
+    }
+    poolShutdown = 1;
+    signalWorkers(signo);
+    return NIL_VAL;
+}
+
+static Value lxWorkerPoolPidsStatic(int argCount, Value *args) {
+    CHECK_ARITY("WorkerPool.pids", 1, 1, argCount);
+    return workerPids();
+}
+
+void Init_WorkerPoolModule(void) {
+    ObjModule *poolMod = addGlobalModule("WorkerPool");
+    ObjClass *poolModStatic = moduleSingletonClass(poolMod);
+
+    addNativeMethod(poolModStatic, "start", lxWorkerPoolStartStatic);
+    addNativeMethod(poolModStatic, "supervise", lxWorkerPoolSuperviseStatic);
+    addNativeMethod(poolModStatic, "stop", lxWorkerPoolStopStatic);
+    addNativeMethod(poolModStatic, "pids", lxWorkerPoolPidsStatic);
+
+    lxWorkerPoolMod = poolMod;
+}